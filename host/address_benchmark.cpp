@@ -0,0 +1,137 @@
+// measures what the fast FAT32 driver's read and write paths cost per call with the
+// position math done by shifts and masks, and then by division, on a RAM drive so the
+// media doesn't hide the difference. small transfers keep the copying out of the way.
+// usage: address_benchmark [--calls <count>]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <chrono>
+#include "vfs_fast_fat32.hpp"
+#include "vfs_fast_fat32_image_hal.hpp"
+#include "storage_benchmark.hpp"
+using namespace esp32;
+
+constexpr static const size_t file_size = 4*1024*1024;
+constexpr static const int passes = 5;
+static uint8_t buffer[4096];
+static uint32_t random_state;
+// xorshift, so both passes see the same offsets
+static uint32_t random_next() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+static uint64_t now_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+enum struct call_kind {
+    pread,
+    read,
+    pwrite
+};
+static const char* name(call_kind value) {
+    switch(value) {
+        case call_kind::pread: return "pread";
+        case call_kind::read: return "read";
+        case call_kind::pwrite: return "pwrite";
+        default: return "?";
+    }
+}
+// nanoseconds per call, or a negative number on failure
+static double measure(storage_benchmark_target& target,int fd,call_kind kind,size_t size,size_t calls) {
+    random_state = 0x9E3779B9;
+    if(0>target.lseek(fd,0,SEEK_SET)) {
+        return -1;
+    }
+    uint64_t start = now_ns();
+    for(size_t i = 0;i<calls;++i) {
+        off_t offset = (off_t)(random_next()%(file_size-size));
+        ssize_t result;
+        switch(kind) {
+            case call_kind::pread:
+                result = target.pread(fd,buffer,size,offset);
+                break;
+            case call_kind::read:
+                result = target.read(fd,buffer,size);
+                if(0==result) {
+                    target.lseek(fd,0,SEEK_SET);
+                    result = (ssize_t)size;
+                }
+                break;
+            default:
+                result = target.pwrite(fd,buffer,size,offset);
+                break;
+        }
+        if(0>result) {
+            return -1;
+        }
+    }
+    return (double)(now_ns()-start)/calls;
+}
+int main(int argc,char** argv) {
+    size_t calls = 1000000;
+    for(int i = 1;i<argc;++i) {
+        if(0==strcmp(argv[i],"--calls") && i+1<argc) {
+            calls = (size_t)atol(argv[++i]);
+        } else {
+            fprintf(stderr,"usage: %s [--calls <count>]\n",argv[0]);
+            return 2;
+        }
+    }
+    vfs_fast_fat32_ram_hal hal(64*2048);
+    if(!hal.initialized() || !vfs_fast_fat32::format(hal)) {
+        fprintf(stderr,"could not create the RAM drive\n");
+        return 1;
+    }
+    vfs_fast_fat32 fat(hal);
+    if(!fat.initialized()) {
+        fprintf(stderr,"could not mount the fast FAT32 volume\n");
+        return 1;
+    }
+    storage_benchmark_driver_target target(fat);
+    int fd = target.open("/address.dat",O_RDWR|O_CREAT,0666);
+    if(0>fd) {
+        fprintf(stderr,"could not create the test file\n");
+        return 1;
+    }
+    for(size_t written = 0;written<file_size;written+=sizeof(buffer)) {
+        if((ssize_t)sizeof(buffer)!=target.write(fd,buffer,sizeof(buffer))) {
+            fprintf(stderr,"could not write the test file\n");
+            return 1;
+        }
+    }
+    static const call_kind kinds[] = {call_kind::pread,call_kind::read,call_kind::pwrite};
+    static const size_t sizes[] = {4,64,512,4096};
+    printf("%-8s %6s %12s %12s %8s\n","call","bytes","divide ns","shift ns","saved");
+    bool ok = true;
+    for(size_t k = 0;k<sizeof(kinds)/sizeof(kinds[0]);++k) {
+        for(size_t s = 0;s<sizeof(sizes)/sizeof(sizes[0]);++s) {
+            // the best of a few alternating passes, so a burst of noise on the host
+            // doesn't land on one side
+            double divide = 0,shift = 0;
+            for(int pass = 0;pass<passes;++pass) {
+                fat.shift_addressing(false);
+                double d = measure(target,fd,kinds[k],sizes[s],calls);
+                fat.shift_addressing(true);
+                double h = measure(target,fd,kinds[k],sizes[s],calls);
+                if(0>d || 0>h) {
+                    divide = shift = -1;
+                    break;
+                }
+                divide = 0==pass || d<divide?d:divide;
+                shift = 0==pass || h<shift?h:shift;
+            }
+            if(0>divide || 0>shift) {
+                printf("%-8s %6u failed\n",name(kinds[k]),(unsigned)sizes[s]);
+                ok = false;
+                continue;
+            }
+            printf("%-8s %6u %12.1f %12.1f %7.1f%%\n",name(kinds[k]),(unsigned)sizes[s],divide,shift,(divide-shift)*100.0/divide);
+        }
+    }
+    target.close(fd);
+    target.unlink("/address.dat");
+    return ok?0:1;
+}
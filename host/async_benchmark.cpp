@@ -0,0 +1,180 @@
+// runs several streams of file I/O at once on the fast FAT32 driver over a simulated SD
+// card, first as coroutines on one vfs_executor, then as one thread per stream, and
+// checks what they wrote. needs C++20.
+// usage: async_benchmark [--streams <count>] [--size <KB>] [--chunk <bytes>]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "vfs_fast_fat32.hpp"
+#include "vfs_fast_fat32_card_hal.hpp"
+#include "simulated_sd_card.hpp"
+#include "vfs_async.hpp"
+using namespace esp32;
+
+static size_t file_size = 256*1024;
+static size_t chunk_size = 4096;
+static uint64_t now_us() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+static uint8_t pattern(size_t stream,size_t offset) {
+    return (uint8_t)(stream*31+offset/7);
+}
+static void path(char* result,const char* kind,size_t stream) {
+    snprintf(result,32,"/%s%u.dat",kind,(unsigned)stream);
+}
+// writes the stream's file a chunk at a time, syncs it, and reads it back
+static vfs_task async_stream(vfs_executor& executor,vfs_driver& driver,size_t stream,bool& ok) {
+    char name[32];
+    path(name,"async",stream);
+    // opening isn't one of the async operations, but it doesn't touch the card much
+    int fd = driver.open(name,O_RDWR|O_CREAT|O_TRUNC,0666);
+    if(0>fd) {
+        ok = false;
+        co_return;
+    }
+    vfs_async_file file(executor,driver,fd);
+    std::vector<uint8_t> buffer(chunk_size);
+    for(size_t offset = 0;offset<file_size;offset+=chunk_size) {
+        for(size_t i = 0;i<chunk_size;++i) {
+            buffer[i]=pattern(stream,offset+i);
+        }
+        if((ssize_t)chunk_size!=co_await file.async_write(buffer.data(),chunk_size)) {
+            ok = false;
+        }
+    }
+    if(0!=co_await file.async_fsync()) {
+        ok = false;
+    }
+    for(size_t offset = 0;offset<file_size;offset+=chunk_size) {
+        if((ssize_t)chunk_size!=co_await file.async_pread(buffer.data(),chunk_size,(off_t)offset)) {
+            ok = false;
+            continue;
+        }
+        for(size_t i = 0;i<chunk_size;++i) {
+            if(buffer[i]!=pattern(stream,offset+i)) {
+                ok = false;
+                break;
+            }
+        }
+    }
+    driver.close(fd);
+}
+// the same, blocking
+static void thread_stream(vfs_driver& driver,size_t stream,bool& ok) {
+    char name[32];
+    path(name,"thread",stream);
+    int fd = driver.open(name,O_RDWR|O_CREAT|O_TRUNC,0666);
+    if(0>fd) {
+        ok = false;
+        return;
+    }
+    std::vector<uint8_t> buffer(chunk_size);
+    for(size_t offset = 0;offset<file_size;offset+=chunk_size) {
+        for(size_t i = 0;i<chunk_size;++i) {
+            buffer[i]=pattern(stream,offset+i);
+        }
+        if((ssize_t)chunk_size!=driver.write(fd,buffer.data(),chunk_size)) {
+            ok = false;
+        }
+    }
+    if(0!=driver.fsync(fd)) {
+        ok = false;
+    }
+    for(size_t offset = 0;offset<file_size;offset+=chunk_size) {
+        if((ssize_t)chunk_size!=driver.pread(fd,buffer.data(),chunk_size,(off_t)offset)) {
+            ok = false;
+            continue;
+        }
+        for(size_t i = 0;i<chunk_size;++i) {
+            if(buffer[i]!=pattern(stream,offset+i)) {
+                ok = false;
+                break;
+            }
+        }
+    }
+    driver.close(fd);
+}
+int main(int argc,char** argv) {
+    size_t streams = 8;
+    for(int i = 1;i<argc;++i) {
+        if(0==strcmp(argv[i],"--streams") && i+1<argc) {
+            streams = (size_t)atol(argv[++i]);
+        } else if(0==strcmp(argv[i],"--size") && i+1<argc) {
+            file_size = (size_t)atol(argv[++i])*1024;
+        } else if(0==strcmp(argv[i],"--chunk") && i+1<argc) {
+            chunk_size = (size_t)atol(argv[++i]);
+        } else {
+            fprintf(stderr,"usage: %s [--streams <count>] [--size <KB>] [--chunk <bytes>]\n",argv[0]);
+            return 2;
+        }
+    }
+    if(0==streams || 0==chunk_size || 0==file_size || 0!=file_size%chunk_size) {
+        fprintf(stderr,"the size has to be a multiple of the chunk\n");
+        return 2;
+    }
+    simulated_sd_card card(64*2048);
+    vfs_fast_fat32_card_hal<simulated_sd_card> hal(card);
+    if(!card.initialized() || !vfs_fast_fat32::format(hal)) {
+        fprintf(stderr,"could not create the simulated card\n");
+        return 1;
+    }
+    simulated_sd_timing timing = card.timing();
+    timing.command_us = 100;
+    timing.read_bytes_per_second = 20*1024*1024;
+    timing.write_bytes_per_second = 10*1024*1024;
+    card.timing(timing);
+    vfs_fast_fat32 fat(hal,0,streams+1);
+    if(!fat.initialized()) {
+        fprintf(stderr,"could not mount the simulated card\n");
+        return 1;
+    }
+    printf("%u streams of %u KB in %u byte chunks\n",(unsigned)streams,(unsigned)(file_size/1024),(unsigned)chunk_size);
+    bool ok = true;
+    {
+        std::unique_ptr<bool[]> results(new bool[streams]);
+        std::fill(results.get(),results.get()+streams,true);
+        uint64_t start = now_us();
+        vfs_executor executor;
+        if(!executor.initialized()) {
+            fprintf(stderr,"could not start the executor\n");
+            return 1;
+        }
+        for(size_t i = 0;i<streams;++i) {
+            executor.spawn(async_stream(executor,fat,i,results[i]));
+        }
+        executor.wait();
+        uint64_t elapsed = now_us()-start;
+        bool passed = true;
+        for(size_t i = 0;i<streams;++i) {
+            passed = passed && results[i];
+        }
+        printf("coroutines, 1 thread:  %8.1f ms  %s\n",elapsed/1000.0,passed?"ok":"FAILED");
+        ok = ok && passed;
+    }
+    {
+        std::unique_ptr<bool[]> results(new bool[streams]);
+        std::fill(results.get(),results.get()+streams,true);
+        std::vector<std::thread> threads;
+        uint64_t start = now_us();
+        for(size_t i = 0;i<streams;++i) {
+            threads.emplace_back(thread_stream,std::ref(fat),i,std::ref(results[i]));
+        }
+        for(size_t i = 0;i<streams;++i) {
+            threads[i].join();
+        }
+        uint64_t elapsed = now_us()-start;
+        bool passed = true;
+        for(size_t i = 0;i<streams;++i) {
+            passed = passed && results[i];
+        }
+        printf("threads, 1 per stream: %8.1f ms  %s\n",elapsed/1000.0,passed?"ok":"FAILED");
+        ok = ok && passed;
+    }
+    return ok?0:1;
+}
@@ -0,0 +1,12 @@
+// the part of ESP-IDF's esp_err.h the drivers use, for host builds with ESP_PLATFORM set
+#ifndef HTCW_ESP32_HOST_ESP_ERR_H
+#define HTCW_ESP32_HOST_ESP_ERR_H
+#include <stdint.h>
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_NOT_FOUND 0x105
+#endif
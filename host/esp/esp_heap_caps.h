@@ -0,0 +1,16 @@
+// the host has one heap, so every capability comes from malloc()
+#ifndef HTCW_ESP32_HOST_ESP_HEAP_CAPS_H
+#define HTCW_ESP32_HOST_ESP_HEAP_CAPS_H
+#include <stdint.h>
+#include <stdlib.h>
+#define MALLOC_CAP_8BIT (1<<2)
+#define MALLOC_CAP_DMA (1<<3)
+#define MALLOC_CAP_SPIRAM (1<<10)
+#define MALLOC_CAP_INTERNAL (1<<11)
+static inline void* heap_caps_malloc(size_t size,uint32_t caps) {
+    return malloc(size);
+}
+static inline void heap_caps_free(void* data) {
+    free(data);
+}
+#endif
@@ -0,0 +1,11 @@
+// esp_timer_get_time() from the host's monotonic clock
+#ifndef HTCW_ESP32_HOST_ESP_TIMER_H
+#define HTCW_ESP32_HOST_ESP_TIMER_H
+#include <stdint.h>
+#include <time.h>
+static inline int64_t esp_timer_get_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (int64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+#endif
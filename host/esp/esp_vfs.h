@@ -0,0 +1,252 @@
+// a host stand-in for the part of ESP-IDF's VFS that vfs.hpp mounts through, so the mount
+// layer (the trampolines, the stats, the DIR wrapper, the ioctl() tunnel) runs in host
+// tests. esp_vfs_register() keeps the table, and the calls in newlib:: route by path or fd
+// to the mount like newlib does on the device: the driver sees the path past the mount
+// point and its own fd, and a DIR carries its mount in dd_vfs_idx. only the context
+// pointer form is supported, since that's all vfs.hpp registers, and there's no root mount
+#ifndef HTCW_ESP32_HOST_ESP_VFS_H
+#define HTCW_ESP32_HOST_ESP_VFS_H
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include <sys/dirent.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#define ESP_VFS_FLAG_CONTEXT_PTR 1
+#define ESP_VFS_PATH_MAX 15
+typedef struct {
+    int flags;
+    ssize_t (*write_p)(void* ctx,int fd,const void* data,size_t size);
+    off_t (*lseek_p)(void* ctx,int fd,off_t size,int mode);
+    ssize_t (*read_p)(void* ctx,int fd,void* dst,size_t size);
+    ssize_t (*pread_p)(void* ctx,int fd,void* dst,size_t size,off_t offset);
+    ssize_t (*pwrite_p)(void* ctx,int fd,const void* src,size_t size,off_t offset);
+    int (*open_p)(void* ctx,const char* path,int flags,int mode);
+    int (*close_p)(void* ctx,int fd);
+    int (*fstat_p)(void* ctx,int fd,struct stat* st);
+    int (*fsync_p)(void* ctx,int fd);
+    int (*ioctl_p)(void* ctx,int fd,int cmd,va_list args);
+    int (*stat_p)(void* ctx,const char* path,struct stat* st);
+    int (*link_p)(void* ctx,const char* n1,const char* n2);
+    int (*unlink_p)(void* ctx,const char* path);
+    int (*rename_p)(void* ctx,const char* src,const char* dst);
+    DIR* (*opendir_p)(void* ctx,const char* name);
+    struct dirent* (*readdir_p)(void* ctx,DIR* pdir);
+    int (*readdir_r_p)(void* ctx,DIR* pdir,struct dirent* entry,struct dirent** out_dirent);
+    long (*telldir_p)(void* ctx,DIR* pdir);
+    void (*seekdir_p)(void* ctx,DIR* pdir,long offset);
+    int (*closedir_p)(void* ctx,DIR* pdir);
+    int (*mkdir_p)(void* ctx,const char* name,mode_t mode);
+    int (*rmdir_p)(void* ctx,const char* name);
+    int (*access_p)(void* ctx,const char* path,int amode);
+    int (*truncate_p)(void* ctx,const char* path,off_t length);
+    int (*utime_p)(void* ctx,const char* path,const struct utimbuf* times);
+} esp_vfs_t;
+struct esp_vfs_host_mount {
+    char path[ESP_VFS_PATH_MAX+1]; // empty when the slot is free
+    esp_vfs_t vfs;
+    void* ctx;
+};
+struct esp_vfs_host_file {
+    int mount; // -1 when the slot is free
+    int fd;
+};
+struct esp_vfs_host_state {
+    constexpr static const int max_mounts = 8;
+    constexpr static const int max_files = 64;
+    esp_vfs_host_mount mounts[max_mounts];
+    esp_vfs_host_file files[max_files];
+    esp_vfs_host_state() {
+        memset(mounts,0,sizeof(mounts));
+        for(int i = 0;i<max_files;++i) {
+            files[i].mount = -1;
+        }
+    }
+};
+inline esp_vfs_host_state& esp_vfs_host() {
+    static esp_vfs_host_state state;
+    return state;
+}
+inline esp_err_t esp_vfs_register(const char* base_path,const esp_vfs_t* vfs,void* ctx) {
+    size_t length = nullptr==base_path?0:strlen(base_path);
+    if(nullptr==vfs || 0==(vfs->flags&ESP_VFS_FLAG_CONTEXT_PTR) ||
+            0==length || '/'!=base_path[0] || '/'==base_path[length-1] || length>ESP_VFS_PATH_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_vfs_host_state& s = esp_vfs_host();
+    for(int i = 0;i<esp_vfs_host_state::max_mounts;++i) {
+        esp_vfs_host_mount& m = s.mounts[i];
+        if(0==m.path[0]) {
+            memcpy(m.path,base_path,length+1);
+            m.vfs = *vfs;
+            m.ctx = ctx;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+inline esp_err_t esp_vfs_unregister(const char* base_path) {
+    esp_vfs_host_state& s = esp_vfs_host();
+    for(int i = 0;nullptr!=base_path && i<esp_vfs_host_state::max_mounts;++i) {
+        esp_vfs_host_mount& m = s.mounts[i];
+        if(0!=m.path[0] && 0==strcmp(m.path,base_path)) {
+            for(int j = 0;j<esp_vfs_host_state::max_files;++j) {
+                if(i==s.files[j].mount) {
+                    s.files[j].mount = -1;
+                }
+            }
+            m.path[0] = 0;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_INVALID_STATE;
+}
+namespace newlib {
+    // the mount with the longest path that path starts with, and the rest of it
+    inline esp_vfs_host_mount* mount(const char* path,const char** rest,int* index = nullptr) {
+        esp_vfs_host_state& s = esp_vfs_host();
+        esp_vfs_host_mount* result = nullptr;
+        size_t best = 0;
+        for(int i = 0;nullptr!=path && i<esp_vfs_host_state::max_mounts;++i) {
+            esp_vfs_host_mount& m = s.mounts[i];
+            size_t length = strlen(m.path);
+            if(0==m.path[0] || length<best || 0!=strncmp(m.path,path,length) || ('/'!=path[length] && 0!=path[length])) {
+                continue;
+            }
+            result = &m;
+            best = length;
+            *rest = path+length;
+            if(nullptr!=index) {
+                *index = i;
+            }
+        }
+        if(nullptr==result) {
+            errno = ENOENT;
+        }
+        return result;
+    }
+    inline esp_vfs_host_mount* file(int fd,int* local) {
+        esp_vfs_host_state& s = esp_vfs_host();
+        if(0>fd || fd>=esp_vfs_host_state::max_files || 0>s.files[fd].mount) {
+            errno = EBADF;
+            return nullptr;
+        }
+        *local = s.files[fd].fd;
+        return &s.mounts[s.files[fd].mount];
+    }
+    inline int open(const char* path,int flags,int mode) {
+        const char* rest;
+        int index;
+        esp_vfs_host_mount* m = mount(path,&rest,&index);
+        if(nullptr==m) {
+            return -1;
+        }
+        esp_vfs_host_state& s = esp_vfs_host();
+        for(int i = 0;i<esp_vfs_host_state::max_files;++i) {
+            if(0>s.files[i].mount) {
+                int fd = m->vfs.open_p(m->ctx,rest,flags,mode);
+                if(0>fd) {
+                    return -1;
+                }
+                s.files[i].mount = index;
+                s.files[i].fd = fd;
+                return i;
+            }
+        }
+        errno = ENFILE;
+        return -1;
+    }
+    inline int close(int fd) {
+        int local;
+        esp_vfs_host_mount* m = file(fd,&local);
+        if(nullptr==m) {
+            return -1;
+        }
+        esp_vfs_host().files[fd].mount = -1;
+        return m->vfs.close_p(m->ctx,local);
+    }
+    inline ssize_t read(int fd,void* dst,size_t size) {
+        int local;
+        esp_vfs_host_mount* m = file(fd,&local);
+        return nullptr==m?-1:m->vfs.read_p(m->ctx,local,dst,size);
+    }
+    inline ssize_t write(int fd,const void* data,size_t size) {
+        int local;
+        esp_vfs_host_mount* m = file(fd,&local);
+        return nullptr==m?-1:m->vfs.write_p(m->ctx,local,data,size);
+    }
+    inline off_t lseek(int fd,off_t offset,int mode) {
+        int local;
+        esp_vfs_host_mount* m = file(fd,&local);
+        return nullptr==m?-1:m->vfs.lseek_p(m->ctx,local,offset,mode);
+    }
+    inline int fstat(int fd,struct stat* st) {
+        int local;
+        esp_vfs_host_mount* m = file(fd,&local);
+        return nullptr==m?-1:m->vfs.fstat_p(m->ctx,local,st);
+    }
+    inline int ioctl(int fd,int cmd,va_list args) {
+        int local;
+        esp_vfs_host_mount* m = file(fd,&local);
+        if(nullptr==m) {
+            return -1;
+        }
+        if(nullptr==m->vfs.ioctl_p) {
+            errno = ENOSYS;
+            return -1;
+        }
+        return m->vfs.ioctl_p(m->ctx,local,cmd,args);
+    }
+    inline int stat(const char* path,struct stat* st) {
+        const char* rest;
+        esp_vfs_host_mount* m = mount(path,&rest);
+        return nullptr==m?-1:m->vfs.stat_p(m->ctx,rest,st);
+    }
+    inline int unlink(const char* path) {
+        const char* rest;
+        esp_vfs_host_mount* m = mount(path,&rest);
+        return nullptr==m?-1:m->vfs.unlink_p(m->ctx,rest);
+    }
+    inline int mkdir(const char* path,mode_t mode) {
+        const char* rest;
+        esp_vfs_host_mount* m = mount(path,&rest);
+        return nullptr==m?-1:m->vfs.mkdir_p(m->ctx,rest,mode);
+    }
+    inline int utime(const char* path,const struct utimbuf* times) {
+        const char* rest;
+        esp_vfs_host_mount* m = mount(path,&rest);
+        return nullptr==m?-1:m->vfs.utime_p(m->ctx,rest,times);
+    }
+    inline DIR* opendir(const char* path) {
+        const char* rest;
+        int index;
+        esp_vfs_host_mount* m = mount(path,&rest,&index);
+        if(nullptr==m) {
+            return nullptr;
+        }
+        DIR* result = m->vfs.opendir_p(m->ctx,rest);
+        if(nullptr!=result) {
+            result->dd_vfs_idx = (uint16_t)index;
+        }
+        return result;
+    }
+    inline esp_vfs_host_mount* directory(DIR* pdir) {
+        if(nullptr==pdir || pdir->dd_vfs_idx>=esp_vfs_host_state::max_mounts || 0==esp_vfs_host().mounts[pdir->dd_vfs_idx].path[0]) {
+            errno = EBADF;
+            return nullptr;
+        }
+        return &esp_vfs_host().mounts[pdir->dd_vfs_idx];
+    }
+    inline struct dirent* readdir(DIR* pdir) {
+        esp_vfs_host_mount* m = directory(pdir);
+        return nullptr==m?nullptr:m->vfs.readdir_p(m->ctx,pdir);
+    }
+    inline int closedir(DIR* pdir) {
+        esp_vfs_host_mount* m = directory(pdir);
+        return nullptr==m?-1:m->vfs.closedir_p(m->ctx,pdir);
+    }
+}
+#endif
@@ -0,0 +1,5 @@
+// the options a host build with ESP_PLATFORM set stands in for
+#ifndef HTCW_ESP32_HOST_SDKCONFIG_H
+#define HTCW_ESP32_HOST_SDKCONFIG_H
+#define CONFIG_VFS_SUPPORT_DIR 1
+#endif
@@ -0,0 +1,19 @@
+// newlib's DIR and dirent as ESP-IDF has them. esp_vfs keeps the mount a DIR came from in
+// dd_vfs_idx
+#ifndef HTCW_ESP32_HOST_SYS_DIRENT_H
+#define HTCW_ESP32_HOST_SYS_DIRENT_H
+#include <stdint.h>
+#include <sys/types.h>
+typedef struct {
+    uint16_t dd_vfs_idx;
+    uint16_t dd_rsv;
+} DIR;
+struct dirent {
+    ino_t d_ino;
+    uint8_t d_type;
+    char d_name[256];
+};
+#define DT_UNKNOWN 0
+#define DT_REG 1
+#define DT_DIR 2
+#endif
@@ -0,0 +1,12 @@
+// ioctl() as newlib has it on ESP-IDF: sent to the mount the fd is open on
+#ifndef HTCW_ESP32_HOST_SYS_IOCTL_H
+#define HTCW_ESP32_HOST_SYS_IOCTL_H
+#include "esp_vfs.h"
+static inline int ioctl(int fd,int cmd,...) {
+    va_list args;
+    va_start(args,cmd);
+    int result = newlib::ioctl(fd,cmd,args);
+    va_end(args);
+    return result;
+}
+#endif
@@ -0,0 +1,326 @@
+// checks the fast FAT32 group commit log. threads append at once while the card is
+// copied in the middle of commits and checkpoints, sometimes with the write in flight
+// only partly landed, and each copy is mounted and recovered as if the power had gone
+// then: it has to replay an unbroken run of records that includes every one wait() had
+// returned for. also checks that checkpoints alternate between the two header sectors,
+// and that recovery stops at a record with a bad CRC, at one left from an earlier
+// session, and at one from another log with a different salt.
+// usage: fast_fat32_log_test [--records <per thread>]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "vfs_fast_fat32.hpp"
+#include "vfs_fast_fat32_image_hal.hpp"
+#include "vfs_fast_fat32_log.hpp"
+#include "host_test.hpp"
+using namespace esp32;
+
+constexpr static const uint32_t sector_count = 32*2048;
+constexpr static const size_t sector_size = 512;
+constexpr static const size_t thread_count = 4;
+constexpr static const size_t log_buffer_size = 4096;
+// small, so there are plenty of checkpoints
+constexpr static const uint32_t checkpoint_size = 16384;
+constexpr static const size_t record_prefix = 5;
+
+// a record is the thread that wrote it, its index among that thread's records, and
+// then bytes that follow from both
+static size_t make_record(uint8_t* record,uint8_t thread,uint32_t index,size_t size) {
+    record[0] = thread;
+    record[1] = (uint8_t)index;
+    record[2] = (uint8_t)(index>>8);
+    record[3] = (uint8_t)(index>>16);
+    record[4] = (uint8_t)(index>>24);
+    fill_pattern(record+record_prefix,size-record_prefix,thread*1000000u+index,0);
+    return size;
+}
+// what a replay found: the records have to come in sequence, and each thread's in the
+// order it appended them
+struct replay_state {
+    uint32_t last_sequence;
+    uint32_t next_index[256];
+    bool ok;
+};
+static void replay_record(uint32_t sequence,const void* data,size_t size,void* state) {
+    replay_state& s = *(replay_state*)state;
+    const uint8_t* p = (const uint8_t*)data;
+    if(sequence!=s.last_sequence+1 || size<record_prefix) {
+        s.ok = false;
+        return;
+    }
+    s.last_sequence = sequence;
+    uint8_t thread = p[0];
+    uint32_t index = p[1]|(p[2]<<8)|(p[3]<<16)|((uint32_t)p[4]<<24);
+    if(index!=s.next_index[thread] || !check_pattern(p+record_prefix,size-record_prefix,thread*1000000u+index,0)) {
+        s.ok = false;
+        return;
+    }
+    ++s.next_index[thread];
+}
+// replays the log, checking the records. returns the last sequence
+static uint32_t check_replay(vfs_fast_fat32_log& log) {
+    replay_state state;
+    memset(&state,0,sizeof(state));
+    state.ok = true;
+    CHECK(log.replay(replay_record,&state));
+    CHECK(state.ok);
+    CHECK(state.last_sequence==log.durable());
+    return state.last_sequence;
+}
+// mounts the image, recovers the log and replays it. returns the last sequence, after
+// checking that appending carries on from there
+static uint32_t recover(vfs_fast_fat32_hal& hal,const char* path) {
+    vfs_fast_fat32 fat(hal);
+    CHECK(fat.initialized());
+    vfs_fast_fat32_log log(fat,path,log_buffer_size,0,1,checkpoint_size);
+    CHECK(log.initialized());
+    uint32_t result = check_replay(log);
+    uint8_t record[64];
+    make_record(record,200,0,sizeof(record));
+    uint32_t sequence = log.append(record,sizeof(record));
+    CHECK(result+1==sequence);
+    CHECK(log.wait(sequence));
+    return result;
+}
+// copies the card from time to time as writes arrive. a copy may take only the first
+// few sectors of the write in progress, like a card losing power part way through one
+class snapshot_hal : public vfs_fast_fat32_hal {
+    vfs_fast_fat32_ram_hal& m_inner;
+    vfs_fast_fat32_ram_hal m_copy;
+    test_random m_random;
+    size_t m_writes;
+public:
+    // records every wait() has returned for, as of now
+    std::atomic<uint32_t> confirmed;
+    size_t snapshots;
+    const char* path;
+    snapshot_hal(vfs_fast_fat32_ram_hal& inner) : m_inner(inner),m_copy(sector_count),m_random(3),m_writes(0),confirmed(0),snapshots(0),path(nullptr) {
+        CHECK(m_copy.initialized());
+    }
+    virtual vfs_fast_fat32_disk_status initialize(uint8_t pdrv) {
+        return m_inner.initialize(pdrv);
+    }
+    virtual vfs_fast_fat32_disk_status status(uint8_t pdrv) {
+        return m_inner.status(pdrv);
+    }
+    virtual vfs_fast_fat32_hal_result read(uint8_t pdrv,void* buffer,uint32_t sector,unsigned int count) {
+        return m_inner.read(pdrv,buffer,sector,count);
+    }
+    virtual vfs_fast_fat32_hal_result write(uint8_t pdrv,const void* buffer,uint32_t sector,unsigned int count) {
+        if(nullptr!=path && 0==m_random.below(3)) {
+            // anything confirmed before this write started is on the card already
+            uint32_t expected = confirmed;
+            memcpy(m_copy.data(),m_inner.data(),(size_t)sector_count*sector_size);
+            unsigned int landed = m_random.below(count+1);
+            memcpy(m_copy.data()+(size_t)sector*sector_size,buffer,(size_t)landed*sector_size);
+            uint32_t found = recover(m_copy,path);
+            CHECK(found>=expected);
+            ++snapshots;
+        }
+        ++m_writes;
+        return m_inner.write(pdrv,buffer,sector,count);
+    }
+    virtual vfs_fast_fat32_hal_result ioctl(uint8_t pdrv,vfs_fast_fat32_ioctl_command command,void* buffer) {
+        return m_inner.ioctl(pdrv,command,buffer);
+    }
+};
+static uint32_t crc32(const uint8_t* data,size_t size) {
+    uint32_t crc = 0xFFFFFFFF;
+    while(size--) {
+        crc ^= *data++;
+        for(int i = 0;i<8;++i) {
+            crc = crc>>1^(0xEDB88320&(0-(crc&1)));
+        }
+    }
+    return ~crc;
+}
+static uint32_t ld_32(const uint8_t* p) {
+    return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+// the two header sectors each hold a good checkpoint, the even generation in the first
+// and the odd in the second, one apart. returns the newer generation
+static uint32_t check_headers(vfs_fast_fat32& fat,const char* path) {
+    int fd = fat.open(path,O_RDONLY,0);
+    CHECK(0<=fd);
+    uint8_t headers[2*sector_size];
+    CHECK((ssize_t)sizeof(headers)==fat.pread(fd,headers,sizeof(headers),0));
+    struct stat st;
+    CHECK(0==fat.fstat(fd,&st));
+    CHECK(0==fat.close(fd));
+    uint32_t generation[2];
+    for(int i = 0;i<2;++i) {
+        const uint8_t* p = headers+i*sector_size;
+        CHECK(0x474F4C48==ld_32(p));
+        CHECK(crc32(p,28)==ld_32(p+28));
+        generation[i] = ld_32(p+4);
+        CHECK((uint32_t)i==(generation[i]&1));
+    }
+    uint32_t newer = generation[0]>generation[1]?0:1;
+    CHECK(1==generation[newer]-generation[newer^1]);
+    // a closed log's last checkpoint is at its end
+    CHECK((off_t)ld_32(headers+newer*sector_size+16)==st.st_size);
+    return generation[newer];
+}
+static void concurrent(size_t records) {
+    printf("concurrent appends\n");
+    vfs_fast_fat32_ram_hal ram(sector_count);
+    CHECK(ram.initialized() && vfs_fast_fat32::format(ram));
+    snapshot_hal hal(ram);
+    const char* path = "/threads.log";
+    {
+        vfs_fast_fat32 fat(hal);
+        CHECK(fat.initialized());
+        vfs_fast_fat32_log log(fat,path,log_buffer_size,0,1,checkpoint_size);
+        CHECK(log.initialized());
+        hal.path = path;
+        std::mutex confirm_lock;
+        std::thread threads[thread_count];
+        for(size_t t = 0;t<thread_count;++t) {
+            threads[t] = std::thread([&log,&hal,&confirm_lock,records,t]{
+                test_random random((uint32_t)t+1);
+                std::vector<uint8_t> record(400);
+                for(uint32_t i = 0;i<records;++i) {
+                    size_t size = make_record(record.data(),(uint8_t)t,i,record_prefix+random.below(300));
+                    uint32_t sequence = log.append(record.data(),size);
+                    CHECK(0!=sequence);
+                    if(0==random.below(8)) {
+                        CHECK(log.wait(sequence));
+                        // wait() for one means every one before it is on the card too
+                        std::lock_guard<std::mutex> lock(confirm_lock);
+                        if((int32_t)(sequence-hal.confirmed)>0) {
+                            hal.confirmed = sequence;
+                        }
+                    }
+                }
+            });
+        }
+        for(size_t t = 0;t<thread_count;++t) {
+            threads[t].join();
+        }
+        CHECK(log.commit());
+        CHECK(thread_count*records==log.durable());
+        hal.path = nullptr;
+    }
+    printf("  %u copies recovered\n",(unsigned)hal.snapshots);
+    CHECK(0!=hal.snapshots);
+    // the clean close
+    {
+        vfs_fast_fat32 fat(ram);
+        CHECK(fat.initialized());
+        CHECK(check_headers(fat,path)>2);
+    }
+    CHECK(thread_count*records==recover(ram,path));
+    {
+        vfs_fast_fat32 fat(ram);
+        CHECK(fat.initialized());
+        check_headers(fat,path);
+    }
+}
+// where the record from this thread with this index starts in the image, found by its
+// data, which no other record has
+static uint8_t* find_record(vfs_fast_fat32_ram_hal& ram,uint8_t thread,uint32_t index,size_t size) {
+    std::vector<uint8_t> record(size);
+    make_record(record.data(),thread,index,size);
+    uint8_t* found = (uint8_t*)memmem(ram.data(),(size_t)sector_count*sector_size,record.data(),size);
+    CHECK(nullptr!=found);
+    return found-16;
+}
+// appends count records of the same size to the log at path, and commits them without
+// closing, so they're past the last checkpoint as after a crash
+static void append_records(vfs_fast_fat32_log& log,uint8_t thread,uint32_t first,uint32_t count,size_t size) {
+    std::vector<uint8_t> record(size);
+    for(uint32_t i = first;i<first+count;++i) {
+        make_record(record.data(),thread,i,size);
+        CHECK(0!=log.append(record.data(),size));
+    }
+    CHECK(log.commit());
+}
+// fill writes to a new volume and calls crash while its logs are still open, which
+// copies the card as it is then, before any closing checkpoint
+static void crashed(vfs_fast_fat32_ram_hal& copy,void(*fill)(vfs_fast_fat32& fat,const std::function<void()>& crash)) {
+    vfs_fast_fat32_ram_hal ram(sector_count);
+    CHECK(ram.initialized() && vfs_fast_fat32::format(ram));
+    vfs_fast_fat32 fat(ram);
+    CHECK(fat.initialized());
+    bool copied = false;
+    fill(fat,[&ram,&copy,&copied]{
+        memcpy(copy.data(),ram.data(),(size_t)sector_count*sector_size);
+        copied = true;
+    });
+    CHECK(copied);
+}
+// with its header a record is a quarter of a sector, so every fourth starts one
+constexpr static const size_t fixed_size = 112;
+static void torn_tail() {
+    printf("torn tail\n");
+    vfs_fast_fat32_ram_hal copy(sector_count);
+    CHECK(copy.initialized());
+    // a record with a bad CRC ends the log, even with good ones after it
+    crashed(copy,[](vfs_fast_fat32& fat,const std::function<void()>& crash) {
+        vfs_fast_fat32_log log(fat,"/crc.log",log_buffer_size,0,1,1024*1024);
+        CHECK(log.initialized());
+        append_records(log,0,0,40,fixed_size);
+        crash();
+    });
+    // record 21 is the one with index 20
+    find_record(copy,0,20,fixed_size)[16+50]^=1;
+    // that leaves records 22 on past the end. the session that recovers writes a new 21
+    // to 24 over the rest of the sector 21 starts, which a commit pads with zeros, so the
+    // old 25 in the next sector follows them in sequence with a good CRC. but it's from
+    // the session before
+    {
+        vfs_fast_fat32 fat(copy);
+        CHECK(fat.initialized());
+        vfs_fast_fat32_log log(fat,"/crc.log",log_buffer_size,0,1,1024*1024);
+        CHECK(log.initialized());
+        CHECK(20==check_replay(log));
+        append_records(log,1,0,4,fixed_size);
+        CHECK(24==log.durable());
+        // the log is still open, so this is a crash
+        vfs_fast_fat32_ram_hal crash(sector_count);
+        CHECK(crash.initialized());
+        memcpy(crash.data(),copy.data(),(size_t)sector_count*sector_size);
+        uint8_t* old = find_record(crash,0,24,fixed_size);
+        uint8_t* fresh = find_record(crash,1,3,fixed_size);
+        CHECK(old==fresh+16+fixed_size);
+        CHECK(25==ld_32(old+4));
+        CHECK(24==recover(crash,"/crc.log"));
+    }
+    // a record from another log at the same offset, with the sequence that comes next, is
+    // turned away by the salt
+    crashed(copy,[](vfs_fast_fat32& fat,const std::function<void()>& crash) {
+        vfs_fast_fat32_log first(fat,"/first.log",log_buffer_size,0,1,1024*1024);
+        vfs_fast_fat32_log second(fat,"/second.log",log_buffer_size,0,1,1024*1024);
+        CHECK(first.initialized() && second.initialized());
+        append_records(first,2,0,20,fixed_size);
+        append_records(second,3,0,10,fixed_size);
+        crash();
+    });
+    uint8_t* stranger = find_record(copy,2,10,fixed_size);
+    uint8_t* end = find_record(copy,3,9,fixed_size)+16+fixed_size;
+    CHECK(11==ld_32(stranger+4));
+    memcpy(end,stranger,16+fixed_size);
+    CHECK(10==recover(copy,"/second.log"));
+    CHECK(20==recover(copy,"/first.log"));
+}
+int main(int argc,char** argv) {
+    size_t records = 300;
+    for(int i = 1;i<argc;++i) {
+        if(0==strcmp(argv[i],"--records") && i+1<argc) {
+            records = (size_t)atol(argv[++i]);
+        } else {
+            fprintf(stderr,"usage: %s [--records <per thread>]\n",argv[0]);
+            return 2;
+        }
+    }
+    concurrent(records);
+    torn_tail();
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,382 @@
+// writes files of awkward sizes to the fast FAT32 driver, remounts, and checks every byte
+// that comes back, on a RAM drive and on a disk image file that is closed and reopened
+// between mounts. then again on RAM drives whose data region starts a sector before a
+// cache line boundary, with a cache of a few lines, so the boot sector and FSInfo sit in
+// the short line below the first aligned one and lines are evicted all the time. last,
+// readv(), writev() and pwritev() have to move the same bytes as the calls they stand for,
+// and clusters reserved by grow_by() have to hold data and be given back on close.
+// usage: fast_fat32_test [<image file>]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <vector>
+#include "vfs_fast_fat32.hpp"
+#include "vfs_fast_fat32_image_hal.hpp"
+#include "host_test.hpp"
+using namespace esp32;
+
+constexpr static const uint32_t sector_count = 32*2048;
+struct test_file {
+    const char* path;
+    uint32_t size;
+};
+// around the sector, cache line and cluster boundaries, and big enough to stream
+static const test_file files[] = {
+    {"/empty.dat",0},
+    {"/one.dat",1},
+    {"/data/511.dat",511},
+    {"/data/512.dat",512},
+    {"/data/513.dat",513},
+    {"/data/line.dat",2048+7},
+    {"/data/cluster.dat",4096*3+100},
+    {"/data/big.dat",1024*1024+333},
+    {"/data/deep/more.dat",70001}
+};
+constexpr static const size_t file_count = sizeof(files)/sizeof(files[0]);
+// written with pwrite() past its end, so the front is a gap of zeros
+static const char* gap_path = "/gap.dat";
+constexpr static const uint32_t gap_offset = 70000;
+constexpr static const uint32_t gap_size = 1000;
+
+// the RAM drive stays put across mounts. the image is reopened, so what's read back
+// came from the file
+class drive {
+    const char* m_image;
+    vfs_fast_fat32_ram_hal* m_ram;
+    vfs_fast_fat32_file_hal* m_file;
+public:
+    drive(const char* image) : m_image(image),m_ram(nullptr),m_file(nullptr) {
+        if(nullptr==image) {
+            m_ram = new vfs_fast_fat32_ram_hal(sector_count);
+            CHECK(m_ram->initialized());
+        } else {
+            ::unlink(image);
+            m_file = new vfs_fast_fat32_file_hal(image,sector_count);
+            CHECK(m_file->initialized());
+        }
+    }
+    ~drive() {
+        delete m_ram;
+        delete m_file;
+        if(nullptr!=m_image) {
+            ::unlink(m_image);
+        }
+    }
+    vfs_fast_fat32_hal& hal() {
+        return nullptr!=m_ram?(vfs_fast_fat32_hal&)*m_ram:(vfs_fast_fat32_hal&)*m_file;
+    }
+    void reopen() {
+        if(nullptr!=m_file) {
+            delete m_file;
+            m_file = new vfs_fast_fat32_file_hal(m_image);
+            CHECK(m_file->initialized());
+        }
+    }
+};
+static void check_gap(vfs_fast_fat32& fat) {
+    int fd = fat.open(gap_path,O_RDONLY,0);
+    CHECK(0<=fd);
+    std::vector<uint8_t> buffer(gap_offset+gap_size+10);
+    CHECK((ssize_t)(gap_offset+gap_size)==fat.read(fd,buffer.data(),buffer.size()));
+    for(uint32_t i = 0;i<gap_offset;++i) {
+        CHECK(0==buffer[i]);
+    }
+    CHECK(check_pattern(buffer.data()+gap_offset,gap_size,100,0));
+    CHECK(0==fat.close(fd));
+}
+static void check_all(vfs_fast_fat32& fat,const bool* present,const uint32_t* sizes) {
+    test_random random(7);
+    for(size_t i = 0;i<file_count;++i) {
+        if(present[i]) {
+            check_test_file(fat,files[i].path,(uint32_t)i,sizes[i],random);
+        } else {
+            CHECK(0!=fat.access(files[i].path,F_OK));
+        }
+    }
+    check_gap(fat);
+}
+static inline uint32_t ld_16(const uint8_t* p) {
+    return p[0]|p[1]<<8;
+}
+static inline uint32_t ld_32(const uint8_t* p) {
+    return p[0]|p[1]<<8|p[2]<<16|(uint32_t)p[3]<<24;
+}
+static inline void st_32(uint8_t* p,uint32_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value>>8);
+    p[2] = (uint8_t)(value>>16);
+    p[3] = (uint8_t)(value>>24);
+}
+// adds reserved sectors to a fresh volume, moving the rest along, until the data region
+// starts one sector before a multiple of line_sectors
+static void misalign(vfs_fast_fat32_hal& hal,uint32_t line_sectors) {
+    constexpr static const size_t sector_size = 512;
+    std::vector<uint8_t> image((size_t)sector_count*sector_size);
+    CHECK(vfs_fast_fat32_hal_result::success==hal.read(0,image.data(),0,sector_count));
+    uint8_t* boot = image.data();
+    uint32_t reserved = ld_16(boot+14);
+    uint32_t fats = boot[16];
+    uint32_t fat_sectors = ld_32(boot+36);
+    uint32_t data = reserved+fats*fat_sectors;
+    uint32_t shift = (line_sectors-1-data%line_sectors)%line_sectors;
+    memmove(boot+(reserved+shift)*sector_size,boot+reserved*sector_size,(sector_count-reserved-shift)*sector_size);
+    memset(boot+reserved*sector_size,0,shift*sector_size);
+    reserved+=shift;
+    boot[14] = (uint8_t)reserved;
+    boot[15] = (uint8_t)(reserved>>8);
+    CHECK(line_sectors-1==(reserved+fats*fat_sectors)%line_sectors);
+    memcpy(boot+6*sector_size,boot,sector_size);
+    // FSInfo and its backup, with the free count of the smaller data region
+    uint32_t clusters = (sector_count-reserved-fats*fat_sectors)/boot[13];
+    st_32(boot+sector_size+488,clusters-1);
+    st_32(boot+7*sector_size+488,clusters-1);
+    CHECK(vfs_fast_fat32_hal_result::success==hal.write(0,image.data(),0,sector_count));
+}
+// the free count the last mount left in FSInfo has to match the FAT
+static void check_fsinfo(vfs_fast_fat32_hal& hal) {
+    uint8_t sector[512];
+    CHECK(vfs_fast_fat32_hal_result::success==hal.read(0,sector,0,1));
+    uint32_t reserved = ld_16(sector+14);
+    uint32_t fat_sectors = ld_32(sector+36);
+    uint32_t data = reserved+sector[16]*fat_sectors;
+    uint32_t clusters = (ld_32(sector+32)-data)/sector[13];
+    uint32_t free_clusters = 0;
+    for(uint32_t i = 0;i<fat_sectors;++i) {
+        CHECK(vfs_fast_fat32_hal_result::success==hal.read(0,sector,reserved+i,1));
+        for(uint32_t j = 0;j<128;++j) {
+            uint32_t cluster = i*128+j;
+            if(cluster>=2 && cluster<clusters+2 && 0==(ld_32(sector+j*4)&0x0FFFFFFF)) {
+                ++free_clusters;
+            }
+        }
+    }
+    CHECK(vfs_fast_fat32_hal_result::success==hal.read(0,sector,1,1));
+    CHECK(0x41615252==ld_32(sector));
+    CHECK(free_clusters==ld_32(sector+488));
+}
+static void run(const char* image,size_t line_size = 0) {
+    if(0!=line_size) {
+        printf("RAM drive, data region misaligned to %u sector cache lines\n",(unsigned)(line_size/512));
+    } else {
+        printf("%s\n",nullptr==image?"RAM drive":image);
+    }
+    drive d(image);
+    CHECK(vfs_fast_fat32::format(d.hal()));
+    size_t cache_size = 16384;
+    if(0!=line_size) {
+        misalign(d.hal(),(uint32_t)(line_size/512));
+        cache_size = 3*line_size;
+    } else {
+        line_size = 2048;
+    }
+    bool present[file_count];
+    uint32_t sizes[file_count];
+    test_random random;
+    {
+        vfs_fast_fat32 fat(d.hal(),0,5,16,cache_size,line_size);
+        CHECK(fat.initialized());
+        CHECK(0==fat.mkdir("/data",0777));
+        CHECK(0==fat.mkdir("/data/deep",0777));
+        for(size_t i = 0;i<file_count;++i) {
+            write_test_file(fat,files[i].path,(uint32_t)i,files[i].size,random);
+            present[i] = true;
+            sizes[i] = files[i].size;
+        }
+        int fd = fat.open(gap_path,O_WRONLY|O_CREAT,0666);
+        CHECK(0<=fd);
+        std::vector<uint8_t> buffer(gap_size);
+        fill_pattern(buffer.data(),gap_size,100,0);
+        CHECK((ssize_t)gap_size==fat.pwrite(fd,buffer.data(),gap_size,gap_offset));
+        CHECK(0==fat.close(fd));
+    }
+    d.reopen();
+    {
+        vfs_fast_fat32 fat(d.hal(),0,5,16,cache_size,line_size);
+        CHECK(fat.initialized());
+        check_all(fat,present,sizes);
+        // change some and check they stay changed
+        CHECK(0==fat.unlink(files[4].path));
+        present[4] = false;
+        CHECK(0==fat.truncate(files[7].path,300000));
+        sizes[7] = 300000;
+        write_test_file(fat,files[1].path,1,100000,random);
+        sizes[1] = 100000;
+        int fd = fat.open(files[3].path,O_WRONLY|O_APPEND,0);
+        CHECK(0<=fd);
+        std::vector<uint8_t> buffer(5000);
+        fill_pattern(buffer.data(),buffer.size(),3,files[3].size);
+        CHECK((ssize_t)buffer.size()==fat.write(fd,buffer.data(),buffer.size()));
+        CHECK(0==fat.close(fd));
+        sizes[3]+=buffer.size();
+        check_all(fat,present,sizes);
+    }
+    d.reopen();
+    {
+        vfs_fast_fat32 fat(d.hal(),0,5,16,cache_size,line_size);
+        CHECK(fat.initialized());
+        check_all(fat,present,sizes);
+    }
+    check_fsinfo(d.hal());
+}
+// points iov at data cut into pieces of the given sizes, and returns how many bytes that is
+static size_t cut(std::vector<struct iovec>& iov,uint8_t* data,const size_t* sizes,size_t count) {
+    iov.resize(count);
+    size_t total = 0;
+    for(size_t i = 0;i<count;++i) {
+        iov[i].iov_base = data+total;
+        iov[i].iov_len = sizes[i];
+        total+=sizes[i];
+    }
+    return total;
+}
+// readv(), writev() and pwritev() over pieces that start and end anywhere in a sector,
+// with empty ones among them
+static void vectored() {
+    printf("vectored I/O\n");
+    vfs_fast_fat32_ram_hal ram(sector_count);
+    CHECK(ram.initialized());
+    CHECK(vfs_fast_fat32::format(ram));
+    static const size_t write_sizes[] = {1,511,0,3000,513,7000,4096,20};
+    static const size_t pwrite_sizes[] = {100,0,2000,1};
+    static const size_t read_sizes[] = {700,1,4096,0,9000,20000};
+    std::vector<uint8_t> expected(40000,0);
+    std::vector<uint8_t> data(40000);
+    std::vector<struct iovec> iov;
+    size_t size;
+    {
+        vfs_fast_fat32 fat(ram);
+        CHECK(fat.initialized());
+        int fd = fat.open("/v.dat",O_RDWR|O_CREAT,0666);
+        CHECK(0<=fd);
+        fill_pattern(expected.data(),expected.size(),1,0);
+        size = cut(iov,expected.data(),write_sizes,sizeof(write_sizes)/sizeof(write_sizes[0]));
+        CHECK((ssize_t)size==fat.writev(fd,iov.data(),(int)iov.size()));
+        CHECK((off_t)size==fat.lseek(fd,0,SEEK_CUR));
+        // pwritev() over the middle, and past the end, which leaves a gap of zeros. the
+        // position stays where writev() left it
+        size_t offset = 700;
+        size_t written = cut(iov,expected.data()+offset,pwrite_sizes,sizeof(pwrite_sizes)/sizeof(pwrite_sizes[0]));
+        fill_pattern(expected.data()+offset,written,2,offset);
+        CHECK((ssize_t)written==fat.pwritev(fd,iov.data(),(int)iov.size(),offset));
+        CHECK((off_t)size==fat.lseek(fd,0,SEEK_CUR));
+        offset = size+1000;
+        memset(expected.data()+size,0,1000);
+        written = cut(iov,expected.data()+offset,pwrite_sizes,sizeof(pwrite_sizes)/sizeof(pwrite_sizes[0]));
+        fill_pattern(expected.data()+offset,written,3,offset);
+        CHECK((ssize_t)written==fat.pwritev(fd,iov.data(),(int)iov.size(),offset));
+        CHECK((off_t)size==fat.lseek(fd,0,SEEK_CUR));
+        size = offset+written;
+        // a read that asks for more than is left stops short at the end of the file
+        CHECK(0==fat.lseek(fd,0,SEEK_SET));
+        memset(data.data(),0xEE,data.size());
+        CHECK(size<cut(iov,data.data(),read_sizes,sizeof(read_sizes)/sizeof(read_sizes[0])));
+        CHECK((ssize_t)size==fat.readv(fd,iov.data(),(int)iov.size()));
+        CHECK(0==memcmp(data.data(),expected.data(),size));
+        CHECK(0xEE==data[size]);
+        CHECK(0==fat.readv(fd,iov.data(),(int)iov.size()));
+        CHECK(0==fat.close(fd));
+        errno = 0;
+        CHECK(-1==fat.readv(fd,iov.data(),(int)iov.size()));
+        CHECK(EBADF==errno);
+    }
+    vfs_fast_fat32 fat(ram);
+    CHECK(fat.initialized());
+    int fd = fat.open("/v.dat",O_RDONLY,0);
+    CHECK(0<=fd);
+    memset(data.data(),0xEE,data.size());
+    cut(iov,data.data(),read_sizes,sizeof(read_sizes)/sizeof(read_sizes[0]));
+    CHECK((ssize_t)size==fat.readv(fd,iov.data(),(int)iov.size()));
+    CHECK(0==memcmp(data.data(),expected.data(),size));
+    // nothing can be written through a read only file, from the position or elsewhere
+    cut(iov,data.data(),write_sizes,sizeof(write_sizes)/sizeof(write_sizes[0]));
+    errno = 0;
+    CHECK(-1==fat.writev(fd,iov.data(),(int)iov.size()));
+    CHECK(EBADF==errno);
+    errno = 0;
+    CHECK(-1==fat.pwritev(fd,iov.data(),(int)iov.size(),0));
+    CHECK(EBADF==errno);
+    CHECK(0==fat.close(fd));
+    struct stat st;
+    CHECK(0==fat.stat("/v.dat",&st));
+    CHECK((off_t)size==st.st_size);
+}
+// grow_by() reserves clusters a run at a time as the file grows. they count in
+// allocated_size() but not in the size, and what's left of them is freed on close
+static void grown() {
+    printf("grow_by\n");
+    vfs_fast_fat32_ram_hal ram(sector_count);
+    CHECK(ram.initialized());
+    CHECK(vfs_fast_fat32::format(ram));
+    off_t cluster;
+    unsigned long long before;
+    size_t size;
+    std::vector<uint8_t> data;
+    {
+        vfs_fast_fat32 fat(ram);
+        CHECK(fat.initialized());
+        // one byte takes one cluster by default
+        int fd = fat.open("/one.dat",O_WRONLY|O_CREAT,0666);
+        CHECK(0<=fd);
+        CHECK(1==fat.write(fd,"x",1));
+        cluster = fat.allocated_size(fd);
+        CHECK(0<cluster);
+        CHECK(0==fat.close(fd));
+        before = fat.free();
+        fd = fat.open("/g.dat",O_RDWR|O_CREAT,0666);
+        CHECK(0<=fd);
+        CHECK(0==fat.grow_by(fd,8));
+        CHECK(0==fat.allocated_size(fd));
+        data.resize((size_t)(8*cluster+1));
+        fill_pattern(data.data(),data.size(),5,0);
+        CHECK(100==fat.write(fd,data.data(),100));
+        struct stat st;
+        CHECK(8*cluster==fat.allocated_size(fd));
+        CHECK(0==fat.fstat(fd,&st) && 100==st.st_size);
+        CHECK(before-8*cluster==fat.free());
+        // writing into the grown region takes nothing more
+        size = (size_t)(7*cluster+10);
+        CHECK((ssize_t)(size-100)==fat.write(fd,data.data()+100,size-100));
+        CHECK(8*cluster==fat.allocated_size(fd));
+        CHECK(0==fat.fstat(fd,&st) && (off_t)size==st.st_size);
+        CHECK(before-8*cluster==fat.free());
+        // and past the end of it takes another run
+        CHECK((ssize_t)(data.size()-size)==fat.write(fd,data.data()+size,data.size()-size));
+        size = data.size();
+        CHECK(16*cluster==fat.allocated_size(fd));
+        CHECK(0==fat.fstat(fd,&st) && (off_t)size==st.st_size);
+        CHECK(before-16*cluster==fat.free());
+        errno = 0;
+        CHECK(-1==fat.grow_by(fd+1,8));
+        CHECK(EBADF==errno);
+        CHECK(0==fat.close(fd));
+        CHECK(before-9*cluster==fat.free());
+    }
+    vfs_fast_fat32 fat(ram);
+    CHECK(fat.initialized());
+    CHECK(before-9*cluster==fat.free());
+    int fd = fat.open("/g.dat",O_RDONLY,0);
+    CHECK(0<=fd);
+    CHECK(9*cluster==fat.allocated_size(fd));
+    std::vector<uint8_t> read(size+1);
+    CHECK((ssize_t)size==fat.read(fd,read.data(),read.size()));
+    CHECK(check_pattern(read.data(),size,5,0));
+    CHECK(0==fat.close(fd));
+}
+int main(int argc,char** argv) {
+    if(argc>2) {
+        fprintf(stderr,"usage: %s [<image file>]\n",argv[0]);
+        return 2;
+    }
+    run(nullptr);
+    run(argc>1?argv[1]:"fast_fat32_test.img");
+    run(nullptr,2048);
+    run(nullptr,4096);
+    vectored();
+    grown();
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,172 @@
+// checks that the fast FAT32 driver trims what it frees and never what's still in use. it
+// runs on a RAM drive that zeroes trimmed sectors, so a trim that reaches live data shows
+// up in the file contents. covers unlink, truncate, overwriting with O_TRUNC, clusters
+// taken again before their trim went out, more fragmented frees than the driver keeps
+// runs for, trim_free_space() with and without the free map, and turning trims off.
+// usage: fast_fat32_trim_test
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <vector>
+#include "vfs_fast_fat32.hpp"
+#include "vfs_fast_fat32_image_hal.hpp"
+#include "host_test.hpp"
+using namespace esp32;
+
+constexpr static const uint32_t sector_count = 64*2048;
+constexpr static const size_t sector_size = 512;
+constexpr static const size_t fragments = 200;
+// the volume's cluster size
+constexpr static const size_t fragment_size = 4096;
+
+struct kept_file {
+    char path[16];
+    uint32_t seed;
+    size_t size;
+};
+static void check_kept(vfs_fast_fat32& fat,const std::vector<kept_file>& kept) {
+    for(size_t i = 0;i<kept.size();++i) {
+        check_test_file(fat,kept[i].path,kept[i].seed,kept[i].size);
+    }
+}
+int main(int argc,char** argv) {
+    if(argc>1) {
+        fprintf(stderr,"usage: %s\n",argv[0]);
+        return 2;
+    }
+    zeroing_hal hal(sector_count);
+    CHECK(vfs_fast_fat32::format(hal));
+    std::vector<kept_file> kept;
+    kept_file file;
+    test_random random;
+    {
+        vfs_fast_fat32 fat(hal);
+        CHECK(fat.initialized());
+        CHECK(fat.trim());
+        printf("unlink\n");
+        write_test_file(fat,"/a.dat",1,100000);
+        write_test_file(fat,"/b.dat",2,50000);
+        hal.reset();
+        CHECK(0==fat.unlink("/a.dat"));
+        // goes out at the sync unlink() ends with, as one run
+        CHECK(fat.trim_freed());
+        CHECK(1==hal.trims && hal.sectors>=100000/sector_size);
+        check_test_file(fat,"/b.dat",2,50000);
+        printf("truncate\n");
+        hal.reset();
+        CHECK(0==fat.truncate("/b.dat",1000));
+        CHECK(fat.trim_freed());
+        CHECK(1==hal.trims);
+        check_test_file(fat,"/b.dat",2,1000);
+        printf("overwrite\n");
+        write_test_file(fat,"/c.dat",3,70000);
+        hal.reset();
+        write_test_file(fat,"/c.dat",4,3000);
+        CHECK(fat.trim_freed());
+        CHECK(0!=hal.trims);
+        check_test_file(fat,"/c.dat",4,3000);
+        printf("reuse before the trim\n");
+        write_test_file(fat,"/p.dat",7,3000);
+        write_test_file(fat,"/d.dat",5,200000);
+        // the unlink frees the clusters but its sync can't write the FAT, so their trims
+        // stay queued
+        hal.reset();
+        hal.fail_writes = true;
+        CHECK(0!=fat.unlink("/d.dat"));
+        hal.fail_writes = false;
+        CHECK(0==hal.trims);
+        // a file grows from its last cluster on, into the ones just freed
+        {
+            int fd = fat.open("/p.dat",O_WRONLY|O_APPEND,0);
+            CHECK(0<=fd);
+            std::vector<uint8_t> data(150000);
+            fill_pattern(data.data(),data.size(),7,3000);
+            CHECK((ssize_t)data.size()==fat.write(fd,data.data(),data.size()));
+            CHECK(0==fat.close(fd));
+        }
+        CHECK(fat.trim_freed());
+        // only what wasn't taken again
+        CHECK(0!=hal.trims && hal.sectors<200000/sector_size);
+        check_test_file(fat,"/p.dat",7,153000);
+        check_test_file(fat,"/b.dat",2,1000);
+        check_test_file(fat,"/c.dat",4,3000);
+        CHECK(0!=fat.access("/d.dat",F_OK));
+        printf("fragmented\n");
+        // two files written a cluster's worth at a time, turn about, so each chain is
+        // mostly runs of one or two clusters. freeing one at once is far more runs than
+        // the driver keeps
+        {
+            int fds[2] = {fat.open("/x.dat",O_WRONLY|O_CREAT|O_TRUNC,0666),fat.open("/y.dat",O_WRONLY|O_CREAT|O_TRUNC,0666)};
+            CHECK(0<=fds[0] && 0<=fds[1]);
+            std::vector<uint8_t> data(fragment_size);
+            for(size_t i = 0;i<fragments;++i) {
+                for(int f = 0;f<2;++f) {
+                    fill_pattern(data.data(),fragment_size,10+f,i*fragment_size);
+                    CHECK((ssize_t)fragment_size==fat.write(fds[f],data.data(),fragment_size));
+                }
+            }
+            CHECK(0==fat.close(fds[0]));
+            CHECK(0==fat.close(fds[1]));
+        }
+        hal.reset();
+        CHECK(0==fat.unlink("/x.dat"));
+        CHECK(hal.trims>16);
+        CHECK(hal.sectors>=fragments*fragment_size/sector_size);
+        check_test_file(fat,"/y.dat",11,fragments*fragment_size);
+        // and lots of files, every other one freed, with new files landing in the holes
+        for(size_t i = 0;i<fragments;++i) {
+            snprintf(file.path,sizeof(file.path),"/f%u.dat",(unsigned)i);
+            file.seed = 100+(uint32_t)i;
+            file.size = 1000+random.below(20000);
+            write_test_file(fat,file.path,file.seed,file.size);
+            if(i&1) {
+                kept.push_back(file);
+            }
+        }
+        for(size_t i = 0;i<fragments;i+=2) {
+            snprintf(file.path,sizeof(file.path),"/f%u.dat",(unsigned)i);
+            CHECK(0==fat.unlink(file.path));
+        }
+        check_kept(fat,kept);
+        for(size_t i = 0;i<60;++i) {
+            snprintf(file.path,sizeof(file.path),"/g%u.dat",(unsigned)i);
+            file.seed = 1000+(uint32_t)i;
+            file.size = 3000;
+            write_test_file(fat,file.path,file.seed,file.size);
+            kept.push_back(file);
+        }
+        CHECK(fat.trim_freed());
+        check_kept(fat,kept);
+        printf("free space\n");
+        hal.reset();
+        CHECK(fat.trim_free_space());
+        CHECK(hal.sectors*sector_size>=fat.free());
+        check_kept(fat,kept);
+        check_test_file(fat,"/p.dat",7,153000);
+        printf("off\n");
+        fat.trim(false);
+        hal.reset();
+        CHECK(0==fat.unlink("/p.dat"));
+        CHECK(fat.trim_freed());
+        CHECK(0==hal.trims);
+    }
+    // the FAT reached the drive before any of the data was trimmed
+    printf("without the free map\n");
+    {
+        vfs_fast_fat32 fat(hal,0,5,16,16384,2048,false);
+        CHECK(fat.initialized());
+        check_kept(fat,kept);
+        hal.reset();
+        CHECK(fat.trim_free_space());
+        CHECK(hal.sectors*sector_size>=fat.free());
+        check_kept(fat,kept);
+        check_test_file(fat,"/b.dat",2,1000);
+        check_test_file(fat,"/y.dat",11,fragments*fragment_size);
+        CHECK(0!=fat.access("/p.dat",F_OK));
+    }
+    // every trim the driver sent was in range
+    CHECK(0==hal.rejected);
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,170 @@
+// what the host tests share. each test is a program that exits with 0 when it passes, so
+// ctest can run it
+#ifndef HTCW_ESP32_HOST_TEST_HPP
+#define HTCW_ESP32_HOST_TEST_HPP
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+#include "vfs_fast_fat32.hpp"
+#include "vfs_fast_fat32_image_hal.hpp"
+// stops the test at the first thing that's wrong
+#define CHECK(x) do { if(!(x)) { fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#x); exit(1); } } while(false)
+// the byte at offset in file number seed. it doesn't repeat on any power of two, so data
+// landing in the wrong sector or at the wrong offset within one shows up
+static inline uint8_t test_pattern(uint32_t seed,uint64_t offset) {
+    uint32_t x = (uint32_t)offset*2654435761u^(uint32_t)(offset>>32)^seed*40503u;
+    return (uint8_t)(x>>13^x>>24^offset/509);
+}
+static inline void fill_pattern(uint8_t* buffer,size_t size,uint32_t seed,uint64_t offset) {
+    for(size_t i = 0;i<size;++i) {
+        buffer[i] = test_pattern(seed,offset+i);
+    }
+}
+static inline bool check_pattern(const uint8_t* buffer,size_t size,uint32_t seed,uint64_t offset) {
+    for(size_t i = 0;i<size;++i) {
+        if(buffer[i]!=test_pattern(seed,offset+i)) {
+            fprintf(stderr,"byte %llu of file %u differs\n",(unsigned long long)(offset+i),(unsigned)seed);
+            return false;
+        }
+    }
+    return true;
+}
+// xorshift, so every run sees the same sizes and offsets
+struct test_random {
+    uint32_t state;
+    test_random(uint32_t seed = 0x9E3779B9) : state(0==seed?1:seed) {
+    }
+    uint32_t next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+    // 0 to limit-1
+    uint32_t below(uint32_t limit) {
+        return 0==limit?0:next()%limit;
+    }
+};
+// a RAM drive that zeroes what's trimmed, so a trim that reaches too far, or not far
+// enough, shows up as data that doesn't match. it counts the trims that went through and
+// the sectors they covered, and, until it's destroyed, the ones the drive turned down as
+// out of range
+class zeroing_hal : public esp32::vfs_fast_fat32_hal {
+    esp32::vfs_fast_fat32_ram_hal m_ram;
+    uint32_t m_sector_count;
+public:
+    constexpr static const size_t sector_size = 512;
+    size_t trims;
+    size_t sectors;
+    size_t rejected;
+    // so a sync can fail partway
+    bool fail_writes;
+    zeroing_hal(uint32_t sector_count) : m_ram(sector_count),m_sector_count(sector_count),trims(0),sectors(0),rejected(0),fail_writes(false) {
+        CHECK(m_ram.initialized());
+    }
+    inline uint8_t* data() {
+        return m_ram.data();
+    }
+    inline uint32_t sector_count() const {
+        return m_sector_count;
+    }
+    void reset() {
+        trims = sectors = 0;
+    }
+    virtual esp32::vfs_fast_fat32_disk_status initialize(uint8_t pdrv) {
+        return m_ram.initialize(pdrv);
+    }
+    virtual esp32::vfs_fast_fat32_disk_status status(uint8_t pdrv) {
+        return m_ram.status(pdrv);
+    }
+    virtual esp32::vfs_fast_fat32_hal_result read(uint8_t pdrv,void* buffer,uint32_t sector,unsigned int count) {
+        return m_ram.read(pdrv,buffer,sector,count);
+    }
+    virtual esp32::vfs_fast_fat32_hal_result write(uint8_t pdrv,const void* buffer,uint32_t sector,unsigned int count) {
+        if(fail_writes) {
+            return esp32::vfs_fast_fat32_hal_result::io_error;
+        }
+        return m_ram.write(pdrv,buffer,sector,count);
+    }
+    virtual esp32::vfs_fast_fat32_hal_result ioctl(uint8_t pdrv,esp32::vfs_fast_fat32_ioctl_command command,void* buffer) {
+        esp32::vfs_fast_fat32_hal_result result = m_ram.ioctl(pdrv,command,buffer);
+        if(esp32::control_trim==command) {
+            if(esp32::vfs_fast_fat32_hal_result::success!=result) {
+                ++rejected;
+                return result;
+            }
+            // [first, last] inclusive
+            const uint32_t* range = (const uint32_t*)buffer;
+            memset(m_ram.data()+(size_t)range[0]*sector_size,0,(size_t)(range[1]-range[0]+1)*sector_size);
+            ++trims;
+            sectors+=range[1]-range[0]+1;
+        }
+        return result;
+    }
+};
+// a chunk size for the file helpers: sometimes odd, sometimes whole sectors, sometimes
+// many of them
+static inline uint32_t test_chunk(test_random& random) {
+    return 0==random.below(3)?512*(1+random.below(64)):1+random.below(3000);
+}
+// writes file number seed in chunks of random sizes, so some go through the cache and some
+// straight to the drive
+static inline void write_test_file(esp32::vfs_fast_fat32& fat,const char* path,uint32_t seed,size_t size,test_random& random) {
+    int fd = fat.open(path,O_WRONLY|O_CREAT|O_TRUNC,0666);
+    CHECK(0<=fd);
+    std::vector<uint8_t> buffer(512*64);
+    size_t written = 0;
+    while(written<size) {
+        size_t chunk = test_chunk(random);
+        if(chunk>size-written) {
+            chunk = size-written;
+        }
+        fill_pattern(buffer.data(),chunk,seed,written);
+        CHECK((ssize_t)chunk==fat.write(fd,buffer.data(),chunk));
+        written+=chunk;
+    }
+    CHECK(0==fat.close(fd));
+}
+static inline void write_test_file(esp32::vfs_fast_fat32& fat,const char* path,uint32_t seed,size_t size) {
+    test_random random(seed+1);
+    write_test_file(fat,path,seed,size,random);
+}
+// checks the size, every byte in chunks of random sizes, the end of the file, and a few
+// positional reads
+static inline void check_test_file(esp32::vfs_fast_fat32& fat,const char* path,uint32_t seed,size_t size,test_random& random) {
+    struct stat st;
+    CHECK(0==fat.stat(path,&st));
+    CHECK((off_t)size==st.st_size);
+    int fd = fat.open(path,O_RDONLY,0);
+    CHECK(0<=fd);
+    std::vector<uint8_t> buffer(512*64);
+    size_t read = 0;
+    while(read<size) {
+        size_t chunk = test_chunk(random);
+        size_t expected = chunk>size-read?size-read:chunk;
+        CHECK((ssize_t)expected==fat.read(fd,buffer.data(),chunk));
+        if(!check_pattern(buffer.data(),expected,seed,read)) {
+            fprintf(stderr,"in %s\n",path);
+            CHECK(false);
+        }
+        read+=expected;
+    }
+    CHECK(0==fat.read(fd,buffer.data(),buffer.size()));
+    for(int i = 0;i<8 && 0!=size;++i) {
+        size_t offset = random.below((uint32_t)size);
+        size_t chunk = 1+random.below(5000);
+        size_t expected = chunk>size-offset?size-offset:chunk;
+        CHECK((ssize_t)expected==fat.pread(fd,buffer.data(),chunk,offset));
+        CHECK(check_pattern(buffer.data(),expected,seed,offset));
+    }
+    CHECK(0==fat.close(fd));
+}
+static inline void check_test_file(esp32::vfs_fast_fat32& fat,const char* path,uint32_t seed,size_t size) {
+    test_random random(seed+2);
+    check_test_file(fat,path,seed,size,random);
+}
+#endif
@@ -0,0 +1,273 @@
+// checks vfs_fast_fat32_read_ahead_hal over a RAM drive whose reads can be held at a gate,
+// so the test decides when the background fetch finishes. a sequential reader that
+// prefetches ahead has to hit, with every sector read from the drive once and the stats
+// adding up. a read of a sector still being fetched has to wait for it, and a write over
+// a fetch that is queued, in flight or done must never let the old data be read back.
+// fast FAT32 has to read its files back through it too.
+// usage: read_ahead_test [--reads <count>]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "vfs_fast_fat32.hpp"
+#include "vfs_fast_fat32_image_hal.hpp"
+#include "vfs_fast_fat32_read_ahead_hal.hpp"
+#include "host_test.hpp"
+using namespace esp32;
+
+constexpr static const size_t sector_size = 512;
+constexpr static const uint32_t sector_count = 4096;
+// 4KB buffers of 8 sectors
+constexpr static const size_t buffer_size = 4096;
+constexpr static const uint32_t buffer_sectors = 8;
+
+// a RAM drive that counts the sectors read from it, and whose reads wait while the gate
+// is shut
+class gated_hal : public vfs_fast_fat32_hal {
+    vfs_fast_fat32_ram_hal m_ram;
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+    bool m_open;
+    size_t m_entered;
+    size_t m_sectors_read;
+public:
+    // slows every read down, so the reader catches up with the fetches
+    unsigned int delay_us;
+    gated_hal(uint32_t sector_count) : m_ram(sector_count),m_open(true),m_entered(0),m_sectors_read(0),delay_us(0) {
+        CHECK(m_ram.initialized());
+    }
+    inline uint8_t* data() {
+        return m_ram.data();
+    }
+    void shut() {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_open = false;
+    }
+    void open() {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_open = true;
+        m_changed.notify_all();
+    }
+    // waits until count reads in all have reached the gate
+    void wait_entered(size_t count) {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_changed.wait(lock,[this,count] { return m_entered>=count; });
+    }
+    size_t entered() {
+        std::lock_guard<std::mutex> lock(m_lock);
+        return m_entered;
+    }
+    size_t sectors_read() {
+        std::lock_guard<std::mutex> lock(m_lock);
+        return m_sectors_read;
+    }
+    virtual vfs_fast_fat32_disk_status initialize(uint8_t pdrv) {
+        return m_ram.initialize(pdrv);
+    }
+    virtual vfs_fast_fat32_disk_status status(uint8_t pdrv) {
+        return m_ram.status(pdrv);
+    }
+    virtual vfs_fast_fat32_hal_result read(uint8_t pdrv,void* buffer,uint32_t sector,unsigned int count) {
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            ++m_entered;
+            m_changed.notify_all();
+            m_changed.wait(lock,[this] { return m_open; });
+            m_sectors_read+=count;
+        }
+        if(0!=delay_us) {
+            std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+        }
+        return m_ram.read(pdrv,buffer,sector,count);
+    }
+    virtual vfs_fast_fat32_hal_result write(uint8_t pdrv,const void* buffer,uint32_t sector,unsigned int count) {
+        return m_ram.write(pdrv,buffer,sector,count);
+    }
+    virtual vfs_fast_fat32_hal_result ioctl(uint8_t pdrv,vfs_fast_fat32_ioctl_command command,void* buffer) {
+        return m_ram.ioctl(pdrv,command,buffer);
+    }
+};
+static void write_sectors(vfs_fast_fat32_hal& hal,uint32_t sector,uint32_t count,uint32_t seed) {
+    std::vector<uint8_t> data((size_t)count*sector_size);
+    fill_pattern(data.data(),data.size(),seed,(uint64_t)sector*sector_size);
+    CHECK(vfs_fast_fat32_hal_result::success==hal.write(0,data.data(),sector,count));
+}
+// the sectors read back have the pattern of seed
+static void check_sectors(vfs_fast_fat32_hal& hal,uint32_t sector,uint32_t count,uint32_t seed) {
+    std::vector<uint8_t> data((size_t)count*sector_size);
+    CHECK(vfs_fast_fat32_hal_result::success==hal.read(0,data.data(),sector,count));
+    CHECK(check_pattern(data.data(),data.size(),seed,(uint64_t)sector*sector_size));
+}
+// reads the drive front to back in random sized pieces, asking for the next few buffers'
+// worth ahead of each read like vfs_fast_fat32 does
+static void sequential(size_t reads) {
+    printf("sequential\n");
+    gated_hal ram(sector_count);
+    fill_pattern(ram.data(),(size_t)sector_count*sector_size,1,0);
+    ram.delay_us = 50;
+    vfs_fast_fat32_read_ahead_hal hal(ram,4,buffer_size);
+    CHECK(hal.initialized());
+    hal.initialize(0);
+    std::vector<uint8_t> data(3*buffer_size);
+    test_random random(2);
+    size_t calls = 0;
+    uint32_t sector = 0;
+    uint32_t prefetched = 0;
+    for(size_t i = 0;i<reads && sector<sector_count;++i) {
+        uint32_t count = 1+random.below(2*buffer_sectors);
+        if(count>sector_count-sector) {
+            count = sector_count-sector;
+        }
+        CHECK(vfs_fast_fat32_hal_result::success==hal.read(0,data.data(),sector,count));
+        ++calls;
+        CHECK(check_pattern(data.data(),(size_t)count*sector_size,1,(uint64_t)sector*sector_size));
+        sector+=count;
+        // keep three buffers' worth asked for past the reader
+        uint32_t end = sector+3*buffer_sectors;
+        if(end>sector_count) {
+            end = sector_count;
+        }
+        if(prefetched<sector) {
+            prefetched = sector;
+        }
+        if(prefetched<end) {
+            prefetched+=hal.prefetch(0,prefetched,end-prefetched);
+        }
+    }
+    // nothing was fetched past the end of what was read, so every slot has been used up
+    // and the drive was read once for each sector, plus the ones fetched and dropped
+    vfs_fast_fat32_read_ahead_stats stats = hal.stats();
+    CHECK(calls==stats.hits+stats.misses);
+    CHECK(stats.waits<=stats.hits);
+    CHECK(sector+stats.unused==ram.sectors_read());
+    CHECK(stats.fetched<=ram.sectors_read());
+    // hardly anything but the first read, before anything was asked for, should have to go
+    // to the drive
+    printf("%d hits, %d misses, %d waits, %d fetched, %d unused\n",(int)stats.hits,(int)stats.misses,(int)stats.waits,(int)stats.fetched,(int)stats.unused);
+    CHECK(stats.hits>=calls*9/10);
+    CHECK(0<stats.waits);
+}
+// writes that land on fetches in each state
+static void coherency() {
+    printf("coherency\n");
+    gated_hal ram(sector_count);
+    fill_pattern(ram.data(),(size_t)sector_count*sector_size,1,0);
+    vfs_fast_fat32_read_ahead_hal hal(ram,4,buffer_size);
+    CHECK(hal.initialized());
+    hal.initialize(0);
+    // a read of a fetch that's still going gets it when it lands, rather than reading the
+    // drive
+    ram.shut();
+    size_t entered = ram.entered();
+    CHECK(2*buffer_sectors==hal.prefetch(0,0,2*buffer_sectors));
+    ram.wait_entered(entered+1);
+    std::thread reader([&hal] { check_sectors(hal,buffer_sectors+2,4,1); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ram.open();
+    reader.join();
+    vfs_fast_fat32_read_ahead_stats stats = hal.stats();
+    CHECK(1==stats.hits && 0==stats.misses && stats.waits<=1);
+    CHECK(2*buffer_sectors==ram.sectors_read());
+    // a write over a fetched buffer drops it, and all of it is counted as unused
+    hal.reset_stats();
+    write_sectors(hal,3,1,2);
+    check_sectors(hal,0,3,1);
+    check_sectors(hal,3,1,2);
+    check_sectors(hal,4,buffer_sectors-4,1);
+    stats = hal.stats();
+    CHECK(buffer_sectors==stats.unused);
+    CHECK(0==stats.hits && 3==stats.misses);
+    // what the reader above left of the second one is still good
+    check_sectors(hal,buffer_sectors+6,2,1);
+    CHECK(1==hal.stats().hits);
+    // a write over a fetch in flight, and over the one queued behind it. it has to wait
+    // for the drive, so it goes from another thread while the first fetch is at the gate
+    hal.reset_stats();
+    ram.shut();
+    uint32_t first = 100;
+    entered = ram.entered();
+    CHECK(2*buffer_sectors==hal.prefetch(0,first,2*buffer_sectors));
+    ram.wait_entered(entered+1);
+    std::thread writer([&hal,first] { write_sectors(hal,first+4,buffer_sectors,3); });
+    // the queued one is dropped whole as the one in flight is marked, so once it's gone
+    // the write is only waiting for the drive
+    std::chrono::steady_clock::time_point give_up = std::chrono::steady_clock::now()+std::chrono::seconds(10);
+    while(buffer_sectors!=hal.stats().unused) {
+        CHECK(std::chrono::steady_clock::now()<give_up);
+        std::this_thread::yield();
+    }
+    ram.open();
+    writer.join();
+    // and the one in flight is thrown away when it lands
+    check_sectors(hal,first,4,1);
+    check_sectors(hal,first+4,buffer_sectors,3);
+    check_sectors(hal,first+buffer_sectors+4,4,1);
+    stats = hal.stats();
+    CHECK(0==stats.hits && 3==stats.misses);
+    CHECK(buffer_sectors==stats.unused);
+    CHECK(check_pattern(ram.data()+(first+4)*sector_size,buffer_size,3,(first+4)*sector_size));
+}
+static void file_system() {
+    printf("fast FAT32\n");
+    gated_hal ram(64*2048);
+    CHECK(vfs_fast_fat32::format(ram));
+    constexpr static const size_t size = 1000000;
+    std::vector<uint8_t> expected(size);
+    fill_pattern(expected.data(),size,1,0);
+    std::vector<uint8_t> data(size);
+    {
+        vfs_fast_fat32 fat(ram);
+        CHECK(fat.initialized());
+        int fd = fat.open("/a.dat",O_WRONLY|O_CREAT,0666);
+        CHECK(0<=fd);
+        CHECK((ssize_t)size==fat.write(fd,expected.data(),size));
+        CHECK(0==fat.close(fd));
+    }
+    vfs_fast_fat32_read_ahead_hal hal(ram);
+    CHECK(hal.initialized());
+    vfs_fast_fat32 fat(hal);
+    CHECK(fat.initialized());
+    int fd = fat.open("/a.dat",O_RDWR,0);
+    CHECK(0<=fd);
+    test_random random(3);
+    size_t read = 0;
+    while(read<size) {
+        size_t chunk = 1+random.below(20000);
+        if(chunk>size-read) {
+            chunk = size-read;
+        }
+        CHECK((ssize_t)chunk==fat.read(fd,data.data()+read,chunk));
+        read+=chunk;
+        // overwrites ahead of the reader, over what may have been fetched
+        if(0==random.below(4) && read+30000<size) {
+            size_t offset = read+random.below(30000);
+            fill_pattern(expected.data()+offset,100,2,offset);
+            CHECK(100==fat.pwrite(fd,expected.data()+offset,100,offset));
+        }
+    }
+    CHECK(0==memcmp(data.data(),expected.data(),size));
+    CHECK(0==fat.close(fd));
+    vfs_fast_fat32_read_ahead_stats stats = hal.stats();
+    CHECK(0<stats.hits && 0<stats.fetched);
+}
+int main(int argc,char** argv) {
+    size_t reads = 1000;
+    for(int i = 1;i<argc;++i) {
+        if(0==strcmp(argv[i],"--reads") && i+1<argc) {
+            reads = (size_t)atol(argv[++i]);
+        } else {
+            fprintf(stderr,"usage: %s [--reads <count>]\n",argv[0]);
+            return 2;
+        }
+    }
+    sequential(reads);
+    coherency();
+    file_system();
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,188 @@
+// runs sdspi_card over simulated_sdspi_bus, in block and byte addressing. random single
+// and multi-block reads and writes (CMD17/18/24/25) have to leave the card as a flat copy
+// says, with each taking the commands it should: ACMD23 before every CMD25, and a CMD12
+// that stops a read stream before another block goes out. a bad sector has to come back
+// as an error token in the middle of a stream, without losing the blocks before it or the
+// card. also checks how much of a 16KB stream is data, and runs fast FAT32 on top.
+// usage: sdspi_card_test [--operations <count>]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <vector>
+#include "sdspi_card.hpp"
+#include "simulated_sdspi_bus.hpp"
+#include "vfs_fast_fat32.hpp"
+#include "vfs_fast_fat32_card_hal.hpp"
+#include "host_test.hpp"
+using namespace esp32;
+
+typedef sdspi_card<simulated_sdspi_bus> test_card;
+constexpr static const size_t sector_size = 512;
+// a whole number of the 1024 sector units the CSD gives the size in
+constexpr static const size_t sector_count = 4096;
+constexpr static const size_t max_run = 40;
+
+static void transfers(bool high_capacity,size_t operations) {
+    printf("%s addressing\n",high_capacity?"block":"byte");
+    simulated_sd_card card(sector_count,sector_size);
+    CHECK(card.initialized());
+    // a slow card, to make sure the gaps and busy periods are waited out
+    simulated_sdspi_bus bus(card,high_capacity,3,5);
+    test_card sd(bus);
+    CHECK(sd.initialized());
+    CHECK(sector_count==sd.sector_count());
+    CHECK(sector_size==sd.sector_size());
+    std::vector<uint8_t> expected(sector_count*sector_size,0);
+    std::vector<uint8_t> data(max_run*sector_size);
+    test_random random(high_capacity?1:2);
+    for(size_t i = 0;i<operations;++i) {
+        size_t count = 0==random.below(4)?1:1+random.below(max_run);
+        size_t start = random.below((uint32_t)(sector_count-count+1));
+        size_t commands = bus.commands();
+        size_t pre_erased = bus.pre_erased();
+        uint64_t data_bytes = bus.data_bytes();
+        if(random.below(2)) {
+            fill_pattern(data.data(),count*sector_size,(uint32_t)i,0);
+            CHECK(sd.write(data.data(),start,count));
+            memcpy(expected.data()+start*sector_size,data.data(),count*sector_size);
+            // CMD24, or ACMD23 (two commands) and CMD25
+            CHECK((1==count?1:3)==bus.commands()-commands);
+            CHECK((1==count?0:1)==bus.pre_erased()-pre_erased);
+        } else {
+            CHECK(sd.read(data.data(),start,count));
+            CHECK(0==memcmp(data.data(),expected.data()+start*sector_size,count*sector_size));
+            // CMD17, or CMD18 and CMD12
+            CHECK((1==count?1:2)==bus.commands()-commands);
+            CHECK(pre_erased==bus.pre_erased());
+        }
+        // a stream that ran on past its end would have moved more
+        CHECK(count*sector_size==bus.data_bytes()-data_bytes);
+    }
+    CHECK(0==memcmp(card.data(),expected.data(),expected.size()));
+    // the first and last sectors
+    CHECK(sd.read(data.data(),0,1));
+    CHECK(0==memcmp(data.data(),expected.data(),sector_size));
+    CHECK(sd.read(data.data(),sector_count-2,2));
+    CHECK(0==memcmp(data.data(),expected.data()+(sector_count-2)*sector_size,2*sector_size));
+    // past the end doesn't reach the card
+    size_t commands = bus.commands();
+    CHECK(!sd.read(data.data(),sector_count-1,2));
+    CHECK(EINVAL==sd.last_error());
+    CHECK(!sd.write(data.data(),sector_count,1));
+    CHECK(EINVAL==sd.last_error());
+    CHECK(commands==bus.commands());
+}
+static void errors() {
+    printf("errors\n");
+    constexpr static const size_t bad = 100;
+    simulated_sd_card card(sector_count,sector_size);
+    CHECK(card.initialized());
+    simulated_sdspi_bus bus(card);
+    test_card sd(bus);
+    CHECK(sd.initialized());
+    std::vector<uint8_t> data(max_run*sector_size);
+    fill_pattern(data.data(),data.size(),1,0);
+    CHECK(sd.write(data.data(),bad-20,max_run));
+    card.bad_sector(bad);
+    // the card sends an error token instead of the block
+    CHECK(!sd.read(data.data(),bad,1));
+    CHECK(EIO==sd.last_error());
+    memset(data.data(),0,data.size());
+    CHECK(!sd.read(data.data(),bad-10,20));
+    CHECK(EIO==sd.last_error());
+    CHECK(check_pattern(data.data(),10*sector_size,1,10*sector_size));
+    // and the card still answers
+    CHECK(sd.read(data.data(),bad-20,20));
+    CHECK(check_pattern(data.data(),20*sector_size,1,0));
+    // a write error response stops a stream at the bad block
+    fill_pattern(data.data(),data.size(),2,0);
+    CHECK(!sd.write(data.data(),bad,1));
+    CHECK(EIO==sd.last_error());
+    CHECK(!sd.write(data.data(),bad-5,10));
+    CHECK(EIO==sd.last_error());
+    CHECK(check_pattern(card.data()+(bad-5)*sector_size,5*sector_size,2,0));
+    CHECK(check_pattern(card.data()+bad*sector_size,5*sector_size,1,20*sector_size));
+    card.bad_sector(SIZE_MAX);
+    CHECK(sd.write(data.data(),bad-5,10));
+    CHECK(check_pattern(card.data()+(bad-5)*sector_size,10*sector_size,2,0));
+    // a card that fails every write
+    card.fail_writes(true);
+    CHECK(!sd.write(data.data(),0,1));
+    CHECK(!sd.write(data.data(),0,8));
+    card.fail_writes(false);
+    CHECK(sd.write(data.data(),0,8));
+    CHECK(sd.read(data.data(),0,8));
+    CHECK(check_pattern(data.data(),8*sector_size,2,0));
+}
+// with one byte of gap before each block and the default busy time, about 97% of what a
+// write stream clocks is data and 99% of a read stream
+static void efficiency() {
+    simulated_sd_card card(sector_count,sector_size);
+    CHECK(card.initialized());
+    simulated_sdspi_bus bus(card);
+    test_card sd(bus);
+    CHECK(sd.initialized());
+    std::vector<uint8_t> data(32*sector_size);
+    fill_pattern(data.data(),data.size(),3,0);
+    bus.reset_counters();
+    CHECK(sd.write(data.data(),64,32));
+    double writes = (double)bus.data_bytes()/bus.bytes();
+    bus.reset_counters();
+    CHECK(sd.read(data.data(),64,32));
+    double reads = (double)bus.data_bytes()/bus.bytes();
+    CHECK(check_pattern(data.data(),data.size(),3,0));
+    printf("16KB streams: %.1f%% data writing, %.1f%% reading\n",writes*100,reads*100);
+    CHECK(writes>=0.965 && reads>=0.985);
+}
+static void file_system() {
+    printf("fast FAT32\n");
+    simulated_sd_card card(68*1024,sector_size);
+    CHECK(card.initialized());
+    simulated_sdspi_bus bus(card);
+    test_card sd(bus);
+    CHECK(sd.initialized());
+    vfs_fast_fat32_card_hal<test_card> hal(sd);
+    CHECK(vfs_fast_fat32::format(hal));
+    constexpr static const size_t size = 300000;
+    std::vector<uint8_t> data(size+1);
+    {
+        vfs_fast_fat32 fat(hal);
+        CHECK(fat.initialized());
+        int fd = fat.open("/spi.dat",O_WRONLY|O_CREAT|O_TRUNC,0666);
+        CHECK(0<=fd);
+        fill_pattern(data.data(),size,4,0);
+        CHECK((ssize_t)(size-1000)==fat.write(fd,data.data(),size-1000));
+        CHECK(1000==fat.write(fd,data.data()+size-1000,1000));
+        CHECK(0==fat.close(fd));
+    }
+    {
+        vfs_fast_fat32 fat(hal);
+        CHECK(fat.initialized());
+        int fd = fat.open("/spi.dat",O_RDONLY,0);
+        CHECK(0<=fd);
+        memset(data.data(),0,data.size());
+        CHECK((ssize_t)size==fat.read(fd,data.data(),data.size()));
+        CHECK(check_pattern(data.data(),size,4,0));
+        CHECK(0==fat.close(fd));
+    }
+}
+int main(int argc,char** argv) {
+    size_t operations = 1000;
+    for(int i = 1;i<argc;++i) {
+        if(0==strcmp(argv[i],"--operations") && i+1<argc) {
+            operations = (size_t)atol(argv[++i]);
+        } else {
+            fprintf(stderr,"usage: %s [--operations <count>]\n",argv[0]);
+            return 2;
+        }
+    }
+    transfers(true,operations);
+    transfers(false,operations);
+    errors();
+    efficiency();
+    file_system();
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,234 @@
+// runs the storage benchmark on a PC, so driver changes can be compared without a board.
+// exits with 1 if anything failed, including data that didn't read back as written.
+// usage: storage_benchmark [--csv] [--image <file>] [--size <MB>] [--dir <path>]
+//                          [--sim [<file>]] [--timing <key>=<value>,...] [--schedule]
+//   --image  runs the fast FAT32 driver on a disk image file instead of a RAM drive. the
+//            image is created and formatted if it doesn't exist
+//   --size   size of the RAM drive or new image, 64MB by default
+//   --dir    also runs against a directory of the host's own file system
+//   --sim    also runs the fast FAT32 driver on a simulated SD card, held in RAM or in a
+//            sparse file, that takes the time a real one would
+//   --timing changes the simulated card's timing. keys are command_us, read_kbps,
+//            write_kbps, erase_kb, open_blocks, erase_us, copy_kbps, stall_ppm, stall_us
+//            and seed
+//   --schedule also runs the simulated card with writes gathered into whole erase blocks
+//            by the write scheduler
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vfs.hpp"
+#include "vfs_ramfs.hpp"
+#include "vfs_fast_fat32.hpp"
+#include "vfs_fast_fat32_image_hal.hpp"
+#include "vfs_fast_fat32_card_hal.hpp"
+#include "vfs_fast_fat32_write_scheduler_hal.hpp"
+#include "simulated_sd_card.hpp"
+#include "storage_benchmark.hpp"
+using namespace esp32;
+
+static bool csv = false;
+static void print_result(const storage_benchmark_result& result,void* state) {
+    storage_benchmark::print(stdout,result,(const char*)state,csv);
+}
+static bool run(storage_benchmark_target& target,const char* name,bool verify = true) {
+    if(!csv) {
+        printf("\n%s\n",name);
+    }
+    storage_benchmark bench(target);
+    if(!bench.initialized()) {
+        fprintf(stderr,"out of memory\n");
+        return false;
+    }
+    bench.verify(verify);
+    if(!csv) {
+        storage_benchmark::print_header(stdout);
+    }
+    return bench.run_all(print_result,(void*)name);
+}
+// roughly a class 10 card: 20MB/s reads, 10MB/s writes, and 64KB erase blocks that cost a
+// few milliseconds to rewrite
+static simulated_sd_timing default_timing() {
+    simulated_sd_timing result;
+    memset(&result,0,sizeof(result));
+    result.command_us = 100;
+    result.read_bytes_per_second = 20*1024*1024;
+    result.write_bytes_per_second = 10*1024*1024;
+    result.erase_block_sectors = 128;
+    result.open_blocks = 2;
+    result.erase_us = 1000;
+    result.copy_bytes_per_second = 40*1024*1024;
+    result.stall_per_million = 1000;
+    result.stall_us = 20000;
+    result.seed = 1;
+    result.sleep = true;
+    return result;
+}
+static bool parse_timing(char* text,simulated_sd_timing& timing) {
+    for(char* item = strtok(text,",");nullptr!=item;item = strtok(nullptr,",")) {
+        char* value = strchr(item,'=');
+        if(nullptr==value) {
+            return false;
+        }
+        *value++=0;
+        unsigned long long v = strtoull(value,nullptr,10);
+        if(0==strcmp(item,"command_us")) {
+            timing.command_us = (uint32_t)v;
+        } else if(0==strcmp(item,"read_kbps")) {
+            timing.read_bytes_per_second = v*1024;
+        } else if(0==strcmp(item,"write_kbps")) {
+            timing.write_bytes_per_second = v*1024;
+        } else if(0==strcmp(item,"erase_kb")) {
+            timing.erase_block_sectors = (size_t)(v*2);
+        } else if(0==strcmp(item,"open_blocks")) {
+            timing.open_blocks = (size_t)v;
+        } else if(0==strcmp(item,"erase_us")) {
+            timing.erase_us = (uint32_t)v;
+        } else if(0==strcmp(item,"copy_kbps")) {
+            timing.copy_bytes_per_second = v*1024;
+        } else if(0==strcmp(item,"stall_ppm")) {
+            timing.stall_per_million = (uint32_t)v;
+        } else if(0==strcmp(item,"stall_us")) {
+            timing.stall_us = (uint32_t)v;
+        } else if(0==strcmp(item,"seed")) {
+            timing.seed = (uint32_t)v;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+static bool run_simulated(const char* file,uint32_t sectors,const simulated_sd_timing& timing,bool schedule) {
+    simulated_sd_card* card = nullptr==file?new simulated_sd_card(sectors):new simulated_sd_card(file,sectors);
+    bool ok = false;
+    {
+        vfs_fast_fat32_card_hal<simulated_sd_card> hal(*card);
+        // the scheduler gathers blocks the size of the card's erase blocks
+        size_t block_size = 0==timing.erase_block_sectors?16384:timing.erase_block_sectors*card->sector_size();
+        vfs_fast_fat32_write_scheduler_hal scheduler(hal,4,block_size);
+        if(!card->initialized() || !scheduler.initialized() || !vfs_fast_fat32::format(hal)) {
+            fprintf(stderr,"could not create the simulated card\n");
+        } else {
+            card->timing(timing);
+            vfs_fast_fat32 fat(schedule?(vfs_fast_fat32_hal&)scheduler:(vfs_fast_fat32_hal&)hal);
+            if(!fat.initialized()) {
+                fprintf(stderr,"could not mount the simulated card\n");
+            } else {
+                card->reset_counters();
+                storage_benchmark_driver_target fat_target(fat);
+                ok = run(fat_target,schedule?"fast_fat32 (simulated card, scheduled)":"fast_fat32 (simulated card)");
+                if(!csv) {
+                    printf("card: %u reads, %u writes, %.1f s busy, %u rewrites copying %llu kB, %u stalls\n",
+                        (unsigned)card->reads(),
+                        (unsigned)card->writes(),
+                        card->elapsed_us()/1000000.0,
+                        (unsigned)card->rewrites(),
+                        (unsigned long long)(card->copied_bytes()/1024),
+                        (unsigned)card->stalls());
+                    if(schedule) {
+                        vfs_fast_fat32_write_scheduler_stats stats = scheduler.stats();
+                        printf("scheduler: %u sector blocks, %u buffered writes, %u direct blocks, %u blocks flushed, %u partial, %u sectors filled\n",
+                            (unsigned)scheduler.block_sectors(),
+                            (unsigned)stats.buffered,
+                            (unsigned)stats.direct,
+                            (unsigned)stats.flushed,
+                            (unsigned)stats.partial,
+                            (unsigned)stats.filled);
+                    }
+                }
+            }
+        }
+    }
+    delete card;
+    return ok;
+}
+int main(int argc,char** argv) {
+    const char* image = nullptr;
+    const char* dir = nullptr;
+    uint32_t size_mb = 64;
+    bool sim = false;
+    const char* sim_file = nullptr;
+    simulated_sd_timing timing = default_timing();
+    bool schedule = false;
+    for(int i = 1;i<argc;++i) {
+        if(0==strcmp(argv[i],"--csv")) {
+            csv = true;
+        } else if(0==strcmp(argv[i],"--image") && i+1<argc) {
+            image = argv[++i];
+        } else if(0==strcmp(argv[i],"--size") && i+1<argc) {
+            size_mb = (uint32_t)atoi(argv[++i]);
+        } else if(0==strcmp(argv[i],"--dir") && i+1<argc) {
+            dir = argv[++i];
+        } else if(0==strcmp(argv[i],"--sim")) {
+            sim = true;
+            if(i+1<argc && '-'!=argv[i+1][0]) {
+                sim_file = argv[++i];
+            }
+        } else if(0==strcmp(argv[i],"--timing") && i+1<argc && parse_timing(argv[i+1],timing)) {
+            ++i;
+        } else if(0==strcmp(argv[i],"--schedule")) {
+            schedule = true;
+        } else {
+            fprintf(stderr,"usage: %s [--csv] [--image <file>] [--size <MB>] [--dir <path>] [--sim [<file>]] [--timing <key>=<value>,...] [--schedule]\n",argv[0]);
+            return 2;
+        }
+    }
+    if(csv) {
+        storage_benchmark::print_header(stdout,true);
+    }
+    // failures on vfs_null are expected, since it has no directories. it reads back zeros,
+    // so there's nothing to check
+    vfs_null null_driver;
+    storage_benchmark_driver_target null_target(null_driver);
+    run(null_target,"vfs_null",false);
+
+    // the upper bound for a real file system
+    bool ok = true;
+    vfs_ramfs ram_driver;
+    storage_benchmark_driver_target ram_target(ram_driver);
+    ok = run(ram_target,"vfs_ramfs") && ok;
+
+    uint32_t sectors = size_mb*2048;
+    vfs_fast_fat32_ram_hal ram_hal(nullptr==image?sectors:0);
+    vfs_fast_fat32_file_hal* file_hal = nullptr;
+    vfs_fast_fat32_hal* hal = &ram_hal;
+    if(nullptr!=image) {
+        file_hal = new vfs_fast_fat32_file_hal(image);
+        if(!file_hal->initialized()) {
+            delete file_hal;
+            file_hal = new vfs_fast_fat32_file_hal(image,sectors);
+            if(!file_hal->initialized() || !vfs_fast_fat32::format(*file_hal)) {
+                fprintf(stderr,"could not create %s\n",image);
+                delete file_hal;
+                return 1;
+            }
+        }
+        hal = file_hal;
+    } else if(!ram_hal.initialized() || !vfs_fast_fat32::format(ram_hal)) {
+        fprintf(stderr,"could not create the RAM drive\n");
+        return 1;
+    }
+    {
+        vfs_fast_fat32 fat(*hal);
+        if(!fat.initialized()) {
+            fprintf(stderr,"could not mount the fast FAT32 volume\n");
+            ok = false;
+        } else {
+            storage_benchmark_driver_target fat_target(fat);
+            ok = run(fat_target,nullptr==image?"fast_fat32 (RAM)":"fast_fat32 (image)") && ok;
+        }
+    }
+    delete file_hal;
+
+    if(sim) {
+        ok = run_simulated(sim_file,sectors,timing,false) && ok;
+        if(schedule) {
+            ok = run_simulated(sim_file,sectors,timing,true) && ok;
+        }
+    }
+
+    if(nullptr!=dir) {
+        storage_benchmark_posix_target host_target(dir);
+        ok = run(host_target,"host") && ok;
+    }
+    return ok?0:1;
+}
@@ -0,0 +1,198 @@
+// checks vfs_fast_fat32_stripe_hal against a flat drive. random reads, writes and trims
+// that cross stripes go to a stripe over two RAM drives of different sizes and to one
+// flat RAM drive, with stripes of odd sizes as well as the usual, and the two have to
+// match byte for byte throughout. each member drive has to hold exactly its stripes in
+// order. then the fast FAT32 driver runs on a stripe, with every operation also made on
+// a flat drive, and the images are compared after files are written, freed and trimmed.
+// usage: stripe_hal_test [--operations <count>]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <vector>
+#include "vfs_fast_fat32.hpp"
+#include "vfs_fast_fat32_image_hal.hpp"
+#include "vfs_fast_fat32_stripe_hal.hpp"
+#include "host_test.hpp"
+using namespace esp32;
+
+constexpr static const size_t sector_size = 512;
+
+// member sector t of index holds stripe row t/stripe, which is volume stripe 2*row+index
+static void check_members(zeroing_hal** members,zeroing_hal& flat,uint32_t stripe) {
+    uint32_t used = flat.sector_count()/2;
+    for(int i = 0;i<2;++i) {
+        for(uint32_t t = 0;t<members[i]->sector_count();++t) {
+            const uint8_t* p = members[i]->data()+(size_t)t*sector_size;
+            if(t<used) {
+                uint32_t sector = (2*(t/stripe)+i)*stripe+t%stripe;
+                CHECK(0==memcmp(p,flat.data()+(size_t)sector*sector_size,sector_size));
+            } else {
+                // past the last whole stripe the smaller drive has, nothing goes
+                for(size_t j = 0;j<sector_size;++j) {
+                    CHECK(0==p[j]);
+                }
+            }
+        }
+    }
+}
+static void mapping(uint32_t stripe,uint32_t first_count,uint32_t second_count,size_t operations) {
+    printf("stripes of %u over %u and %u sectors\n",(unsigned)stripe,(unsigned)first_count,(unsigned)second_count);
+    zeroing_hal first(first_count),second(second_count);
+    zeroing_hal* members[2] = {&first,&second};
+    vfs_fast_fat32_stripe_hal hal(first,second,stripe);
+    CHECK(hal.initialized());
+    CHECK(0==(hal.initialize(0)&not_initialized));
+    uint32_t sector_count = 0;
+    CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,get_sector_count,&sector_count));
+    uint32_t smaller = first_count<second_count?first_count:second_count;
+    CHECK(2*(smaller/stripe)*stripe==sector_count);
+    uint32_t block = 0;
+    CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,get_block_size,&block));
+    CHECK(2*stripe==block);
+    zeroing_hal flat(sector_count);
+    std::vector<uint8_t> data((size_t)(4*stripe+8)*sector_size);
+    std::vector<uint8_t> expected(data.size());
+    test_random random(stripe*7919+first_count);
+    for(size_t i = 0;i<operations;++i) {
+        // from inside one stripe to a few of them, starting anywhere
+        uint32_t count = 1+random.below(4*stripe+8);
+        if(count>sector_count) {
+            count = sector_count;
+        }
+        uint32_t sector = random.below(sector_count-count+1);
+        uint32_t kind = random.below(10);
+        if(kind<5) {
+            fill_pattern(data.data(),(size_t)count*sector_size,(uint32_t)i,0);
+            CHECK(vfs_fast_fat32_hal_result::success==hal.write(0,data.data(),sector,count));
+            CHECK(vfs_fast_fat32_hal_result::success==flat.write(0,data.data(),sector,count));
+        } else if(kind<9) {
+            CHECK(vfs_fast_fat32_hal_result::success==hal.read(0,data.data(),sector,count));
+            CHECK(vfs_fast_fat32_hal_result::success==flat.read(0,expected.data(),sector,count));
+            CHECK(0==memcmp(data.data(),expected.data(),(size_t)count*sector_size));
+        } else {
+            uint32_t range[2] = {sector,sector+count-1};
+            CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,control_trim,range));
+            CHECK(vfs_fast_fat32_hal_result::success==flat.ioctl(0,control_trim,range));
+        }
+    }
+    // the edges
+    CHECK(vfs_fast_fat32_hal_result::success==hal.write(0,data.data(),sector_count-1,1));
+    CHECK(vfs_fast_fat32_hal_result::success==flat.write(0,data.data(),sector_count-1,1));
+    CHECK(vfs_fast_fat32_hal_result::invalid_paramter==hal.write(0,data.data(),sector_count-1,2));
+    CHECK(vfs_fast_fat32_hal_result::invalid_paramter==hal.read(0,data.data(),sector_count,1));
+    uint32_t outside[2] = {sector_count-1,sector_count};
+    CHECK(vfs_fast_fat32_hal_result::invalid_paramter==hal.ioctl(0,control_trim,outside));
+    uint32_t whole[2] = {0,sector_count-1};
+    std::vector<uint8_t> image((size_t)sector_count*sector_size);
+    CHECK(vfs_fast_fat32_hal_result::success==hal.read(0,image.data(),0,sector_count));
+    CHECK(0==memcmp(image.data(),flat.data(),image.size()));
+    check_members(members,flat,stripe);
+    // a trim of everything reaches both drives, and only their used parts
+    CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,control_trim,whole));
+    CHECK(vfs_fast_fat32_hal_result::success==flat.ioctl(0,control_trim,whole));
+    check_members(members,flat,stripe);
+    CHECK(0!=first.trims && 0!=second.trims);
+}
+// passes everything to the stripe and to a flat drive, and checks that every read gets
+// the same from both
+class tee_hal : public vfs_fast_fat32_hal {
+    vfs_fast_fat32_hal& m_stripe;
+    zeroing_hal& m_flat;
+    std::vector<uint8_t> m_buffer;
+public:
+    tee_hal(vfs_fast_fat32_hal& stripe,zeroing_hal& flat) : m_stripe(stripe),m_flat(flat) {
+    }
+    virtual vfs_fast_fat32_disk_status initialize(uint8_t pdrv) {
+        m_flat.initialize(pdrv);
+        return m_stripe.initialize(pdrv);
+    }
+    virtual vfs_fast_fat32_disk_status status(uint8_t pdrv) {
+        return m_stripe.status(pdrv);
+    }
+    virtual vfs_fast_fat32_hal_result read(uint8_t pdrv,void* buffer,uint32_t sector,unsigned int count) {
+        vfs_fast_fat32_hal_result result = m_stripe.read(pdrv,buffer,sector,count);
+        m_buffer.resize((size_t)count*sector_size);
+        CHECK(result==m_flat.read(pdrv,m_buffer.data(),sector,count));
+        CHECK(vfs_fast_fat32_hal_result::success!=result || 0==memcmp(buffer,m_buffer.data(),m_buffer.size()));
+        return result;
+    }
+    virtual vfs_fast_fat32_hal_result write(uint8_t pdrv,const void* buffer,uint32_t sector,unsigned int count) {
+        vfs_fast_fat32_hal_result result = m_stripe.write(pdrv,buffer,sector,count);
+        CHECK(result==m_flat.write(pdrv,buffer,sector,count));
+        return result;
+    }
+    virtual vfs_fast_fat32_hal_result ioctl(uint8_t pdrv,vfs_fast_fat32_ioctl_command command,void* buffer) {
+        vfs_fast_fat32_hal_result result = m_stripe.ioctl(pdrv,command,buffer);
+        if(control_sync==command || control_trim==command) {
+            CHECK(result==m_flat.ioctl(pdrv,command,buffer));
+        }
+        return result;
+    }
+};
+static void file_system() {
+    printf("fast FAT32 on stripes of 7\n");
+    constexpr static const uint32_t stripe = 7;
+    zeroing_hal first(40000),second(45001);
+    zeroing_hal* members[2] = {&first,&second};
+    vfs_fast_fat32_stripe_hal hal(first,second,stripe);
+    CHECK(hal.initialized());
+    CHECK(0==(hal.initialize(0)&not_initialized));
+    uint32_t sector_count = 0;
+    CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,get_sector_count,&sector_count));
+    zeroing_hal flat(sector_count);
+    tee_hal tee(hal,flat);
+    CHECK(vfs_fast_fat32::format(tee));
+    static const size_t sizes[] = {100,5000,70000,1000000,3*1024*1024+17};
+    constexpr static const size_t file_count = sizeof(sizes)/sizeof(sizes[0]);
+    char path[32];
+    {
+        vfs_fast_fat32 fat(tee);
+        CHECK(fat.initialized());
+        for(size_t i = 0;i<file_count;++i) {
+            snprintf(path,sizeof(path),"/f%u.dat",(unsigned)i);
+            write_test_file(fat,path,(uint32_t)i,sizes[i]);
+        }
+        // freeing clusters sends trims through the stripe at the next sync
+        CHECK(0==fat.unlink("/f3.dat"));
+        CHECK(0==fat.truncate("/f4.dat",12345));
+        CHECK(fat.trim_freed());
+    }
+    CHECK(0!=first.trims && 0!=second.trims);
+    {
+        vfs_fast_fat32 fat(tee);
+        CHECK(fat.initialized());
+        for(size_t i = 0;i<file_count;++i) {
+            snprintf(path,sizeof(path),"/f%u.dat",(unsigned)i);
+            if(3==i) {
+                CHECK(0!=fat.access(path,F_OK));
+            } else {
+                check_test_file(fat,path,(uint32_t)i,4==i?12345:sizes[i]);
+            }
+        }
+        CHECK(fat.trim_free_space());
+    }
+    std::vector<uint8_t> image((size_t)sector_count*sector_size);
+    CHECK(vfs_fast_fat32_hal_result::success==hal.read(0,image.data(),0,sector_count));
+    CHECK(0==memcmp(image.data(),flat.data(),image.size()));
+    check_members(members,flat,stripe);
+}
+int main(int argc,char** argv) {
+    size_t operations = 3000;
+    for(int i = 1;i<argc;++i) {
+        if(0==strcmp(argv[i],"--operations") && i+1<argc) {
+            operations = (size_t)atol(argv[++i]);
+        } else {
+            fprintf(stderr,"usage: %s [--operations <count>]\n",argv[0]);
+            return 2;
+        }
+    }
+    static const uint32_t stripes[] = {1,3,7,64};
+    for(size_t i = 0;i<sizeof(stripes)/sizeof(stripes[0]);++i) {
+        mapping(stripes[i],1000,1300,operations);
+        mapping(stripes[i],1301,999,operations);
+    }
+    file_system();
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,352 @@
+// runs the vfs mount layer on the host, through the stand-in for ESP-IDF's VFS in esp/,
+// with the fast FAT32 driver mounted with stats. readdir_plus() has to list what
+// readdir() and stat() would say, names, sizes, dates and attributes, over directories
+// of many sectors read a few entries at a time, and count each call in the stats. a DIR
+// that isn't a live one from opendir() on a mount, even one that looks like it, has to
+// fail with EBADF. readv(), writev() and pwritev() have to get through the ioctl() tunnel
+// to the driver and back, and so do the driver's own requests like file_grow_clusters.
+// usage: vfs_test
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <vector>
+#include "vfs.hpp"
+#include "vfs_fast_fat32.hpp"
+#include "vfs_fast_fat32_image_hal.hpp"
+#include "host_test.hpp"
+using namespace esp32;
+
+constexpr static const uint32_t sector_count = 64*2048;
+// enough entries for many directory sectors, and more than a cluster of them
+constexpr static const size_t entry_count = 300;
+// read at a time, so windows end at every point in a sector
+constexpr static const size_t window = 7;
+
+struct expected_entry {
+    char name[16];
+    uint32_t size;
+    bool directory;
+    time_t modified;
+    bool removed;
+};
+static time_t test_time(size_t i) {
+    struct tm t;
+    memset(&t,0,sizeof(t));
+    t.tm_year = 95+(int)(i%40);
+    t.tm_mon = (int)(i%12);
+    t.tm_mday = 1+(int)(i%28);
+    t.tm_hour = (int)(i%24);
+    t.tm_min = (int)(i*7%60);
+    t.tm_sec = (int)(i*2%60);
+    t.tm_isdst = -1;
+    return mktime(&t);
+}
+static void check_entry(const vfs_file_info& info,const expected_entry& e) {
+    if(0!=strcasecmp(info.name,e.name)) {
+        fprintf(stderr,"got %s, expected %s\n",info.name,e.name);
+        CHECK(false);
+    }
+    CHECK(e.size==info.size);
+    CHECK(e.directory==(0!=(info.attributes&0x10)));
+    // the driver sets the archive bit on files when it writes them
+    if(e.directory || 0!=e.size) {
+        CHECK(e.directory!=(0!=(info.attributes&0x20)));
+    }
+    struct tm t;
+    localtime_r(&e.modified,&t);
+    CHECK(((t.tm_year-80)<<9|(t.tm_mon+1)<<5|t.tm_mday)==info.modified_date);
+    CHECK((t.tm_hour<<11|t.tm_min<<5|t.tm_sec/2)==info.modified_time);
+}
+static void readdir_plus() {
+    printf("readdir_plus\n");
+    vfs_fast_fat32_ram_hal ram(sector_count);
+    CHECK(ram.initialized());
+    CHECK(vfs_fast_fat32::format(ram));
+    vfs_fast_fat32 fat(ram);
+    CHECK(fat.initialized());
+    vfs_stats stats;
+    CHECK(vfs::mount("/fat",&fat,&stats));
+    std::vector<expected_entry> expected(entry_count);
+    std::vector<uint8_t> data(5000);
+    fill_pattern(data.data(),data.size(),1,0);
+    test_random random;
+    char path[32];
+    for(size_t i = 0;i<entry_count;++i) {
+        expected_entry& e = expected[i];
+        e.directory = 0==i%25;
+        e.removed = false;
+        e.modified = test_time(i);
+        if(e.directory) {
+            snprintf(e.name,sizeof(e.name),"dir%u",(unsigned)i);
+            snprintf(path,sizeof(path),"/fat/%s",e.name);
+            CHECK(0==newlib::mkdir(path,0777));
+            e.size = 0;
+        } else {
+            snprintf(e.name,sizeof(e.name),"f%03u.txt",(unsigned)i);
+            snprintf(path,sizeof(path),"/fat/%s",e.name);
+            e.size = 0==i%10?0:random.below((uint32_t)data.size());
+            int fd = newlib::open(path,O_WRONLY|O_CREAT|O_TRUNC,0666);
+            CHECK(0<=fd);
+            CHECK((ssize_t)e.size==newlib::write(fd,data.data(),e.size));
+            CHECK(0==newlib::close(fd));
+        }
+        struct utimbuf times;
+        times.actime = times.modtime = e.modified;
+        CHECK(0==newlib::utime(path,&times));
+    }
+    // deleted entries are left in the directory for readdir_plus() to skip
+    for(size_t i = 3;i<entry_count;i+=7) {
+        if(!expected[i].directory) {
+            snprintf(path,sizeof(path),"/fat/%s",expected[i].name);
+            CHECK(0==newlib::unlink(path));
+            expected[i].removed = true;
+        }
+    }
+    stats.reset();
+    DIR* pdir = newlib::opendir("/fat/");
+    CHECK(nullptr!=pdir);
+    vfs_file_info infos[window];
+    size_t next = 0;
+    size_t calls = 0;
+    size_t listed = 0;
+    while(true) {
+        ssize_t result = vfs::readdir_plus(pdir,infos,window);
+        ++calls;
+        CHECK(0<=result && (size_t)result<=window);
+        if(0==result) {
+            break;
+        }
+        for(ssize_t i = 0;i<result;++i) {
+            while(expected[next].removed) {
+                ++next;
+            }
+            CHECK(next<entry_count);
+            check_entry(infos[i],expected[next++]);
+            ++listed;
+        }
+        // readdir() goes on from where readdir_plus() stopped, and the other way about
+        if(0==calls%5) {
+            while(next<entry_count && expected[next].removed) {
+                ++next;
+            }
+            dirent* d = newlib::readdir(pdir);
+            if(next==entry_count) {
+                CHECK(nullptr==d);
+            } else {
+                CHECK(nullptr!=d);
+                CHECK(0==strcasecmp(d->d_name,expected[next].name));
+                CHECK((expected[next].directory?DT_DIR:DT_REG)==d->d_type);
+                ++next;
+                ++listed;
+            }
+        }
+    }
+    while(next<entry_count && expected[next].removed) {
+        ++next;
+    }
+    CHECK(entry_count==next);
+    size_t live = 0;
+    for(size_t i = 0;i<entry_count;++i) {
+        live+=expected[i].removed?0:1;
+    }
+    CHECK(live==listed);
+    // and stays at the end
+    CHECK(0==vfs::readdir_plus(pdir,infos,window));
+    ++calls;
+    // sizes match stat()
+    for(size_t i = 0;i<entry_count;i+=11) {
+        if(expected[i].removed) {
+            continue;
+        }
+        struct stat st;
+        snprintf(path,sizeof(path),"/fat/%s",expected[i].name);
+        CHECK(0==newlib::stat(path,&st));
+        CHECK((off_t)expected[i].size==(expected[i].directory?0:st.st_size));
+        CHECK(expected[i].modified==st.st_mtime);
+    }
+    vfs_operation_stats s;
+    stats.snapshot(vfs_operation::readdir_plus,s);
+    CHECK(calls==s.calls && 0==s.errors);
+    // a subdirectory lists without . and ..
+    CHECK(0==newlib::mkdir("/fat/dir0/sub",0777));
+    int fd = newlib::open("/fat/dir0/a.dat",O_WRONLY|O_CREAT,0666);
+    CHECK(0<=fd);
+    CHECK(100==newlib::write(fd,data.data(),100));
+    CHECK(0==newlib::close(fd));
+    DIR* sub = newlib::opendir("/fat/dir0");
+    CHECK(nullptr!=sub);
+    CHECK(2==vfs::readdir_plus(sub,infos,window));
+    CHECK(0==strcasecmp("sub",infos[0].name) && 0!=(infos[0].attributes&0x10) && 0==infos[0].size);
+    CHECK(0==strcasecmp("a.dat",infos[1].name) && 0==(infos[1].attributes&0x10) && 100==infos[1].size);
+    CHECK(0==vfs::readdir_plus(sub,infos,window));
+    // nothing that isn't a live directory from a mount gets through, even laid out like
+    // one. these never reach the driver, so they aren't counted
+    stats.reset();
+    struct {
+        DIR dir;
+        uint32_t magic;
+        DIR* inner;
+        void* ctx;
+        void* readdir_plus;
+        void* next;
+    } lookalike;
+    memset(&lookalike,0,sizeof(lookalike));
+    lookalike.magic = 0x52494456;
+    lookalike.inner = pdir;
+    errno = 0;
+    CHECK(-1==vfs::readdir_plus(&lookalike.dir,infos,window));
+    CHECK(EBADF==errno);
+    errno = 0;
+    CHECK(-1==vfs::readdir_plus(nullptr,infos,window));
+    CHECK(EBADF==errno);
+    CHECK(0==newlib::closedir(sub));
+    errno = 0;
+    CHECK(-1==vfs::readdir_plus(sub,infos,window));
+    CHECK(EBADF==errno);
+    stats.snapshot(vfs_operation::readdir_plus,s);
+    CHECK(0==s.calls);
+    // the one still open is still found
+    CHECK(0==vfs::readdir_plus(pdir,infos,window));
+    stats.snapshot(vfs_operation::readdir_plus,s);
+    CHECK(1==s.calls);
+    CHECK(0==newlib::closedir(pdir));
+    CHECK(-1==vfs::readdir_plus(pdir,infos,window));
+    CHECK(vfs::unmount("/fat"));
+}
+// vfs::readv(), writev() and pwritev() reach the driver's through ioctl(), counted in the
+// mount's stats as themselves rather than as ioctl() calls
+static void vectored() {
+    printf("vectored I/O\n");
+    vfs_fast_fat32_ram_hal ram(sector_count);
+    CHECK(ram.initialized());
+    CHECK(vfs_fast_fat32::format(ram));
+    vfs_fast_fat32 fat(ram);
+    CHECK(fat.initialized());
+    vfs_stats stats;
+    CHECK(vfs::mount("/fat",&fat,&stats));
+    std::vector<uint8_t> expected(12000);
+    std::vector<uint8_t> data(expected.size()+1000,0xEE);
+    fill_pattern(expected.data(),expected.size(),1,0);
+    struct iovec iov[3];
+    iov[0].iov_base = expected.data();
+    iov[0].iov_len = 100;
+    iov[1].iov_base = expected.data()+100;
+    iov[1].iov_len = 5000;
+    iov[2].iov_base = expected.data()+5100;
+    iov[2].iov_len = 6900;
+    int fd = newlib::open("/fat/v.dat",O_RDWR|O_CREAT,0666);
+    CHECK(0<=fd);
+    CHECK(12000==vfs::writev(fd,iov,3));
+    CHECK(12000==newlib::lseek(fd,0,SEEK_CUR));
+    fill_pattern(expected.data()+300,2000,2,300);
+    iov[0].iov_base = expected.data()+300;
+    iov[0].iov_len = 1000;
+    iov[1].iov_base = expected.data()+1300;
+    iov[1].iov_len = 1000;
+    CHECK(2000==vfs::pwritev(fd,iov,2,300));
+    CHECK(12000==newlib::lseek(fd,0,SEEK_CUR));
+    // asks for more than is there, so it stops at the end
+    CHECK(0==newlib::lseek(fd,0,SEEK_SET));
+    iov[0].iov_base = data.data();
+    iov[0].iov_len = 511;
+    iov[1].iov_base = data.data()+511;
+    iov[1].iov_len = 9000;
+    iov[2].iov_base = data.data()+9511;
+    iov[2].iov_len = data.size()-9511;
+    CHECK(12000==vfs::readv(fd,iov,3));
+    CHECK(0==memcmp(data.data(),expected.data(),expected.size()));
+    CHECK(0xEE==data[expected.size()]);
+    CHECK(0==vfs::readv(fd,iov,3));
+    CHECK(0==newlib::close(fd));
+    // read only
+    fd = newlib::open("/fat/v.dat",O_RDONLY,0);
+    CHECK(0<=fd);
+    errno = 0;
+    CHECK(-1==vfs::writev(fd,iov,3));
+    CHECK(EBADF==errno);
+    errno = 0;
+    CHECK(-1==vfs::pwritev(fd,iov,3,0));
+    CHECK(EBADF==errno);
+    CHECK(0==newlib::close(fd));
+    // and a closed file doesn't get as far as the driver
+    errno = 0;
+    CHECK(-1==vfs::readv(fd,iov,3));
+    CHECK(EBADF==errno);
+    vfs_operation_stats s;
+    stats.snapshot(vfs_operation::writev,s);
+    CHECK(2==s.calls && 1==s.errors && 12000==s.bytes);
+    stats.snapshot(vfs_operation::pwritev,s);
+    CHECK(2==s.calls && 1==s.errors && 2000==s.bytes);
+    stats.snapshot(vfs_operation::readv,s);
+    CHECK(2==s.calls && 0==s.errors && 12000==s.bytes);
+    stats.snapshot(vfs_operation::ioctl,s);
+    CHECK(0==s.calls);
+    stats.snapshot(vfs_operation::write,s);
+    CHECK(0==s.calls);
+    CHECK(vfs::unmount("/fat"));
+}
+// file_grow_clusters reaches the driver through ioctl(), and anything it doesn't know fails
+// with ENOTTY, both counted as ioctl() calls
+static void grow_clusters() {
+    printf("file_grow_clusters\n");
+    vfs_fast_fat32_ram_hal ram(sector_count);
+    CHECK(ram.initialized());
+    CHECK(vfs_fast_fat32::format(ram));
+    std::vector<uint8_t> data(3000);
+    fill_pattern(data.data(),data.size(),1,0);
+    unsigned long long cluster;
+    {
+        vfs_fast_fat32 fat(ram);
+        CHECK(fat.initialized());
+        vfs_stats stats;
+        CHECK(vfs::mount("/fat",&fat,&stats));
+        unsigned long long before = fat.free();
+        int fd = newlib::open("/fat/a.dat",O_WRONLY|O_CREAT,0666);
+        CHECK(0<=fd);
+        CHECK(1==newlib::write(fd,data.data(),1));
+        CHECK(0==newlib::close(fd));
+        cluster = before-fat.free();
+        before = fat.free();
+        fd = newlib::open("/fat/b.dat",O_WRONLY|O_CREAT,0666);
+        CHECK(0<=fd);
+        CHECK(0==ioctl(fd,file_grow_clusters,(unsigned long)6));
+        errno = 0;
+        CHECK(-1==ioctl(fd,0x4699,(unsigned long)6));
+        CHECK(ENOTTY==errno);
+        CHECK(100==newlib::write(fd,data.data(),100));
+        CHECK(before-6*cluster==fat.free());
+        struct stat st;
+        CHECK(0==newlib::fstat(fd,&st) && 100==st.st_size);
+        CHECK(2900==newlib::write(fd,data.data()+100,2900));
+        CHECK(0==newlib::close(fd));
+        CHECK(before-(3000+cluster-1)/cluster*cluster==fat.free());
+        vfs_operation_stats s;
+        stats.snapshot(vfs_operation::ioctl,s);
+        CHECK(2==s.calls && 1==s.errors);
+        CHECK(vfs::unmount("/fat"));
+    }
+    vfs_fast_fat32 fat(ram);
+    CHECK(fat.initialized());
+    int fd = fat.open("/b.dat",O_RDONLY,0);
+    CHECK(0<=fd);
+    CHECK((off_t)((3000+cluster-1)/cluster*cluster)==fat.allocated_size(fd));
+    std::vector<uint8_t> read(data.size()+1);
+    CHECK(3000==fat.read(fd,read.data(),read.size()));
+    CHECK(0==memcmp(read.data(),data.data(),data.size()));
+    CHECK(0==fat.close(fd));
+}
+int main(int argc,char** argv) {
+    if(argc>1) {
+        fprintf(stderr,"usage: %s\n",argv[0]);
+        return 2;
+    }
+    readdir_plus();
+    vectored();
+    grow_clusters();
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,192 @@
+// runs write_pipeline over a simulated SD card: random overlapping writes, some bigger
+// than a buffer, have to land in the order they were submitted. also checks the tokens
+// across the wrap, wait() and drain(), and that a failed write is reported by wait() and
+// flush() and then cleared.
+// usage: write_pipeline_test [--writes <count>]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "write_pipeline.hpp"
+#include "simulated_sd_card.hpp"
+#include "host_test.hpp"
+using namespace esp32;
+
+constexpr static const size_t sector_size = 512;
+constexpr static const size_t buffer_sectors = 4;
+// small, so writes keep landing on each other
+constexpr static const size_t region_sectors = 64;
+
+static simulated_sd_card* make_card() {
+    simulated_sd_card* card = new simulated_sd_card(4096,sector_size);
+    CHECK(card->initialized());
+    simulated_sd_timing timing = card->timing();
+    // slow enough that the ring fills and submit() has to wait
+    timing.command_us = 20;
+    timing.write_bytes_per_second = 50*1024*1024;
+    timing.sleep = true;
+    card->timing(timing);
+    return card;
+}
+// what the card should hold is what the writes would leave if made one at a time in order
+static void ordering(size_t writes) {
+    simulated_sd_card* card = make_card();
+    std::vector<uint8_t> expected(region_sectors*sector_size,0);
+    std::vector<uint8_t> data(region_sectors*sector_size);
+    {
+        write_pipeline<simulated_sd_card> pipeline(*card,3,buffer_sectors*sector_size);
+        CHECK(pipeline.initialized());
+        CHECK(buffer_sectors*sector_size==pipeline.buffer_size());
+        test_random random(1);
+        uint32_t last = 0;
+        for(size_t i = 0;i<writes;++i) {
+            // up to three buffers' worth, so some are split
+            size_t count = 1+random.below(3*buffer_sectors);
+            size_t start = random.below((uint32_t)(region_sectors-count+1));
+            fill_pattern(data.data(),count*sector_size,(uint32_t)i,0);
+            uint32_t token = pipeline.submit(data.data(),start,count);
+            CHECK(0!=token);
+            // one token per buffer, in order
+            size_t pieces = (count+buffer_sectors-1)/buffer_sectors;
+            CHECK(token==last+pieces);
+            last = token;
+            memcpy(expected.data()+start*sector_size,data.data(),count*sector_size);
+            // the source can be reused as soon as submit() returns
+            memset(data.data(),0xEE,count*sector_size);
+            if(0==random.below(50)) {
+                CHECK(pipeline.wait(token));
+                CHECK(pipeline.completed(token));
+                CHECK(0==memcmp(card->data(),expected.data(),expected.size()));
+            }
+        }
+        CHECK(pipeline.flush());
+        CHECK(pipeline.completed(last));
+    }
+    CHECK(0==memcmp(card->data(),expected.data(),expected.size()));
+    delete card;
+}
+// two threads submitting to their own halves at once. each half ends up with its own
+// thread's last writes
+static void concurrent() {
+    simulated_sd_card* card = make_card();
+    {
+        write_pipeline<simulated_sd_card> pipeline(*card,2,buffer_sectors*sector_size);
+        CHECK(pipeline.initialized());
+        bool ok[2] = {true,true};
+        std::thread threads[2];
+        for(int t = 0;t<2;++t) {
+            threads[t] = std::thread([&pipeline,&ok,t]{
+                std::vector<uint8_t> data(buffer_sectors*2*sector_size);
+                for(size_t i = 0;i<300;++i) {
+                    size_t start = 1024*(1+t)+(i%32)*8;
+                    fill_pattern(data.data(),data.size(),(uint32_t)(1000*t+i),0);
+                    ok[t] = 0!=pipeline.submit(data.data(),start,buffer_sectors*2) && ok[t];
+                }
+            });
+        }
+        for(int t = 0;t<2;++t) {
+            threads[t].join();
+        }
+        CHECK(ok[0] && ok[1]);
+        CHECK(pipeline.flush());
+    }
+    // the last write to each spot in each half
+    for(int t = 0;t<2;++t) {
+        for(size_t spot = 0;spot<32;++spot) {
+            size_t i = spot+32*((299-spot)/32);
+            const uint8_t* p = card->data()+(1024*(1+t)+spot*8)*sector_size;
+            CHECK(check_pattern(p,buffer_sectors*2*sector_size,(uint32_t)(1000*t+i),0));
+        }
+    }
+    delete card;
+}
+// tokens skip 0 when they wrap, and everything that compares them keeps working
+static void wraparound() {
+    simulated_sd_card* card = make_card();
+    std::vector<uint8_t> data(buffer_sectors*sector_size);
+    {
+        write_pipeline<simulated_sd_card> pipeline(*card,2,buffer_sectors*sector_size,-1,0xFFFFFFF8);
+        CHECK(pipeline.initialized());
+        uint32_t first = 0,previous = 0;
+        for(uint32_t i = 0;i<20;++i) {
+            fill_pattern(data.data(),data.size(),i,0);
+            uint32_t token = pipeline.submit(data.data(),i*buffer_sectors,buffer_sectors);
+            CHECK(0!=token);
+            if(0==i) {
+                first = token;
+                CHECK(0xFFFFFFF8==token);
+            } else {
+                CHECK(token==(0xFFFFFFFF==previous?1:previous+1));
+            }
+            previous = token;
+        }
+        // 8 up to 0xFFFFFFFF, then 1 to 12
+        CHECK(12==previous);
+        CHECK(pipeline.wait(previous));
+        // the ones before the wrap count as done too
+        CHECK(pipeline.completed(first));
+        CHECK(pipeline.completed(0xFFFFFFFF));
+        CHECK(pipeline.completed(previous));
+        CHECK(!pipeline.completed(previous+1000));
+        CHECK(pipeline.flush());
+    }
+    for(uint32_t i = 0;i<20;++i) {
+        CHECK(check_pattern(card->data()+i*buffer_sectors*sector_size,buffer_sectors*sector_size,i,0));
+    }
+    delete card;
+}
+// drain() waits without clearing a failure, wait() reports it only for tokens at or after
+// the one that failed, and flush() reports it once
+static void failure() {
+    simulated_sd_card* card = make_card();
+    std::vector<uint8_t> data(buffer_sectors*sector_size);
+    {
+        write_pipeline<simulated_sd_card> pipeline(*card,2,buffer_sectors*sector_size);
+        CHECK(pipeline.initialized());
+        fill_pattern(data.data(),data.size(),1,0);
+        uint32_t good = pipeline.submit(data.data(),0,buffer_sectors);
+        pipeline.drain();
+        CHECK(pipeline.completed(good));
+        card->fail_writes(true);
+        uint32_t bad = pipeline.submit(data.data(),100,buffer_sectors);
+        pipeline.drain();
+        card->fail_writes(false);
+        uint32_t after = pipeline.submit(data.data(),200,buffer_sectors);
+        pipeline.drain();
+        CHECK(pipeline.wait(good));
+        CHECK(!pipeline.wait(bad));
+        CHECK(!pipeline.wait(after));
+        // drain() left it for flush()
+        CHECK(!pipeline.flush());
+        CHECK(pipeline.flush());
+        CHECK(pipeline.wait(after));
+        uint32_t again = pipeline.submit(data.data(),300,buffer_sectors);
+        CHECK(pipeline.wait(again));
+        CHECK(pipeline.flush());
+    }
+    CHECK(check_pattern(card->data(),buffer_sectors*sector_size,1,0));
+    CHECK(check_pattern(card->data()+300*sector_size,buffer_sectors*sector_size,1,0));
+    // the failed one never reached the card
+    for(size_t i = 0;i<buffer_sectors*sector_size;++i) {
+        CHECK(0==card->data()[100*sector_size+i]);
+    }
+    delete card;
+}
+int main(int argc,char** argv) {
+    size_t writes = 2000;
+    for(int i = 1;i<argc;++i) {
+        if(0==strcmp(argv[i],"--writes") && i+1<argc) {
+            writes = (size_t)atol(argv[++i]);
+        } else {
+            fprintf(stderr,"usage: %s [--writes <count>]\n",argv[0]);
+            return 2;
+        }
+    }
+    ordering(writes);
+    concurrent();
+    wraparound();
+    failure();
+    printf("passed\n");
+    return 0;
+}
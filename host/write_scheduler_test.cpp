@@ -0,0 +1,257 @@
+// checks vfs_fast_fat32_write_scheduler_hal. random reads and writes of all sizes have to
+// read back and land on the drive like a flat copy says, with each fill limit, and fast
+// FAT32 has to run on top. sectors trimmed while their block is held, or before it is,
+// must never be read in and written back, and a block whose trimmed sectors are all
+// written again goes out whole.
+// usage: write_scheduler_test [--operations <count>]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <vector>
+#include "vfs_fast_fat32.hpp"
+#include "vfs_fast_fat32_image_hal.hpp"
+#include "vfs_fast_fat32_write_scheduler_hal.hpp"
+#include "host_test.hpp"
+using namespace esp32;
+
+constexpr static const size_t sector_size = 512;
+constexpr static const uint32_t sector_count = 4096;
+// 8KB blocks of 16 sectors
+constexpr static const size_t block_size = 8192;
+constexpr static const uint32_t block_sectors = 16;
+
+// a RAM drive that remembers which sectors were written since the last trim of them
+class recording_hal : public vfs_fast_fat32_hal {
+    vfs_fast_fat32_ram_hal m_ram;
+public:
+    std::vector<bool> trimmed;
+    std::vector<bool> written;
+    recording_hal(uint32_t sector_count) : m_ram(sector_count),trimmed(sector_count,false),written(sector_count,false) {
+        CHECK(m_ram.initialized());
+    }
+    inline uint8_t* data() {
+        return m_ram.data();
+    }
+    virtual vfs_fast_fat32_disk_status initialize(uint8_t pdrv) {
+        return m_ram.initialize(pdrv);
+    }
+    virtual vfs_fast_fat32_disk_status status(uint8_t pdrv) {
+        return m_ram.status(pdrv);
+    }
+    virtual vfs_fast_fat32_hal_result read(uint8_t pdrv,void* buffer,uint32_t sector,unsigned int count) {
+        return m_ram.read(pdrv,buffer,sector,count);
+    }
+    virtual vfs_fast_fat32_hal_result write(uint8_t pdrv,const void* buffer,uint32_t sector,unsigned int count) {
+        for(uint32_t i = sector;i<sector+count && i<trimmed.size();++i) {
+            written[i] = true;
+        }
+        return m_ram.write(pdrv,buffer,sector,count);
+    }
+    virtual vfs_fast_fat32_hal_result ioctl(uint8_t pdrv,vfs_fast_fat32_ioctl_command command,void* buffer) {
+        vfs_fast_fat32_hal_result result = m_ram.ioctl(pdrv,command,buffer);
+        if(control_trim==command) {
+            const uint32_t* range = (const uint32_t*)buffer;
+            for(uint32_t i = range[0];i<=range[1];++i) {
+                trimmed[i] = true;
+                written[i] = false;
+            }
+        }
+        return result;
+    }
+    // the sectors in [first, last) written since they were trimmed
+    size_t rewritten(uint32_t first,uint32_t last) const {
+        size_t result = 0;
+        for(uint32_t i = first;i<last;++i) {
+            if(trimmed[i] && written[i]) {
+                ++result;
+            }
+        }
+        return result;
+    }
+};
+static void random_access(size_t fill_limit,size_t operations) {
+    printf("fill limit %d\n",(int)fill_limit);
+    recording_hal ram(sector_count);
+    std::vector<uint8_t> expected((size_t)sector_count*sector_size,0);
+    {
+        vfs_fast_fat32_write_scheduler_hal hal(ram,3,block_size,fill_limit);
+        CHECK(hal.initialized());
+        hal.initialize(0);
+        CHECK(block_sectors==hal.block_sectors());
+        std::vector<uint8_t> data(64*sector_size);
+        test_random random((uint32_t)fill_limit+1);
+        for(size_t i = 0;i<operations;++i) {
+            // mostly a few sectors, sometimes several blocks
+            uint32_t count = 1+random.below(0==random.below(4)?60:3);
+            uint32_t sector = random.below(sector_count-count+1);
+            if(random.below(2)) {
+                fill_pattern(data.data(),(size_t)count*sector_size,(uint32_t)i,0);
+                CHECK(vfs_fast_fat32_hal_result::success==hal.write(0,data.data(),sector,count));
+                memcpy(expected.data()+(size_t)sector*sector_size,data.data(),(size_t)count*sector_size);
+            } else {
+                CHECK(vfs_fast_fat32_hal_result::success==hal.read(0,data.data(),sector,count));
+                CHECK(0==memcmp(data.data(),expected.data()+(size_t)sector*sector_size,(size_t)count*sector_size));
+            }
+            if(0==random.below(500)) {
+                CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,control_sync,nullptr));
+            }
+        }
+        CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,control_sync,nullptr));
+        CHECK(0==memcmp(ram.data(),expected.data(),expected.size()));
+    }
+    CHECK(0==memcmp(ram.data(),expected.data(),expected.size()));
+}
+static void trim_range(vfs_fast_fat32_hal& hal,uint32_t first,uint32_t last) {
+    uint32_t range[2] = {first,last};
+    CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,control_trim,range));
+}
+static void write_sectors(vfs_fast_fat32_hal& hal,uint32_t sector,uint32_t count,uint32_t seed) {
+    std::vector<uint8_t> data((size_t)count*sector_size);
+    fill_pattern(data.data(),data.size(),seed,0);
+    CHECK(vfs_fast_fat32_hal_result::success==hal.write(0,data.data(),sector,count));
+}
+static void trims() {
+    printf("trims\n");
+    recording_hal ram(sector_count);
+    vfs_fast_fat32_write_scheduler_hal hal(ram,4,block_size);
+    CHECK(hal.initialized());
+    hal.initialize(0);
+    // a held block with the end trimmed, over some of what was written to it
+    write_sectors(hal,0,4,1);
+    trim_range(hal,2,15);
+    CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,control_sync,nullptr));
+    CHECK(0==ram.rewritten(0,16));
+    CHECK(check_pattern(ram.data(),2*sector_size,1,0));
+    CHECK(ram.written[0] && ram.written[1]);
+    // a block taken after its sectors were trimmed
+    trim_range(hal,32,63);
+    hal.reset_stats();
+    write_sectors(hal,40,1,2);
+    write_sectors(hal,50,2,3);
+    CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,control_sync,nullptr));
+    CHECK(1==ram.rewritten(32,48) && ram.written[40]);
+    CHECK(2==ram.rewritten(48,64) && ram.written[50] && ram.written[51]);
+    CHECK(0==hal.stats().filled);
+    CHECK(2==hal.stats().split);
+    CHECK(check_pattern(ram.data()+40*sector_size,sector_size,2,0));
+    CHECK(check_pattern(ram.data()+50*sector_size,2*sector_size,3,0));
+    // writing a trimmed block again, in pieces from the front, completes it
+    trim_range(hal,128,191);
+    hal.reset_stats();
+    write_sectors(hal,128,8,4);
+    write_sectors(hal,136,8,5);
+    CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,control_sync,nullptr));
+    CHECK(1==hal.stats().flushed && 0==hal.stats().split && 0==hal.stats().filled);
+    CHECK(0==ram.rewritten(144,192));
+    // and a block written straight through isn't trimmed any more either
+    write_sectors(hal,144,16,6);
+    write_sectors(hal,160,3,7);
+    hal.reset_stats();
+    CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,control_sync,nullptr));
+    CHECK(1==hal.stats().split);
+    CHECK(3==ram.rewritten(160,192));
+    // so a block taken over it later is filled and written whole as usual
+    trim_range(hal,192,223);
+    write_sectors(hal,192,16,9);
+    write_sectors(hal,195,10,10);
+    hal.reset_stats();
+    CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,control_sync,nullptr));
+    CHECK(1==hal.stats().flushed && 0==hal.stats().split && 6==hal.stats().filled);
+    CHECK(check_pattern(ram.data()+192*sector_size,3*sector_size,9,0));
+    CHECK(check_pattern(ram.data()+195*sector_size,10*sector_size,10,0));
+    // trimming everything held drops the blocks without writing them
+    write_sectors(hal,300,2,8);
+    write_sectors(hal,400,2,8);
+    trim_range(hal,290,410);
+    hal.reset_stats();
+    CHECK(vfs_fast_fat32_hal_result::success==hal.ioctl(0,control_sync,nullptr));
+    CHECK(0==hal.stats().split && 0==hal.stats().flushed && 0==hal.stats().partial);
+    CHECK(0==ram.rewritten(290,411));
+}
+static void file_system() {
+    printf("fast FAT32\n");
+    vfs_fast_fat32_ram_hal ram(64*2048);
+    CHECK(ram.initialized());
+    CHECK(vfs_fast_fat32::format(ram));
+    constexpr static const size_t size = 300000;
+    std::vector<uint8_t> expected(size);
+    fill_pattern(expected.data(),size,1,0);
+    std::vector<uint8_t> data(size);
+    test_random random(5);
+    {
+        vfs_fast_fat32_write_scheduler_hal hal(ram);
+        CHECK(hal.initialized());
+        vfs_fast_fat32 fat(hal);
+        CHECK(fat.initialized());
+        int fd = fat.open("/a.dat",O_RDWR|O_CREAT,0666);
+        CHECK(0<=fd);
+        size_t written = 0;
+        while(written<size) {
+            size_t chunk = 1+random.below(5000);
+            if(chunk>size-written) {
+                chunk = size-written;
+            }
+            CHECK((ssize_t)chunk==fat.write(fd,expected.data()+written,chunk));
+            written+=chunk;
+        }
+        // small overwrites all over, which is what the scheduler gathers
+        for(size_t i = 0;i<500;++i) {
+            size_t offset = random.below(size-100);
+            fill_pattern(expected.data()+offset,100,2+(uint32_t)i,offset);
+            CHECK(100==fat.pwrite(fd,expected.data()+offset,100,offset));
+        }
+        CHECK((ssize_t)size==fat.pread(fd,data.data(),size,0));
+        CHECK(0==memcmp(data.data(),expected.data(),size));
+        CHECK(0==fat.close(fd));
+        // freed and trimmed while blocks around them are held
+        for(size_t i = 0;i<20;++i) {
+            char path[16];
+            snprintf(path,sizeof(path),"/f%u.dat",(unsigned)i);
+            fd = fat.open(path,O_WRONLY|O_CREAT,0666);
+            CHECK(0<=fd);
+            CHECK(3000==fat.write(fd,expected.data()+i*1000,3000));
+            CHECK(0==fat.close(fd));
+        }
+        for(size_t i = 0;i<20;i+=2) {
+            char path[16];
+            snprintf(path,sizeof(path),"/f%u.dat",(unsigned)i);
+            CHECK(0==fat.unlink(path));
+        }
+    }
+    vfs_fast_fat32 fat(ram);
+    CHECK(fat.initialized());
+    int fd = fat.open("/a.dat",O_RDONLY,0);
+    CHECK(0<=fd);
+    CHECK((ssize_t)size==fat.read(fd,data.data(),size));
+    CHECK(0==memcmp(data.data(),expected.data(),size));
+    CHECK(0==fat.close(fd));
+    for(size_t i = 1;i<20;i+=2) {
+        char path[16];
+        snprintf(path,sizeof(path),"/f%u.dat",(unsigned)i);
+        fd = fat.open(path,O_RDONLY,0);
+        CHECK(0<=fd);
+        CHECK(3000==fat.read(fd,data.data(),size));
+        CHECK(0==memcmp(data.data(),expected.data()+i*1000,3000));
+        CHECK(0==fat.close(fd));
+    }
+}
+int main(int argc,char** argv) {
+    size_t operations = 20000;
+    for(int i = 1;i<argc;++i) {
+        if(0==strcmp(argv[i],"--operations") && i+1<argc) {
+            operations = (size_t)atol(argv[++i]);
+        } else {
+            fprintf(stderr,"usage: %s [--operations <count>]\n",argv[0]);
+            return 2;
+        }
+    }
+    static const size_t limits[] = {0,4,(size_t)-1,1000};
+    for(size_t i = 0;i<sizeof(limits)/sizeof(limits[0]);++i) {
+        random_access(limits[i],operations);
+    }
+    trims();
+    file_system();
+    printf("passed\n");
+    return 0;
+}
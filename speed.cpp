@@ -5,76 +5,130 @@ extern "C"
     void app_main();
 }
 
-#include <chrono>
+#include <stdio.h>
 #include <iostream>
 
 using namespace std;
-typedef chrono::high_resolution_clock hires_clock_t;
 // keep all the nonsense we need
 // to set the sd_reader device up
 // in another file to declutter the
 // example
 #include "sd_configuration.h"
-void print_speed(double bps);
-uint8_t block_buffer[16384];
+#include "vfs.hpp"
+#include "vfs_ramfs.hpp"
+#include "storage_benchmark.hpp"
+#ifndef USE_SPI_MODE
+#include "sdmmc_host.hpp"
+#include "vfs_fast_fat32_sdmmc_hal.hpp"
+#else
+#include "sdspi_bus.hpp"
+#include "sdspi_card.hpp"
+#include "vfs_fast_fat32_card_hal.hpp"
+#endif
+
+// runs the storage benchmark against the stock FatFs mount, vfs_null, vfs_ramfs and the
+// fast FAT32 driver in turn. define BENCHMARK_CSV to get comma separated output to compare
+// runs with the host build in host/
+
+#ifdef BENCHMARK_CSV
+static const bool csv = true;
+#else
+static const bool csv = false;
+#endif
+static void print_result(const storage_benchmark_result& result,void* state) {
+    storage_benchmark::print(stdout,result,(const char*)state,csv);
+}
+static void benchmark(const char* mount_point,const char* name,size_t file_size = 1024*1024) {
+    if(!csv) {
+        printf("\n%s\n",name);
+    }
+    storage_benchmark_posix_target target(mount_point);
+    storage_benchmark bench(target,file_size);
+    if(!bench.initialized()) {
+        cout << "Not enough memory to run the benchmark" << endl;
+        return;
+    }
+    if(!csv) {
+        storage_benchmark::print_header(stdout);
+    }
+    bench.run_all(print_result,(void*)name);
+}
 void app_main()
 {
-    sd_reader reader = sd_configure();
-    cout << "Size in GB: " << reader.size() / 1024.0 / 1024.0 / 1024.0 << endl;
-    cout << "Free space in GB: " << reader.free() / 1024.0 / 1024.0 / 1024.0 << endl;
-    // as long as an sd_reader is created we can use standard C and C++
-    // file operations to work with files at paths rooted at the SD reader
-    // mount_point - the filesystem uses POSIX style addressing
-    
-    for (int i = 0; i < sizeof(block_buffer); ++i)
-    {
-        block_buffer[i] = (uint8_t)(i & 0xFF);
+    if(csv) {
+        storage_benchmark::print_header(stdout,true);
     }
-    FILE *fd = fopen("/sdcard/test.dat", "w");
-    if(nullptr!=fd) {
-        auto start_time = hires_clock_t::now();
-        int i=0;
-        for (; i < 256; i++)
-        {
-            size_t res = fwrite(block_buffer, sizeof(block_buffer), 1, fd);
-            if(1!=res) {
-                ESP_LOGE("perftest","sd write data failed .. wrote %llu bytes ",(unsigned long long)res*sizeof(block_buffer));
-                break;
+#ifdef USE_SPI_MODE
+    // this goes first, since the stock mount below leaves the SPI bus claimed
+    {
+        sdmmc_host_t host = SDSPI_HOST_DEFAULT();
+        spi_host spi((spi_host_device_t)host.slot,sd_spi_bus_config(),SPI_DMA_CHAN);
+        sdspi_bus bus(spi,PIN_NUM_CS,SPI_MAX_TRANSFER);
+        sdspi_card<sdspi_bus> card(bus);
+        vfs_fast_fat32_card_hal<sdspi_card<sdspi_bus>> card_hal(card);
+        if(!card.initialized()) {
+            cout << "Could not initialize the SD card over SPI" << endl;
+        } else {
+            vfs_fast_fat32 fat(card_hal);
+            if(!fat.initialized() || !vfs::mount("/fast",&fat)) {
+                cout << "Could not mount fast FAT32 filesystem" << endl;
+            } else {
+                benchmark("/fast","fast FAT32 over SPI");
+                vfs::unmount("/fast");
             }
         }
-        auto end_time = hires_clock_t::now();
-        double secs = chrono::duration_cast<chrono::milliseconds>(end_time - start_time).count() /1000.0;
-        cout << "Wrote: "
-            << (sizeof(block_buffer)*i)/1024.0/1024.0 
-            << "MB in " 
-            << secs
-            << " s @ " ;
-        print_speed(ftell(fd)/secs);
-        cout << endl;
-        
     }
-    
-    fclose(fd);
-       
-}
-void print_speed(double bps) {
-    if (bps >= (1024.0 * 1024.0 * 1024.0))
+#endif
     {
-        cout << bps / (1024.0 * 1024.0 * 1024.0);
-        cout <<" GB/s";
+        sd_reader reader = sd_configure();
+        if(!reader.initialized()) {
+            cout << "Could not mount the SD card with FatFs" << endl;
+        } else {
+            cout << "Size in GB: " << reader.size() / 1024.0 / 1024.0 / 1024.0 << endl;
+            cout << "Free space in GB: " << reader.free() / 1024.0 / 1024.0 / 1024.0 << endl;
+            benchmark(reader.mount_point(),"FatFs");
+        }
     }
-    if (bps >= (1024.0 * 1024.0))
     {
-        cout << bps / (1024.0 * 1024.0);
-        cout << " MB/s";
-        return;
+        // measures the overhead of the VFS layer itself. the file tests fail, since it
+        // has no directories
+        static vfs_null null_driver;
+        if(vfs::mount("/null",&null_driver)) {
+            benchmark("/null","vfs_null");
+            vfs::unmount("/null");
+        }
     }
-    if (bps >= 1024)
     {
-        cout << (bps / 1024.0);
-        cout << " kB/s";
-        return;
+        // the upper bound for a real file system. the file is smaller so it fits in RAM
+        vfs_ramfs ram_driver;
+        if(vfs::mount("/ram",&ram_driver)) {
+            benchmark("/ram","vfs_ramfs",128*1024);
+            vfs::unmount("/ram");
+        }
     }
-    cout << bps;
-    cout << " bytes/s";
-}
\ No newline at end of file
+#ifndef USE_SPI_MODE
+    {
+        sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
+        sdmmc_host_t card_config = SDMMC_HOST_DEFAULT();
+        card_config.max_freq_khz = SDMMC_FREQ_HIGHSPEED;
+        if(slot_config.width==8) {
+            card_config.flags&=~SDMMC_HOST_FLAG_DDR;
+        }
+        sdmmc_host_slot slot_1(SDMMC_HOST_SLOT_1,slot_config);
+        sdmmc_card card(slot_1,card_config);
+        if(!card.initialized()) {
+            cout << "Could not initialize the SD card for fast FAT32" << endl;
+            return;
+        }
+        card.start_pipeline();
+        vfs_fast_fat32_sdmmc_hal card_hal(card);
+        vfs_fast_fat32 fat(card_hal);
+        if(!fat.initialized() || !vfs::mount("/fast",&fat)) {
+            cout << "Could not mount fast FAT32 filesystem" << endl;
+            return;
+        }
+        benchmark("/fast","fast FAT32");
+        vfs::unmount("/fast");
+    }
+#endif
+}
@@ -0,0 +1,257 @@
+#ifndef HTCW_ESP32_BUFFER_ALLOCATOR_HPP
+#define HTCW_ESP32_BUFFER_ALLOCATOR_HPP
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <mutex>
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#endif
+namespace esp32 {
+    // what a driver buffer is for, so an allocator policy can decide where it goes
+    enum struct buffer_kind : uint8_t {
+        // handed to a HAL or the bus: sector caches, bounce and queue buffers. these
+        // need to be DMA capable, or the transfer gets copied through a bounce buffer
+        transfer = 0,
+        // large and rarely touched, like the free cluster map
+        cache = 1,
+        // small bookkeeping: file tables, handles, cache line headers
+        object = 2
+    };
+    // allocator policies are template parameters on the drivers. a policy is a type with
+    //   static void* allocate(size_t size,buffer_kind kind)
+    //   static void deallocate(void* data)
+    // allocate() returns nullptr on failure, and every result is aligned to at least 4
+    // bytes. deallocate() takes nullptr
+
+    // the heap, with transfers in DMA capable memory. this is what the drivers used
+    // before they took a policy
+    struct heap_allocator {
+        static void* allocate(size_t size,buffer_kind kind) {
+#ifdef ESP_PLATFORM
+            if(buffer_kind::transfer==kind) {
+                return heap_caps_malloc(size,MALLOC_CAP_DMA);
+            }
+#endif
+            return malloc(size);
+        }
+        static void deallocate(void* data) {
+#ifdef ESP_PLATFORM
+            heap_caps_free(data);
+#else
+            ::free(data);
+#endif
+        }
+    };
+    // like heap_allocator but puts caches in PSRAM when there is any, leaving internal RAM
+    // for the DMA buffers
+    struct psram_allocator {
+        static void* allocate(size_t size,buffer_kind kind) {
+#ifdef ESP_PLATFORM
+            if(buffer_kind::cache==kind) {
+                void* result = heap_caps_malloc(size,MALLOC_CAP_SPIRAM|MALLOC_CAP_8BIT);
+                if(nullptr!=result) {
+                    return result;
+                }
+            }
+#endif
+            return heap_allocator::allocate(size,kind);
+        }
+        static void deallocate(void* data) {
+            heap_allocator::deallocate(data);
+        }
+    };
+    // transfers come out of BlockCount fixed blocks of BlockSize bytes, carved from DMA
+    // capable memory on first use and kept for the life of the program. a transfer takes
+    // the first run of free blocks that fits it, so the pool can't fragment the heap and
+    // its buffers never need a bounce copy. when the pool is out of room the allocation
+    // fails rather than going to the heap. other kinds come from heap_allocator. Tag
+    // keeps separate pools apart when they have the same geometry
+    template<size_t BlockSize = 4096,size_t BlockCount = 32,int Tag = 0>
+    class dma_pool_allocator {
+        static_assert(0==(BlockSize&3) && 0!=BlockSize,"BlockSize must be a multiple of 4");
+        static_assert(0<BlockCount && BlockCount<=0xFFFF,"BlockCount must be from 1 to 65535");
+        struct pool {
+            std::mutex lock;
+            uint8_t* data;
+            bool failed;
+            // the length of the run starting at each block, or 0 where none starts
+            uint16_t runs[BlockCount];
+            uint8_t used[(BlockCount+7)/8];
+        };
+        static pool& instance() {
+            static pool result;
+            return result;
+        }
+        static bool used(const pool& p,size_t index) {
+            return 0!=(p.used[index/8]&(1<<(index%8)));
+        }
+        static void mark(pool& p,size_t index,size_t count,bool value) {
+            for(size_t i = index;i<index+count;++i) {
+                if(value) {
+                    p.used[i/8]|=(uint8_t)(1<<(i%8));
+                } else {
+                    p.used[i/8]&=(uint8_t)~(1<<(i%8));
+                }
+            }
+        }
+    public:
+        static void* allocate(size_t size,buffer_kind kind) {
+            if(buffer_kind::transfer!=kind) {
+                return heap_allocator::allocate(size,kind);
+            }
+            size_t count = (size+BlockSize-1)/BlockSize;
+            if(0==count) {
+                count = 1;
+            }
+            pool& p = instance();
+            std::lock_guard<std::mutex> lock(p.lock);
+            if(nullptr==p.data) {
+                if(p.failed) {
+                    return nullptr;
+                }
+                p.data = (uint8_t*)heap_allocator::allocate(BlockSize*BlockCount,buffer_kind::transfer);
+                if(nullptr==p.data) {
+                    p.failed = true;
+                    return nullptr;
+                }
+            }
+            size_t start = 0;
+            while(start+count<=BlockCount) {
+                size_t i = 0;
+                while(i<count && !used(p,start+i)) {
+                    ++i;
+                }
+                if(i==count) {
+                    mark(p,start,count,true);
+                    p.runs[start]=(uint16_t)count;
+                    return p.data+start*BlockSize;
+                }
+                start+=i+1;
+            }
+            return nullptr;
+        }
+        static void deallocate(void* data) {
+            if(nullptr==data) {
+                return;
+            }
+            pool& p = instance();
+            std::lock_guard<std::mutex> lock(p.lock);
+            uint8_t* d = (uint8_t*)data;
+            if(nullptr!=p.data && d>=p.data && d<p.data+BlockSize*BlockCount) {
+                size_t index = (d-p.data)/BlockSize;
+                mark(p,index,p.runs[index],false);
+                p.runs[index]=0;
+                return;
+            }
+            heap_allocator::deallocate(data);
+        }
+        // blocks in use, out of BlockCount
+        static size_t used_blocks() {
+            pool& p = instance();
+            std::lock_guard<std::mutex> lock(p.lock);
+            size_t result = 0;
+            for(size_t i = 0;i<BlockCount;++i) {
+                if(used(p,i)) {
+                    ++result;
+                }
+            }
+            return result;
+        }
+    };
+    // everything comes out of a Size byte static array, so the drivers make no heap calls
+    // at all. space is handed out from the front, and a freed block is kept on a list for
+    // the next allocation of the same rounded size, which is how opendir()/closedir()
+    // reuse their handles. when nothing is left allocated the arena starts over. static
+    // memory is internal, and so DMA capable, unless the build moves .bss to PSRAM. Tag
+    // keeps separate arenas apart when they have the same size
+    template<size_t Size,int Tag = 0>
+    class static_arena_allocator {
+        constexpr static const size_t align = 16;
+        struct block_header {
+            size_t size;
+            block_header* next;
+        };
+        constexpr static const size_t header_size = (sizeof(block_header)+align-1)/align*align;
+        struct arena {
+            std::mutex lock;
+            size_t used;
+            size_t live;
+            block_header* free_list;
+            alignas(16) uint8_t data[Size];
+        };
+        static arena& instance() {
+            static arena result;
+            return result;
+        }
+    public:
+        static void* allocate(size_t size,buffer_kind kind) {
+            (void)kind;
+            size = (size+align-1)/align*align;
+            arena& a = instance();
+            std::lock_guard<std::mutex> lock(a.lock);
+            block_header** link = &a.free_list;
+            while(nullptr!=*link) {
+                block_header* b = *link;
+                if(b->size==size) {
+                    *link = b->next;
+                    ++a.live;
+                    return ((uint8_t*)b)+header_size;
+                }
+                link = &b->next;
+            }
+            if(a.used+header_size+size>Size) {
+                return nullptr;
+            }
+            block_header* b = (block_header*)(a.data+a.used);
+            b->size = size;
+            a.used+=header_size+size;
+            ++a.live;
+            return ((uint8_t*)b)+header_size;
+        }
+        static void deallocate(void* data) {
+            if(nullptr==data) {
+                return;
+            }
+            arena& a = instance();
+            std::lock_guard<std::mutex> lock(a.lock);
+            block_header* b = (block_header*)(((uint8_t*)data)-header_size);
+            if(0==--a.live) {
+                a.used = 0;
+                a.free_list = nullptr;
+                return;
+            }
+            b->next = a.free_list;
+            a.free_list = b;
+        }
+        // bytes taken from the front of the arena so far
+        static size_t used() {
+            arena& a = instance();
+            std::lock_guard<std::mutex> lock(a.lock);
+            return a.used;
+        }
+    };
+    // arrays of objects through a policy. the count has to be given back on the way out
+    template<typename Allocator,typename T>
+    T* allocate_array(size_t count,buffer_kind kind) {
+        T* result = (T*)Allocator::allocate(sizeof(T)*(0==count?1:count),kind);
+        if(nullptr!=result) {
+            for(size_t i = 0;i<count;++i) {
+                new(result+i) T();
+            }
+        }
+        return result;
+    }
+    template<typename Allocator,typename T>
+    void deallocate_array(T* data,size_t count) {
+        if(nullptr!=data) {
+            for(size_t i = 0;i<count;++i) {
+                data[i].~T();
+            }
+            Allocator::deallocate(data);
+        }
+    }
+}
+#endif
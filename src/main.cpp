@@ -1,9 +1,14 @@
 // we'll be using fopen/fseek etc instead of i/o streams to avoid too much abstraction in the way
 // of our results
 #include <stdio.h>
+#include "esp_timer.h"
 
+#include "nvs_flash.h"
 #include "sdmmc_host.hpp"
+#include "sdmmc_bus_tuner.hpp"
 #include "vfs.hpp"
+#include "vfs_fast_fat32_sdmmc_hal.hpp"
+#include "vfs_fast_fat32_read_ahead_hal.hpp"
 #include <iostream>
 using namespace std;
 using namespace esp32;
@@ -20,13 +25,15 @@ void app_main() {
         << mhi.total_free_bytes/1024.0
         << "kB"
         << endl;
+    // the bus tuner keeps what it finds for each card in NVS
+    esp_err_t nvs_res = nvs_flash_init();
+    if(ESP_ERR_NVS_NO_FREE_PAGES==nvs_res || ESP_ERR_NVS_NEW_VERSION_FOUND==nvs_res) {
+        nvs_flash_erase();
+        nvs_flash_init();
+    }
     sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
+    // start out in the default mode every card supports. the tuner picks the real one
     sdmmc_host_t card_config = SDMMC_HOST_DEFAULT();
-    card_config.max_freq_khz = SDMMC_FREQ_HIGHSPEED;
-    // 8 bit bus can'd do DDR
-    if(slot_config.width==8) {
-        card_config.flags&=~SDMMC_HOST_FLAG_DDR;
-    }
 
     sdmmc_host_slot slot_1(SDMMC_HOST_SLOT_1,slot_config);
 
@@ -44,6 +51,61 @@ void app_main() {
         
     } else {
         cout << "Initialized SD card" << endl;
+        // find the fastest bus mode this card is reliable in, or reuse the one found on an
+        // earlier boot. the card holds the file system, so the tuner only reads
+        sdmmc_bus_tuner tuner(card,slot_1,card_config);
+        if(tuner.tune()) {
+            cout << "Bus tuned to "
+                << card.bus_width()
+                << " bit"
+                << (card.ddr()?" DDR":"")
+                << " at "
+                << card.frequency()
+                << "kHz"
+                << (tuner.saved()?" (saved)":"")
+                << endl;
+        } else {
+            cout << "Could not tune the bus, staying in the default mode" << endl;
+        }
+        // let the file system queue its writes so they move on the other core
+        if(!card.start_pipeline()) {
+            cout << "Could not start the card's write pipeline" << endl;
+        }
+        vfs_fast_fat32_sdmmc_hal card_hal(card);
+        // and fetch ahead of sequential readers, also on the other core
+        vfs_fast_fat32_read_ahead_hal read_ahead_hal(card_hal);
+        vfs_fast_fat32 fat(read_ahead_hal);
+        // time every call that goes through the mount
+        static vfs_stats sdcard_stats;
+        if(!fat.initialized() || !vfs::mount("/sdcard",&fat,&sdcard_stats)) {
+            cout << "Could not mount fast FAT32 filesystem" << endl;
+        } else {
+            cout << "Mounted fast FAT32 filesystem" << endl;
+            static uint8_t block_buffer[16384];
+            for(int i = 0;i<sizeof(block_buffer);++i) {
+                block_buffer[i]=(uint8_t)(i&0xFF);
+            }
+            FILE* f = fopen("/sdcard/test.dat","w");
+            if(nullptr!=f) {
+                int64_t start_time = esp_timer_get_time();
+                int i = 0;
+                for(;i<256;++i) {
+                    if(1!=fwrite(block_buffer,sizeof(block_buffer),1,f)) {
+                        break;
+                    }
+                }
+                fclose(f);
+                double secs = (esp_timer_get_time()-start_time)/1000000.0;
+                cout << "Wrote "
+                    << (sizeof(block_buffer)*i)/1024.0/1024.0
+                    << "MB @ "
+                    << (sizeof(block_buffer)*i)/1024.0/1024.0/secs
+                    << "MB/s"
+                    << endl;
+            }
+            vfs::unmount("/sdcard");
+            sdcard_stats.dump(stdout);
+        }
     }
     vfs_null null_fs;
     if(!vfs::mount("/null",&null_fs)) {
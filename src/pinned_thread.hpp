@@ -0,0 +1,48 @@
+#ifndef HTCW_ESP32_PINNED_THREAD_HPP
+#define HTCW_ESP32_PINNED_THREAD_HPP
+#include <thread>
+#include <utility>
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_pthread.h"
+#endif
+namespace esp32 {
+    // starts thread running function. on the ESP32 it is pinned to core, or to the core
+    // other than the caller's if core is -1, so it runs alongside the caller. elsewhere
+    // core and name are ignored. returns false if the thread couldn't be created
+    template<typename Function>
+    bool start_pinned_thread(std::thread& thread,int core,const char* name,Function&& function) {
+#ifdef ESP_PLATFORM
+        esp_pthread_cfg_t old_cfg;
+        bool restore = ESP_OK==esp_pthread_get_cfg(&old_cfg);
+        esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+        if(0>core) {
+            core = (xPortGetCoreID()+1)%portNUM_PROCESSORS;
+        }
+        cfg.pin_to_core = core;
+        cfg.thread_name = name;
+        esp_pthread_set_cfg(&cfg);
+#endif
+        bool result = true;
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+        try {
+            thread = std::thread(std::forward<Function>(function));
+        } catch(...) {
+            result = false;
+        }
+#else
+        thread = std::thread(std::forward<Function>(function));
+#endif
+#ifdef ESP_PLATFORM
+        if(restore) {
+            esp_pthread_set_cfg(&old_cfg);
+        } else {
+            cfg = esp_pthread_get_default_config();
+            esp_pthread_set_cfg(&cfg);
+        }
+#endif
+        return result;
+    }
+}
+#endif
@@ -78,6 +78,24 @@ using namespace esp32;
 #define PIN_NUM_CLK  GPIO_NUM_8
 #define PIN_NUM_CS   GPIO_NUM_19
 #endif //CONFIG_IDF_TARGET_ESP32 || CONFIG_IDF_TARGET_ESP32S2
+
+// the largest single DMA transfer. it covers a whole 4KB page, and matches the buffers
+// sdspi_bus uses for anything it can't send in place
+#define SPI_MAX_TRANSFER 4096
+
+static inline spi_bus_config_t sd_spi_bus_config() {
+    spi_bus_config_t bus_config = {
+        .mosi_io_num = PIN_NUM_MOSI,
+        .miso_io_num = PIN_NUM_MISO,
+        .sclk_io_num = PIN_NUM_CLK,
+        .quadwp_io_num = -1,
+        .quadhd_io_num = -1,
+        .max_transfer_sz = SPI_MAX_TRANSFER,
+        .flags=0,
+        .intr_flags=0
+    };
+    return bus_config;
+}
 #endif //USE_SPI_MODE
 
 static inline sd_reader sd_configure() {
@@ -98,16 +116,7 @@ static inline sd_reader sd_configure() {
     gpio_set_pull_mode(GPIO_NUM_13, GPIO_PULLUP_ONLY);   // D3, needed in 4- and 1-line modes
 #else
     sdmmc_host_t host = SDSPI_HOST_DEFAULT();
-    spi_bus_config_t bus_config = {
-        .mosi_io_num = PIN_NUM_MOSI,
-        .miso_io_num = PIN_NUM_MISO,
-        .sclk_io_num = PIN_NUM_CLK,
-        .quadwp_io_num = -1,
-        .quadhd_io_num = -1,
-        .max_transfer_sz = 4000,
-        .flags=0,
-        .intr_flags=0
-    };
+    spi_bus_config_t bus_config = sd_spi_bus_config();
     spi_host spi((spi_host_device_t)host.slot,bus_config,SPI_DMA_CHAN);
     sdspi_device_config_t slot_config = SDSPI_DEVICE_CONFIG_DEFAULT();
     slot_config.gpio_cs = PIN_NUM_CS;
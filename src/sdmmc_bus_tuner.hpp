@@ -0,0 +1,377 @@
+#ifndef HTCW_ESP32_SDMMC_BUS_TUNER_HPP
+#define HTCW_ESP32_SDMMC_BUS_TUNER_HPP
+extern "C"
+{
+#include <stdio.h>
+#include <string.h>
+#include "esp_timer.h"
+#include "nvs.h"
+}
+#include "sdmmc_host.hpp"
+namespace esp32 {
+    // a bus configuration to ask the card for
+    struct sdmmc_bus_mode {
+        uint8_t width; // data lines: 1, 4 or 8
+        bool ddr;
+        uint32_t frequency_khz; // the highest clock to allow
+    };
+    // how one mode fared
+    struct sdmmc_bus_trial {
+        sdmmc_bus_mode mode;
+        // what the card actually settled on, which can be less than was asked for
+        uint8_t width;
+        bool ddr;
+        int frequency_khz;
+        uint32_t read_bytes_per_second;
+        // 0 unless the tuner was given a scratch area to write
+        uint32_t write_bytes_per_second;
+        // ESP_OK if every transfer succeeded and read back what was expected. a mismatch
+        // is ESP_ERR_INVALID_CRC, like a CRC error reported by the host
+        esp_err_t error;
+    };
+    // finds the fastest bus mode a card runs reliably in. it reinitializes the card in each
+    // combination of width, DDR and clock the slot allows, checks a small test area in
+    // each, and leaves the card in the fastest mode that made no errors. by default it
+    // only reads: the area is read once in the mode the card came up in, and each mode has
+    // to read back the same. nothing on the card changes, but the write path goes
+    // untested. given a scratch() area the caller knows holds nothing, each mode also
+    // writes and reads back a pattern there. the result is kept in NVS under the card's
+    // CID, so later boots try it once and skip the probing. nvs_flash_init() has to have
+    // been called for that, otherwise every boot probes. the card's write pipeline has to
+    // be stopped, and no other task may use the card while tuning
+    class sdmmc_bus_tuner final {
+        constexpr static const size_t max_trials = 24;
+        constexpr static const uint32_t saved_version = 1;
+        struct saved_mode {
+            uint32_t version;
+            uint32_t cid[4];
+            sdmmc_bus_mode mode;
+        };
+        sdmmc_card& m_card;
+        sdmmc_host_t m_config; // what the card was initialized with, to fall back on
+        size_t m_slot_width;
+        size_t m_test_size;
+        size_t m_test_sector;
+        size_t m_scratch_sector;
+        size_t m_scratch_count;
+        // what the test area read in the mode the card came up in, when only reading
+        uint8_t* m_reference;
+        uint8_t* m_work;
+        sdmmc_bus_trial m_trials[max_trials];
+        size_t m_trial_count;
+        sdmmc_bus_mode m_mode;
+        bool m_saved;
+
+        static void key(const sdmmc_card& card,char* result) {
+            // FNV-1a, since NVS keys are limited to 15 characters
+            uint32_t hash = 2166136261u;
+            const uint8_t* p = (const uint8_t*)card.cid();
+            for(size_t i = 0;i<16;++i) {
+                hash = (hash^p[i])*16777619u;
+            }
+            snprintf(result,16,"cid%08x",(unsigned int)hash);
+        }
+        bool load(sdmmc_bus_mode& mode) const {
+            nvs_handle_t handle;
+            if(ESP_OK!=nvs_open("sdmmc_tuner",NVS_READONLY,&handle)) {
+                return false;
+            }
+            char name[16];
+            key(m_card,name);
+            saved_mode saved;
+            size_t size = sizeof(saved);
+            bool result = ESP_OK==nvs_get_blob(handle,name,&saved,&size) &&
+                sizeof(saved)==size &&
+                saved_version==saved.version &&
+                0==memcmp(saved.cid,m_card.cid(),sizeof(saved.cid));
+            nvs_close(handle);
+            if(result) {
+                mode = saved.mode;
+            }
+            return result;
+        }
+        void save(const sdmmc_bus_mode& mode) const {
+            nvs_handle_t handle;
+            if(ESP_OK!=nvs_open("sdmmc_tuner",NVS_READWRITE,&handle)) {
+                return;
+            }
+            char name[16];
+            key(m_card,name);
+            saved_mode saved;
+            memset(&saved,0,sizeof(saved));
+            saved.version = saved_version;
+            memcpy(saved.cid,m_card.cid(),sizeof(saved.cid));
+            saved.mode = mode;
+            if(ESP_OK==nvs_set_blob(handle,name,&saved,sizeof(saved))) {
+                nvs_commit(handle);
+            }
+            nvs_close(handle);
+        }
+        bool apply(const sdmmc_bus_mode& mode) {
+            sdmmc_host_t config = m_config;
+            config.flags&=~(SDMMC_HOST_FLAG_1BIT|SDMMC_HOST_FLAG_4BIT|SDMMC_HOST_FLAG_8BIT|SDMMC_HOST_FLAG_DDR);
+            config.flags|=SDMMC_HOST_FLAG_1BIT;
+            if(mode.width>=4) {
+                config.flags|=SDMMC_HOST_FLAG_4BIT;
+            }
+            if(mode.width>=8) {
+                config.flags|=SDMMC_HOST_FLAG_8BIT;
+            }
+            if(mode.ddr) {
+                config.flags|=SDMMC_HOST_FLAG_DDR;
+            }
+            config.max_freq_khz = mode.frequency_khz;
+            return m_card.reinitialize(config);
+        }
+        inline bool writing() const {
+            return 0!=m_scratch_count;
+        }
+        // the byte the test area should hold at index after a round. rounds differ, so a
+        // write that never happened doesn't pass
+        uint8_t expected(size_t index,size_t round) const {
+            if(!writing()) {
+                return m_reference[index];
+            }
+            return (uint8_t)((0x5A+index*7+round*0x3D)^(index>>9));
+        }
+        // writes and reads back the test area twice in the card's current mode, or just
+        // reads it when there's no scratch area
+        void run_trial(sdmmc_bus_trial& trial) {
+            size_t sectors = m_test_size/m_card.sector_size();
+            int64_t write_us = 0;
+            int64_t read_us = 0;
+            trial.error = ESP_OK;
+            for(size_t round = 0;round<2;++round) {
+                if(writing()) {
+                    for(size_t i = 0;i<m_test_size;++i) {
+                        m_work[i]=expected(i,round);
+                    }
+                    int64_t start = esp_timer_get_time();
+                    if(!m_card.write(m_work,m_test_sector,sectors)) {
+                        trial.error = m_card.last_error();
+                        return;
+                    }
+                    write_us+=esp_timer_get_time()-start;
+                }
+                memset(m_work,0,m_test_size);
+                int64_t start = esp_timer_get_time();
+                if(!m_card.read(m_work,m_test_sector,sectors)) {
+                    trial.error = m_card.last_error();
+                    return;
+                }
+                read_us+=esp_timer_get_time()-start;
+                for(size_t i = 0;i<m_test_size;++i) {
+                    if(m_work[i]!=expected(i,round)) {
+                        trial.error = ESP_ERR_INVALID_CRC;
+                        return;
+                    }
+                }
+            }
+            if(writing()) {
+                trial.write_bytes_per_second = (uint32_t)(2*m_test_size*1000000ull/(0==write_us?1:write_us));
+            }
+            trial.read_bytes_per_second = (uint32_t)(2*m_test_size*1000000ull/(0==read_us?1:read_us));
+        }
+        // time to read and write the same amount, so neither direction dominates. reads
+        // alone when nothing was written
+        uint64_t score(const sdmmc_bus_trial& trial) const {
+            uint64_t result = 1000000000000ull/trial.read_bytes_per_second;
+            if(writing()) {
+                result+=1000000000000ull/trial.write_bytes_per_second;
+            }
+            return result;
+        }
+        bool probe(const uint32_t* frequencies,size_t frequency_count) {
+            static const uint8_t widths[] = {8,4,1};
+            for(size_t w = 0;w<sizeof(widths);++w) {
+                if(widths[w]>m_slot_width) {
+                    continue;
+                }
+                // the ESP32's host can't do DDR on an 8 bit bus
+                for(int ddr = 0;ddr<(8==widths[w]?1:2);++ddr) {
+                    for(size_t f = 0;f<frequency_count && m_trial_count<max_trials;++f) {
+                        sdmmc_bus_trial& trial = m_trials[m_trial_count];
+                        memset(&trial,0,sizeof(trial));
+                        trial.mode.width = widths[w];
+                        trial.mode.ddr = 0!=ddr;
+                        trial.mode.frequency_khz = frequencies[f];
+                        if(!apply(trial.mode)) {
+                            trial.error = m_card.last_error();
+                            ++m_trial_count;
+                            continue;
+                        }
+                        trial.width = (uint8_t)m_card.bus_width();
+                        trial.ddr = m_card.ddr();
+                        trial.frequency_khz = m_card.frequency();
+                        // the card may have settled on a mode that's already been tried
+                        bool tried = false;
+                        for(size_t i = 0;i<m_trial_count;++i) {
+                            const sdmmc_bus_trial& t = m_trials[i];
+                            if(t.width==trial.width && t.ddr==trial.ddr && t.frequency_khz==trial.frequency_khz) {
+                                tried = true;
+                                break;
+                            }
+                        }
+                        if(tried) {
+                            continue;
+                        }
+                        run_trial(trial);
+                        ++m_trial_count;
+                    }
+                }
+            }
+            const sdmmc_bus_trial* best = nullptr;
+            for(size_t i = 0;i<m_trial_count;++i) {
+                const sdmmc_bus_trial& t = m_trials[i];
+                if(ESP_OK==t.error && 0!=t.read_bytes_per_second && (!writing() || 0!=t.write_bytes_per_second) &&
+                        (nullptr==best || score(t)<score(*best))) {
+                    best = &t;
+                }
+            }
+            if(nullptr==best) {
+                return false;
+            }
+            m_mode = best->mode;
+            return apply(m_mode);
+        }
+        void release() {
+            heap_caps_free(m_reference);
+            heap_caps_free(m_work);
+            m_reference = nullptr;
+            m_work = nullptr;
+        }
+    public:
+        // config is what card was initialized with on slot. test_size bytes are set aside
+        // twice in DMA capable memory while tuning
+        sdmmc_bus_tuner(sdmmc_card& card,const sdmmc_host_slot& slot,const sdmmc_host_t& config,size_t test_size = 16384) :
+                m_card(card),
+                m_config(config),
+                m_slot_width(slot.bus_width()),
+                m_test_size(test_size),
+                m_test_sector(0),
+                m_scratch_sector(0),
+                m_scratch_count(0),
+                m_reference(nullptr),
+                m_work(nullptr),
+                m_trial_count(0),
+                m_saved(false) {
+            memset(&m_mode,0,sizeof(m_mode));
+        }
+        sdmmc_bus_tuner(const sdmmc_bus_tuner& rhs)=delete;
+        sdmmc_bus_tuner& operator=(const sdmmc_bus_tuner& rhs)=delete;
+        ~sdmmc_bus_tuner() {
+            release();
+        }
+        // lets tune() write its test pattern to sector_count sectors at sector, which the
+        // caller guarantees hold nothing to keep: space past the last partition, or a range
+        // the file system has free and won't touch while tuning. whatever is there is lost,
+        // and isn't put back. a sector_count of 0 goes back to only reading
+        inline void scratch(size_t sector,size_t sector_count) {
+            m_scratch_sector = sector;
+            m_scratch_count = sector_count;
+        }
+        // leaves the card in the fastest reliable mode. frequencies are the clocks to try, in
+        // khz, and default to 20MHz, 26MHz, 40MHz and 52MHz. with use_saved, a mode saved for
+        // this card on an earlier boot is checked once and used without probing. returns
+        // false if no mode worked, in which case the card is put back how it was
+        bool tune(bool use_saved = true,const uint32_t* frequencies = nullptr,size_t frequency_count = 0) {
+            static const uint32_t default_frequencies[] = {SDMMC_FREQ_DEFAULT,SDMMC_FREQ_26M,SDMMC_FREQ_HIGHSPEED,SDMMC_FREQ_52M};
+            if(nullptr==frequencies || 0==frequency_count) {
+                frequencies = default_frequencies;
+                frequency_count = sizeof(default_frequencies)/sizeof(default_frequencies[0]);
+            }
+            m_trial_count = 0;
+            m_saved = false;
+            if(!m_card.initialized() || m_card.pipelined() || 0==m_card.sector_size()) {
+                sdmmc_host::last_error(ESP_ERR_INVALID_STATE);
+                return false;
+            }
+            m_test_size = (m_test_size+m_card.sector_size()-1)/m_card.sector_size()*m_card.sector_size();
+            if(0==m_test_size) {
+                m_test_size = m_card.sector_size();
+            }
+            if(writing()) {
+                if(m_scratch_sector>=m_card.sector_count() || m_scratch_count>m_card.sector_count()-m_scratch_sector) {
+                    sdmmc_host::last_error(ESP_ERR_INVALID_ARG);
+                    return false;
+                }
+                if(m_test_size>m_scratch_count*m_card.sector_size()) {
+                    m_test_size = m_scratch_count*m_card.sector_size();
+                }
+                m_test_sector = m_scratch_sector;
+            } else {
+                // past the file system's metadata at the start of the card, where there's
+                // more likely to be data than zeros to compare
+                m_test_sector = (m_card.sector_count()/2)&~((size_t)127);
+                if(m_test_sector+m_test_size/m_card.sector_size()>m_card.sector_count()) {
+                    m_test_sector = 0;
+                }
+            }
+            release();
+            m_work = (uint8_t*)heap_caps_malloc(m_test_size,MALLOC_CAP_DMA);
+            if(!writing()) {
+                m_reference = (uint8_t*)heap_caps_malloc(m_test_size,MALLOC_CAP_DMA);
+            }
+            if(nullptr==m_work || (!writing() && nullptr==m_reference)) {
+                release();
+                sdmmc_host::last_error(ESP_ERR_NO_MEM);
+                return false;
+            }
+            // the mode the card came up in is the one trusted to read the reference
+            if(!writing() && !m_card.read(m_reference,m_test_sector,m_test_size/m_card.sector_size())) {
+                release();
+                return false;
+            }
+            bool result = false;
+            if(use_saved && load(m_mode) && apply(m_mode)) {
+                sdmmc_bus_trial& trial = m_trials[m_trial_count++];
+                memset(&trial,0,sizeof(trial));
+                trial.mode = m_mode;
+                trial.width = (uint8_t)m_card.bus_width();
+                trial.ddr = m_card.ddr();
+                trial.frequency_khz = m_card.frequency();
+                run_trial(trial);
+                m_saved = result = ESP_OK==trial.error;
+            }
+            if(!result) {
+                result = probe(frequencies,frequency_count);
+            }
+            if(!result) {
+                sdmmc_host_t config = m_config;
+                m_card.reinitialize(config);
+            } else if(!m_saved) {
+                save(m_mode);
+            }
+            release();
+            return result;
+        }
+        // the mode the card was left in by tune()
+        inline const sdmmc_bus_mode& mode() const {
+            return m_mode;
+        }
+        // true if tune() used the mode saved on an earlier boot
+        inline bool saved() const {
+            return m_saved;
+        }
+        // the modes tune() tried, in the order it tried them
+        inline size_t trial_count() const {
+            return m_trial_count;
+        }
+        inline const sdmmc_bus_trial& trial(size_t index) const {
+            return m_trials[index];
+        }
+        // drops the mode saved for card, so the next tune() probes again
+        static bool forget(const sdmmc_card& card) {
+            nvs_handle_t handle;
+            if(ESP_OK!=nvs_open("sdmmc_tuner",NVS_READWRITE,&handle)) {
+                return false;
+            }
+            char name[16];
+            key(card,name);
+            bool result = ESP_OK==nvs_erase_key(handle,name) && ESP_OK==nvs_commit(handle);
+            nvs_close(handle);
+            return result;
+        }
+    };
+}
+#endif
@@ -6,20 +6,61 @@ extern "C"
 #include <sys/unistd.h>
 #include <sys/stat.h>
 #include "esp_err.h"
+#include "esp_idf_version.h"
 #include "esp_log.h"
 #include "sdmmc_cmd.h"
 #include "sdkconfig.h"
 #include "driver/sdmmc_host.h"
+#include "esp_heap_caps.h"
+#include "soc/soc_memory_layout.h"
 }
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include "write_pipeline.hpp"
+// the SD status and the erase commands came with ESP-IDF 4.4. before that, cards report
+// no erase block and can't be erased, so nothing is trimmed
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+#define HTCW_ESP32_SDMMC_ERASE
+#endif
 namespace esp32 {
     class sdmmc_host_slot;
     class sdmmc_card;
+    class sdmmc_bus_tuner;
+    // a read or write waiting its turn on a slot. it lives on the stack of the task that
+    // submitted it until whichever task is driving the bus marks it done. a write without
+    // a buffer is an erase
+    struct sdmmc_request {
+        sdmmc_card* card;
+        uint8_t* buffer;
+        size_t start_sector;
+        size_t sector_count;
+        sdmmc_request* next;
+        bool out;
+        bool done;
+        bool result;
+    };
+    // the requests waiting on one slot, in the order they arrived. one task at a time
+    // drives the bus and runs the requests from the front, its own and everyone else's,
+    // so tasks on either core are served first come, first served
+    struct sdmmc_request_queue {
+        std::mutex lock;
+        std::condition_variable done;
+        sdmmc_request* head;
+        sdmmc_request* tail;
+        bool busy;
+    };
     class sdmmc_host final {
         friend class sdmmc_host_slot;
         friend class sdmmc_card;
+        friend class sdmmc_bus_tuner;
+        constexpr static const size_t slot_count = 2;
+        // held across init and deinit so the reference count and the host's state agree
+        static std::mutex m_lock;
         static std::atomic_int m_count;
         static std::atomic<esp_err_t> m_last_error;
+        // one per slot, so the slots never wait on each other's queues
+        static sdmmc_request_queue m_queues[slot_count];
         sdmmc_host()=delete;
         sdmmc_host(const sdmmc_host& rhs)=delete;
         sdmmc_host& operator=(sdmmc_host& rhs)=delete;
@@ -29,33 +70,38 @@ namespace esp32 {
         static void last_error(esp_err_t error) {
             m_last_error = error;
         }
+        static sdmmc_request_queue* queue(int slot) {
+            return 0>slot || slot_count<=(size_t)slot?nullptr:&m_queues[slot];
+        }
     public:
-        // TODO: not thread safe yet
+        // takes a reference to the host, initializing it on the first one. safe to call
+        // from any task
         static bool acquire() {
+            std::lock_guard<std::mutex> lock(m_lock);
             if(0==m_count) {
-                ++m_count;
                 esp_err_t res = sdmmc_host_init();
                 if(ESP_OK!=res) {
-                    --m_count;
                     m_last_error=res;
                     return false;
-                } 
-                return true;
+                }
             }
             ++m_count;
             return true;
         }
-        // TODO: not thread safe yet
+        // gives back a reference, shutting the host down with the last one. safe to call
+        // from any task
         static bool release() {
-            if(2>m_count) {
-                --m_count;
+            std::lock_guard<std::mutex> lock(m_lock);
+            if(0==m_count) {
+                m_last_error=ESP_ERR_INVALID_STATE;
+                return false;
+            }
+            if(1==m_count) {
                 esp_err_t res = sdmmc_host_deinit();
                 if(ESP_OK!=res) {
-                    ++m_count;
                     m_last_error=res;
                     return false;
-                } 
-                return true;
+                }
             }
             --m_count;
             return true;
@@ -64,15 +110,19 @@ namespace esp32 {
         inline static esp_err_t last_error() { return m_last_error; }
         
     };
+    std::mutex sdmmc_host::m_lock;
     std::atomic_int sdmmc_host::m_count {0};
     std::atomic<esp_err_t> sdmmc_host::m_last_error {ESP_OK};
+    sdmmc_request_queue sdmmc_host::m_queues[sdmmc_host::slot_count] {};
 
     class sdmmc_host_slot final {
         int m_id;
+        bool m_acquired;
     public:
-        sdmmc_host_slot(int slot,sdmmc_slot_config_t& configuration) : m_id(-1) {
+        sdmmc_host_slot(int slot,sdmmc_slot_config_t& configuration) : m_id(-1),m_acquired(false) {
             if(!sdmmc_host::acquire())
                 return;
+            m_acquired = true;
             esp_err_t res = sdmmc_host_init_slot(slot,&configuration);
             if(ESP_OK!=res) {
                 sdmmc_host::last_error(res);
@@ -82,16 +132,21 @@ namespace esp32 {
         }
         sdmmc_host_slot(const sdmmc_host_slot& rhs)=delete;
         sdmmc_host_slot& operator=(const sdmmc_host_slot& rhs)=delete;
-        sdmmc_host_slot(sdmmc_host_slot&& rhs) : m_id(rhs.m_id) {
+        // the host reference moves along with the slot
+        sdmmc_host_slot(sdmmc_host_slot&& rhs) : m_id(rhs.m_id),m_acquired(rhs.m_acquired) {
             rhs.m_id=-1;
-            // the other one will inevitably go away so we need our own reference
-            sdmmc_host::acquire(); 
+            rhs.m_acquired=false;
         }
         sdmmc_host_slot& operator=(sdmmc_host_slot&& rhs) {
-            m_id = rhs.m_id;
-            rhs.m_id=-1;
-            // the other one will inevitably go away so we need our own reference
-            sdmmc_host::acquire(); 
+            if(this!=&rhs) {
+                if(m_acquired) {
+                    sdmmc_host::release();
+                }
+                m_id = rhs.m_id;
+                m_acquired = rhs.m_acquired;
+                rhs.m_id=-1;
+                rhs.m_acquired=false;
+            }
             return *this;
         }
         size_t bus_width() const {
@@ -109,7 +164,9 @@ namespace esp32 {
             return true;
         }
         ~sdmmc_host_slot() {
-            sdmmc_host::release();
+            if(m_acquired) {
+                sdmmc_host::release();
+            }
             m_id=-1;
         }
         inline esp_err_t last_error() const {
@@ -119,27 +176,248 @@ namespace esp32 {
         inline int id() const { return m_id; }
     };
     class sdmmc_card {
+        // the pipeline's I/O task writes through the slot's queue like everyone else
+        struct writer {
+            sdmmc_card* card;
+            bool write(const void* source,size_t start_sector,size_t sector_count) {
+                return card->submit((uint8_t*)source,start_sector,sector_count,true);
+            }
+            size_t sector_size() const {
+                return card->sector_size();
+            }
+        };
         sdmmc_card_t m_card;
+        writer m_writer;
+        write_pipeline<writer>* m_pipeline;
+        // DMA capable staging for buffers the host can't transfer to directly
+        uint8_t* m_bounce;
+        constexpr static const size_t bounce_size = 4096;
+        // the host DMA copies sector_count sectors straight to or from the buffer when it
+        // can. otherwise they're staged through m_bounce several sectors per transaction,
+        // rather than the one sector per transaction sdmmc_read/write_sectors falls back to
+        template<typename Transfer>
+        bool transfer(uint8_t* buffer,size_t start_sector,size_t sector_count,bool out,Transfer fn) {
+            if(dma_capable(buffer) || !bounce()) {
+                return fn(buffer,start_sector,sector_count);
+            }
+            size_t bounce_sectors = bounce_size/sector_size();
+            while(0!=sector_count) {
+                size_t count = sector_count<bounce_sectors?sector_count:bounce_sectors;
+                size_t size = count*sector_size();
+                if(out) {
+                    memcpy(m_bounce,buffer,size);
+                }
+                if(!fn(m_bounce,start_sector,count)) {
+                    return false;
+                }
+                if(!out) {
+                    memcpy(buffer,m_bounce,size);
+                }
+                buffer+=size;
+                start_sector+=count;
+                sector_count-=count;
+            }
+            return true;
+        }
+        bool bounce() {
+            if(nullptr==m_bounce && bounce_size>=sector_size()) {
+                m_bounce = (uint8_t*)heap_caps_malloc(bounce_size,MALLOC_CAP_DMA);
+            }
+            return nullptr!=m_bounce;
+        }
+        bool bus_transfer(uint8_t* data,size_t start_sector,size_t sector_count,bool out) {
+            esp_err_t res = out?sdmmc_write_sectors(&m_card,data,start_sector,sector_count):
+                sdmmc_read_sectors(&m_card,data,start_sector,sector_count);
+            if(ESP_OK!=res) {
+                sdmmc_host::last_error(res);
+                return false;
+            }
+            return true;
+        }
+        // a discard if the card has it, which lets it erase in the background, or else an
+        // erase
+        bool bus_erase(size_t start_sector,size_t sector_count) {
+#ifdef HTCW_ESP32_SDMMC_ERASE
+            sdmmc_erase_arg_t arg = ESP_OK==sdmmc_can_discard(&m_card)?SDMMC_DISCARD_ARG:SDMMC_ERASE_ARG;
+            esp_err_t res = sdmmc_erase_sectors(&m_card,start_sector,sector_count,arg);
+#else
+            esp_err_t res = ESP_ERR_NOT_SUPPORTED;
+#endif
+            if(ESP_OK!=res) {
+                sdmmc_host::last_error(res);
+                return false;
+            }
+            return true;
+        }
+        // runs first through last, which cover adjacent sectors in order, as one transaction
+        // through the bounce buffer, so several small requests cost a single command
+        bool transfer_batch(sdmmc_request* first,sdmmc_request* last,size_t sector_count) {
+            size_t size = sector_size();
+            uint8_t* p = m_bounce;
+            if(first->out) {
+                for(sdmmc_request* r = first;;r=r->next) {
+                    memcpy(p,r->buffer,r->sector_count*size);
+                    p+=r->sector_count*size;
+                    if(r==last) break;
+                }
+            }
+            if(!bus_transfer(m_bounce,first->start_sector,sector_count,first->out)) {
+                return false;
+            }
+            if(!first->out) {
+                for(sdmmc_request* r = first;;r=r->next) {
+                    memcpy(r->buffer,p,r->sector_count*size);
+                    p+=r->sector_count*size;
+                    if(r==last) break;
+                }
+            }
+            return true;
+        }
+        // queues a transfer on the card's slot and returns once it's done. whichever task
+        // finds the bus idle runs the queue from the front until its own request is done,
+        // joining runs of small requests to adjacent sectors in the same direction
+        bool submit(uint8_t* buffer,size_t start_sector,size_t sector_count,bool out) {
+            sdmmc_request_queue* queue = sdmmc_host::queue(m_card.host.slot);
+            if(nullptr==queue) {
+                sdmmc_host::last_error(ESP_ERR_INVALID_STATE);
+                return false;
+            }
+            sdmmc_request request;
+            request.card = this;
+            request.buffer = buffer;
+            request.start_sector = start_sector;
+            request.sector_count = sector_count;
+            request.next = nullptr;
+            request.out = out;
+            request.done = false;
+            request.result = false;
+            std::unique_lock<std::mutex> lock(queue->lock);
+            if(nullptr==queue->tail) {
+                queue->head = &request;
+            } else {
+                queue->tail->next = &request;
+            }
+            queue->tail = &request;
+            while(!request.done && queue->busy) {
+                queue->done.wait(lock);
+            }
+            if(request.done) {
+                return request.result;
+            }
+            queue->busy = true;
+            while(!request.done) {
+                sdmmc_request* first = queue->head;
+                sdmmc_request* last = first;
+                sdmmc_card* card = first->card;
+                size_t count = first->sector_count;
+                size_t batch_sectors = bounce_size/card->sector_size();
+                while(nullptr!=first->buffer && nullptr!=last->next && nullptr!=last->next->buffer &&
+                        last->next->card==card && last->next->out==first->out &&
+                        last->next->start_sector==last->start_sector+last->sector_count &&
+                        count+last->next->sector_count<=batch_sectors) {
+                    last = last->next;
+                    count+=last->sector_count;
+                }
+                queue->head = last->next;
+                if(nullptr==queue->head) {
+                    queue->tail = nullptr;
+                }
+                lock.unlock();
+                if(first!=last && card->bounce()) {
+                    bool result = card->transfer_batch(first,last,count);
+                    for(sdmmc_request* r = first;;r=r->next) {
+                        r->result = result;
+                        if(r==last) break;
+                    }
+                } else {
+                    for(sdmmc_request* r = first;;r=r->next) {
+                        bool out = r->out;
+                        if(nullptr==r->buffer) {
+                            r->result = card->bus_erase(r->start_sector,r->sector_count);
+                        } else {
+                            r->result = card->transfer(r->buffer,r->start_sector,r->sector_count,out,[card,out](uint8_t* data,size_t start,size_t count){
+                                return card->bus_transfer(data,start,count,out);
+                            });
+                        }
+                        if(r==last) break;
+                    }
+                }
+                lock.lock();
+                // the requests are only touched under the lock from here, since their
+                // tasks return as soon as they see them done
+                for(sdmmc_request* r = first;;) {
+                    sdmmc_request* next = r->next;
+                    r->done = true;
+                    if(r==last) break;
+                    r = next;
+                }
+                queue->done.notify_all();
+            }
+            // hand the bus to the next task in line
+            queue->busy = false;
+            queue->done.notify_all();
+            return request.result;
+        }
 public:
-        sdmmc_card(const sdmmc_host_slot& slot,sdmmc_host_t& config) {
+        // true if the host can DMA straight to or from buffer
+        inline static bool dma_capable(const void* buffer) {
+            return esp_ptr_dma_capable(buffer) && 0==((uintptr_t)buffer&3);
+        }
+        sdmmc_card(const sdmmc_host_slot& slot,sdmmc_host_t& config) : m_pipeline(nullptr),m_bounce(nullptr) {
+            m_writer.card = this;
             memset(&m_card,0,sizeof(m_card));
             config.slot=slot.id();
             esp_err_t res = sdmmc_card_init(&config,&m_card);
             if(ESP_OK!=res) {
+                // keep the slot so reinitialize() can try again
+                memset(&m_card,0,sizeof(m_card));
+                m_card.host.slot = slot.id();
                 sdmmc_host::last_error(res);
             }
         }
         sdmmc_card(const sdmmc_card& rhs)=delete;
         sdmmc_card& operator=(const sdmmc_card& rhs)=delete;
-        sdmmc_card(sdmmc_card&& rhs) : m_card(rhs.m_card) {
+        // runs the card's initialization again with another host configuration, to change
+        // the bus width, DDR or clock. the write pipeline has to be stopped, and no other
+        // task may be using the card. on failure the card is left uninitialized
+        bool reinitialize(sdmmc_host_t& config) {
+            if(nullptr!=m_pipeline) {
+                sdmmc_host::last_error(ESP_ERR_INVALID_STATE);
+                return false;
+            }
+            int slot = m_card.host.slot;
+            config.slot = slot;
+            memset(&m_card,0,sizeof(m_card));
+            esp_err_t res = sdmmc_card_init(&config,&m_card);
+            if(ESP_OK!=res) {
+                memset(&m_card,0,sizeof(m_card));
+                m_card.host.slot = slot;
+                sdmmc_host::last_error(res);
+                return false;
+            }
+            return true;
+        }
+        // the write pipeline is tied to the card it was started on, so moving stops it
+        sdmmc_card(sdmmc_card&& rhs) : m_pipeline(nullptr),m_bounce(rhs.m_bounce) {
+            rhs.stop_pipeline();
+            m_card = rhs.m_card;
+            m_writer.card = this;
             memset(&rhs.m_card,0,sizeof(rhs.m_card));
+            rhs.m_bounce = nullptr;
         }
         sdmmc_card& operator=(sdmmc_card&& rhs) {
+            stop_pipeline();
+            rhs.stop_pipeline();
             m_card = rhs.m_card;
             memset(&rhs.m_card,0,sizeof(rhs.m_card));
+            heap_caps_free(m_bounce);
+            m_bounce = rhs.m_bounce;
+            rhs.m_bounce = nullptr;
             return *this;
         }
         ~sdmmc_card() {
+            stop_pipeline();
+            heap_caps_free(m_bounce);
         }
         inline bool initialized() const {
             return 0!=m_card.max_freq_khz;
@@ -154,6 +432,18 @@ public:
         inline bool ddr() const {
             return 0!=m_card.is_ddr;
         }
+        // the data lines in use: 1, 4 or 8
+        inline size_t bus_width() const {
+            return ((size_t)1)<<m_card.log_bus_width;
+        }
+        // the clock the bus actually runs at, in khz
+        inline int frequency() const {
+            return m_card.real_freq_khz;
+        }
+        // the raw 128 bit card identification register, which is unique to the card
+        inline const uint32_t* cid() const {
+            return m_card.raw_cid;
+        }
         inline bool memory() const {
             return 0!=m_card.is_mem;
         }
@@ -163,22 +453,117 @@ public:
         inline bool sdio() const {
             return 0!=m_card.is_sdio;
         }
+        inline size_t sector_count() const {
+            return m_card.csd.capacity;
+        }
+        inline size_t sector_size() const {
+            return m_card.csd.sector_size;
+        }
+        // the allocation unit from the SD status, which is the card's erase block, in
+        // sectors. 0 when the card didn't report one
+        inline size_t erase_block_sectors() const {
+#ifdef HTCW_ESP32_SDMMC_ERASE
+            if(0==m_card.csd.sector_size) {
+                return 0;
+            }
+            return (size_t)m_card.ssr.alloc_unit_kb*1024/m_card.csd.sector_size;
+#else
+            return 0;
+#endif
+        }
+        // reads and writes wait for any queued writes first, so they always see them.
+        // buffers that pass dma_capable() are transferred without being copied. they can
+        // be called from any task, and take turns on the slot in the order they're called
         bool read(void* destination,size_t start_sector,size_t sector_count) {
-            esp_err_t res = sdmmc_read_sectors(&m_card,destination,start_sector,sector_count);
-            if(ESP_OK!=res) {
-                sdmmc_host::last_error(res);
-                return false;
+            if(nullptr!=m_pipeline) {
+                m_pipeline->drain();
             }
-            return true;
+            return submit((uint8_t*)destination,start_sector,sector_count,false);
         }
         bool write(const void* source,size_t start_sector,size_t sector_count) {
-            esp_err_t res = sdmmc_write_sectors(&m_card,source,start_sector,sector_count);
-            if(ESP_OK!=res) {
-                sdmmc_host::last_error(res);
+            if(nullptr!=m_pipeline) {
+                m_pipeline->drain();
+            }
+            return submit((uint8_t*)source,start_sector,sector_count,true);
+        }
+        // whether erase() can do anything with this ESP-IDF
+        constexpr static bool can_erase() {
+#ifdef HTCW_ESP32_SDMMC_ERASE
+            return true;
+#else
+            return false;
+#endif
+        }
+        // tells the card the sectors don't hold anything anymore, so it needn't keep them
+        // when it reuses their erase blocks. waits for queued writes first, and takes its
+        // turn on the slot like a write. fails with ESP_ERR_NOT_SUPPORTED without can_erase()
+        bool erase(size_t start_sector,size_t sector_count) {
+            if(!can_erase()) {
+                sdmmc_host::last_error(ESP_ERR_NOT_SUPPORTED);
+                return false;
+            }
+            if(nullptr!=m_pipeline) {
+                m_pipeline->drain();
+            }
+            return submit(nullptr,start_sector,sector_count,true);
+        }
+        // starts an I/O task that takes writes from submit_write() through a ring of
+        // buffer_count DMA capable buffers, pinned to core, or the core other than the
+        // caller's if it's -1
+        bool start_pipeline(size_t buffer_count = 2,size_t buffer_size = 16384,int core = -1) {
+            if(!initialized()) {
+                sdmmc_host::last_error(ESP_ERR_INVALID_STATE);
+                return false;
+            }
+            stop_pipeline();
+            m_pipeline = new(std::nothrow) write_pipeline<writer>(m_writer,buffer_count,buffer_size,core);
+            if(nullptr==m_pipeline || !m_pipeline->initialized()) {
+                delete m_pipeline;
+                m_pipeline = nullptr;
+                sdmmc_host::last_error(ESP_ERR_NO_MEM);
                 return false;
             }
             return true;
         }
+        // finishes the queued writes and stops the I/O task
+        void stop_pipeline() {
+            if(nullptr!=m_pipeline) {
+                delete m_pipeline;
+                m_pipeline = nullptr;
+            }
+        }
+        inline bool pipelined() const {
+            return nullptr!=m_pipeline;
+        }
+        // the size of each of the pipeline's buffers, or 0 if it isn't running
+        inline size_t pipeline_buffer_size() const {
+            return nullptr==m_pipeline?0:m_pipeline->buffer_size();
+        }
+        // queues a write and returns a token for it, or 0 on error. source can be reused
+        // right away. requires start_pipeline()
+        uint32_t submit_write(const void* source,size_t start_sector,size_t sector_count) {
+            if(nullptr==m_pipeline) {
+                sdmmc_host::last_error(ESP_ERR_INVALID_STATE);
+                return 0;
+            }
+            uint32_t token = m_pipeline->submit(source,start_sector,sector_count);
+            if(0==token) {
+                sdmmc_host::last_error(ESP_ERR_INVALID_ARG);
+            }
+            return token;
+        }
+        // true once the write with this token is on the card
+        bool completed(uint32_t token) {
+            return nullptr==m_pipeline || m_pipeline->completed(token);
+        }
+        // waits for the write with this token. false if it or one before it failed
+        bool wait(uint32_t token) {
+            return nullptr==m_pipeline || m_pipeline->wait(token);
+        }
+        // waits for every queued write. false if any failed since the last flush()
+        bool flush() {
+            return nullptr==m_pipeline || m_pipeline->flush();
+        }
     };
 }
 #endif
\ No newline at end of file
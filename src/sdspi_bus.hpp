@@ -0,0 +1,232 @@
+#ifndef HTCW_ESP32_SDSPI_BUS_HPP
+#define HTCW_ESP32_SDSPI_BUS_HPP
+extern "C"
+{
+#include <string.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "driver/gpio.h"
+#include "driver/spi_master.h"
+#include "esp_heap_caps.h"
+#include "soc/soc_memory_layout.h"
+#include "sdkconfig.h"
+}
+#include "spi_host.hpp"
+namespace esp32 {
+    // the wire for sdspi_card: one device on an spi_host with CS driven by hand, so it
+    // can stay low across a whole multi-block stream. the bus is held while the card is
+    // selected. transfers of a few bytes (commands, tokens, busy polls) are polled, since
+    // that costs less than an interrupt. data blocks are queued as DMA transactions and
+    // the caller sleeps until they finish. buffers that pass dma_capable() go straight to
+    // the DMA engine; anything else goes through a bounce buffer. the host should be set
+    // up with a max_transfer_sz of at least buffer_size
+    class sdspi_bus final {
+        spi_host_device_t m_host_id;
+        gpio_num_t m_cs;
+        spi_device_handle_t m_device;
+        uint32_t m_frequency;
+        bool m_selected;
+        size_t m_buffer_size;
+        // clocked out for reads, since a null tx_buffer doesn't keep MOSI high
+        uint8_t* m_ones;
+        uint8_t* m_bounce;
+        esp_err_t m_last_error;
+        constexpr static const size_t small_size = 32;
+        inline static bool dma_capable(const void* buffer) {
+            return esp_ptr_dma_capable(buffer) && 0==((uintptr_t)buffer&3);
+        }
+        bool check(esp_err_t ret) {
+            if(ESP_OK!=ret) {
+                m_last_error = ret;
+                return false;
+            }
+            return true;
+        }
+        bool remove() {
+            if(nullptr!=m_device) {
+                if(m_selected) {
+                    spi_device_release_bus(m_device);
+                }
+                if(!check(spi_bus_remove_device(m_device))) {
+                    return false;
+                }
+                m_device = nullptr;
+            }
+            return true;
+        }
+        // up to four bytes go in the transaction itself, with no DMA
+        bool transfer_inline(const uint8_t* tx,uint8_t* rx,size_t size) {
+            spi_transaction_t t;
+            memset(&t,0,sizeof(t));
+            t.flags = SPI_TRANS_USE_TXDATA|SPI_TRANS_USE_RXDATA;
+            t.length = size*8;
+            if(nullptr!=tx) {
+                memcpy(t.tx_data,tx,size);
+            } else {
+                memset(t.tx_data,0xFF,sizeof(t.tx_data));
+            }
+            if(!check(spi_device_polling_transmit(m_device,&t))) {
+                return false;
+            }
+            if(nullptr!=rx) {
+                memcpy(rx,t.rx_data,size);
+            }
+            return true;
+        }
+        bool transfer_dma(const uint8_t* tx,uint8_t* rx,size_t size) {
+            spi_transaction_t t;
+            memset(&t,0,sizeof(t));
+            t.length = size*8;
+            t.tx_buffer = nullptr!=tx?tx:m_ones;
+            t.rx_buffer = rx;
+            if(size<=small_size) {
+                return check(spi_device_polling_transmit(m_device,&t));
+            }
+            spi_transaction_t* result;
+            return check(spi_device_queue_trans(m_device,&t,portMAX_DELAY)) &&
+                check(spi_device_get_trans_result(m_device,&result,portMAX_DELAY));
+        }
+    public:
+        sdspi_bus(const spi_host& host,gpio_num_t cs,size_t buffer_size = 4096) :
+                m_host_id(host.host_id()),
+                m_cs(cs),
+                m_device(nullptr),
+                m_frequency(0),
+                m_selected(false),
+                m_buffer_size(buffer_size),
+                m_ones(nullptr),
+                m_bounce(nullptr),
+                m_last_error(ESP_OK) {
+            if(!host.initialized()) {
+                m_last_error = ESP_ERR_INVALID_STATE;
+                return;
+            }
+            m_ones = (uint8_t*)heap_caps_malloc(buffer_size,MALLOC_CAP_DMA);
+            m_bounce = (uint8_t*)heap_caps_malloc(buffer_size,MALLOC_CAP_DMA);
+            if(nullptr==m_ones || nullptr==m_bounce) {
+                heap_caps_free(m_ones);
+                heap_caps_free(m_bounce);
+                m_ones = m_bounce = nullptr;
+                m_last_error = ESP_ERR_NO_MEM;
+                return;
+            }
+            memset(m_ones,0xFF,buffer_size);
+            gpio_config_t io;
+            memset(&io,0,sizeof(io));
+            io.pin_bit_mask = 1ULL<<cs;
+            io.mode = GPIO_MODE_OUTPUT;
+            if(!check(gpio_config(&io)) || !check(gpio_set_level(cs,1))) {
+                heap_caps_free(m_ones);
+                heap_caps_free(m_bounce);
+                m_ones = m_bounce = nullptr;
+            }
+        }
+        sdspi_bus(const sdspi_bus& rhs)=delete;
+        sdspi_bus& operator=(const sdspi_bus& rhs)=delete;
+        ~sdspi_bus() {
+            remove();
+            heap_caps_free(m_ones);
+            heap_caps_free(m_bounce);
+        }
+        inline bool initialized() const {
+            return nullptr!=m_ones;
+        }
+        inline esp_err_t last_error() const {
+            return m_last_error;
+        }
+        inline uint32_t frequency() const {
+            return m_frequency;
+        }
+        // re-adds the device at the new clock, since its timing is fixed when it's added
+        bool frequency(uint32_t khz) {
+            if(!initialized()) {
+                return false;
+            }
+            bool selected = m_selected;
+            if(!remove()) {
+                return false;
+            }
+            spi_device_interface_config_t config;
+            memset(&config,0,sizeof(config));
+            config.mode = 0;
+            config.clock_speed_hz = (int)khz*1000;
+            config.spics_io_num = -1;
+            config.queue_size = 1;
+            if(!check(spi_bus_add_device(m_host_id,&config,&m_device))) {
+                m_device = nullptr;
+                m_selected = false;
+                return false;
+            }
+            m_frequency = khz;
+            if(selected) {
+                m_selected = check(spi_device_acquire_bus(m_device,portMAX_DELAY));
+            }
+            return true;
+        }
+        void select(bool selected) {
+            if(nullptr==m_device || selected==m_selected) {
+                return;
+            }
+            if(selected) {
+                if(!check(spi_device_acquire_bus(m_device,portMAX_DELAY))) {
+                    return;
+                }
+                gpio_set_level(m_cs,0);
+            } else {
+                gpio_set_level(m_cs,1);
+                spi_device_release_bus(m_device);
+            }
+            m_selected = selected;
+        }
+        bool transfer(const void* tx,void* rx,size_t size) {
+            if(nullptr==m_device) {
+                return false;
+            }
+            const uint8_t* t = (const uint8_t*)tx;
+            uint8_t* r = (uint8_t*)rx;
+            while(0!=size) {
+                if(nullptr!=r && size<=4) {
+                    return transfer_inline(t,r,size);
+                }
+                size_t n = size<m_buffer_size?size:m_buffer_size;
+                // the DMA engine takes received data in whole words. the odd bytes at the
+                // end go inline on the next pass
+                if(nullptr!=r) {
+                    n&=~(size_t)3;
+                }
+                bool rx_direct = nullptr==r || dma_capable(r);
+                bool tx_direct = nullptr==t || dma_capable(t);
+                if(!tx_direct) {
+                    if(!rx_direct) {
+                        // full duplex with neither side usable by DMA goes four bytes
+                        // at a time. sdspi_card never does this
+                        n = 4;
+                        if(!transfer_inline(t,r,n)) {
+                            return false;
+                        }
+                        t+=n;
+                        r+=n;
+                        size-=n;
+                        continue;
+                    }
+                    memcpy(m_bounce,t,n);
+                }
+                if(!transfer_dma(tx_direct?t:m_bounce,rx_direct?r:(nullptr!=r?m_bounce:nullptr),n)) {
+                    return false;
+                }
+                if(!rx_direct) {
+                    memcpy(r,m_bounce,n);
+                }
+                if(nullptr!=t) {
+                    t+=n;
+                }
+                if(nullptr!=r) {
+                    r+=n;
+                }
+                size-=n;
+            }
+            return true;
+        }
+    };
+}
+#endif
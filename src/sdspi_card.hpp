@@ -0,0 +1,378 @@
+#ifndef HTCW_ESP32_SDSPI_CARD_HPP
+#define HTCW_ESP32_SDSPI_CARD_HPP
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <chrono>
+#include <mutex>
+namespace esp32 {
+    // an SD card in SPI mode, with the same read/write surface as sdmmc_card so it can sit
+    // under vfs_fast_fat32_card_hal. runs of sectors go out as one CMD18 or CMD25 stream
+    // (the latter pre-erased with ACMD23), with each data block moved in a single
+    // transfer straight to or from the caller's buffer. Bus is the wire:
+    //   bool frequency(uint32_t khz)
+    //   void select(bool selected)
+    //   bool transfer(const void* tx,void* rx,size_t size)
+    // transfer() is full duplex. a null tx clocks out 0xFF and a null rx drops what comes
+    // back. sdspi_bus.hpp has the one over spi_host and simulated_sdspi_bus.hpp has one
+    // that runs on a host
+    template<typename Bus>
+    class sdspi_card final {
+        constexpr static const size_t block_size = 512;
+        constexpr static const uint8_t r1_idle = 0x01;
+        constexpr static const uint8_t r1_illegal_command = 0x04;
+        constexpr static const uint8_t token_single = 0xFE;
+        constexpr static const uint8_t token_multiple = 0xFC;
+        constexpr static const uint8_t token_stop = 0xFD;
+        constexpr static const uint32_t init_timeout_ms = 1000;
+        constexpr static const uint32_t read_timeout_ms = 100;
+        constexpr static const uint32_t write_timeout_ms = 500;
+        Bus& m_bus;
+        std::mutex m_lock;
+        bool m_initialized;
+        bool m_block_addressing;
+        size_t m_sector_count;
+        uint32_t m_frequency;
+        int m_last_error;
+        uint8_t m_csd[16];
+        // a data token read ahead of where it was looked for, or 0xFF
+        uint8_t m_next;
+        typedef std::chrono::steady_clock clock;
+        static uint8_t crc7(const uint8_t* data,size_t size) {
+            uint8_t crc = 0;
+            while(size--) {
+                uint8_t d = *data++;
+                for(int i = 0;i<8;++i) {
+                    crc<<=1;
+                    if((d^crc)&0x80) {
+                        crc^=0x09;
+                    }
+                    d<<=1;
+                }
+            }
+            return crc&0x7F;
+        }
+        // the timeouts are taken by value, since the duration's constructor would need
+        // the constants defined out of the class before C++17
+        static inline clock::time_point deadline(uint32_t timeout_ms) {
+            return clock::now()+std::chrono::milliseconds(timeout_ms);
+        }
+        inline bool fail(int error) {
+            m_last_error = error;
+            return false;
+        }
+        inline uint32_t address(size_t sector) const {
+            return m_block_addressing?(uint32_t)sector:(uint32_t)(sector*block_size);
+        }
+        bool receive_byte(uint8_t* value) {
+            if(0xFF!=m_next) {
+                *value = m_next;
+                m_next = 0xFF;
+                return true;
+            }
+            return m_bus.transfer(nullptr,value,1);
+        }
+        // sends a command and returns its R1, or 0xFF if the card never answered
+        uint8_t command(uint8_t cmd,uint32_t arg,void* response = nullptr,size_t response_size = 0) {
+            uint8_t frame[7];
+            frame[0]=0x40|cmd;
+            frame[1]=(uint8_t)(arg>>24);
+            frame[2]=(uint8_t)(arg>>16);
+            frame[3]=(uint8_t)(arg>>8);
+            frame[4]=(uint8_t)arg;
+            frame[5]=(uint8_t)((crc7(frame,5)<<1)|1);
+            size_t size = 6;
+            if(12==cmd) {
+                // CMD12 is followed by a stuff byte that may look like a response
+                frame[size++]=0xFF;
+            }
+            m_next = 0xFF;
+            if(!m_bus.transfer(frame,nullptr,size)) {
+                return 0xFF;
+            }
+            uint8_t r1 = 0xFF;
+            for(int i = 0;i<9;++i) {
+                if(!m_bus.transfer(nullptr,&r1,1)) {
+                    return 0xFF;
+                }
+                if(0==(r1&0x80)) {
+                    break;
+                }
+            }
+            if(0==(r1&0x80) && 0!=response_size && !m_bus.transfer(nullptr,response,response_size)) {
+                return 0xFF;
+            }
+            return r1;
+        }
+        uint8_t app_command(uint8_t cmd,uint32_t arg,void* response = nullptr,size_t response_size = 0) {
+            uint8_t r1 = command(55,0);
+            if(r1&~r1_idle) {
+                return r1;
+            }
+            return command(cmd,arg,response,response_size);
+        }
+        // waits out a busy card. whatever follows busy is idle 0xFF, so it's safe to poll
+        // several bytes at once
+        bool wait_ready(uint32_t timeout_ms) {
+            m_next = 0xFF;
+            uint8_t poll[4];
+            clock::time_point end = deadline(timeout_ms);
+            while(true) {
+                if(!m_bus.transfer(nullptr,poll,sizeof(poll))) {
+                    return fail(EIO);
+                }
+                if(0xFF==poll[sizeof(poll)-1]) {
+                    return true;
+                }
+                if(clock::now()>end) {
+                    return fail(ETIMEDOUT);
+                }
+            }
+        }
+        // the data token could be followed by data right away, so this polls one byte
+        // at a time
+        bool wait_token(uint8_t* token,uint32_t timeout_ms) {
+            clock::time_point end = deadline(timeout_ms);
+            while(true) {
+                if(!receive_byte(token)) {
+                    return fail(EIO);
+                }
+                if(0xFF!=*token) {
+                    return true;
+                }
+                if(clock::now()>end) {
+                    return fail(ETIMEDOUT);
+                }
+            }
+        }
+        bool receive_block(void* destination,size_t size) {
+            uint8_t token;
+            if(!wait_token(&token,read_timeout_ms)) {
+                return false;
+            }
+            if(token_single!=token) {
+                // an error token
+                return fail(EIO);
+            }
+            if(!m_bus.transfer(nullptr,destination,size)) {
+                return fail(EIO);
+            }
+            // the CRC, plus one byte of the gap before the next block. it's usually the
+            // only byte of it, and reading it here saves the token poll a transfer
+            uint8_t tail[3];
+            if(!m_bus.transfer(nullptr,tail,sizeof(tail))) {
+                return fail(EIO);
+            }
+            m_next = tail[2];
+            return true;
+        }
+        bool send_block(uint8_t token,const void* source) {
+            uint8_t head[2] = {0xFF,token};
+            if(!m_bus.transfer(head,nullptr,sizeof(head)) ||
+                    !m_bus.transfer(source,nullptr,block_size)) {
+                return fail(EIO);
+            }
+            // the CRC, which isn't checked, then the data response
+            uint8_t tail[3];
+            if(!m_bus.transfer(nullptr,tail,sizeof(tail))) {
+                return fail(EIO);
+            }
+            uint8_t response = tail[2];
+            for(int i = 0;0xFF==response && i<8;++i) {
+                if(!m_bus.transfer(nullptr,&response,1)) {
+                    return fail(EIO);
+                }
+            }
+            if(0x05!=(response&0x1F)) {
+                return fail(EIO);
+            }
+            return wait_ready(write_timeout_ms);
+        }
+        bool read_csd() {
+            if(0!=command(9,0)) {
+                return fail(EIO);
+            }
+            if(!receive_block(m_csd,sizeof(m_csd))) {
+                return false;
+            }
+            if(1==(m_csd[0]>>6)) {
+                // CSD version 2
+                uint32_t c_size = ((uint32_t)(m_csd[7]&0x3F)<<16)|((uint32_t)m_csd[8]<<8)|m_csd[9];
+                m_sector_count = ((size_t)c_size+1)*1024;
+            } else {
+                uint32_t read_bl_len = m_csd[5]&0x0F;
+                uint32_t c_size = ((uint32_t)(m_csd[6]&0x03)<<10)|((uint32_t)m_csd[7]<<2)|(m_csd[8]>>6);
+                uint32_t c_size_mult = ((m_csd[9]&0x03)<<1)|(m_csd[10]>>7);
+                m_sector_count = ((size_t)(c_size+1)<<(c_size_mult+2+read_bl_len))/block_size;
+            }
+            return true;
+        }
+        bool init(uint32_t max_khz) {
+            // at least 74 clocks with the card deselected to put it in SPI mode
+            m_bus.select(false);
+            if(!m_bus.frequency(400) || !m_bus.transfer(nullptr,nullptr,10)) {
+                return fail(EIO);
+            }
+            m_bus.select(true);
+            uint8_t r1 = 0xFF;
+            for(int i = 0;i<10 && r1_idle!=r1;++i) {
+                r1 = command(0,0);
+            }
+            if(r1_idle!=r1) {
+                return fail(ENODEV);
+            }
+            uint8_t r7[4];
+            r1 = command(8,0x1AA,r7,sizeof(r7));
+            bool v2 = 0==(r1&r1_illegal_command);
+            if(v2 && 0xAA!=r7[3]) {
+                return fail(ENODEV);
+            }
+            clock::time_point end = deadline(init_timeout_ms);
+            do {
+                r1 = app_command(41,v2?0x40000000:0);
+                if(0!=(r1&~r1_idle) || clock::now()>end) {
+                    return fail(ENODEV);
+                }
+            } while(0!=r1);
+            m_block_addressing = false;
+            if(v2) {
+                uint8_t ocr[4];
+                if(0!=command(58,0,ocr,sizeof(ocr))) {
+                    return fail(EIO);
+                }
+                m_block_addressing = 0!=(ocr[0]&0x40);
+            }
+            if(!m_block_addressing && 0!=command(16,block_size)) {
+                return fail(EIO);
+            }
+            if(!read_csd()) {
+                return false;
+            }
+            m_bus.select(false);
+            m_bus.transfer(nullptr,nullptr,1);
+            if(!m_bus.frequency(max_khz)) {
+                return fail(EIO);
+            }
+            m_frequency = max_khz;
+            return true;
+        }
+        // the card is released between operations so other devices can share the bus.
+        // it needs a few clocks after CS goes high to let go of MISO
+        inline void release() {
+            m_bus.select(false);
+            m_bus.transfer(nullptr,nullptr,1);
+        }
+    public:
+        // max_khz is the clock after initialization. cards in SPI mode are only rated
+        // for 25MHz
+        sdspi_card(Bus& bus,uint32_t max_khz = 20000) :
+                m_bus(bus),
+                m_initialized(false),
+                m_block_addressing(false),
+                m_sector_count(0),
+                m_frequency(0),
+                m_last_error(0),
+                m_next(0xFF) {
+            memset(m_csd,0,sizeof(m_csd));
+            m_initialized = init(max_khz);
+            if(!m_initialized) {
+                release();
+            }
+        }
+        sdspi_card(const sdspi_card& rhs)=delete;
+        sdspi_card& operator=(const sdspi_card& rhs)=delete;
+        inline bool initialized() const {
+            return m_initialized;
+        }
+        // an errno value for the last failure
+        inline int last_error() const {
+            return m_last_error;
+        }
+        inline size_t sector_count() const {
+            return m_sector_count;
+        }
+        inline size_t sector_size() const {
+            return block_size;
+        }
+        inline uint32_t frequency() const {
+            return m_frequency;
+        }
+        inline const uint8_t* csd() const {
+            return m_csd;
+        }
+        bool read(void* destination,size_t start_sector,size_t sector_count) {
+            if(!m_initialized) {
+                return fail(ENODEV);
+            }
+            if(start_sector+sector_count>m_sector_count) {
+                return fail(EINVAL);
+            }
+            if(0==sector_count) {
+                return true;
+            }
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_bus.select(true);
+            uint8_t* p = (uint8_t*)destination;
+            bool result;
+            if(1==sector_count) {
+                result = 0==command(17,address(start_sector)) || fail(EIO);
+                result = result && receive_block(p,block_size);
+            } else {
+                result = 0==command(18,address(start_sector)) || fail(EIO);
+                for(size_t i = 0;result && i<sector_count;++i) {
+                    result = receive_block(p,block_size);
+                    p+=block_size;
+                }
+                // stops the stream even when it failed partway
+                if(0!=command(12,0)) {
+                    result = result && fail(EIO);
+                }
+                result = wait_ready(write_timeout_ms) && result;
+            }
+            release();
+            return result;
+        }
+        bool write(const void* source,size_t start_sector,size_t sector_count) {
+            if(!m_initialized) {
+                return fail(ENODEV);
+            }
+            if(start_sector+sector_count>m_sector_count) {
+                return fail(EINVAL);
+            }
+            if(0==sector_count) {
+                return true;
+            }
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_bus.select(true);
+            const uint8_t* p = (const uint8_t*)source;
+            bool result;
+            if(1==sector_count) {
+                result = 0==command(24,address(start_sector)) || fail(EIO);
+                result = result && send_block(token_single,p);
+            } else {
+                // lets the card erase the whole run up front. it's only a hint, so a card
+                // that refuses it still gets the write
+                app_command(23,(uint32_t)sector_count&0x7FFFFF);
+                result = 0==command(25,address(start_sector)) || fail(EIO);
+                for(size_t i = 0;result && i<sector_count;++i) {
+                    result = send_block(token_multiple,p);
+                    p+=block_size;
+                }
+                uint8_t stop[2] = {token_stop,0xFF};
+                if(!m_bus.transfer(stop,nullptr,sizeof(stop))) {
+                    result = result && fail(EIO);
+                }
+                result = wait_ready(write_timeout_ms) && result;
+            }
+            if(!result) {
+                // a failed write leaves its reason in the status, which CMD13 clears
+                uint8_t r2;
+                command(13,0,&r2,1);
+            }
+            release();
+            return result;
+        }
+    };
+}
+#endif
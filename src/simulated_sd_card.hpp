@@ -0,0 +1,315 @@
+#ifndef HTCW_ESP32_SIMULATED_SD_CARD_HPP
+#define HTCW_ESP32_SIMULATED_SD_CARD_HPP
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+namespace esp32 {
+    // how long a simulated_sd_card takes. times are in microseconds and rates in bytes per
+    // second. a 0 costs nothing
+    struct simulated_sd_timing {
+        // per transaction, before any data moves
+        uint32_t command_us;
+        uint64_t read_bytes_per_second;
+        uint64_t write_bytes_per_second;
+        // the erase block (allocation unit) size. writes that continue where the last one
+        // left off in an open block cost nothing extra. one that starts a block costs an
+        // erase. anything else costs an erase and a copy of the rest of the block. 0 turns
+        // this off
+        size_t erase_block_sectors;
+        // blocks the card can have open for appending at once
+        size_t open_blocks;
+        uint32_t erase_us;
+        // how fast the card copies the live sectors of a block it rewrites
+        uint64_t copy_bytes_per_second;
+        // the chance in a million that a write is followed by a busy stall, and its length
+        uint32_t stall_per_million;
+        uint32_t stall_us;
+        // for the stalls, so runs can be repeated
+        uint32_t seed;
+        // sleeps for the time each transaction takes. otherwise it's only added to
+        // elapsed_us(), for tests that shouldn't wait
+        bool sleep;
+    };
+    // a card held in RAM or a sparse file with the same read/write surface as sdmmc_card,
+    // for running the queueing and file system code on a host. each transaction takes
+    // the time simulated_sd_timing gives it, during which the "bus" is held like the real
+    // one
+    class simulated_sd_card final {
+        constexpr static const size_t max_open_blocks = 8;
+        uint8_t* m_data;
+        int m_fd;
+        size_t m_sector_count;
+        size_t m_sector_size;
+        simulated_sd_timing m_timing;
+        std::mutex m_bus;
+        std::atomic<size_t> m_reads;
+        std::atomic<size_t> m_writes;
+        std::atomic<bool> m_fail_writes;
+        std::atomic<size_t> m_bad_sector;
+        // the erase blocks open for appending, least recently used first, and the next
+        // sector of each
+        size_t m_open_count;
+        size_t m_open[max_open_blocks];
+        size_t m_open_next[max_open_blocks];
+        uint32_t m_random;
+        std::atomic<uint64_t> m_elapsed_us;
+        std::atomic<size_t> m_rewrites;
+        std::atomic<uint64_t> m_copied_bytes;
+        std::atomic<size_t> m_stalls;
+        static simulated_sd_timing make_timing(uint32_t latency_us,uint64_t bytes_per_second) {
+            simulated_sd_timing result;
+            memset(&result,0,sizeof(result));
+            result.command_us = latency_us;
+            result.read_bytes_per_second = bytes_per_second;
+            result.write_bytes_per_second = bytes_per_second;
+            result.open_blocks = 1;
+            result.seed = 1;
+            result.sleep = true;
+            return result;
+        }
+        inline uint64_t move_us(size_t sector_count,uint64_t bytes_per_second) const {
+            return 0==bytes_per_second?0:(uint64_t)sector_count*m_sector_size*1000000/bytes_per_second;
+        }
+        void wait(uint64_t us) {
+            if(0==us) {
+                return;
+            }
+            m_elapsed_us+=us;
+            if(m_timing.sleep) {
+                std::this_thread::sleep_for(std::chrono::microseconds(us));
+            }
+        }
+        // xorshift
+        uint32_t random() {
+            m_random ^= m_random << 13;
+            m_random ^= m_random >> 17;
+            m_random ^= m_random << 5;
+            return m_random;
+        }
+        // what the erase blocks under a write cost, and the bookkeeping of which are open
+        uint64_t erase_us(size_t start_sector,size_t sector_count) {
+            size_t block_sectors = m_timing.erase_block_sectors;
+            if(0==block_sectors) {
+                return 0;
+            }
+            size_t open_blocks = m_timing.open_blocks;
+            if(open_blocks<1) {
+                open_blocks = 1;
+            } else if(open_blocks>max_open_blocks) {
+                open_blocks = max_open_blocks;
+            }
+            uint64_t result = 0;
+            size_t sector = start_sector;
+            size_t end = start_sector+sector_count;
+            while(sector<end) {
+                size_t block = sector/block_sectors;
+                size_t offset = sector-block*block_sectors;
+                size_t count = block_sectors-offset<end-sector?block_sectors-offset:end-sector;
+                size_t i = 0;
+                while(i<m_open_count && m_open[i]!=block) {
+                    ++i;
+                }
+                bool append = i<m_open_count && m_open_next[i]==sector;
+                if(i<m_open_count) {
+                    // taken out, and put back at the end if it's still open
+                    --m_open_count;
+                    memmove(m_open+i,m_open+i+1,(m_open_count-i)*sizeof(size_t));
+                    memmove(m_open_next+i,m_open_next+i+1,(m_open_count-i)*sizeof(size_t));
+                }
+                if(!append) {
+                    // a write from the start of a block begins a new one. anywhere else
+                    // the card copies what isn't being written into the new block
+                    result+=m_timing.erase_us;
+                    if(0!=offset) {
+                        size_t copied = block_sectors-count;
+                        result+=move_us(copied,m_timing.copy_bytes_per_second);
+                        m_copied_bytes+=(uint64_t)copied*m_sector_size;
+                        ++m_rewrites;
+                    }
+                }
+                if(offset+count<block_sectors) {
+                    if(m_open_count==open_blocks) {
+                        // closing the least recently used one
+                        --m_open_count;
+                        memmove(m_open,m_open+1,m_open_count*sizeof(size_t));
+                        memmove(m_open_next,m_open_next+1,m_open_count*sizeof(size_t));
+                    }
+                    m_open[m_open_count]=block;
+                    m_open_next[m_open_count]=sector+count;
+                    ++m_open_count;
+                }
+                sector+=count;
+            }
+            return result;
+        }
+        bool load(void* destination,size_t start_sector,size_t sector_count) {
+            size_t size = sector_count*m_sector_size;
+            if(nullptr!=m_data) {
+                memcpy(destination,m_data+start_sector*m_sector_size,size);
+                return true;
+            }
+            return (ssize_t)size==::pread(m_fd,destination,size,(off_t)start_sector*m_sector_size);
+        }
+        bool store(const void* source,size_t start_sector,size_t sector_count) {
+            size_t size = sector_count*m_sector_size;
+            if(nullptr!=m_data) {
+                memcpy(m_data+start_sector*m_sector_size,source,size);
+                return true;
+            }
+            return (ssize_t)size==::pwrite(m_fd,source,size,(off_t)start_sector*m_sector_size);
+        }
+        inline bool bad(size_t start_sector,size_t sector_count) const {
+            size_t sector = m_bad_sector;
+            return sector>=start_sector && sector-start_sector<sector_count;
+        }
+        void reset_state() {
+            m_open_count = 0;
+            m_random = 0==m_timing.seed?1:m_timing.seed;
+        }
+    public:
+        simulated_sd_card(size_t sector_count,size_t sector_size = 512,uint32_t latency_us = 0,uint64_t bytes_per_second = 0) :
+                m_fd(-1),
+                m_sector_count(sector_count),
+                m_sector_size(sector_size),
+                m_timing(make_timing(latency_us,bytes_per_second)),
+                m_reads(0),
+                m_writes(0),
+                m_fail_writes(false),
+                m_bad_sector(SIZE_MAX),
+                m_elapsed_us(0),
+                m_rewrites(0),
+                m_copied_bytes(0),
+                m_stalls(0) {
+            reset_state();
+            m_data = (uint8_t*)calloc(sector_count,sector_size);
+        }
+        // a card stored in a file, which is created if needed and sized to the card
+        // without writing it, so unused space takes no room on file systems that allow it
+        simulated_sd_card(const char* path,size_t sector_count,size_t sector_size = 512,uint32_t latency_us = 0,uint64_t bytes_per_second = 0) :
+                m_data(nullptr),
+                m_sector_count(sector_count),
+                m_sector_size(sector_size),
+                m_timing(make_timing(latency_us,bytes_per_second)),
+                m_reads(0),
+                m_writes(0),
+                m_fail_writes(false),
+                m_bad_sector(SIZE_MAX),
+                m_elapsed_us(0),
+                m_rewrites(0),
+                m_copied_bytes(0),
+                m_stalls(0) {
+            reset_state();
+            m_fd = ::open(path,O_RDWR|O_CREAT,0666);
+            if(0<=m_fd && 0!=ftruncate(m_fd,(off_t)sector_count*sector_size)) {
+                ::close(m_fd);
+                m_fd = -1;
+            }
+        }
+        simulated_sd_card(const simulated_sd_card& rhs)=delete;
+        simulated_sd_card& operator=(const simulated_sd_card& rhs)=delete;
+        ~simulated_sd_card() {
+            ::free(m_data);
+            if(0<=m_fd) {
+                ::close(m_fd);
+            }
+        }
+        inline bool initialized() const {
+            return nullptr!=m_data || 0<=m_fd;
+        }
+        inline size_t sector_count() const {
+            return m_sector_count;
+        }
+        inline size_t sector_size() const {
+            return m_sector_size;
+        }
+        // the contents, or nullptr for a card stored in a file
+        inline uint8_t* data() {
+            return m_data;
+        }
+        simulated_sd_timing timing() {
+            std::lock_guard<std::mutex> lock(m_bus);
+            return m_timing;
+        }
+        // changes the timing, closing any open erase blocks and restarting the stalls
+        void timing(const simulated_sd_timing& value) {
+            std::lock_guard<std::mutex> lock(m_bus);
+            m_timing = value;
+            reset_state();
+        }
+        // transactions so far
+        inline size_t reads() const {
+            return m_reads;
+        }
+        inline size_t writes() const {
+            return m_writes;
+        }
+        // the time all the transactions took, whether or not they slept
+        inline uint64_t elapsed_us() const {
+            return m_elapsed_us;
+        }
+        // writes that made the card copy part of an erase block, and the bytes it copied
+        inline size_t rewrites() const {
+            return m_rewrites;
+        }
+        inline uint64_t copied_bytes() const {
+            return m_copied_bytes;
+        }
+        inline size_t stalls() const {
+            return m_stalls;
+        }
+        void reset_counters() {
+            m_reads = 0;
+            m_writes = 0;
+            m_elapsed_us = 0;
+            m_rewrites = 0;
+            m_copied_bytes = 0;
+            m_stalls = 0;
+        }
+        // makes writes fail, to exercise error paths
+        inline void fail_writes(bool value) {
+            m_fail_writes = value;
+        }
+        // makes reads and writes that reach this sector fail, like a bad block, so the
+        // ones before it in a multi-sector stream still go through. SIZE_MAX for none
+        inline void bad_sector(size_t sector) {
+            m_bad_sector = sector;
+        }
+        bool read(void* destination,size_t start_sector,size_t sector_count) {
+            if(!initialized() || start_sector+sector_count>m_sector_count || bad(start_sector,sector_count)) {
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(m_bus);
+            wait(m_timing.command_us+move_us(sector_count,m_timing.read_bytes_per_second));
+            if(!load(destination,start_sector,sector_count)) {
+                return false;
+            }
+            ++m_reads;
+            return true;
+        }
+        bool write(const void* source,size_t start_sector,size_t sector_count) {
+            if(!initialized() || start_sector+sector_count>m_sector_count || m_fail_writes || bad(start_sector,sector_count)) {
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(m_bus);
+            uint64_t us = m_timing.command_us+move_us(sector_count,m_timing.write_bytes_per_second);
+            us+=erase_us(start_sector,sector_count);
+            if(0!=m_timing.stall_per_million && random()%1000000<m_timing.stall_per_million) {
+                us+=m_timing.stall_us;
+                ++m_stalls;
+            }
+            wait(us);
+            if(!store(source,start_sector,sector_count)) {
+                return false;
+            }
+            ++m_writes;
+            return true;
+        }
+    };
+}
+#endif
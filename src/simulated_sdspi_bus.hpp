@@ -0,0 +1,372 @@
+#ifndef HTCW_ESP32_SIMULATED_SDSPI_BUS_HPP
+#define HTCW_ESP32_SIMULATED_SDSPI_BUS_HPP
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+#include "simulated_sd_card.hpp"
+namespace esp32 {
+    // a bus for sdspi_card with the card end of the SPI mode protocol behind it, byte by
+    // byte, storing to a simulated_sd_card. it answers the commands sdspi_card uses, with
+    // access_bytes of 0xFF before each data token and busy_bytes of busy after each
+    // write. it also keeps the time the transfers would take on a real bus: every byte
+    // at the clock set by frequency(), plus transfer_ns for each transfer() call. this is
+    // the figure to compare against the ceiling of the clock
+    class simulated_sdspi_bus final {
+        enum struct mode {
+            command,
+            streaming,
+            receiving_single,
+            receiving_multiple
+        };
+        simulated_sd_card& m_card;
+        bool m_high_capacity;
+        size_t m_access_bytes;
+        size_t m_busy_bytes;
+        uint32_t m_transfer_ns;
+        uint32_t m_frequency;
+        bool m_selected;
+        bool m_idle;
+        bool m_app;
+        int m_init_count;
+        mode m_mode;
+        uint8_t m_frame[6];
+        size_t m_frame_size;
+        std::vector<uint8_t> m_block;
+        // in the middle of a block being received, or past the gap before one being sent
+        bool m_in_block;
+        size_t m_sector;
+        std::deque<uint8_t> m_out;
+        uint64_t m_bytes;
+        uint64_t m_data_bytes;
+        uint64_t m_transfers;
+        uint64_t m_elapsed_ns;
+        size_t m_commands;
+        size_t m_pre_erased;
+        static uint8_t crc7(const uint8_t* data,size_t size) {
+            uint8_t crc = 0;
+            while(size--) {
+                uint8_t d = *data++;
+                for(int i = 0;i<8;++i) {
+                    crc<<=1;
+                    if((d^crc)&0x80) {
+                        crc^=0x09;
+                    }
+                    d<<=1;
+                }
+            }
+            return crc&0x7F;
+        }
+        void push(uint8_t value,size_t count = 1) {
+            while(count--) {
+                m_out.push_back(value);
+            }
+        }
+        void r1(uint8_t value) {
+            // one byte of Ncr before the response
+            push(0xFF);
+            push(value|(m_idle?0x01:0x00));
+        }
+        bool push_block(size_t sector) {
+            size_t size = m_card.sector_size();
+            m_block.resize(size);
+            if(sector>=m_card.sector_count() || !m_card.read(m_block.data(),sector,1)) {
+                // an error token: out of range or a card error
+                push(sector>=m_card.sector_count()?0x08:0x01);
+                return false;
+            }
+            push(0xFE);
+            for(size_t i = 0;i<size;++i) {
+                m_out.push_back(m_block[i]);
+            }
+            push(0x00,2);
+            m_data_bytes+=size;
+            return true;
+        }
+        size_t sector(uint32_t arg) const {
+            return m_high_capacity?arg:arg/m_card.sector_size();
+        }
+        void execute() {
+            uint8_t cmd = m_frame[0]&0x3F;
+            uint32_t arg = ((uint32_t)m_frame[1]<<24)|((uint32_t)m_frame[2]<<16)|((uint32_t)m_frame[3]<<8)|m_frame[4];
+            bool app = m_app;
+            m_app = false;
+            ++m_commands;
+            // CRC is off in SPI mode except for these two
+            if((0==cmd || 8==cmd) && (m_frame[5]>>1)!=crc7(m_frame,5)) {
+                r1(0x08);
+                return;
+            }
+            if(12==cmd) {
+                // stops a read stream. the stuff byte after it is junk
+                m_out.clear();
+                m_mode = mode::command;
+                push(0x3C);
+                r1(0x00);
+                push(0x00,m_busy_bytes);
+                return;
+            }
+            if(mode::command!=m_mode) {
+                return;
+            }
+            switch(cmd) {
+                case 0:
+                    m_idle = true;
+                    m_init_count = 0;
+                    r1(0x00);
+                    break;
+                case 8:
+                    r1(0x00);
+                    push(0x00,2);
+                    push(0x01);
+                    push((uint8_t)arg);
+                    break;
+                case 55:
+                    m_app = true;
+                    r1(0x00);
+                    break;
+                case 41:
+                    if(!app) {
+                        r1(0x04);
+                        break;
+                    }
+                    // takes a few goes, like a real card
+                    if(++m_init_count>=3) {
+                        m_idle = false;
+                    }
+                    r1(0x00);
+                    break;
+                case 58:
+                    r1(0x00);
+                    push(m_high_capacity?0xC0:0x80);
+                    push(0xFF);
+                    push(0x80);
+                    push(0x00);
+                    break;
+                case 9: {
+                    r1(0x00);
+                    uint8_t csd[16];
+                    memset(csd,0,sizeof(csd));
+                    if(m_high_capacity) {
+                        uint32_t c_size = (uint32_t)(m_card.sector_count()/1024)-1;
+                        csd[0]=0x40;
+                        csd[7]=(uint8_t)((c_size>>16)&0x3F);
+                        csd[8]=(uint8_t)(c_size>>8);
+                        csd[9]=(uint8_t)c_size;
+                    } else {
+                        // 512 byte blocks with a multiplier of 512
+                        uint32_t c_size = (uint32_t)(m_card.sector_count()/512)-1;
+                        csd[5]=9;
+                        csd[6]=(uint8_t)((c_size>>10)&0x03);
+                        csd[7]=(uint8_t)(c_size>>2);
+                        csd[8]=(uint8_t)(c_size<<6);
+                        csd[9]=0x03;
+                        csd[10]=0x80;
+                    }
+                    push(0xFF,m_access_bytes);
+                    push(0xFE);
+                    for(size_t i = 0;i<sizeof(csd);++i) {
+                        push(csd[i]);
+                    }
+                    push(0x00,2);
+                }
+                    break;
+                case 13:
+                    r1(0x00);
+                    push(0x00);
+                    break;
+                case 16:
+                    r1(m_card.sector_size()==arg?0x00:0x40);
+                    break;
+                case 17:
+                    if(sector(arg)>=m_card.sector_count()) {
+                        r1(0x40);
+                        break;
+                    }
+                    r1(0x00);
+                    push(0xFF,m_access_bytes);
+                    push_block(sector(arg));
+                    break;
+                case 18:
+                    if(sector(arg)>=m_card.sector_count()) {
+                        r1(0x40);
+                        break;
+                    }
+                    r1(0x00);
+                    m_sector = sector(arg);
+                    m_in_block = false;
+                    m_mode = mode::streaming;
+                    break;
+                case 23:
+                    r1(app?0x00:0x04);
+                    if(app) {
+                        ++m_pre_erased;
+                    }
+                    break;
+                case 24:
+                case 25:
+                    if(sector(arg)>=m_card.sector_count()) {
+                        r1(0x40);
+                        break;
+                    }
+                    r1(0x00);
+                    m_sector = sector(arg);
+                    m_in_block = false;
+                    m_mode = 24==cmd?mode::receiving_single:mode::receiving_multiple;
+                    break;
+                case 59:
+                    r1(0x00);
+                    break;
+                default:
+                    r1(0x04);
+                    break;
+            }
+        }
+        void receive(uint8_t value) {
+            if(!m_in_block) {
+                if(0xFE==value || (0xFC==value && mode::receiving_multiple==m_mode)) {
+                    m_in_block = true;
+                    m_block.clear();
+                } else if(0xFD==value && mode::receiving_multiple==m_mode) {
+                    // one byte before busy starts
+                    push(0xFF);
+                    push(0x00,m_busy_bytes);
+                    m_mode = mode::command;
+                }
+                return;
+            }
+            m_block.push_back(value);
+            if(m_block.size()<m_card.sector_size()+2) {
+                return;
+            }
+            m_in_block = false;
+            bool ok = m_sector<m_card.sector_count() && m_card.write(m_block.data(),m_sector,1);
+            ++m_sector;
+            if(ok) {
+                m_data_bytes+=m_card.sector_size();
+            }
+            // accepted, or a write error
+            push(ok?0xE5:0xED);
+            push(0x00,m_busy_bytes);
+            if(!ok || mode::receiving_single==m_mode) {
+                m_mode = mode::command;
+            }
+        }
+        uint8_t exchange(uint8_t value) {
+            if(!m_selected) {
+                return 0xFF;
+            }
+            bool command = 0!=m_frame_size || 0x40==(value&0xC0);
+            if(m_out.empty() && mode::streaming==m_mode && !command) {
+                // the gap goes out first, so a CMD12 after it stops the stream before
+                // the next block is read
+                if(!m_in_block) {
+                    push(0xFF,m_access_bytes);
+                    m_in_block = true;
+                } else {
+                    m_in_block = false;
+                    if(!push_block(m_sector++)) {
+                        m_mode = mode::command;
+                    }
+                }
+            }
+            uint8_t result = 0xFF;
+            if(!m_out.empty()) {
+                result = m_out.front();
+                m_out.pop_front();
+            }
+            if(mode::receiving_single==m_mode || mode::receiving_multiple==m_mode) {
+                receive(value);
+            } else if(command) {
+                m_frame[m_frame_size++]=value;
+                if(sizeof(m_frame)==m_frame_size) {
+                    m_frame_size = 0;
+                    execute();
+                }
+            }
+            return result;
+        }
+    public:
+        simulated_sdspi_bus(simulated_sd_card& card,bool high_capacity = true,size_t access_bytes = 1,size_t busy_bytes = 8,uint32_t transfer_ns = 0) :
+                m_card(card),
+                m_high_capacity(high_capacity),
+                m_access_bytes(0==access_bytes?1:access_bytes),
+                m_busy_bytes(busy_bytes),
+                m_transfer_ns(transfer_ns),
+                m_frequency(0),
+                m_selected(false),
+                m_idle(true),
+                m_app(false),
+                m_init_count(0),
+                m_mode(mode::command),
+                m_frame_size(0),
+                m_in_block(false),
+                m_sector(0),
+                m_bytes(0),
+                m_data_bytes(0),
+                m_transfers(0),
+                m_elapsed_ns(0),
+                m_commands(0),
+                m_pre_erased(0) {
+        }
+        simulated_sdspi_bus(const simulated_sdspi_bus& rhs)=delete;
+        simulated_sdspi_bus& operator=(const simulated_sdspi_bus& rhs)=delete;
+        bool frequency(uint32_t khz) {
+            if(0==khz) {
+                return false;
+            }
+            m_frequency = khz;
+            return true;
+        }
+        inline uint32_t frequency() const {
+            return m_frequency;
+        }
+        void select(bool selected) {
+            m_selected = selected;
+            m_frame_size = 0;
+        }
+        bool transfer(const void* tx,void* rx,size_t size) {
+            if(0==m_frequency) {
+                return false;
+            }
+            const uint8_t* t = (const uint8_t*)tx;
+            uint8_t* r = (uint8_t*)rx;
+            for(size_t i = 0;i<size;++i) {
+                uint8_t value = exchange(nullptr!=t?t[i]:0xFF);
+                if(nullptr!=r) {
+                    r[i]=value;
+                }
+            }
+            m_bytes+=size;
+            ++m_transfers;
+            m_elapsed_ns+=(uint64_t)size*8*1000000/m_frequency+m_transfer_ns;
+            return true;
+        }
+        // bytes clocked in each direction
+        inline uint64_t bytes() const {
+            return m_bytes;
+        }
+        // sector bytes that actually moved
+        inline uint64_t data_bytes() const {
+            return m_data_bytes;
+        }
+        inline uint64_t transfers() const {
+            return m_transfers;
+        }
+        inline uint64_t elapsed_ns() const {
+            return m_elapsed_ns;
+        }
+        inline size_t commands() const {
+            return m_commands;
+        }
+        // ACMD23s seen
+        inline size_t pre_erased() const {
+            return m_pre_erased;
+        }
+        void reset_counters() {
+            m_bytes = m_data_bytes = m_transfers = m_elapsed_ns = 0;
+            m_commands = m_pre_erased = 0;
+        }
+    };
+}
+#endif
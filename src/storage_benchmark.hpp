@@ -0,0 +1,493 @@
+#ifndef HTCW_ESP32_STORAGE_BENCHMARK_HPP
+#define HTCW_ESP32_STORAGE_BENCHMARK_HPP
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <new>
+#include <algorithm>
+#include "vfs.hpp"
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+#else
+#include <chrono>
+#endif
+namespace esp32 {
+    // what a benchmark runs against. paths always start with '/' and are relative to the
+    // target's root
+    class storage_benchmark_target {
+    public:
+        virtual int open(const char* path,int flags,int mode)=0;
+        virtual int close(int fd)=0;
+        virtual ssize_t read(int fd,void* dst,size_t size)=0;
+        virtual ssize_t write(int fd,const void* src,size_t size)=0;
+        virtual ssize_t pread(int fd,void* dst,size_t size,off_t offset)=0;
+        virtual ssize_t pwrite(int fd,const void* src,size_t size,off_t offset)=0;
+        virtual off_t lseek(int fd,off_t offset,int whence)=0;
+        virtual int fsync(int fd)=0;
+        virtual int unlink(const char* path)=0;
+        virtual int mkdir(const char* path,mode_t mode)=0;
+        virtual int rmdir(const char* path)=0;
+        virtual DIR* opendir(const char* path)=0;
+        virtual dirent* readdir(DIR* dir)=0;
+        virtual int closedir(DIR* dir)=0;
+    };
+    // anything mounted in the C library's file system, such as the stock FatFs mount, or a
+    // vfs_driver registered with vfs::mount()
+    class storage_benchmark_posix_target : public storage_benchmark_target {
+        char m_root[64];
+        char m_path[192];
+        const char* path(const char* relative) {
+            snprintf(m_path,sizeof(m_path),"%s%s",m_root,relative);
+            return m_path;
+        }
+    public:
+        storage_benchmark_posix_target(const char* root) {
+            snprintf(m_root,sizeof(m_root),"%s",nullptr==root || 0==strcmp(root,"/")?"":root);
+        }
+        virtual int open(const char* path,int flags,int mode) { return ::open(this->path(path),flags,mode); }
+        virtual int close(int fd) { return ::close(fd); }
+        virtual ssize_t read(int fd,void* dst,size_t size) { return ::read(fd,dst,size); }
+        virtual ssize_t write(int fd,const void* src,size_t size) { return ::write(fd,src,size); }
+        virtual ssize_t pread(int fd,void* dst,size_t size,off_t offset) { return ::pread(fd,dst,size,offset); }
+        virtual ssize_t pwrite(int fd,const void* src,size_t size,off_t offset) { return ::pwrite(fd,src,size,offset); }
+        virtual off_t lseek(int fd,off_t offset,int whence) { return ::lseek(fd,offset,whence); }
+        virtual int fsync(int fd) { return ::fsync(fd); }
+        virtual int unlink(const char* path) { return ::unlink(this->path(path)); }
+        virtual int mkdir(const char* path,mode_t mode) { return ::mkdir(this->path(path),mode); }
+        virtual int rmdir(const char* path) { return ::rmdir(this->path(path)); }
+        virtual DIR* opendir(const char* path) { return ::opendir(this->path(path)); }
+        virtual dirent* readdir(DIR* dir) { return ::readdir(dir); }
+        virtual int closedir(DIR* dir) { return ::closedir(dir); }
+    };
+    // calls a vfs_driver directly, for host builds where there's nothing to mount it in
+    class storage_benchmark_driver_target : public storage_benchmark_target {
+        vfs_driver& m_driver;
+    public:
+        storage_benchmark_driver_target(vfs_driver& driver) : m_driver(driver) {
+        }
+        virtual int open(const char* path,int flags,int mode) { return m_driver.open(path,flags,mode); }
+        virtual int close(int fd) { return m_driver.close(fd); }
+        virtual ssize_t read(int fd,void* dst,size_t size) { return m_driver.read(fd,dst,size); }
+        virtual ssize_t write(int fd,const void* src,size_t size) { return m_driver.write(fd,src,size); }
+        virtual ssize_t pread(int fd,void* dst,size_t size,off_t offset) { return m_driver.pread(fd,dst,size,offset); }
+        virtual ssize_t pwrite(int fd,const void* src,size_t size,off_t offset) { return m_driver.pwrite(fd,src,size,offset); }
+        virtual off_t lseek(int fd,off_t offset,int whence) { return m_driver.lseek(fd,offset,whence); }
+        virtual int fsync(int fd) { return m_driver.fsync(fd); }
+#ifdef CONFIG_VFS_SUPPORT_DIR
+        virtual int unlink(const char* path) { return m_driver.unlink(path); }
+        virtual int mkdir(const char* path,mode_t mode) { return m_driver.mkdir(path,mode); }
+        virtual int rmdir(const char* path) { return m_driver.rmdir(path); }
+        virtual DIR* opendir(const char* path) { return m_driver.opendir(path); }
+        virtual dirent* readdir(DIR* dir) { return m_driver.readdir(dir); }
+        virtual int closedir(DIR* dir) { return m_driver.closedir(dir); }
+#else
+        virtual int unlink(const char* path) { errno = ENOSYS; return -1; }
+        virtual int mkdir(const char* path,mode_t mode) { errno = ENOSYS; return -1; }
+        virtual int rmdir(const char* path) { errno = ENOSYS; return -1; }
+        virtual DIR* opendir(const char* path) { errno = ENOSYS; return nullptr; }
+        virtual dirent* readdir(DIR* dir) { return nullptr; }
+        virtual int closedir(DIR* dir) { return -1; }
+#endif
+    };
+    enum struct storage_benchmark_test {
+        sequential_write = 0,
+        sequential_read,
+        random_write,
+        random_read,
+        positional_write, // pwrite() at random offsets
+        positional_read, // pread() at random offsets
+        synchronous_write, // fsync() after every write()
+        create_files,
+        delete_files,
+        list_directory // each readdir() is an operation
+    };
+    struct storage_benchmark_result {
+        storage_benchmark_test test;
+        size_t block_size; // 0 for the tests that don't move data
+        size_t operations;
+        uint64_t bytes;
+        uint64_t elapsed_us;
+        uint32_t p50_us;
+        uint32_t p99_us;
+        uint32_t max_us;
+        int error; // errno of the failure, or 0
+        inline double bytes_per_second() const {
+            return 0==elapsed_us?0:bytes*1000000.0/elapsed_us;
+        }
+        inline double operations_per_second() const {
+            return 0==elapsed_us?0:operations*1000000.0/elapsed_us;
+        }
+    };
+    // times file system operations through a storage_benchmark_target. block tests work on
+    // one file of file_size bytes at /bench.dat. the file tests work on file_count files
+    // in /bench. every operation is timed on its own to get the latency percentiles. what
+    // the read tests get back is checked against what was written, outside the timing
+    class storage_benchmark final {
+        storage_benchmark_target& m_target;
+        size_t m_file_size;
+        size_t m_file_count;
+        size_t m_max_block_size;
+        uint8_t* m_buffer;
+        uint32_t* m_samples;
+        size_t m_sample_capacity;
+        size_t m_sample_count;
+        uint32_t m_random;
+        bool m_verify;
+        constexpr static const char* file_path = "/bench.dat";
+        constexpr static const char* directory_path = "/bench";
+        // fsync() per write is slow enough that the whole file would take too long
+        constexpr static const size_t synchronous_operations = 64;
+
+        inline static uint64_t now_us() {
+#ifdef ESP_PLATFORM
+            return (uint64_t)esp_timer_get_time();
+#else
+            return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+        }
+        // xorshift, so every target sees the same offsets
+        uint32_t random() {
+            m_random ^= m_random << 13;
+            m_random ^= m_random >> 17;
+            m_random ^= m_random << 5;
+            return m_random;
+        }
+        inline void sample(uint64_t start,uint64_t end) {
+            if(m_sample_count<m_sample_capacity) {
+                m_samples[m_sample_count++] = (uint32_t)(end-start);
+            }
+        }
+        void begin(storage_benchmark_result& result,storage_benchmark_test test,size_t block_size) {
+            memset(&result,0,sizeof(result));
+            result.test = test;
+            result.block_size = block_size;
+            m_sample_count = 0;
+            m_random = 0x9E3779B9;
+        }
+        // every write puts byte i of the buffer at an offset that is a multiple of the block
+        // size, which is a multiple of 256, so byte n of the file is always n&0xFF. a read
+        // that comes back different is put right, so it doesn't spoil later writes
+        bool check(size_t size) {
+            bool result = true;
+            for(size_t i = 0;i<size;++i) {
+                if(m_buffer[i]!=(uint8_t)(i&0xFF)) {
+                    m_buffer[i] = (uint8_t)(i&0xFF);
+                    result = false;
+                }
+            }
+            return result;
+        }
+        bool fail(storage_benchmark_result& result) {
+            result.error = 0==errno?EIO:errno;
+            return false;
+        }
+        bool end(storage_benchmark_result& result,uint64_t start) {
+            result.elapsed_us = now_us()-start;
+            if(0!=m_sample_count) {
+                std::sort(m_samples,m_samples+m_sample_count);
+                result.p50_us = m_samples[(m_sample_count-1)/2];
+                result.p99_us = m_samples[(m_sample_count-1)*99/100];
+                result.max_us = m_samples[m_sample_count-1];
+            }
+            return true;
+        }
+        static void file_name(char* path,size_t index) {
+            snprintf(path,32,"%s/f%04u.tmp",directory_path,(unsigned)index);
+        }
+        // makes sure /bench.dat is at least file_size bytes so the read tests have something to read
+        bool prepare() {
+            int fd = m_target.open(file_path,O_RDWR|O_CREAT,0666);
+            if(0>fd) {
+                return false;
+            }
+            off_t size = m_target.lseek(fd,0,SEEK_END);
+            bool result = true;
+            if(0<=size && (size_t)size<m_file_size) {
+                m_target.lseek(fd,0,SEEK_SET);
+                for(size_t written = 0;result && written<m_file_size;written+=m_max_block_size) {
+                    size_t size = m_file_size-written<m_max_block_size?m_file_size-written:m_max_block_size;
+                    result = (ssize_t)size==m_target.write(fd,m_buffer,size);
+                }
+            }
+            return 0==m_target.close(fd) && result;
+        }
+        bool run_block(storage_benchmark_test test,size_t block_size,storage_benchmark_result& result) {
+            bool reading = storage_benchmark_test::sequential_read==test ||
+                storage_benchmark_test::random_read==test ||
+                storage_benchmark_test::positional_read==test;
+            if(reading && !prepare()) {
+                return fail(result);
+            }
+            int flags = reading?O_RDONLY:storage_benchmark_test::sequential_write==test || storage_benchmark_test::synchronous_write==test?O_WRONLY|O_CREAT|O_TRUNC:O_RDWR|O_CREAT;
+            if(storage_benchmark_test::random_write==test || storage_benchmark_test::positional_write==test) {
+                if(!prepare()) {
+                    return fail(result);
+                }
+            }
+            size_t blocks = m_file_size/block_size;
+            size_t operations = storage_benchmark_test::synchronous_write==test && blocks>synchronous_operations?(size_t)synchronous_operations:blocks;
+            int fd = m_target.open(file_path,flags,0666);
+            if(0>fd) {
+                return fail(result);
+            }
+            uint64_t start = now_us();
+            for(size_t i = 0;i<operations;++i) {
+                off_t offset = (off_t)(random()%blocks)*block_size;
+                uint64_t op_start = now_us();
+                ssize_t res;
+                switch(test) {
+                    case storage_benchmark_test::sequential_read:
+                        res = m_target.read(fd,m_buffer,block_size);
+                        break;
+                    case storage_benchmark_test::random_read:
+                        res = 0<=m_target.lseek(fd,offset,SEEK_SET)?m_target.read(fd,m_buffer,block_size):-1;
+                        break;
+                    case storage_benchmark_test::random_write:
+                        res = 0<=m_target.lseek(fd,offset,SEEK_SET)?m_target.write(fd,m_buffer,block_size):-1;
+                        break;
+                    case storage_benchmark_test::positional_read:
+                        res = m_target.pread(fd,m_buffer,block_size,offset);
+                        break;
+                    case storage_benchmark_test::positional_write:
+                        res = m_target.pwrite(fd,m_buffer,block_size,offset);
+                        break;
+                    case storage_benchmark_test::synchronous_write:
+                        res = m_target.write(fd,m_buffer,block_size);
+                        if(0<res && 0!=m_target.fsync(fd)) {
+                            res = -1;
+                        }
+                        break;
+                    default:
+                        res = m_target.write(fd,m_buffer,block_size);
+                        break;
+                }
+                sample(op_start,now_us());
+                if(reading && m_verify && (ssize_t)block_size==res && !check(block_size)) {
+                    // the data read back isn't what was written
+                    errno = EIO;
+                    res = -1;
+                }
+                if((ssize_t)block_size!=res) {
+                    fail(result);
+                    m_target.close(fd);
+                    return false;
+                }
+                ++result.operations;
+                result.bytes+=block_size;
+            }
+            // buffered data isn't written until it's on the media
+            if(!reading && 0!=m_target.fsync(fd)) {
+                fail(result);
+                m_target.close(fd);
+                return false;
+            }
+            if(0!=m_target.close(fd)) {
+                return fail(result);
+            }
+            return end(result,start);
+        }
+        bool run_files(storage_benchmark_test test,storage_benchmark_result& result) {
+            char path[32];
+            if(0!=m_target.mkdir(directory_path,0777) && EEXIST!=errno) {
+                return fail(result);
+            }
+            if(storage_benchmark_test::create_files!=test) {
+                // the other tests need the files to be there
+                for(size_t i = 0;i<m_file_count;++i) {
+                    file_name(path,i);
+                    int fd = m_target.open(path,O_WRONLY|O_CREAT,0666);
+                    if(0>fd || 0!=m_target.close(fd)) {
+                        return fail(result);
+                    }
+                }
+            }
+            uint64_t start = now_us();
+            if(storage_benchmark_test::list_directory==test) {
+                DIR* dir = m_target.opendir(directory_path);
+                if(nullptr==dir) {
+                    return fail(result);
+                }
+                while(true) {
+                    uint64_t op_start = now_us();
+                    dirent* entry = m_target.readdir(dir);
+                    if(nullptr==entry) {
+                        break;
+                    }
+                    sample(op_start,now_us());
+                    ++result.operations;
+                }
+                m_target.closedir(dir);
+                return end(result,start);
+            }
+            for(size_t i = 0;i<m_file_count;++i) {
+                file_name(path,i);
+                uint64_t op_start = now_us();
+                bool ok;
+                if(storage_benchmark_test::create_files==test) {
+                    int fd = m_target.open(path,O_WRONLY|O_CREAT|O_TRUNC,0666);
+                    ok = 0<=fd && 0==m_target.close(fd);
+                } else {
+                    ok = 0==m_target.unlink(path);
+                }
+                sample(op_start,now_us());
+                if(!ok) {
+                    return fail(result);
+                }
+                ++result.operations;
+            }
+            if(storage_benchmark_test::delete_files==test) {
+                m_target.rmdir(directory_path);
+            }
+            return end(result,start);
+        }
+    public:
+        constexpr static const size_t min_block_size = 512;
+        // blocks up to max_block_size, which should be a power of two. check initialized()
+        // afterward
+        storage_benchmark(storage_benchmark_target& target,size_t file_size = 1024*1024,size_t file_count = 64,size_t max_block_size = 65536) :
+                m_target(target),
+                m_file_size(file_size),
+                m_file_count(file_count),
+                m_max_block_size(max_block_size<min_block_size?(size_t)min_block_size:max_block_size),
+                m_sample_count(0),
+                m_random(0),
+                m_verify(true) {
+            if(m_file_size<m_max_block_size) {
+                m_file_size = m_max_block_size;
+            }
+            m_sample_capacity = m_file_size/min_block_size;
+            if(m_sample_capacity<m_file_count+2) {
+                m_sample_capacity = m_file_count+2;
+            }
+            m_buffer = (uint8_t*)malloc(m_max_block_size);
+            m_samples = new(std::nothrow) uint32_t[m_sample_capacity];
+            if(nullptr!=m_buffer) {
+                for(size_t i = 0;i<m_max_block_size;++i) {
+                    m_buffer[i]=(uint8_t)(i&0xFF);
+                }
+            }
+        }
+        storage_benchmark(const storage_benchmark& rhs)=delete;
+        storage_benchmark& operator=(const storage_benchmark& rhs)=delete;
+        ~storage_benchmark() {
+            ::free(m_buffer);
+            delete[] m_samples;
+        }
+        inline bool initialized() const {
+            return nullptr!=m_buffer && nullptr!=m_samples;
+        }
+        inline size_t max_block_size() const {
+            return m_max_block_size;
+        }
+        // whether reads are checked against what was written. on by default. targets that
+        // don't keep data, like vfs_null, need it off
+        inline bool verify() const {
+            return m_verify;
+        }
+        inline void verify(bool value) {
+            m_verify = value;
+        }
+        // runs one test. block_size is ignored by the file tests. returns false and sets
+        // result.error if an operation failed
+        bool run(storage_benchmark_test test,size_t block_size,storage_benchmark_result& result) {
+            bool blocks = storage_benchmark_test::create_files!=test &&
+                storage_benchmark_test::delete_files!=test &&
+                storage_benchmark_test::list_directory!=test;
+            begin(result,test,blocks?block_size:0);
+            if(!initialized()) {
+                result.error = ENOMEM;
+                return false;
+            }
+            if(blocks && (block_size<min_block_size || block_size>m_max_block_size)) {
+                result.error = EINVAL;
+                return false;
+            }
+            errno = 0;
+            return blocks?run_block(test,block_size,result):run_files(test,result);
+        }
+        // runs every block test at each power of two block size from 512 bytes to
+        // max_block_size, then the file tests, calling callback with each result.
+        // returns false if any of them failed
+        bool run_all(void(*callback)(const storage_benchmark_result& result,void* state),void* state = nullptr) {
+            bool ok = true;
+            storage_benchmark_result result;
+            for(int t = (int)storage_benchmark_test::sequential_write;t<=(int)storage_benchmark_test::synchronous_write;++t) {
+                for(size_t block_size = min_block_size;block_size<=m_max_block_size;block_size*=2) {
+                    ok = run((storage_benchmark_test)t,block_size,result) && ok;
+                    callback(result,state);
+                }
+            }
+            // the listing reads the files create made, and delete cleans them up
+            const storage_benchmark_test file_tests[] = {
+                storage_benchmark_test::create_files,
+                storage_benchmark_test::list_directory,
+                storage_benchmark_test::delete_files
+            };
+            for(size_t i = 0;i<sizeof(file_tests)/sizeof(file_tests[0]);++i) {
+                ok = run(file_tests[i],0,result) && ok;
+                callback(result,state);
+            }
+            m_target.unlink(file_path);
+            return ok;
+        }
+        static const char* name(storage_benchmark_test test) {
+            switch(test) {
+                case storage_benchmark_test::sequential_write: return "seq write";
+                case storage_benchmark_test::sequential_read: return "seq read";
+                case storage_benchmark_test::random_write: return "rand write";
+                case storage_benchmark_test::random_read: return "rand read";
+                case storage_benchmark_test::positional_write: return "pwrite";
+                case storage_benchmark_test::positional_read: return "pread";
+                case storage_benchmark_test::synchronous_write: return "write+fsync";
+                case storage_benchmark_test::create_files: return "create";
+                case storage_benchmark_test::delete_files: return "delete";
+                case storage_benchmark_test::list_directory: return "readdir";
+                default: return "?";
+            }
+        }
+        // prints results as a table, or as comma separated values for comparing runs
+        static void print_header(FILE* out,bool csv = false) {
+            if(csv) {
+                fprintf(out,"target,test,block,ops,bytes,us,kB/s,iops,p50_us,p99_us,max_us,error\n");
+            } else {
+                fprintf(out,"%-12s %6s %7s %10s %9s %7s %7s %7s\n","test","block","ops","kB/s","iops","p50us","p99us","maxus");
+            }
+        }
+        static void print(FILE* out,const storage_benchmark_result& result,const char* target = "",bool csv = false) {
+            if(csv) {
+                fprintf(out,"%s,%s,%u,%u,%llu,%llu,%.1f,%.1f,%u,%u,%u,%d\n",
+                    target,
+                    name(result.test),
+                    (unsigned)result.block_size,
+                    (unsigned)result.operations,
+                    (unsigned long long)result.bytes,
+                    (unsigned long long)result.elapsed_us,
+                    result.bytes_per_second()/1024.0,
+                    result.operations_per_second(),
+                    (unsigned)result.p50_us,
+                    (unsigned)result.p99_us,
+                    (unsigned)result.max_us,
+                    result.error);
+                return;
+            }
+            if(0!=result.error) {
+                fprintf(out,"%-12s %6u failed: %s\n",name(result.test),(unsigned)result.block_size,strerror(result.error));
+                return;
+            }
+            fprintf(out,"%-12s %6u %7u %10.1f %9.1f %7u %7u %7u\n",
+                name(result.test),
+                (unsigned)result.block_size,
+                (unsigned)result.operations,
+                result.bytes_per_second()/1024.0,
+                result.operations_per_second(),
+                (unsigned)result.p50_us,
+                (unsigned)result.p99_us,
+                (unsigned)result.max_us);
+        }
+    };
+}
+#endif
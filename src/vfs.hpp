@@ -1,11 +1,44 @@
 #ifndef HTCW_ESP32_VFS_HPP
 #define HTCW_ESP32_VFS_HPP
 #include <sys/stat.h>
-#include <sys/dirent.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <utime.h>
+#include <sys/uio.h>
+#ifdef ESP_PLATFORM
+#include <sys/dirent.h>
+#include <sys/ioctl.h>
 #include "esp_vfs.h"
+#else
+// host builds have no sdkconfig, so drivers expose the full surface there
+#include <sys/types.h>
+#include <string.h>
+#include <dirent.h>
+#ifndef CONFIG_VFS_SUPPORT_DIR
+#define CONFIG_VFS_SUPPORT_DIR 1
+#endif
+#endif
 #include <atomic>
+#ifdef ESP_PLATFORM
+#include <assert.h>
+#include <new>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include "esp_timer.h"
+#endif
 namespace esp32 {
+#ifdef CONFIG_VFS_SUPPORT_DIR
+    // a directory entry with what stat() would say about it, as read by readdir_plus().
+    // the dates and attributes are in FAT format
+    struct vfs_file_info {
+        uint32_t size;          // 0 for directories
+        uint16_t modified_date; // (year-1980)<<9 | month<<5 | day
+        uint16_t modified_time; // hour<<11 | minute<<5 | second/2
+        uint8_t attributes;     // read only 0x01, hidden 0x02, system 0x04, directory 0x10, archive 0x20
+        char name[13];          // 8.3
+    };
+#endif // CONFIG_VFS_SUPPORT_DIR
     class vfs_driver {
     public:
         virtual ssize_t write(int fd, const void * data, size_t size)=0;
@@ -17,6 +50,68 @@ namespace esp32 {
         virtual int close(int fd)=0;
         virtual int fstat(int fd, struct stat * st)=0;
         virtual int fsync(int fd)=0;
+        // driver specific requests made through ioctl(). there are none by default
+        virtual int ioctl(int /*fd*/, int /*cmd*/, va_list /*args*/) {
+            errno = ENOTTY;
+            return -1;
+        }
+        // the buffers in order, as one call. returns the bytes moved, which are short only
+        // at the end of the file or when the volume fills, or -1 with errno set if nothing
+        // moved. the defaults make a call per buffer, so drivers that can do better should
+        virtual ssize_t readv(int fd, const struct iovec* iov, int count) {
+            if(0>count) {
+                errno = EINVAL;
+                return -1;
+            }
+            ssize_t total = 0;
+            for(int i = 0;i<count;++i) {
+                ssize_t result = read(fd,iov[i].iov_base,iov[i].iov_len);
+                if(0>result) {
+                    return 0==total?result:total;
+                }
+                total+=result;
+                if((size_t)result<iov[i].iov_len) {
+                    break;
+                }
+            }
+            return total;
+        }
+        virtual ssize_t writev(int fd, const struct iovec* iov, int count) {
+            if(0>count) {
+                errno = EINVAL;
+                return -1;
+            }
+            ssize_t total = 0;
+            for(int i = 0;i<count;++i) {
+                ssize_t result = write(fd,iov[i].iov_base,iov[i].iov_len);
+                if(0>result) {
+                    return 0==total?result:total;
+                }
+                total+=result;
+                if((size_t)result<iov[i].iov_len) {
+                    break;
+                }
+            }
+            return total;
+        }
+        virtual ssize_t pwritev(int fd, const struct iovec* iov, int count, off_t offset) {
+            if(0>count) {
+                errno = EINVAL;
+                return -1;
+            }
+            ssize_t total = 0;
+            for(int i = 0;i<count;++i) {
+                ssize_t result = pwrite(fd,iov[i].iov_base,iov[i].iov_len,offset+total);
+                if(0>result) {
+                    return 0==total?result:total;
+                }
+                total+=result;
+                if((size_t)result<iov[i].iov_len) {
+                    break;
+                }
+            }
+            return total;
+        }
 #ifdef CONFIG_VFS_SUPPORT_DIR    
         virtual int stat(const char * path, struct stat * st)=0;
         virtual int link(const char* n1, const char* n2)=0;
@@ -33,6 +128,13 @@ namespace esp32 {
         virtual int access(const char *path, int amode)=0;
         virtual int truncate(const char *path, off_t length)=0;
         virtual int utime(const char *path, const struct utimbuf *times)=0;
+        // reads up to count entries of an open directory, skipping . and .., so a listing
+        // doesn't need a stat() per name. returns the number read, 0 at the end, or -1 with
+        // errno set. drivers that can't fail with ENOTSUP
+        virtual ssize_t readdir_plus(DIR* pdir, vfs_file_info* entries, size_t count) {
+            errno = ENOTSUP;
+            return -1;
+        }
 #endif // CONFIG_VFS_SUPPORT_DIR
     };
     class vfs_null : public vfs_driver {
@@ -126,8 +228,246 @@ namespace esp32 {
         }
 #endif // CONFIG_VFS_SUPPORT_DIR
     };
+#ifdef ESP_PLATFORM
+    enum struct vfs_operation {
+        write = 0,
+        lseek,
+        read,
+        pread,
+        pwrite,
+        open,
+        close,
+        fstat,
+        fsync,
+        ioctl,
+        stat,
+        link,
+        unlink,
+        rename,
+        opendir,
+        readdir,
+        readdir_r,
+        telldir,
+        seekdir,
+        closedir,
+        mkdir,
+        rmdir,
+        access,
+        truncate,
+        utime,
+        readv,
+        writev,
+        pwritev,
+        readdir_plus,
+        count
+    };
+    // a copy of the counters for one operation. the counters are 32 bits so they stay
+    // lock free on the ESP32, and wrap, so take differences between snapshots
+    struct vfs_operation_stats {
+        // bucket i counts calls that took less than 2^i microseconds. the last one
+        // counts the rest
+        constexpr static const size_t buckets = 24;
+        uint32_t calls;
+        uint32_t errors;
+        uint32_t bytes;
+        uint32_t total_us;
+        uint32_t max_us;
+        uint32_t histogram[buckets];
+        // an upper bound on the latency of the given fraction of calls, from the histogram
+        uint32_t percentile_us(double fraction) const {
+            uint64_t total = 0;
+            for(size_t i = 0;i<buckets;++i) {
+                total+=histogram[i];
+            }
+            uint64_t target = (uint64_t)(total*fraction);
+            uint64_t seen = 0;
+            for(size_t i = 0;i<buckets;++i) {
+                seen+=histogram[i];
+                if(seen>target || (0!=seen && seen==total)) {
+                    return i==buckets-1 || (1u<<i)>max_us?max_us:(1u<<i);
+                }
+            }
+            return 0;
+        }
+    };
+    // per mount counters, byte totals and latency histograms, kept by the vfs trampolines
+    // when the driver is mounted with vfs::mount(mount_point,driver,&stats). must outlive
+    // the mount. safe to read from another task at any time
+    class vfs_stats final {
+        friend class vfs;
+        struct counters {
+            std::atomic<uint32_t> calls;
+            std::atomic<uint32_t> errors;
+            std::atomic<uint32_t> bytes;
+            std::atomic<uint32_t> total_us;
+            std::atomic<uint32_t> max_us;
+            std::atomic<uint32_t> histogram[vfs_operation_stats::buckets];
+        };
+        vfs_driver* m_driver;
+        counters m_counters[(size_t)vfs_operation::count];
+        void record(vfs_operation operation,uint32_t us,bool failed,uint32_t bytes) {
+            counters& c = m_counters[(size_t)operation];
+            c.calls.fetch_add(1,std::memory_order_relaxed);
+            if(failed) {
+                c.errors.fetch_add(1,std::memory_order_relaxed);
+            }
+            if(0!=bytes) {
+                c.bytes.fetch_add(bytes,std::memory_order_relaxed);
+            }
+            c.total_us.fetch_add(us,std::memory_order_relaxed);
+            uint32_t max = c.max_us.load(std::memory_order_relaxed);
+            while(us>max && !c.max_us.compare_exchange_weak(max,us,std::memory_order_relaxed)) {
+            }
+            size_t bucket = 0==us?0:32-__builtin_clz(us);
+            if(bucket>=vfs_operation_stats::buckets) {
+                bucket = vfs_operation_stats::buckets-1;
+            }
+            c.histogram[bucket].fetch_add(1,std::memory_order_relaxed);
+        }
+        // the vfs trampolines' view of a mount with stats: ctx is the vfs_stats, and each
+        // call is timed from construction to done()
+        static inline vfs_driver* driver(void* ctx) {
+            return reinterpret_cast<vfs_stats*>(ctx)->m_driver;
+        }
+        class measure final {
+            vfs_stats* m_stats;
+            vfs_operation m_operation;
+            int64_t m_start;
+            inline void record(bool failed,uint32_t bytes) {
+                m_stats->record(m_operation,(uint32_t)(esp_timer_get_time()-m_start),failed,bytes);
+            }
+        public:
+            inline measure(void* ctx,vfs_operation operation) :
+                    m_stats(reinterpret_cast<vfs_stats*>(ctx)),
+                    m_operation(operation),
+                    m_start(esp_timer_get_time()) {
+            }
+            template<typename T>
+            inline T done(T result) {
+                record(0>result,0);
+                return result;
+            }
+            template<typename T>
+            inline T* done(T* result) {
+                record(nullptr==result,0);
+                return result;
+            }
+            // readdir() and seekdir() have no way to fail that can be told from the result
+            inline void done() {
+                record(false,0);
+            }
+            inline ssize_t transferred(ssize_t result) {
+                record(0>result,0<result?(uint32_t)result:0);
+                return result;
+            }
+        };
+    public:
+        vfs_stats() : m_driver(nullptr) {
+            reset();
+        }
+        vfs_stats(const vfs_stats& rhs)=delete;
+        vfs_stats& operator=(const vfs_stats& rhs)=delete;
+        // clears every counter. calls in progress may still land in the old totals
+        void reset() {
+            for(size_t i = 0;i<(size_t)vfs_operation::count;++i) {
+                counters& c = m_counters[i];
+                c.calls.store(0,std::memory_order_relaxed);
+                c.errors.store(0,std::memory_order_relaxed);
+                c.bytes.store(0,std::memory_order_relaxed);
+                c.total_us.store(0,std::memory_order_relaxed);
+                c.max_us.store(0,std::memory_order_relaxed);
+                for(size_t j = 0;j<vfs_operation_stats::buckets;++j) {
+                    c.histogram[j].store(0,std::memory_order_relaxed);
+                }
+            }
+        }
+        void snapshot(vfs_operation operation,vfs_operation_stats& result) const {
+            const counters& c = m_counters[(size_t)operation];
+            result.calls = c.calls.load(std::memory_order_relaxed);
+            result.errors = c.errors.load(std::memory_order_relaxed);
+            result.bytes = c.bytes.load(std::memory_order_relaxed);
+            result.total_us = c.total_us.load(std::memory_order_relaxed);
+            result.max_us = c.max_us.load(std::memory_order_relaxed);
+            for(size_t i = 0;i<vfs_operation_stats::buckets;++i) {
+                result.histogram[i] = c.histogram[i].load(std::memory_order_relaxed);
+            }
+        }
+        static const char* name(vfs_operation operation) {
+            static const char* names[] = {
+                "write","lseek","read","pread","pwrite","open","close","fstat","fsync","ioctl",
+                "stat","link","unlink","rename","opendir","readdir","readdir_r","telldir",
+                "seekdir","closedir","mkdir","rmdir","access","truncate","utime","readv","writev",
+                "pwritev","readdir_plus"
+            };
+            return (size_t)operation<(size_t)vfs_operation::count?names[(size_t)operation]:"?";
+        }
+        // prints a line for each operation that has been called
+        void dump(FILE* out) const {
+            fprintf(out,"%-10s %9s %7s %11s %9s %8s %8s %8s\n","op","calls","errors","bytes","avg_us","p50_us","p99_us","max_us");
+            vfs_operation_stats s;
+            for(size_t i = 0;i<(size_t)vfs_operation::count;++i) {
+                snapshot((vfs_operation)i,s);
+                if(0==s.calls) {
+                    continue;
+                }
+                fprintf(out,"%-10s %9u %7u %11u %9u %8u %8u %8u\n",
+                    name((vfs_operation)i),
+                    (unsigned)s.calls,
+                    (unsigned)s.errors,
+                    (unsigned)s.bytes,
+                    (unsigned)(s.total_us/s.calls),
+                    (unsigned)s.percentile_us(.5),
+                    (unsigned)s.percentile_us(.99),
+                    (unsigned)s.max_us);
+            }
+        }
+    };
     class vfs final {
         static std::atomic<esp_err_t> m_last_error;
+#ifdef CONFIG_VFS_SUPPORT_DIR
+        // what opendir() through a mount hands back: the driver's own DIR, with what
+        // readdir_plus() needs to reach the driver and the mount's stats. esp_vfs fills in
+        // dir, so it comes first. the live ones are kept in a list, so readdir_plus() can
+        // tell them from a DIR of another file system without reading it
+        constexpr static const uint32_t directory_magic = 0x52494456;
+        struct directory final {
+            DIR dir;
+            uint32_t magic; // only checked in debug builds, once the list has found it
+            DIR* inner;
+            void* ctx;
+            ssize_t (*readdir_plus)(void* ctx,DIR* pdir,vfs_file_info* entries,size_t count);
+            directory* next;
+        };
+        static std::mutex m_directories_lock;
+        static directory* m_directories;
+        static inline DIR* inner(DIR* pdir) {
+            return reinterpret_cast<directory*>(pdir)->inner;
+        }
+#endif // CONFIG_VFS_SUPPORT_DIR
+        // esp_vfs_t has no slots for the vectored calls, so they reach the trampolines as
+        // these ioctl() requests, which arrive with the driver's own fd
+        enum vector_command {
+            readv_command = 0x5601,
+            writev_command = 0x5602,
+            pwritev_command = 0x5603
+        };
+        struct vector_request {
+            const struct iovec* iov;
+            int count;
+            off_t offset;
+            ssize_t result;
+        };
+        static ssize_t vector(int fd,int command,const struct iovec* iov,int count,off_t offset) {
+            vector_request request;
+            request.iov = iov;
+            request.count = count;
+            request.offset = offset;
+            request.result = -1;
+            if(0>::ioctl(fd,command,&request)) {
+                return -1;
+            }
+            return request.result;
+        }
         vfs()=delete;
         vfs(const vfs& rhs)=delete;
         vfs& operator=(vfs& rhs)=delete;
@@ -135,79 +475,164 @@ namespace esp32 {
         vfs& operator=(vfs&& rhs)=delete;
         ~vfs()=delete;
 
-        static ssize_t write(void* ctx, int fd, const void * data, size_t size) { return reinterpret_cast<vfs_driver*>(ctx)->write(fd,data,size); }
-        static off_t lseek(void* ctx, int fd, off_t size, int mode) { return reinterpret_cast<vfs_driver*>(ctx)->lseek(fd,size,mode); }
-        static ssize_t read(void* ctx, int fd, void * dst, size_t size) { return reinterpret_cast<vfs_driver*>(ctx)->read(fd,dst,size); }
-        static ssize_t pread(void* ctx, int fd, void *dst, size_t size, off_t offset) { return reinterpret_cast<vfs_driver*>(ctx)->pread(fd,dst,size,offset); }
-        static ssize_t pwrite(void* ctx, int fd, const void *src, size_t size, off_t offset) { return reinterpret_cast<vfs_driver*>(ctx)->pwrite(fd,src,size,offset); }
-        static int open(void* ctx, const char * path, int flags, int mode) { return reinterpret_cast<vfs_driver*>(ctx)->open(path,flags,mode); }
-        static int close(void* ctx, int fd) { return reinterpret_cast<vfs_driver*>(ctx)->close(fd); }
-        static int fstat(void* ctx, int fd, struct stat * st) { return reinterpret_cast<vfs_driver*>(ctx)->fstat(fd,st); }
-        static int fsync(void* ctx, int fd) { return reinterpret_cast<vfs_driver*>(ctx)->fsync(fd); }
+        // the trampolines' view of a plain mount: ctx is the driver, and measuring compiles
+        // away to nothing
+        struct unmeasured final {
+            static inline vfs_driver* driver(void* ctx) {
+                return reinterpret_cast<vfs_driver*>(ctx);
+            }
+            struct measure final {
+                inline measure(void* ctx,vfs_operation operation) {
+                }
+                template<typename T>
+                inline T done(T result) {
+                    return result;
+                }
+                inline void done() {
+                }
+                inline ssize_t transferred(ssize_t result) {
+                    return result;
+                }
+            };
+        };
+        template<typename P> static ssize_t write(void* ctx, int fd, const void * data, size_t size) { typename P::measure m(ctx,vfs_operation::write); return m.transferred(P::driver(ctx)->write(fd,data,size)); }
+        template<typename P> static off_t lseek(void* ctx, int fd, off_t size, int mode) { typename P::measure m(ctx,vfs_operation::lseek); return m.done(P::driver(ctx)->lseek(fd,size,mode)); }
+        template<typename P> static ssize_t read(void* ctx, int fd, void * dst, size_t size) { typename P::measure m(ctx,vfs_operation::read); return m.transferred(P::driver(ctx)->read(fd,dst,size)); }
+        template<typename P> static ssize_t pread(void* ctx, int fd, void *dst, size_t size, off_t offset) { typename P::measure m(ctx,vfs_operation::pread); return m.transferred(P::driver(ctx)->pread(fd,dst,size,offset)); }
+        template<typename P> static ssize_t pwrite(void* ctx, int fd, const void *src, size_t size, off_t offset) { typename P::measure m(ctx,vfs_operation::pwrite); return m.transferred(P::driver(ctx)->pwrite(fd,src,size,offset)); }
+        template<typename P> static int open(void* ctx, const char * path, int flags, int mode) { typename P::measure m(ctx,vfs_operation::open); return m.done(P::driver(ctx)->open(path,flags,mode)); }
+        template<typename P> static int close(void* ctx, int fd) { typename P::measure m(ctx,vfs_operation::close); return m.done(P::driver(ctx)->close(fd)); }
+        template<typename P> static int fstat(void* ctx, int fd, struct stat * st) { typename P::measure m(ctx,vfs_operation::fstat); return m.done(P::driver(ctx)->fstat(fd,st)); }
+        template<typename P> static int fsync(void* ctx, int fd) { typename P::measure m(ctx,vfs_operation::fsync); return m.done(P::driver(ctx)->fsync(fd)); }
+        template<typename P> static int vector(void* ctx, int fd, int cmd, vector_request* request) {
+            switch(cmd) {
+                case readv_command: { typename P::measure m(ctx,vfs_operation::readv); request->result = m.transferred(P::driver(ctx)->readv(fd,request->iov,request->count)); } break;
+                case writev_command: { typename P::measure m(ctx,vfs_operation::writev); request->result = m.transferred(P::driver(ctx)->writev(fd,request->iov,request->count)); } break;
+                default: { typename P::measure m(ctx,vfs_operation::pwritev); request->result = m.transferred(P::driver(ctx)->pwritev(fd,request->iov,request->count,request->offset)); } break;
+            }
+            return 0>request->result?-1:0;
+        }
+        template<typename P> static int ioctl(void* ctx, int fd, int cmd, va_list args) {
+            if(readv_command==cmd || writev_command==cmd || pwritev_command==cmd) {
+                return vector<P>(ctx,fd,cmd,va_arg(args,vector_request*));
+            }
+            typename P::measure m(ctx,vfs_operation::ioctl); return m.done(P::driver(ctx)->ioctl(fd,cmd,args));
+        }
 #ifdef CONFIG_VFS_SUPPORT_DIR    
-        static int stat(void* ctx, const char * path, struct stat * st) { return reinterpret_cast<vfs_driver*>(ctx)->stat(path,st); }
-        static int link(void* ctx, const char* n1, const char* n2) { return reinterpret_cast<vfs_driver*>(ctx)->link(n1,n2); }
-        static int unlink(void* ctx, const char *path) { return reinterpret_cast<vfs_driver*>(ctx)->unlink(path); }
-        static int rename(void* ctx, const char *src, const char *dst) { return reinterpret_cast<vfs_driver*>(ctx)->rename(src,dst); }
-        static DIR* opendir(void* ctx, const char* name) { return reinterpret_cast<vfs_driver*>(ctx)->opendir(name); }
-        static dirent* readdir(void* ctx, DIR* pdir) { return reinterpret_cast<vfs_driver*>(ctx)->readdir(pdir); }
-        static int readdir_r(void* ctx, DIR* pdir, struct dirent* entry, struct dirent** out_dirent) { return reinterpret_cast<vfs_driver*>(ctx)->readdir_r(pdir,entry,out_dirent); }
-        static long telldir(void* ctx, DIR* pdir) { return reinterpret_cast<vfs_driver*>(ctx)->telldir(pdir); }
-        static void seekdir(void* ctx, DIR* pdir, long offset) { return reinterpret_cast<vfs_driver*>(ctx)->seekdir(pdir,offset); }
-        static int closedir(void* ctx, DIR* pdir) { return reinterpret_cast<vfs_driver*>(ctx)->closedir(pdir); }
-        static int mkdir(void* ctx, const char* name, mode_t mode) { return reinterpret_cast<vfs_driver*>(ctx)->mkdir(name,mode); }
-        static int rmdir(void* ctx, const char* name) { return reinterpret_cast<vfs_driver*>(ctx)->rmdir(name); }
-        static int access(void* ctx, const char *path, int amode) { return reinterpret_cast<vfs_driver*>(ctx)->access(path,amode); }
-        static int truncate(void* ctx, const char *path, off_t length) { return reinterpret_cast<vfs_driver*>(ctx)->truncate(path,length); }
-        static int utime(void* ctx, const char *path, const struct utimbuf *times) { return reinterpret_cast<vfs_driver*>(ctx)->utime(path,times); }
-#endif // CONFIG_VFS_SUPPORT_DIR  
-    public:
-
-        static bool mount(const char* mount_point,vfs_driver* driver) {
-            if(nullptr==mount_point || nullptr==driver) {
-                m_last_error=ESP_ERR_INVALID_ARG;
-                return false;
+        template<typename P> static int stat(void* ctx, const char * path, struct stat * st) { typename P::measure m(ctx,vfs_operation::stat); return m.done(P::driver(ctx)->stat(path,st)); }
+        template<typename P> static int link(void* ctx, const char* n1, const char* n2) { typename P::measure m(ctx,vfs_operation::link); return m.done(P::driver(ctx)->link(n1,n2)); }
+        template<typename P> static int unlink(void* ctx, const char *path) { typename P::measure m(ctx,vfs_operation::unlink); return m.done(P::driver(ctx)->unlink(path)); }
+        template<typename P> static int rename(void* ctx, const char *src, const char *dst) { typename P::measure m(ctx,vfs_operation::rename); return m.done(P::driver(ctx)->rename(src,dst)); }
+        template<typename P> static DIR* opendir(void* ctx, const char* name) {
+            typename P::measure m(ctx,vfs_operation::opendir);
+            DIR* pdir = P::driver(ctx)->opendir(name);
+            if(nullptr==pdir) {
+                return m.done(pdir);
             }
-
+            directory* result = new(std::nothrow) directory();
+            if(nullptr==result) {
+                P::driver(ctx)->closedir(pdir);
+                errno = ENOMEM;
+                return m.done((DIR*)nullptr);
+            }
+            result->magic = directory_magic;
+            result->inner = pdir;
+            result->ctx = ctx;
+            result->readdir_plus = &vfs::readdir_plus<P>;
+            std::lock_guard<std::mutex> lock(m_directories_lock);
+            result->next = m_directories;
+            m_directories = result;
+            return m.done(&result->dir);
+        }
+        template<typename P> static dirent* readdir(void* ctx, DIR* pdir) { typename P::measure m(ctx,vfs_operation::readdir); dirent* result = P::driver(ctx)->readdir(inner(pdir)); m.done(); return result; }
+        template<typename P> static int readdir_r(void* ctx, DIR* pdir, struct dirent* entry, struct dirent** out_dirent) { typename P::measure m(ctx,vfs_operation::readdir_r); return m.done(P::driver(ctx)->readdir_r(inner(pdir),entry,out_dirent)); }
+        template<typename P> static long telldir(void* ctx, DIR* pdir) { typename P::measure m(ctx,vfs_operation::telldir); return m.done(P::driver(ctx)->telldir(inner(pdir))); }
+        template<typename P> static void seekdir(void* ctx, DIR* pdir, long offset) { typename P::measure m(ctx,vfs_operation::seekdir); P::driver(ctx)->seekdir(inner(pdir),offset); m.done(); }
+        // the wrapper goes even if the driver fails, since the caller can't use the
+        // directory after closedir() either way
+        template<typename P> static int closedir(void* ctx, DIR* pdir) {
+            typename P::measure m(ctx,vfs_operation::closedir);
+            directory* d = reinterpret_cast<directory*>(pdir);
+            int result = P::driver(ctx)->closedir(d->inner);
+            {
+                std::lock_guard<std::mutex> lock(m_directories_lock);
+                directory** p = &m_directories;
+                while(*p!=d) {
+                    p = &(*p)->next;
+                }
+                *p = d->next;
+            }
+            d->magic = 0;
+            delete d;
+            return m.done(result);
+        }
+        template<typename P> static ssize_t readdir_plus(void* ctx, DIR* pdir, vfs_file_info* entries, size_t count) { typename P::measure m(ctx,vfs_operation::readdir_plus); return m.done(P::driver(ctx)->readdir_plus(pdir,entries,count)); }
+        template<typename P> static int mkdir(void* ctx, const char* name, mode_t mode) { typename P::measure m(ctx,vfs_operation::mkdir); return m.done(P::driver(ctx)->mkdir(name,mode)); }
+        template<typename P> static int rmdir(void* ctx, const char* name) { typename P::measure m(ctx,vfs_operation::rmdir); return m.done(P::driver(ctx)->rmdir(name)); }
+        template<typename P> static int access(void* ctx, const char *path, int amode) { typename P::measure m(ctx,vfs_operation::access); return m.done(P::driver(ctx)->access(path,amode)); }
+        template<typename P> static int truncate(void* ctx, const char *path, off_t length) { typename P::measure m(ctx,vfs_operation::truncate); return m.done(P::driver(ctx)->truncate(path,length)); }
+        template<typename P> static int utime(void* ctx, const char *path, const struct utimbuf *times) { typename P::measure m(ctx,vfs_operation::utime); return m.done(P::driver(ctx)->utime(path,times)); }
+#endif // CONFIG_VFS_SUPPORT_DIR  
+        template<typename P>
+        static bool mount(const char* mount_point,void* ctx) {
             // should be const but I needed to shut the compiler up
             esp_vfs_t vfs = {};
             
             vfs.flags = ESP_VFS_FLAG_CONTEXT_PTR;
-            vfs.write_p = &vfs::write;
-            vfs.lseek_p= &vfs::lseek;
-            vfs.read_p=&vfs::read;
-            vfs.pread_p=&vfs::pread;
-            vfs.pwrite_p=&vfs::pwrite;
-            vfs.open_p=&vfs::open;
-            vfs.close_p=&vfs::close;
-            vfs.fstat_p=&vfs::fstat;
-            vfs.fsync_p=&vfs::fsync;
+            vfs.write_p = &vfs::write<P>;
+            vfs.lseek_p= &vfs::lseek<P>;
+            vfs.read_p=&vfs::read<P>;
+            vfs.pread_p=&vfs::pread<P>;
+            vfs.pwrite_p=&vfs::pwrite<P>;
+            vfs.open_p=&vfs::open<P>;
+            vfs.close_p=&vfs::close<P>;
+            vfs.fstat_p=&vfs::fstat<P>;
+            vfs.fsync_p=&vfs::fsync<P>;
+            vfs.ioctl_p=&vfs::ioctl<P>;
 #ifdef CONFIG_VFS_SUPPORT_DIR
-            vfs.stat_p=&vfs::stat;
-            vfs.link_p=&vfs::link;
-            vfs.unlink_p=&vfs::unlink;
-            vfs.rename_p=&vfs::rename;
-            vfs.opendir_p=&vfs::opendir;
-            vfs.readdir_p=&vfs::readdir;
-            vfs.readdir_r_p=&vfs::readdir_r;
-            vfs.telldir_p=&vfs::telldir;
-            vfs.seekdir_p=&vfs::seekdir;
-            vfs.closedir_p=&vfs::closedir;
-            vfs.mkdir_p=&vfs::mkdir;
-            vfs.rmdir_p=&vfs::rmdir;
-            vfs.access_p=&vfs::access;
-            vfs.truncate_p=&vfs::truncate;
-            vfs.utime_p=&vfs::utime;
+            vfs.stat_p=&vfs::stat<P>;
+            vfs.link_p=&vfs::link<P>;
+            vfs.unlink_p=&vfs::unlink<P>;
+            vfs.rename_p=&vfs::rename<P>;
+            vfs.opendir_p=&vfs::opendir<P>;
+            vfs.readdir_p=&vfs::readdir<P>;
+            vfs.readdir_r_p=&vfs::readdir_r<P>;
+            vfs.telldir_p=&vfs::telldir<P>;
+            vfs.seekdir_p=&vfs::seekdir<P>;
+            vfs.closedir_p=&vfs::closedir<P>;
+            vfs.mkdir_p=&vfs::mkdir<P>;
+            vfs.rmdir_p=&vfs::rmdir<P>;
+            vfs.access_p=&vfs::access<P>;
+            vfs.truncate_p=&vfs::truncate<P>;
+            vfs.utime_p=&vfs::utime<P>;
 #endif
             
             
-            esp_err_t res = esp_vfs_register(mount_point,&vfs,driver);
+            esp_err_t res = esp_vfs_register(mount_point,&vfs,ctx);
             if(ESP_OK!=res) {
                 m_last_error = res;
                 return false;
             }
             return true;
         }
+    public:
+
+        static bool mount(const char* mount_point,vfs_driver* driver) {
+            if(nullptr==mount_point || nullptr==driver) {
+                m_last_error=ESP_ERR_INVALID_ARG;
+                return false;
+            }
+            return mount<unmeasured>(mount_point,driver);
+        }
+        // mounts the driver with every call through it counted and timed in stats
+        static bool mount(const char* mount_point,vfs_driver* driver,vfs_stats* stats) {
+            if(nullptr==mount_point || nullptr==driver || nullptr==stats) {
+                m_last_error=ESP_ERR_INVALID_ARG;
+                return false;
+            }
+            stats->m_driver = driver;
+            return mount<vfs_stats>(mount_point,stats);
+        }
         static bool unmount(const char* mount_point) {
             if(nullptr==mount_point) {
                 m_last_error=ESP_ERR_INVALID_ARG;
@@ -220,9 +645,45 @@ namespace esp32 {
             }
             return true;
         }
-        
+        // vfs_driver::readv(), writev() and pwritev() for a file open on a mounted driver.
+        // fd is the one open() returned
+        static ssize_t readv(int fd,const struct iovec* iov,int count) {
+            return vector(fd,readv_command,iov,count,0);
+        }
+        static ssize_t writev(int fd,const struct iovec* iov,int count) {
+            return vector(fd,writev_command,iov,count,0);
+        }
+        static ssize_t pwritev(int fd,const struct iovec* iov,int count,off_t offset) {
+            return vector(fd,pwritev_command,iov,count,offset);
+        }
+#ifdef CONFIG_VFS_SUPPORT_DIR
+        // vfs_driver::readdir_plus() for a directory from opendir() on a mounted driver,
+        // counted in the mount's stats like readdir(). anything else, like a directory from
+        // another file system or one already closed, fails with EBADF
+        static ssize_t readdir_plus(DIR* pdir,vfs_file_info* entries,size_t count) {
+            directory* d;
+            {
+                std::lock_guard<std::mutex> lock(m_directories_lock);
+                d = m_directories;
+                while(nullptr!=d && &d->dir!=pdir) {
+                    d = d->next;
+                }
+            }
+            if(nullptr==d) {
+                errno = EBADF;
+                return -1;
+            }
+            assert(directory_magic==d->magic);
+            return d->readdir_plus(d->ctx,d->inner,entries,count);
+        }
+#endif // CONFIG_VFS_SUPPORT_DIR
     };
     std::atomic<esp_err_t> vfs::m_last_error {ESP_OK};
+#ifdef CONFIG_VFS_SUPPORT_DIR
+    std::mutex vfs::m_directories_lock;
+    vfs::directory* vfs::m_directories = nullptr;
+#endif // CONFIG_VFS_SUPPORT_DIR
+#endif // ESP_PLATFORM
 
 }
 #endif
\ No newline at end of file
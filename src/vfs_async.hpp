@@ -0,0 +1,301 @@
+#ifndef HTCW_ESP32_VFS_ASYNC_HPP
+#define HTCW_ESP32_VFS_ASYNC_HPP
+// coroutines need C++20. with an older standard this header is empty
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define HTCW_ESP32_VFS_ASYNC 1
+#endif
+#endif
+#ifdef HTCW_ESP32_VFS_ASYNC
+#include <errno.h>
+#include <stdlib.h>
+#include <coroutine>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "vfs.hpp"
+#include "pinned_thread.hpp"
+namespace esp32 {
+    class vfs_executor;
+    // a file operation waiting its turn on a vfs_executor. it lives in the frame of the
+    // coroutine that awaits it until the executor has run it and resumed the coroutine
+    struct vfs_async_request {
+        enum struct operation : uint8_t {
+            // no I/O. just runs the coroutine, to start a task
+            resume,
+            read,
+            write,
+            pread,
+            pwrite,
+            fsync
+        };
+        operation op;
+        vfs_driver* driver;
+        int fd;
+        void* buffer;
+        size_t size;
+        off_t offset;
+        ssize_t result;
+        int error;
+        std::coroutine_handle<> handle;
+        vfs_async_request* next;
+    };
+    // a coroutine run by a vfs_executor, which has to be handed to vfs_executor::spawn()
+    // to start. its frame is freed when it returns. one that is never spawned is freed
+    // with the vfs_task
+    class vfs_task final {
+    public:
+        struct promise_type {
+            vfs_executor* executor = nullptr;
+            vfs_async_request start;
+            vfs_task get_return_object() {
+                return vfs_task(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+            std::suspend_always initial_suspend() noexcept {
+                return {};
+            }
+            std::suspend_never final_suspend() noexcept {
+                return {};
+            }
+            void return_void() {
+            }
+            void unhandled_exception() {
+                abort();
+            }
+            ~promise_type();
+        };
+    private:
+        friend class vfs_executor;
+        std::coroutine_handle<promise_type> m_handle;
+        explicit vfs_task(std::coroutine_handle<promise_type> handle) : m_handle(handle) {
+        }
+    public:
+        vfs_task(const vfs_task& rhs)=delete;
+        vfs_task& operator=(const vfs_task& rhs)=delete;
+        vfs_task(vfs_task&& rhs) : m_handle(rhs.m_handle) {
+            rhs.m_handle = nullptr;
+        }
+        vfs_task& operator=(vfs_task&& rhs) {
+            if(this!=&rhs) {
+                if(m_handle) {
+                    m_handle.destroy();
+                }
+                m_handle = rhs.m_handle;
+                rhs.m_handle = nullptr;
+            }
+            return *this;
+        }
+        ~vfs_task() {
+            if(m_handle) {
+                m_handle.destroy();
+            }
+        }
+    };
+    // one task that runs the file operations of any number of coroutines. the operations
+    // are run first come, first served, and after each one the coroutine that asked for it
+    // is resumed on the executor's task until it awaits the next. so many streams share
+    // one task and one stack, rather than a task and a stack each, but their I/O is
+    // serialized: only one driver call is in flight at a time, and nothing overlaps with
+    // it. the driver calls are made from the executor's task, whose stack has to be big
+    // enough for them. coroutines shouldn't block, since that holds up all the others
+    class vfs_executor final {
+        friend class vfs_task;
+        std::mutex m_lock;
+        std::condition_variable m_ready; // a request was queued, or we're stopping
+        std::condition_variable m_idle; // a task finished
+        vfs_async_request* m_head;
+        vfs_async_request* m_tail;
+        size_t m_tasks; // spawned and not yet returned
+        bool m_stop;
+        bool m_started;
+        std::thread m_thread;
+
+        static void execute(vfs_async_request& request) {
+            errno = 0;
+            switch(request.op) {
+                case vfs_async_request::operation::read:
+                    request.result = request.driver->read(request.fd,request.buffer,request.size);
+                    break;
+                case vfs_async_request::operation::write:
+                    request.result = request.driver->write(request.fd,request.buffer,request.size);
+                    break;
+                case vfs_async_request::operation::pread:
+                    request.result = request.driver->pread(request.fd,request.buffer,request.size,request.offset);
+                    break;
+                case vfs_async_request::operation::pwrite:
+                    request.result = request.driver->pwrite(request.fd,request.buffer,request.size,request.offset);
+                    break;
+                case vfs_async_request::operation::fsync:
+                    request.result = request.driver->fsync(request.fd);
+                    break;
+                default:
+                    request.result = 0;
+                    break;
+            }
+            request.error = 0>request.result?errno:0;
+        }
+        void run() {
+            std::unique_lock<std::mutex> lock(m_lock);
+            while(true) {
+                m_ready.wait(lock,[this]{return nullptr!=m_head || (m_stop && 0==m_tasks);});
+                if(nullptr==m_head) {
+                    // only exit once every task has returned
+                    return;
+                }
+                vfs_async_request* request = m_head;
+                m_head = request->next;
+                if(nullptr==m_head) {
+                    m_tail = nullptr;
+                }
+                lock.unlock();
+                execute(*request);
+                // runs the coroutine until it awaits again, which queues its next
+                // request, or returns
+                request->handle.resume();
+                lock.lock();
+            }
+        }
+        void finished() {
+            std::lock_guard<std::mutex> lock(m_lock);
+            --m_tasks;
+            m_idle.notify_all();
+            m_ready.notify_one();
+        }
+    public:
+        // core is the one the executor's task is pinned to on the ESP32. -1 picks the core
+        // other than the caller's. check initialized() afterward
+        vfs_executor(int core = -1) : m_head(nullptr),m_tail(nullptr),m_tasks(0),m_stop(false),m_started(false) {
+            m_started = start_pinned_thread(m_thread,core,"vfs_executor",[this]{run();});
+        }
+        vfs_executor(const vfs_executor& rhs)=delete;
+        vfs_executor& operator=(const vfs_executor& rhs)=delete;
+        // the task holds this, so it can't move
+        vfs_executor(vfs_executor&& rhs)=delete;
+        vfs_executor& operator=(vfs_executor&& rhs)=delete;
+        // waits for the tasks that are running to return
+        ~vfs_executor() {
+            if(!m_started) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                m_stop = true;
+            }
+            m_ready.notify_one();
+            m_thread.join();
+        }
+        inline bool initialized() const {
+            return m_started;
+        }
+        // queues an operation. the coroutine in it is resumed on the executor's task once
+        // the operation is done
+        void post(vfs_async_request& request) {
+            request.next = nullptr;
+            std::lock_guard<std::mutex> lock(m_lock);
+            if(nullptr==m_tail) {
+                m_head = &request;
+            } else {
+                m_tail->next = &request;
+            }
+            m_tail = &request;
+            m_ready.notify_one();
+        }
+        // starts the task on the executor's task. returns false if the executor isn't
+        // running, in which case the task is freed without having run
+        bool spawn(vfs_task task) {
+            if(!m_started || !task.m_handle) {
+                return false;
+            }
+            std::coroutine_handle<vfs_task::promise_type> handle = task.m_handle;
+            task.m_handle = nullptr;
+            vfs_task::promise_type& promise = handle.promise();
+            promise.executor = this;
+            promise.start.op = vfs_async_request::operation::resume;
+            promise.start.handle = handle;
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                ++m_tasks;
+            }
+            post(promise.start);
+            return true;
+        }
+        // tasks spawned that haven't returned yet
+        size_t tasks() {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_tasks;
+        }
+        // waits until every task spawned has returned. don't call it from a task
+        void wait() {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_idle.wait(lock,[this]{return 0==m_tasks;});
+        }
+    };
+    inline vfs_task::promise_type::~promise_type() {
+        if(nullptr!=executor) {
+            executor->finished();
+        }
+    }
+    // what co_await on a vfs_async_file operation waits on. it yields what the driver
+    // call returned, with errno set from it on failure
+    class vfs_async_operation final {
+        vfs_executor* m_executor;
+        vfs_async_request m_request;
+    public:
+        vfs_async_operation(vfs_executor& executor,vfs_driver& driver,vfs_async_request::operation op,int fd,void* buffer,size_t size,off_t offset) : m_executor(&executor) {
+            m_request.op = op;
+            m_request.driver = &driver;
+            m_request.fd = fd;
+            m_request.buffer = buffer;
+            m_request.size = size;
+            m_request.offset = offset;
+            m_request.result = -1;
+            m_request.error = 0;
+            m_request.next = nullptr;
+        }
+        inline bool await_ready() const {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            m_request.handle = handle;
+            m_executor->post(m_request);
+        }
+        ssize_t await_resume() const {
+            if(0>m_request.result) {
+                errno = m_request.error;
+            }
+            return m_request.result;
+        }
+    };
+    // a file open on a driver, with operations that are awaited from a vfs_task rather
+    // than blocking. fd is the driver's own, from vfs_driver::open(). the buffers have to
+    // stay put until the operation is done, which they will if they're in the coroutine.
+    // the file isn't closed by this
+    class vfs_async_file final {
+        vfs_executor* m_executor;
+        vfs_driver* m_driver;
+        int m_fd;
+    public:
+        vfs_async_file(vfs_executor& executor,vfs_driver& driver,int fd) : m_executor(&executor),m_driver(&driver),m_fd(fd) {
+        }
+        inline int fd() const {
+            return m_fd;
+        }
+        vfs_async_operation async_read(void* destination,size_t size) {
+            return vfs_async_operation(*m_executor,*m_driver,vfs_async_request::operation::read,m_fd,destination,size,0);
+        }
+        vfs_async_operation async_write(const void* source,size_t size) {
+            return vfs_async_operation(*m_executor,*m_driver,vfs_async_request::operation::write,m_fd,(void*)source,size,0);
+        }
+        vfs_async_operation async_pread(void* destination,size_t size,off_t offset) {
+            return vfs_async_operation(*m_executor,*m_driver,vfs_async_request::operation::pread,m_fd,destination,size,offset);
+        }
+        vfs_async_operation async_pwrite(const void* source,size_t size,off_t offset) {
+            return vfs_async_operation(*m_executor,*m_driver,vfs_async_request::operation::pwrite,m_fd,(void*)source,size,offset);
+        }
+        vfs_async_operation async_fsync() {
+            return vfs_async_operation(*m_executor,*m_driver,vfs_async_request::operation::fsync,m_fd,nullptr,0,0);
+        }
+    };
+}
+#endif
+#endif
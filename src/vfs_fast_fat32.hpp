@@ -1,9 +1,16 @@
 #ifndef HTCW_ESP32_VFS_FAST_FAT32_HPP
 #define HTCW_ESP32_VFS_FAST_FAT32_HPP
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+#include <mutex>
 #include "vfs.hpp"
+#include "buffer_allocator.hpp"
 namespace esp32
 {
-    enum vfs_fast_fat32_disk_status : uint8_t 
+    enum vfs_fast_fat32_disk_status : uint8_t
     {
         not_initialized=0x01,
         no_disk=0x02,
@@ -17,7 +24,8 @@ namespace esp32
         directory = 0x10,
         archive = 0x20
     };
-    enum vfs_fast_fat32_hal_result : uint8_t
+    // scoped so it doesn't collide with vfs_fast_fat32_disk_status::write_protected
+    enum struct vfs_fast_fat32_hal_result : uint8_t
     {
         success = 0,
         io_error = 1,
@@ -55,16 +63,760 @@ namespace esp32
         ata_get_model = 21,        // Get model name
         ata_get_serial_number = 22 // Get serial number
     };
+    // driver specific ioctl() requests on an open file, with the argument each one takes
+    enum vfs_fast_fat32_file_command
+    {
+        // (unsigned long length) reserves clusters, contiguous where possible, so the file
+        // can grow to length bytes without allocating. the size doesn't change, and what is
+        // still unused when the file is closed is freed again
+        file_preallocate = 0x4601,
+        // (unsigned long clusters) when the file needs another cluster, reserve this many at
+        // once. 0 or 1 allocates one at a time, which is the default
+        file_grow_clusters = 0x4602
+    };
+    // the block device underneath the driver. the semantics follow FatFs' diskio layer:
+    // get_sector_size fills a uint16_t, get_sector_count and get_block_size fill a uint32_t.
+    // read() and write() are always handed as many consecutive sectors as the driver can
+    // gather, so implementations should issue them as a single transaction
     class vfs_fast_fat32_hal
     {
+    public:
         virtual vfs_fast_fat32_disk_status initialize(uint8_t pdrv) = 0;
         virtual vfs_fast_fat32_disk_status status(uint8_t pdrv) = 0;
         virtual vfs_fast_fat32_hal_result read(uint8_t pdrv, void *buffer, uint32_t sector, unsigned int count) = 0;
         virtual vfs_fast_fat32_hal_result write(uint8_t pdrv, const void *buffer, uint32_t sector, unsigned int count) = 0;
         virtual vfs_fast_fat32_hal_result ioctl(uint8_t pdrv, vfs_fast_fat32_ioctl_command command, void *buffer) = 0;
+        // a hint that these sectors are about to be read. returns how many of them, from the
+        // first, the HAL will fetch ahead of time. the default does no read-ahead
+        virtual unsigned int prefetch(uint8_t /*pdrv*/, uint32_t /*sector*/, unsigned int /*count*/)
+        {
+            return 0;
+        }
+    };
+    // a write-back sector cache shared by everything on a volume. sectors are held in lines
+    // of consecutive sectors so that the dirty runs within a line go out as a single
+    // multi-sector write. lines are evicted with the CLOCK algorithm
+    template <typename Allocator>
+    class vfs_fast_fat32_cache
+    {
+        constexpr static const uint16_t none = 0xFFFF;
+        struct line
+        {
+            uint32_t sector; // first sector, when used
+            uint32_t valid;  // bitmask of loaded sectors
+            uint32_t dirty;  // bitmask of modified sectors
+            uint16_t next;   // hash chain
+            uint8_t referenced;
+            uint8_t used; // holds sector and is in its bucket's chain
+            uint8_t *data;
+        };
+        vfs_fast_fat32_hal *m_hal;
+        uint8_t m_pdrv;
+        uint16_t m_sector_size;
+        uint32_t m_line_sectors; // power of two, at most 32
+        uint32_t m_first;        // lines start here and at every m_line_sectors after, in line with align
+        line *m_lines;
+        uint16_t m_line_count;
+        uint16_t *m_buckets;
+        uint16_t m_bucket_mask;
+        uint16_t m_hand;
+        uint8_t *m_data;
+        // dirty sectors in this range are also written at each copy past it (the FATs)
+        uint32_t m_mirror_sector;
+        uint32_t m_mirror_count;
+        uint8_t m_mirror_copies;
+
+        // the sectors before m_first make a shorter line at 0, rather than the end of one that
+        // would start below 0
+        inline uint32_t line_start(uint32_t sector) const
+        {
+            return sector < m_first ? 0 : sector - ((sector - m_first) & (m_line_sectors - 1));
+        }
+        inline uint32_t line_length(uint32_t start) const
+        {
+            return start < m_first ? m_first : m_line_sectors;
+        }
+        inline uint16_t &bucket(uint32_t start)
+        {
+            return m_buckets[(start / m_line_sectors) & m_bucket_mask];
+        }
+        line *find(uint32_t start)
+        {
+            uint16_t i = bucket(start);
+            while (none != i)
+            {
+                if (m_lines[i].sector == start)
+                {
+                    return &m_lines[i];
+                }
+                i = m_lines[i].next;
+            }
+            return nullptr;
+        }
+        void unlink(line &l)
+        {
+            uint16_t index = (uint16_t)(&l - m_lines);
+            uint16_t *p = &bucket(l.sector);
+            while (none != *p)
+            {
+                if (*p == index)
+                {
+                    *p = l.next;
+                    break;
+                }
+                p = &m_lines[*p].next;
+            }
+            l.used = 0;
+            l.valid = 0;
+            l.dirty = 0;
+        }
+        int write_sectors(const uint8_t *data, uint32_t sector, uint32_t count)
+        {
+            int res = to_errno(m_hal->write(m_pdrv, data, sector, count));
+            if (0 != res || 0 == m_mirror_copies)
+            {
+                return res;
+            }
+            uint32_t end = sector + count;
+            uint32_t mirror_end = m_mirror_sector + m_mirror_count;
+            uint32_t first = sector > m_mirror_sector ? sector : m_mirror_sector;
+            uint32_t last = end < mirror_end ? end : mirror_end;
+            for (uint32_t i = 1; first < last && i < m_mirror_copies; ++i)
+            {
+                res = to_errno(m_hal->write(m_pdrv, data + (first - sector) * m_sector_size, first + i * m_mirror_count, last - first));
+                if (0 != res)
+                {
+                    return res;
+                }
+            }
+            return 0;
+        }
+        // writes the dirty runs of a line, each as one transaction
+        int write_line(line &l)
+        {
+            uint32_t i = 0;
+            while (0 != l.dirty && i < m_line_sectors)
+            {
+                if (!(l.dirty & (1u << i)))
+                {
+                    ++i;
+                    continue;
+                }
+                uint32_t start = i;
+                while (i < m_line_sectors && (l.dirty & (1u << i)))
+                {
+                    ++i;
+                }
+                int res = write_sectors(l.data + start * m_sector_size, l.sector + start, i - start);
+                if (0 != res)
+                {
+                    return res;
+                }
+                for (uint32_t j = start; j < i; ++j)
+                {
+                    l.dirty &= ~(1u << j);
+                }
+            }
+            return 0;
+        }
+        // picks a line to reuse, writing it back first if needed
+        line *evict(int &res)
+        {
+            while (true)
+            {
+                line &l = m_lines[m_hand];
+                m_hand = (uint16_t)((m_hand + 1) % m_line_count);
+                if (l.referenced)
+                {
+                    l.referenced = 0;
+                    continue;
+                }
+                if (l.used)
+                {
+                    res = write_line(l);
+                    if (0 != res)
+                    {
+                        return nullptr;
+                    }
+                    unlink(l);
+                }
+                return &l;
+            }
+        }
+
+    public:
+        vfs_fast_fat32_cache() : m_hal(nullptr), m_lines(nullptr), m_line_count(0), m_buckets(nullptr), m_data(nullptr)
+        {
+        }
+        vfs_fast_fat32_cache(const vfs_fast_fat32_cache &rhs) = delete;
+        vfs_fast_fat32_cache &operator=(const vfs_fast_fat32_cache &rhs) = delete;
+        ~vfs_fast_fat32_cache()
+        {
+            release();
+        }
+        static int to_errno(vfs_fast_fat32_hal_result result)
+        {
+            switch (result)
+            {
+            case vfs_fast_fat32_hal_result::success:
+                return 0;
+            case vfs_fast_fat32_hal_result::write_protected:
+                return EROFS;
+            case vfs_fast_fat32_hal_result::not_ready:
+                return ENODEV;
+            case vfs_fast_fat32_hal_result::invalid_paramter:
+                return EINVAL;
+            default:
+                return EIO;
+            }
+        }
+        // allocates about size bytes of cache in lines of about line_size bytes. lines are
+        // aligned to align so that they can line up with clusters
+        bool initialize(vfs_fast_fat32_hal &hal, uint8_t pdrv, uint16_t sector_size, size_t size, size_t line_size, uint32_t align)
+        {
+            release();
+            uint32_t line_sectors = 1;
+            while (line_sectors < 32 && (line_sectors * 2) * sector_size <= line_size)
+            {
+                line_sectors *= 2;
+            }
+            size_t count = size / (line_sectors * sector_size);
+            if (count < 2)
+            {
+                count = 2;
+            }
+            if (count > 0xFFFE)
+            {
+                count = 0xFFFE;
+            }
+            uint16_t buckets = 1;
+            while (buckets < count)
+            {
+                buckets *= 2;
+            }
+            m_lines = allocate_array<Allocator, line>(count, buffer_kind::object);
+            m_buckets = allocate_array<Allocator, uint16_t>(buckets, buffer_kind::object);
+            m_data = (uint8_t *)Allocator::allocate(count * line_sectors * sector_size, buffer_kind::transfer);
+            if (nullptr == m_lines || nullptr == m_buckets || nullptr == m_data)
+            {
+                release();
+                return false;
+            }
+            m_hal = &hal;
+            m_pdrv = pdrv;
+            m_sector_size = sector_size;
+            m_line_sectors = line_sectors;
+            m_first = align & (line_sectors - 1);
+            m_line_count = (uint16_t)count;
+            m_bucket_mask = (uint16_t)(buckets - 1);
+            m_hand = 0;
+            m_mirror_copies = 0;
+            for (uint16_t i = 0; i < buckets; ++i)
+            {
+                m_buckets[i] = none;
+            }
+            for (uint16_t i = 0; i < m_line_count; ++i)
+            {
+                m_lines[i].used = 0;
+                m_lines[i].valid = 0;
+                m_lines[i].dirty = 0;
+                m_lines[i].next = none;
+                m_lines[i].referenced = 0;
+                m_lines[i].data = m_data + (size_t)i * line_sectors * sector_size;
+            }
+            return true;
+        }
+        // frees the cache without writing it back
+        void release()
+        {
+            deallocate_array<Allocator>(m_lines, m_line_count);
+            m_lines = nullptr;
+            deallocate_array<Allocator>(m_buckets, (size_t)m_bucket_mask + 1);
+            m_buckets = nullptr;
+            Allocator::deallocate(m_data);
+            m_data = nullptr;
+            m_line_count = 0;
+        }
+        inline bool initialized() const
+        {
+            return nullptr != m_data;
+        }
+        inline size_t size() const
+        {
+            return (size_t)m_line_count * m_line_sectors * m_sector_size;
+        }
+        // dirty sectors written in the range are duplicated to the following copies-1 ranges
+        void mirror(uint32_t sector, uint32_t count, uint8_t copies)
+        {
+            m_mirror_sector = sector;
+            m_mirror_count = count;
+            m_mirror_copies = copies > 1 ? copies : 0;
+        }
+        // returns the cached sector. if load is false and the sector isn't cached the contents
+        // are undefined and the caller must fill all of it. on a load miss the following
+        // uncached sectors of the line are read in the same transaction
+        uint8_t *get(uint32_t sector, bool load, int &res)
+        {
+            res = 0;
+            uint32_t start = line_start(sector);
+            line *l = find(start);
+            if (nullptr == l)
+            {
+                l = evict(res);
+                if (nullptr == l)
+                {
+                    return nullptr;
+                }
+                l->sector = start;
+                l->used = 1;
+                uint16_t &head = bucket(start);
+                l->next = head;
+                head = (uint16_t)(l - m_lines);
+            }
+            l->referenced = 1;
+            uint32_t index = sector - start;
+            uint8_t *result = l->data + index * m_sector_size;
+            if (!(l->valid & (1u << index)))
+            {
+                if (load)
+                {
+                    uint32_t end = index + 1;
+                    uint32_t length = line_length(start);
+                    while (end < length && !(l->valid & (1u << end)))
+                    {
+                        ++end;
+                    }
+                    res = to_errno(m_hal->read(m_pdrv, result, sector, end - index));
+                    if (0 != res)
+                    {
+                        return nullptr;
+                    }
+                    for (uint32_t i = index; i < end; ++i)
+                    {
+                        l->valid |= (1u << i);
+                    }
+                }
+                else
+                {
+                    l->valid |= (1u << index);
+                }
+            }
+            return result;
+        }
+        // marks a sector returned by get() as modified
+        void dirty(uint32_t sector)
+        {
+            uint32_t start = line_start(sector);
+            line *l = find(start);
+            if (nullptr != l)
+            {
+                l->dirty |= (1u << (sector - start));
+            }
+        }
+        // writes back every dirty sector in ascending order
+        int flush()
+        {
+            while (true)
+            {
+                line *lowest = nullptr;
+                for (uint16_t i = 0; i < m_line_count; ++i)
+                {
+                    if (0 != m_lines[i].dirty && (nullptr == lowest || m_lines[i].sector < lowest->sector))
+                    {
+                        lowest = &m_lines[i];
+                    }
+                }
+                if (nullptr == lowest)
+                {
+                    return 0;
+                }
+                int res = write_line(*lowest);
+                if (0 != res)
+                {
+                    return res;
+                }
+            }
+        }
+        // reads sectors straight into buffer, after writing back any cached changes to them
+        int read(void *buffer, uint32_t sector, uint32_t count)
+        {
+            for (uint32_t start = line_start(sector); start < sector + count; start += line_length(start))
+            {
+                line *l = find(start);
+                if (nullptr != l && 0 != l->dirty)
+                {
+                    int res = write_line(*l);
+                    if (0 != res)
+                    {
+                        return res;
+                    }
+                }
+            }
+            return to_errno(m_hal->read(m_pdrv, buffer, sector, count));
+        }
+        // writes sectors straight from buffer, dropping any cached copies of them
+        int write(const void *buffer, uint32_t sector, uint32_t count)
+        {
+            for (uint32_t start = line_start(sector); start < sector + count; start += line_length(start))
+            {
+                line *l = find(start);
+                if (nullptr == l)
+                {
+                    continue;
+                }
+                for (uint32_t i = 0; i < m_line_sectors; ++i)
+                {
+                    if (start + i >= sector && start + i < sector + count)
+                    {
+                        l->valid &= ~(1u << i);
+                        l->dirty &= ~(1u << i);
+                    }
+                }
+                if (0 == l->valid)
+                {
+                    unlink(*l);
+                }
+            }
+            return write_sectors((const uint8_t *)buffer, sector, count);
+        }
     };
-    class vfs_fast_fat32 : public vfs_driver
+    // an in-memory index of the live entries of the most recently used directories, so a
+    // name is found without scanning the directory. each directory is a hash table of 8.3
+    // names to the cluster and byte position of the entry, plus the first slot a new entry
+    // could go in. the tables share a budget of size bytes, and the least recently used
+    // directory is dropped whole to make room. a hit is only a hint: the caller checks the
+    // entry it points at. a directory too big for the budget is marked so it's scanned
+    // instead, without trying to index it again
+    template <typename Allocator>
+    class vfs_fast_fat32_directory_index
     {
+    public:
+        constexpr static const uint32_t empty = 0xFFFFFFFF;
+        constexpr static const uint32_t erased = 0xFFFFFFFE;
+        struct slot
+        {
+            uint32_t hash;
+            uint32_t position; // byte offset in the directory, or empty or erased
+            uint32_t cluster;  // the cluster holding position
+        };
+        struct directory
+        {
+            uint32_t start_cluster; // 0 when unused
+            uint32_t last_used;
+            uint32_t count;   // entries in the table
+            uint32_t erased;  // erased slots in the table
+            uint32_t mask;    // slots-1
+            slot *slots;      // nullptr when the directory is too big to index
+            // no free slot comes before this one
+            uint32_t free_position;
+            uint32_t free_cluster;
+        };
+        constexpr static const size_t max_directories = 8;
+
+    private:
+        directory m_directories[max_directories];
+        size_t m_size;
+        size_t m_used;
+        uint32_t m_clock;
+        inline static size_t bytes(uint32_t slots)
+        {
+            return sizeof(slot) * slots;
+        }
+        void release(directory &d)
+        {
+            if (nullptr != d.slots)
+            {
+                Allocator::deallocate(d.slots);
+                m_used -= bytes(d.mask + 1);
+            }
+            d.start_cluster = 0;
+            d.slots = nullptr;
+        }
+        // frees the least recently used directories other than keep until size more bytes fit
+        bool make_room(size_t size, const directory *keep)
+        {
+            while (m_used + size > m_size)
+            {
+                directory *oldest = nullptr;
+                for (size_t i = 0; i < max_directories; ++i)
+                {
+                    directory &d = m_directories[i];
+                    if (&d != keep && nullptr != d.slots && (nullptr == oldest || d.last_used < oldest->last_used))
+                    {
+                        oldest = &d;
+                    }
+                }
+                if (nullptr == oldest)
+                {
+                    return false;
+                }
+                release(*oldest);
+            }
+            return true;
+        }
+        // rebuilds the table at the given number of slots, which drops the erased ones
+        bool resize(directory &d, uint32_t slots)
+        {
+            size_t old_bytes = nullptr == d.slots ? 0 : bytes(d.mask + 1);
+            if (bytes(slots) > m_size || !make_room(bytes(slots), &d))
+            {
+                return false;
+            }
+            slot *table = (slot *)Allocator::allocate(bytes(slots), buffer_kind::cache);
+            if (nullptr == table)
+            {
+                return false;
+            }
+            for (uint32_t i = 0; i < slots; ++i)
+            {
+                table[i].position = empty;
+            }
+            if (nullptr != d.slots)
+            {
+                for (uint32_t i = 0; i <= d.mask; ++i)
+                {
+                    const slot &s = d.slots[i];
+                    if (s.position < erased)
+                    {
+                        uint32_t j = s.hash & (slots - 1);
+                        while (empty != table[j].position)
+                        {
+                            j = (j + 1) & (slots - 1);
+                        }
+                        table[j] = s;
+                    }
+                }
+                Allocator::deallocate(d.slots);
+            }
+            m_used = m_used - old_bytes + bytes(slots);
+            d.slots = table;
+            d.mask = slots - 1;
+            d.erased = 0;
+            return true;
+        }
+
+    public:
+        vfs_fast_fat32_directory_index() : m_size(0), m_used(0), m_clock(0)
+        {
+            for (size_t i = 0; i < max_directories; ++i)
+            {
+                m_directories[i].start_cluster = 0;
+                m_directories[i].slots = nullptr;
+            }
+        }
+        vfs_fast_fat32_directory_index(const vfs_fast_fat32_directory_index &rhs) = delete;
+        vfs_fast_fat32_directory_index &operator=(const vfs_fast_fat32_directory_index &rhs) = delete;
+        ~vfs_fast_fat32_directory_index()
+        {
+            clear();
+        }
+        // the budget for all the tables. 0 turns the index off
+        inline size_t size() const
+        {
+            return m_size;
+        }
+        void size(size_t value)
+        {
+            clear();
+            m_size = value;
+        }
+        // bytes of tables currently held
+        inline size_t used() const
+        {
+            return m_used;
+        }
+        void clear()
+        {
+            for (size_t i = 0; i < max_directories; ++i)
+            {
+                release(m_directories[i]);
+            }
+        }
+        // FNV-1a over the 11 bytes of the 8.3 name
+        static uint32_t hash(const uint8_t *name)
+        {
+            uint32_t result = 2166136261u;
+            for (size_t i = 0; i < 11; ++i)
+            {
+                result = (result ^ name[i]) * 16777619u;
+            }
+            return result;
+        }
+        // the index of a directory, or nullptr if it hasn't been built
+        directory *find(uint32_t start_cluster)
+        {
+            for (size_t i = 0; i < max_directories; ++i)
+            {
+                directory &d = m_directories[i];
+                if (d.start_cluster == start_cluster && 0 != start_cluster)
+                {
+                    d.last_used = ++m_clock;
+                    return &d;
+                }
+            }
+            return nullptr;
+        }
+        // starts an empty index for a directory, taking the place of the least recently
+        // used one if they're all taken. returns nullptr when the index is off
+        directory *create(uint32_t start_cluster)
+        {
+            if (0 == m_size)
+            {
+                return nullptr;
+            }
+            directory *result = nullptr;
+            for (size_t i = 0; i < max_directories; ++i)
+            {
+                directory &d = m_directories[i];
+                if (d.start_cluster == start_cluster || 0 == d.start_cluster)
+                {
+                    result = &d;
+                    break;
+                }
+                if (nullptr == result || d.last_used < result->last_used)
+                {
+                    result = &d;
+                }
+            }
+            release(*result);
+            result->start_cluster = start_cluster;
+            result->last_used = ++m_clock;
+            result->count = 0;
+            result->erased = 0;
+            result->mask = 0;
+            result->free_position = empty;
+            result->free_cluster = 0;
+            if (!resize(*result, 16))
+            {
+                // marked as too big
+                result->slots = nullptr;
+            }
+            return result;
+        }
+        // forgets a directory, for one that was deleted or rewritten
+        void drop(uint32_t start_cluster)
+        {
+            for (size_t i = 0; i < max_directories; ++i)
+            {
+                if (m_directories[i].start_cluster == start_cluster)
+                {
+                    release(m_directories[i]);
+                }
+            }
+        }
+        // adds an entry. when the table can't grow, the directory is marked as too big and
+        // false is returned
+        bool add(directory &d, uint32_t name_hash, uint32_t position, uint32_t cluster)
+        {
+            if (nullptr == d.slots)
+            {
+                return false;
+            }
+            if ((d.count + d.erased + 1) * 4 > (d.mask + 1) * 3)
+            {
+                // rebuilt at no more than half full, which also clears the erased slots
+                uint32_t slots = 16;
+                while ((d.count + 1) * 2 > slots)
+                {
+                    slots *= 2;
+                }
+                if (!resize(d, slots))
+                {
+                    uint32_t start_cluster = d.start_cluster;
+                    release(d);
+                    d.start_cluster = start_cluster;
+                    return false;
+                }
+            }
+            uint32_t i = name_hash & d.mask;
+            while (d.slots[i].position < erased)
+            {
+                i = (i + 1) & d.mask;
+            }
+            if (erased == d.slots[i].position)
+            {
+                --d.erased;
+            }
+            d.slots[i].hash = name_hash;
+            d.slots[i].position = position;
+            d.slots[i].cluster = cluster;
+            ++d.count;
+            return true;
+        }
+        // removes the entry at position, and makes its slot in the directory the first free
+        // one if it comes earlier
+        void erase(directory &d, uint32_t name_hash, uint32_t position, uint32_t cluster)
+        {
+            if (position < d.free_position)
+            {
+                d.free_position = position;
+                d.free_cluster = cluster;
+            }
+            if (nullptr == d.slots)
+            {
+                return;
+            }
+            for (uint32_t i = name_hash & d.mask; empty != d.slots[i].position; i = (i + 1) & d.mask)
+            {
+                if (d.slots[i].position == position)
+                {
+                    d.slots[i].position = erased;
+                    --d.count;
+                    ++d.erased;
+                    return;
+                }
+            }
+        }
+    };
+    // a FAT32 driver that moves sector aligned data straight between the caller and the HAL
+    // in as few multi-sector transactions as the cluster chain allows. Only 8.3 names are
+    // supported (like CONFIG_FATFS_LFN_NONE). its buffers come from Allocator, a policy
+    // from buffer_allocator.hpp. vfs_fast_fat32 is the one that uses the heap
+    template <typename Allocator = heap_allocator>
+    class basic_vfs_fast_fat32 : public vfs_driver
+    {
+        constexpr static const uint32_t cluster_mask = 0x0FFFFFFF;
+        constexpr static const uint32_t cluster_bad = 0x0FFFFFF7;
+        constexpr static const uint32_t cluster_eoc = 0x0FFFFFFF;
+        constexpr static const uint32_t unknown = 0xFFFFFFFF;
+        // fn[11] status flags
+        constexpr static const uint8_t name_body_lower = 0x08; // same as the NTRes bit
+        constexpr static const uint8_t name_ext_lower = 0x10;  // same as the NTRes bit
+        constexpr static const uint8_t name_last = 0x04;
+        constexpr static const uint8_t name_dot = 0x20;
+        constexpr static const uint8_t name_none = 0x80;
+        // directory entry offsets
+        constexpr static const size_t entry_size = 32;
+        constexpr static const size_t entry_attributes = 11;
+        constexpr static const size_t entry_nt_res = 12;
+        constexpr static const size_t entry_create_time = 14;
+        constexpr static const size_t entry_access_date = 18;
+        constexpr static const size_t entry_cluster_high = 20;
+        constexpr static const size_t entry_modified_time = 22;
+        constexpr static const size_t entry_cluster_low = 26;
+        constexpr static const size_t entry_size_field = 28;
+        constexpr static const uint8_t entry_deleted = 0xE5;
+        constexpr static const uint8_t attributes_lfn = 0x0F;
+        constexpr static const uint8_t attributes_volume = 0x08;
+        // the most clusters read ahead of a sequential reader
+        constexpr static const uint16_t read_ahead_max = 64;
+        // file_entry::flags
+        enum file_flags : uint8_t
+        {
+            file_read = 0x01,
+            file_write = 0x02,
+            file_append = 0x04,
+            file_reserved = 0x08, // the chain may run past the end of the file
+            file_modified = 0x40,
+            file_open = 0x80
+        };
+        // a run of physically contiguous clusters in a file
+        struct file_extent
+        {
+            uint32_t index;   // index of the first cluster within the file
+            uint32_t cluster; // the first cluster
+            uint32_t count;
+        };
         struct object_id
         {
             uint16_t mount_id;                  // volume mount id
@@ -82,11 +834,18 @@ namespace esp32
             uint8_t flags;
             uint8_t error;
             uint32_t position;
-            uint32_t cluster;
-            uint32_t sector;
+            uint32_t cluster;       // the cluster holding cluster_index, or 0
+            uint32_t cluster_index; // index of cluster within the chain
+            file_extent *extents;   // the first mapped clusters of the chain
+            uint16_t extent_count;
+            uint16_t extent_capacity;
+            uint32_t mapped;        // number of clusters covered by extents
+            uint16_t grow_clusters; // clusters to reserve whenever the chain runs out
+            uint32_t read_next;     // where a sequential read would continue
+            uint32_t prefetched;    // the HAL was asked to fetch up to here
+            uint16_t read_window;   // clusters to read ahead of the position
             uint32_t directory_sector;
-            uint8_t *directory_pointer;
-            uint8_t buffer[16384];
+            uint16_t directory_offset;
         };
         struct directory_entry : public file_system_entry
         {
@@ -96,22 +855,3245 @@ namespace esp32
             uint8_t *directory_pointer;
             uint8_t fn[12];
         };
-        struct file_info
+        struct directory_handle
         {
-            uint32_t size;
-            uint16_t modified_date;
-            uint16_t modified_time;
-            vfs_fast_fat32_attributes attributes;
-            char name[13];
+#ifdef ESP_PLATFORM
+            DIR dir; // must come first. esp_vfs fills in dd_vfs_idx
+#endif
+            directory_entry entry;
+            struct dirent result;
+        };
+        static std::atomic<uint16_t> m_mount_count;
+        vfs_fast_fat32_hal *m_hal;
+        uint8_t m_pdrv;
+        int m_last_error;
+        uint16_t m_mount_id;
+        std::mutex m_lock;
+        uint16_t m_sector_size;
+        uint8_t m_sector_shift;
+        uint8_t m_cluster_sectors;
+        uint32_t m_cluster_size;
+        uint8_t m_cluster_shift;
+        bool m_shift_math; // the cluster size is a power of two
+        uint32_t m_volume_sector;
+        uint32_t m_fat_sector;
+        uint32_t m_fat_sectors; // per FAT
+        uint8_t m_fat_count;
+        uint32_t m_data_sector;
+        uint32_t m_cluster_count; // valid clusters are 2 to m_cluster_count+1
+        uint32_t m_root_cluster;
+        uint32_t m_fsinfo_sector;
+        uint32_t m_free_clusters;
+        uint32_t m_next_free;
+        bool m_fsinfo_dirty;
+        // one bit per cluster from cluster 2, set when it's free. it is built from the FAT a
+        // step at a time, and only covers the first m_free_map_clusters clusters until done
+        bool m_use_free_map;
+        uint32_t *m_free_map;
+        uint8_t *m_free_map_buffer; // FAT sectors being scanned. null once the map is complete
+        uint32_t m_free_map_clusters;
+        uint32_t m_free_map_count; // free clusters in the part covered so far
+        // runs of clusters freed since the last trim, for the HAL's control_trim
+        constexpr static const size_t max_trim_runs = 16;
+        struct trim_run
+        {
+            uint32_t first;
+            uint32_t count;
         };
+        bool m_trim;
+        trim_run m_trims[max_trim_runs];
+        size_t m_trim_count;
+        vfs_fast_fat32_cache<Allocator> m_cache;
+        typedef vfs_fast_fat32_directory_index<Allocator> directory_index;
+        directory_index m_index;
+        size_t m_cache_size;
+        size_t m_cache_line_size;
+        // the cached sector currently used for FAT and directory access, as in FatFs. only
+        // valid until the next cache access
+        uint8_t *m_window;
+        uint32_t m_window_sector;
+        file_entry *m_files;
+        size_t m_max_files;
+        file_extent *m_extents;
+        size_t m_max_extents; // per file
+
+        static uint16_t ld_16(const uint8_t *p)
+        {
+            return (uint16_t)(p[0] | (p[1] << 8));
+        }
+        static uint32_t ld_32(const uint8_t *p)
+        {
+            return ((uint32_t)p[0]) | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        }
+        static void st_16(uint8_t *p, uint16_t value)
+        {
+            p[0] = (uint8_t)value;
+            p[1] = (uint8_t)(value >> 8);
+        }
+        static void st_32(uint8_t *p, uint32_t value)
+        {
+            p[0] = (uint8_t)value;
+            p[1] = (uint8_t)(value >> 8);
+            p[2] = (uint8_t)(value >> 16);
+            p[3] = (uint8_t)(value >> 24);
+        }
         static uint32_t get_time()
         {
-            time_t t = time(NULL);
+            return to_fat_time(time(NULL));
+        }
+        static uint32_t to_fat_time(time_t t)
+        {
             struct tm tmr;
             localtime_r(&t, &tmr);
             int year = tmr.tm_year < 80 ? 0 : tmr.tm_year - 80;
             return ((uint32_t)(year) << 25) | ((uint32_t)(tmr.tm_mon + 1) << 21) | ((uint32_t)tmr.tm_mday << 16) | (uint32_t)(tmr.tm_hour << 11) | (uint32_t)(tmr.tm_min << 5) | (uint32_t)(tmr.tm_sec >> 1);
         }
+        static time_t from_fat_time(uint16_t date, uint16_t time)
+        {
+            struct tm tmr;
+            memset(&tmr, 0, sizeof(tmr));
+            tmr.tm_year = (date >> 9) + 80;
+            tmr.tm_mon = ((date >> 5) & 15) - 1;
+            tmr.tm_mday = date & 31;
+            tmr.tm_hour = time >> 11;
+            tmr.tm_min = (time >> 5) & 63;
+            tmr.tm_sec = (time & 31) * 2;
+            tmr.tm_isdst = -1;
+            return mktime(&tmr);
+        }
+        static int fail(int error)
+        {
+            errno = error;
+            return -1;
+        }
+        inline uint32_t cluster_to_sector(uint32_t cluster) const
+        {
+            return m_data_sector + (cluster - 2) * m_cluster_sectors;
+        }
+        inline bool valid_cluster(uint32_t cluster) const
+        {
+            return cluster >= 2 && cluster < m_cluster_count + 2;
+        }
+        inline bool mounted() const
+        {
+            return m_cache.initialized();
+        }
+        // sector access. file data bypasses the cache, which keeps itself coherent
+        int read_sectors(void *buffer, uint32_t sector, unsigned int count)
+        {
+            return m_cache.read(buffer, sector, count);
+        }
+        int write_sectors(const void *buffer, uint32_t sector, unsigned int count)
+        {
+            m_window_sector = unknown;
+            return m_cache.write(buffer, sector, count);
+        }
+        int move_window(uint32_t sector)
+        {
+            if (sector == m_window_sector)
+            {
+                return 0;
+            }
+            int res;
+            uint8_t *p = m_cache.get(sector, true, res);
+            if (nullptr == p)
+            {
+                m_window_sector = unknown;
+                return res;
+            }
+            m_window = p;
+            m_window_sector = sector;
+            return 0;
+        }
+        inline void window_dirty()
+        {
+            m_cache.dirty(m_window_sector);
+        }
+        // zero fills a cluster in the cache
+        int clear_cluster(uint32_t cluster)
+        {
+            m_window_sector = unknown;
+            uint32_t sector = cluster_to_sector(cluster);
+            for (uint32_t i = 0; i < m_cluster_sectors; ++i)
+            {
+                int res;
+                uint8_t *p = m_cache.get(sector + i, false, res);
+                if (nullptr == p)
+                {
+                    return res;
+                }
+                memset(p, 0, m_sector_size);
+                m_cache.dirty(sector + i);
+            }
+            return 0;
+        }
+        int sync_fs()
+        {
+            int res;
+            if (m_fsinfo_dirty)
+            {
+                res = move_window(m_fsinfo_sector);
+                if (0 != res)
+                {
+                    return res;
+                }
+                if (ld_32(m_window) == 0x41615252 && ld_32(m_window + 484) == 0x61417272)
+                {
+                    st_32(m_window + 488, m_free_clusters);
+                    st_32(m_window + 492, m_next_free);
+                    window_dirty();
+                }
+                m_fsinfo_dirty = false;
+            }
+            res = m_cache.flush();
+            if (0 != res)
+            {
+                return res;
+            }
+            // after the FAT is written, so the card never loses clusters a file still uses
+            trim_clusters();
+            return vfs_fast_fat32_cache<Allocator>::to_errno(m_hal->ioctl(m_pdrv, control_sync, nullptr));
+        }
+        // tells the HAL the clusters are no longer in use. failures are ignored, since a
+        // drive that can't trim loses nothing by it
+        vfs_fast_fat32_hal_result trim_range(uint32_t first, uint32_t count)
+        {
+            uint32_t range[2];
+            range[0] = cluster_to_sector(first);
+            range[1] = cluster_to_sector(first + count) - 1;
+            return m_hal->ioctl(m_pdrv, control_trim, range);
+        }
+        // sends the runs of clusters freed so far
+        void trim_clusters()
+        {
+            for (size_t i = 0; i < m_trim_count; ++i)
+            {
+                trim_range(m_trims[i].first, m_trims[i].count);
+            }
+            m_trim_count = 0;
+        }
+        // adds a freed cluster to the run it extends, or starts a new one
+        void queue_trim(uint32_t cluster)
+        {
+            for (size_t i = 0; i < m_trim_count; ++i)
+            {
+                trim_run &r = m_trims[i];
+                if (cluster == r.first + r.count)
+                {
+                    ++r.count;
+                    return;
+                }
+                if (cluster + 1 == r.first)
+                {
+                    --r.first;
+                    ++r.count;
+                    return;
+                }
+            }
+            if (max_trim_runs == m_trim_count)
+            {
+                // the FAT has to reach the card before the clusters are trimmed. if it
+                // can't, they just aren't
+                if (0 == m_cache.flush())
+                {
+                    trim_clusters();
+                }
+                m_trim_count = 0;
+            }
+            m_trims[m_trim_count].first = cluster;
+            m_trims[m_trim_count].count = 1;
+            ++m_trim_count;
+        }
+        // takes a cluster that has been allocated again out of the runs waiting to be
+        // trimmed. if that splits a run and there's no room for the second half, the
+        // second half isn't trimmed
+        void unqueue_trim(uint32_t cluster)
+        {
+            for (size_t i = 0; i < m_trim_count; ++i)
+            {
+                trim_run &r = m_trims[i];
+                if (cluster < r.first || cluster >= r.first + r.count)
+                {
+                    continue;
+                }
+                uint32_t end = r.first + r.count;
+                r.count = cluster - r.first;
+                if (cluster + 1 < end && max_trim_runs != m_trim_count)
+                {
+                    m_trims[m_trim_count].first = cluster + 1;
+                    m_trims[m_trim_count].count = end - cluster - 1;
+                    ++m_trim_count;
+                }
+                if (0 == r.count)
+                {
+                    m_trims[i] = m_trims[--m_trim_count];
+                }
+                return;
+            }
+        }
+        // FAT access. returns unknown on error
+        uint32_t get_fat(uint32_t cluster)
+        {
+            if (!valid_cluster(cluster))
+            {
+                return 1;
+            }
+            if (0 != move_window(m_fat_sector + ((cluster * 4) >> m_sector_shift)))
+            {
+                return unknown;
+            }
+            return ld_32(m_window + ((cluster * 4) & (m_sector_size - 1))) & cluster_mask;
+        }
+        int put_fat(uint32_t cluster, uint32_t value)
+        {
+            if (!valid_cluster(cluster))
+            {
+                return EINVAL;
+            }
+            int res = move_window(m_fat_sector + ((cluster * 4) >> m_sector_shift));
+            if (0 != res)
+            {
+                return res;
+            }
+            uint8_t *p = m_window + ((cluster * 4) & (m_sector_size - 1));
+            bool was_free = 0 == (ld_32(p) & cluster_mask);
+            st_32(p, (ld_32(p) & ~cluster_mask) | (value & cluster_mask));
+            window_dirty();
+            bool is_free = 0 == (value & cluster_mask);
+            if (m_trim && was_free != is_free)
+            {
+                if (is_free)
+                {
+                    queue_trim(cluster);
+                }
+                else
+                {
+                    unqueue_trim(cluster);
+                }
+            }
+            if (nullptr != m_free_map && cluster - 2 < m_free_map_clusters && was_free != is_free)
+            {
+                m_free_map[(cluster - 2) / 32] ^= 1u << ((cluster - 2) % 32);
+                if (is_free)
+                {
+                    ++m_free_map_count;
+                }
+                else
+                {
+                    --m_free_map_count;
+                }
+            }
+            return 0;
+        }
+        // FAT sectors scanned into the free map per step
+        inline uint32_t free_map_step() const
+        {
+            return m_cache_line_size > m_sector_size ? (uint32_t)(m_cache_line_size >> m_sector_shift) : 1;
+        }
+        // scans up to sectors more FAT sectors into the free map. once it covers the whole
+        // volume its count is known to be right, so it replaces the one from FSInfo
+        int build_free_map(uint32_t sectors)
+        {
+            if (nullptr == m_free_map_buffer)
+            {
+                return 0;
+            }
+            const uint32_t entries = m_sector_size / 4;
+            while (0 != sectors && m_free_map_clusters < m_cluster_count)
+            {
+                uint32_t cluster = m_free_map_clusters + 2;
+                uint32_t sector = cluster / entries;
+                uint32_t count = free_map_step();
+                if (count > sectors)
+                {
+                    count = sectors;
+                }
+                if (count > m_fat_sectors - sector)
+                {
+                    count = m_fat_sectors - sector;
+                }
+                // dirty FAT lines are written back first, so this sees the current FAT
+                int res = read_sectors(m_free_map_buffer, m_fat_sector + sector, count);
+                if (0 != res)
+                {
+                    return res;
+                }
+                uint32_t end = (sector + count) * entries;
+                if (end > m_cluster_count + 2)
+                {
+                    end = m_cluster_count + 2;
+                }
+                for (; cluster < end; ++cluster)
+                {
+                    if (0 == (ld_32(m_free_map_buffer + (cluster - sector * entries) * 4) & cluster_mask))
+                    {
+                        m_free_map[(cluster - 2) / 32] |= 1u << ((cluster - 2) % 32);
+                        ++m_free_map_count;
+                    }
+                }
+                m_free_map_clusters = end - 2;
+                sectors -= count;
+            }
+            if (m_free_map_clusters == m_cluster_count)
+            {
+                Allocator::deallocate(m_free_map_buffer);
+                m_free_map_buffer = nullptr;
+                if (m_free_clusters != m_free_map_count)
+                {
+                    m_free_clusters = m_free_map_count;
+                    m_fsinfo_dirty = true;
+                }
+            }
+            return 0;
+        }
+        // looks for count free clusters in a row starting at hint. returns the first of the
+        // first such run, or failing that the longest run found with count set to its
+        // length. returns 0 when nothing is free, unknown on error. the part of the volume
+        // covered by the free map is scanned a word at a time, the rest through the FAT
+        uint32_t find_free_run(uint32_t hint, uint32_t &count)
+        {
+            if (unknown != m_free_clusters && m_free_clusters < count)
+            {
+                count = m_free_clusters;
+            }
+            uint32_t best = 0, best_length = 0;
+            if (0 == count)
+            {
+                return 0;
+            }
+            uint32_t cluster = valid_cluster(hint) ? hint : 2;
+            uint32_t start = 0, length = 0;
+            uint32_t scanned = 0;
+            while (scanned < m_cluster_count && best_length < count)
+            {
+                // the number of clusters from here that are known to be all free or all used
+                uint32_t span = 1;
+                bool is_free;
+                uint32_t index = cluster - 2;
+                if (index < m_free_map_clusters)
+                {
+                    uint32_t bits = m_free_map[index / 32] >> (index % 32);
+                    is_free = 0 != (bits & 1);
+                    if (is_free)
+                    {
+                        bits = ~bits;
+                    }
+                    span = 0 == bits ? 32 : __builtin_ctz(bits);
+                    if (span > 32 - index % 32)
+                    {
+                        span = 32 - index % 32;
+                    }
+                    if (span > m_free_map_clusters - index)
+                    {
+                        span = m_free_map_clusters - index;
+                    }
+                    if (span > m_cluster_count - scanned)
+                    {
+                        span = m_cluster_count - scanned;
+                    }
+                }
+                else if (index == m_free_map_clusters && nullptr != m_free_map_buffer)
+                {
+                    // reached the edge of the map, so grow it and look again
+                    if (0 != build_free_map(free_map_step()))
+                    {
+                        return unknown;
+                    }
+                    continue;
+                }
+                else
+                {
+                    uint32_t value = get_fat(cluster);
+                    if (unknown == value)
+                    {
+                        return unknown;
+                    }
+                    is_free = 0 == value;
+                }
+                if (is_free)
+                {
+                    if (0 == length)
+                    {
+                        start = cluster;
+                    }
+                    length += span;
+                    if (length > best_length)
+                    {
+                        best = start;
+                        best_length = length < count ? length : count;
+                    }
+                }
+                else
+                {
+                    length = 0;
+                }
+                scanned += span;
+                cluster += span;
+                if (cluster >= m_cluster_count + 2)
+                {
+                    // runs don't wrap around the end of the volume
+                    cluster = 2;
+                    length = 0;
+                }
+            }
+            count = best_length;
+            return best;
+        }
+        // allocates up to count clusters as one contiguous run, linked after previous if it
+        // isn't 0. falls back to the longest free run there is, so at least one cluster is
+        // allocated unless the volume is full. returns the first cluster, 0 when full, or
+        // unknown on error
+        uint32_t allocate_clusters(uint32_t previous, uint32_t count)
+        {
+            if (0 == count)
+            {
+                count = 1;
+            }
+            uint32_t start = find_free_run(0 != previous ? previous + 1 : m_next_free + 1, count);
+            if (0 == start || unknown == start)
+            {
+                return start;
+            }
+            for (uint32_t i = 1; i < count; ++i)
+            {
+                if (0 != put_fat(start + i - 1, start + i))
+                {
+                    return unknown;
+                }
+            }
+            if (0 != put_fat(start + count - 1, cluster_eoc))
+            {
+                return unknown;
+            }
+            if (0 != previous && 0 != put_fat(previous, start))
+            {
+                return unknown;
+            }
+            m_next_free = start + count - 1;
+            if (unknown != m_free_clusters)
+            {
+                m_free_clusters -= count;
+            }
+            m_fsinfo_dirty = true;
+            return start;
+        }
+        // allocates a cluster, linking it after previous if it isn't 0. prefers previous+1 so
+        // that the chain stays contiguous. returns 0 when full, unknown on error
+        inline uint32_t create_chain(uint32_t previous)
+        {
+            return allocate_clusters(previous, 1);
+        }
+        // frees the chain starting at cluster. if previous isn't 0 it is marked as the end
+        int remove_chain(uint32_t cluster, uint32_t previous)
+        {
+            int res;
+            if (0 != previous)
+            {
+                res = put_fat(previous, cluster_eoc);
+                if (0 != res)
+                {
+                    return res;
+                }
+            }
+            while (valid_cluster(cluster))
+            {
+                uint32_t next = get_fat(cluster);
+                if (unknown == next)
+                {
+                    return EIO;
+                }
+                res = put_fat(cluster, 0);
+                if (0 != res)
+                {
+                    return res;
+                }
+                if (unknown != m_free_clusters)
+                {
+                    ++m_free_clusters;
+                }
+                m_fsinfo_dirty = true;
+                cluster = next;
+            }
+            return 0;
+        }
+        // directory traversal
+        inline uint32_t load_cluster(const uint8_t *entry) const
+        {
+            return ((uint32_t)ld_16(entry + entry_cluster_high) << 16) | ld_16(entry + entry_cluster_low);
+        }
+        inline void store_cluster(uint8_t *entry, uint32_t cluster)
+        {
+            st_16(entry + entry_cluster_high, (uint16_t)(cluster >> 16));
+            st_16(entry + entry_cluster_low, (uint16_t)cluster);
+        }
+        int dir_rewind(directory_entry &dir, uint32_t start_cluster)
+        {
+            if (0 == start_cluster)
+            {
+                start_cluster = m_root_cluster;
+            }
+            if (!valid_cluster(start_cluster))
+            {
+                return EIO;
+            }
+            dir.id.start_cluster = start_cluster;
+            dir.position = 0;
+            dir.cluster = start_cluster;
+            dir.sector = cluster_to_sector(start_cluster);
+            dir.directory_pointer = nullptr;
+            return 0;
+        }
+        // advances to the next entry, optionally growing the directory. ENOENT at the end
+        int dir_next(directory_entry &dir, bool stretch)
+        {
+            uint32_t position = dir.position + entry_size;
+            if (position >= 0x200000)
+            {
+                return ENOENT;
+            }
+            if (0 == (position & (m_sector_size - 1)))
+            {
+                if (0 == (position >> m_sector_shift) % m_cluster_sectors)
+                {
+                    uint32_t next = get_fat(dir.cluster);
+                    if (unknown == next || 1 == next)
+                    {
+                        return EIO;
+                    }
+                    if (!valid_cluster(next))
+                    {
+                        if (!stretch)
+                        {
+                            return ENOENT;
+                        }
+                        next = create_chain(dir.cluster);
+                        if (0 == next)
+                        {
+                            return ENOSPC;
+                        }
+                        if (unknown == next)
+                        {
+                            return EIO;
+                        }
+                        int res = clear_cluster(next);
+                        if (0 != res)
+                        {
+                            return res;
+                        }
+                    }
+                    dir.cluster = next;
+                    dir.sector = cluster_to_sector(next);
+                }
+                else
+                {
+                    ++dir.sector;
+                }
+            }
+            dir.position = position;
+            dir.directory_pointer = nullptr;
+            return 0;
+        }
+        int dir_read(directory_entry &dir)
+        {
+            int res = move_window(dir.sector);
+            if (0 != res)
+            {
+                return res;
+            }
+            dir.directory_pointer = m_window + (dir.position & (m_sector_size - 1));
+            return 0;
+        }
+        // finds the next live SFN entry starting at the current position. ENOENT at the end
+        int dir_read_next_live(directory_entry &dir)
+        {
+            while (true)
+            {
+                int res = dir_read(dir);
+                if (0 != res)
+                {
+                    return res;
+                }
+                uint8_t c = dir.directory_pointer[0];
+                if (0 == c)
+                {
+                    return ENOENT;
+                }
+                uint8_t a = dir.directory_pointer[entry_attributes];
+                if (c != entry_deleted && attributes_lfn != (a & 0x3F) && 0 == (a & attributes_volume))
+                {
+                    return 0;
+                }
+                res = dir_next(dir, false);
+                if (0 != res)
+                {
+                    return res;
+                }
+            }
+        }
+        // the index of a directory, built with one pass over it the first time. nullptr when
+        // the index is off or the pass failed, and no slots when it's too big to index
+        typename directory_index::directory *index_directory(uint32_t start_cluster)
+        {
+            if (0 == start_cluster)
+            {
+                start_cluster = m_root_cluster;
+            }
+            typename directory_index::directory *d = m_index.find(start_cluster);
+            if (nullptr != d)
+            {
+                return d;
+            }
+            d = m_index.create(start_cluster);
+            if (nullptr == d || nullptr == d->slots)
+            {
+                return d;
+            }
+            directory_entry dir;
+            int res = dir_rewind(dir, start_cluster);
+            while (0 == res)
+            {
+                res = dir_read(dir);
+                if (0 != res)
+                {
+                    break;
+                }
+                uint8_t c = dir.directory_pointer[0];
+                uint8_t a = dir.directory_pointer[entry_attributes];
+                if (0 == c || entry_deleted == c)
+                {
+                    if (directory_index::empty == d->free_position)
+                    {
+                        d->free_position = dir.position;
+                        d->free_cluster = dir.cluster;
+                    }
+                    if (0 == c)
+                    {
+                        return d;
+                    }
+                }
+                else if (attributes_lfn != (a & 0x3F) && 0 == (a & attributes_volume))
+                {
+                    if (!m_index.add(*d, directory_index::hash(dir.directory_pointer), dir.position, dir.cluster))
+                    {
+                        return d;
+                    }
+                }
+                res = dir_next(dir, false);
+            }
+            if (ENOENT != res)
+            {
+                m_index.drop(start_cluster);
+                return nullptr;
+            }
+            if (directory_index::empty == d->free_position)
+            {
+                // full to the end of its chain, so new entries go past the last one
+                d->free_position = dir.position;
+                d->free_cluster = dir.cluster;
+            }
+            return d;
+        }
+        // points dir at an entry the index knows the place of
+        int dir_seek(directory_entry &dir, uint32_t position, uint32_t cluster)
+        {
+            dir.position = position;
+            dir.cluster = cluster;
+            dir.sector = cluster_to_sector(cluster) + (position >> m_sector_shift) % m_cluster_sectors;
+            dir.directory_pointer = nullptr;
+            return dir_read(dir);
+        }
+        // the entry was deleted, so takes it out of the parent's index
+        void index_erase(uint32_t start_cluster, const uint8_t *name, uint32_t position, uint32_t cluster)
+        {
+            typename directory_index::directory *d = m_index.find(0 == start_cluster ? m_root_cluster : start_cluster);
+            if (nullptr != d)
+            {
+                m_index.erase(*d, directory_index::hash(name), position, cluster);
+            }
+        }
+        int dir_find(directory_entry &dir)
+        {
+            typename directory_index::directory *d = index_directory(dir.id.start_cluster);
+            if (nullptr != d && nullptr != d->slots)
+            {
+                uint32_t hash = directory_index::hash(dir.fn);
+                dir.id.start_cluster = d->start_cluster;
+                for (uint32_t i = hash & d->mask; directory_index::empty != d->slots[i].position; i = (i + 1) & d->mask)
+                {
+                    const typename directory_index::slot &s = d->slots[i];
+                    if (s.hash != hash || s.position >= directory_index::erased)
+                    {
+                        continue;
+                    }
+                    int res = dir_seek(dir, s.position, s.cluster);
+                    if (0 != res)
+                    {
+                        return res;
+                    }
+                    uint8_t a = dir.directory_pointer[entry_attributes];
+                    if (0 == memcmp(dir.directory_pointer, dir.fn, 11) && attributes_lfn != (a & 0x3F) && 0 == (a & attributes_volume))
+                    {
+                        return 0;
+                    }
+                }
+                dir.directory_pointer = nullptr;
+                return ENOENT;
+            }
+            int res = dir_rewind(dir, dir.id.start_cluster);
+            if (0 != res)
+            {
+                return res;
+            }
+            while (true)
+            {
+                res = dir_read_next_live(dir);
+                if (0 != res)
+                {
+                    return res;
+                }
+                if (0 == memcmp(dir.directory_pointer, dir.fn, 11))
+                {
+                    return 0;
+                }
+                res = dir_next(dir, false);
+                if (0 != res)
+                {
+                    return res;
+                }
+            }
+        }
+        // finds a free slot in the directory, growing it if needed, and writes a blank SFN
+        // entry named dir.fn there
+        int dir_register(directory_entry &dir)
+        {
+            typename directory_index::directory *d = m_index.find(0 == dir.id.start_cluster ? m_root_cluster : dir.id.start_cluster);
+            if (nullptr != d && nullptr == d->slots)
+            {
+                d = nullptr;
+            }
+            int res;
+            if (nullptr != d && directory_index::empty != d->free_position)
+            {
+                // every slot before this one is taken
+                dir.id.start_cluster = d->start_cluster;
+                dir.position = d->free_position;
+                dir.cluster = d->free_cluster;
+                dir.sector = cluster_to_sector(dir.cluster) + (dir.position >> m_sector_shift) % m_cluster_sectors;
+                dir.directory_pointer = nullptr;
+                res = 0;
+            }
+            else
+            {
+                res = dir_rewind(dir, dir.id.start_cluster);
+            }
+            if (0 != res)
+            {
+                return res;
+            }
+            while (true)
+            {
+                res = dir_read(dir);
+                if (0 != res)
+                {
+                    return res;
+                }
+                uint8_t c = dir.directory_pointer[0];
+                if (0 == c || entry_deleted == c)
+                {
+                    break;
+                }
+                res = dir_next(dir, true);
+                if (0 != res)
+                {
+                    return res;
+                }
+            }
+            memset(dir.directory_pointer, 0, entry_size);
+            memcpy(dir.directory_pointer, dir.fn, 11);
+            dir.directory_pointer[entry_nt_res] = dir.fn[11] & (name_body_lower | name_ext_lower);
+            uint32_t tm = get_time();
+            st_32(dir.directory_pointer + entry_create_time, tm);
+            st_16(dir.directory_pointer + entry_access_date, (uint16_t)(tm >> 16));
+            st_32(dir.directory_pointer + entry_modified_time, tm);
+            window_dirty();
+            if (nullptr != d)
+            {
+                d->free_position = dir.position;
+                d->free_cluster = dir.cluster;
+                m_index.add(*d, directory_index::hash(dir.fn), dir.position, dir.cluster);
+            }
+            return 0;
+        }
+        // converts the next path segment into an 8.3 name in dir.fn
+        static int make_sfn(const char *&path, directory_entry &dir)
+        {
+            uint8_t *fn = dir.fn;
+            memset(fn, ' ', 11);
+            fn[11] = 0;
+            while ('/' == *path || '\\' == *path)
+            {
+                ++path;
+            }
+            const char *p = path;
+            size_t i = 0, limit = 8;
+            bool body_lower = false, body_upper = false, ext_lower = false, ext_upper = false;
+            if ('.' == *p)
+            {
+                size_t dots = 0;
+                while ('.' == *p)
+                {
+                    if (2 == dots)
+                    {
+                        return ENOENT;
+                    }
+                    fn[dots++] = '.';
+                    ++p;
+                }
+                if (0 != *p && '/' != *p && '\\' != *p)
+                {
+                    return ENOENT;
+                }
+                fn[11] = name_dot;
+            }
+            else
+            {
+                while (0 != *p && '/' != *p && '\\' != *p)
+                {
+                    char c = *p++;
+                    if ('.' == c && 8 == limit)
+                    {
+                        if (0 == i)
+                        {
+                            return ENOENT;
+                        }
+                        i = 8;
+                        limit = 11;
+                        continue;
+                    }
+                    if ((uint8_t)c < ' ' || '.' == c || nullptr != strchr("\"*+,:;<=>?[]|\x7F", c) || i >= limit)
+                    {
+                        return ENOENT;
+                    }
+                    if (c >= 'a' && c <= 'z')
+                    {
+                        c -= 'a' - 'A';
+                        (8 == limit ? body_lower : ext_lower) = true;
+                    }
+                    else if (c >= 'A' && c <= 'Z')
+                    {
+                        (8 == limit ? body_upper : ext_upper) = true;
+                    }
+                    fn[i++] = (uint8_t)c;
+                }
+                if (' ' == fn[0])
+                {
+                    return ENOENT;
+                }
+                if (entry_deleted == fn[0])
+                {
+                    fn[0] = 0x05;
+                }
+                if (body_lower && !body_upper)
+                {
+                    fn[11] |= name_body_lower;
+                }
+                if (ext_lower && !ext_upper)
+                {
+                    fn[11] |= name_ext_lower;
+                }
+            }
+            path = p;
+            while ('/' == *path || '\\' == *path)
+            {
+                ++path;
+            }
+            if (0 == *path)
+            {
+                fn[11] |= name_last;
+            }
+            return 0;
+        }
+        // resolves a path. on success the entry is in the window at dir.directory_pointer, or
+        // fn[11] has name_none set for the root. on ENOENT with name_last set in fn[11], dir
+        // describes the parent directory and the name that would be created
+        int follow_path(const char *path, directory_entry &dir)
+        {
+            memset(&dir, 0, sizeof(dir));
+            dir.id.mount_id = m_mount_id;
+            dir.id.attributes = directory;
+            dir.id.start_cluster = m_root_cluster;
+            while ('/' == *path || '\\' == *path)
+            {
+                ++path;
+            }
+            if (0 == *path)
+            {
+                dir.fn[11] = name_none | name_last;
+                return dir_rewind(dir, m_root_cluster);
+            }
+            while (true)
+            {
+                int res = make_sfn(path, dir);
+                if (0 != res)
+                {
+                    return res;
+                }
+                if ((dir.fn[11] & name_dot) && dir.id.start_cluster == m_root_cluster)
+                {
+                    // the root has no dot entries
+                    if (dir.fn[11] & name_last)
+                    {
+                        dir.fn[11] = name_none | name_last;
+                        return dir_rewind(dir, m_root_cluster);
+                    }
+                    continue;
+                }
+                res = dir_find(dir);
+                if (0 != res)
+                {
+                    return res;
+                }
+                if (dir.fn[11] & name_last)
+                {
+                    dir.id.attributes = (vfs_fast_fat32_attributes)dir.directory_pointer[entry_attributes];
+                    dir.id.size = ld_32(dir.directory_pointer + entry_size_field);
+                    return 0;
+                }
+                if (!(dir.directory_pointer[entry_attributes] & directory))
+                {
+                    return ENOTDIR;
+                }
+                uint32_t cluster = load_cluster(dir.directory_pointer);
+                dir.id.start_cluster = 0 == cluster ? m_root_cluster : cluster;
+            }
+        }
+        // file I/O
+        file_entry *get_file(int fd)
+        {
+            if (0 > fd || (size_t)fd >= m_max_files || !(m_files[fd].flags & file_open))
+            {
+                return nullptr;
+            }
+            return &m_files[fd];
+        }
+        // finds the cluster holding the index'th cluster of the file in the extent map, which
+        // must cover it
+        static uint32_t map_lookup(const file_entry &f, uint32_t index)
+        {
+            size_t low = 0, high = f.extent_count;
+            while (high - low > 1)
+            {
+                size_t mid = (low + high) / 2;
+                if (f.extents[mid].index <= index)
+                {
+                    low = mid;
+                }
+                else
+                {
+                    high = mid;
+                }
+            }
+            return f.extents[low].cluster + (index - f.extents[low].index);
+        }
+        // records that the index'th cluster of the file is cluster. only the next unmapped
+        // index is accepted, so the map always covers clusters 0 to mapped-1. once the map
+        // is full the rest of the chain is walked from its last cluster instead
+        static void map_cluster(file_entry &f, uint32_t index, uint32_t cluster)
+        {
+            if (index != f.mapped)
+            {
+                return;
+            }
+            if (0 != f.extent_count)
+            {
+                file_extent &last = f.extents[f.extent_count - 1];
+                if (last.cluster + last.count == cluster)
+                {
+                    ++last.count;
+                    ++f.mapped;
+                    return;
+                }
+            }
+            if (f.extent_count == f.extent_capacity)
+            {
+                return;
+            }
+            file_extent &e = f.extents[f.extent_count++];
+            e.index = index;
+            e.cluster = cluster;
+            e.count = 1;
+            ++f.mapped;
+        }
+        // forgets everything at or past cluster index count, after the chain was cut there
+        static void unmap_clusters(file_entry &f, uint32_t count)
+        {
+            while (0 != f.extent_count && f.extents[f.extent_count - 1].index >= count)
+            {
+                --f.extent_count;
+            }
+            if (0 != f.extent_count)
+            {
+                file_extent &last = f.extents[f.extent_count - 1];
+                if (last.index + last.count > count)
+                {
+                    last.count = count - last.index;
+                }
+                f.mapped = last.index + last.count;
+            }
+            else
+            {
+                f.mapped = 0;
+            }
+        }
+        // returns the cluster following f.cluster, from the map if possible. allocates one if
+        // asked to and the chain ends. returns 0 at the end, unknown on error
+        uint32_t next_cluster(file_entry &f, bool allocate)
+        {
+            if (f.cluster_index + 1 < f.mapped)
+            {
+                return map_lookup(f, f.cluster_index + 1);
+            }
+            uint32_t next = get_fat(f.cluster);
+            if (unknown == next || 1 == next)
+            {
+                return unknown;
+            }
+            if (!valid_cluster(next))
+            {
+                if (!allocate)
+                {
+                    return 0;
+                }
+                next = allocate_clusters(f.cluster, f.grow_clusters);
+                if (1 < f.grow_clusters)
+                {
+                    f.flags |= file_reserved;
+                }
+            }
+            if (0 != next && unknown != next)
+            {
+                map_cluster(f, f.cluster_index + 1, next);
+            }
+            return next;
+        }
+        // sets f.cluster to the cluster holding the index'th cluster of the file, optionally
+        // allocating as needed. mapped clusters cost no FAT access
+        int locate_cluster(file_entry &f, uint32_t index, bool allocate)
+        {
+            if (0 == f.id.start_cluster)
+            {
+                if (!allocate)
+                {
+                    return EIO;
+                }
+                uint32_t cluster = allocate_clusters(0, f.grow_clusters);
+                if (0 == cluster)
+                {
+                    return ENOSPC;
+                }
+                if (unknown == cluster)
+                {
+                    return EIO;
+                }
+                if (1 < f.grow_clusters)
+                {
+                    f.flags |= file_reserved;
+                }
+                f.id.start_cluster = cluster;
+                f.flags |= file_modified;
+                f.cluster = 0;
+            }
+            if (0 == f.mapped)
+            {
+                map_cluster(f, 0, f.id.start_cluster);
+            }
+            if (index < f.mapped)
+            {
+                f.cluster = map_lookup(f, index);
+                f.cluster_index = index;
+                return 0;
+            }
+            // walk the FAT from whichever known cluster is closest
+            if (0 == f.cluster || index < f.cluster_index || f.cluster_index + 1 < f.mapped)
+            {
+                if (0 != f.mapped)
+                {
+                    f.cluster_index = f.mapped - 1;
+                    f.cluster = map_lookup(f, f.cluster_index);
+                }
+                else
+                {
+                    f.cluster_index = 0;
+                    f.cluster = f.id.start_cluster;
+                }
+            }
+            while (f.cluster_index < index)
+            {
+                uint32_t next = next_cluster(f, allocate);
+                if (unknown == next)
+                {
+                    return EIO;
+                }
+                if (0 == next)
+                {
+                    return allocate ? ENOSPC : EIO;
+                }
+                f.cluster = next;
+                ++f.cluster_index;
+            }
+            return 0;
+        }
+        // extends a run of sectors starting in f.cluster across physically contiguous clusters,
+        // up to sector_count sectors. returns the number of sectors in the run
+        uint32_t extend_run(file_entry &f, uint32_t run, uint32_t sector_count, bool allocate, int &res)
+        {
+            res = 0;
+            while (run < sector_count)
+            {
+                uint32_t next = next_cluster(f, allocate);
+                if (unknown == next)
+                {
+                    res = EIO;
+                    break;
+                }
+                if (next != f.cluster + 1)
+                {
+                    break;
+                }
+                f.cluster = next;
+                ++f.cluster_index;
+                run += m_cluster_sectors;
+            }
+            return run < sector_count ? run : sector_count;
+        }
+        // byte offset arithmetic for the read and write paths, which are instantiated with
+        // each and pick one once per call. check_boot_sector() turns away volumes whose
+        // clusters aren't a power of two sectors, so every mounted volume uses shift_math.
+        // divide_math is only there for comparison, reached through shift_addressing(false)
+        // as address_benchmark does
+        struct shift_math
+        {
+            inline static uint32_t sectors(const basic_vfs_fast_fat32 &fs, uint32_t bytes)
+            {
+                return bytes >> fs.m_sector_shift;
+            }
+            inline static uint32_t sector_offset(const basic_vfs_fast_fat32 &fs, uint32_t bytes)
+            {
+                return bytes & (fs.m_sector_size - 1);
+            }
+            inline static uint32_t clusters(const basic_vfs_fast_fat32 &fs, uint32_t bytes)
+            {
+                return bytes >> fs.m_cluster_shift;
+            }
+            inline static uint32_t cluster_offset(const basic_vfs_fast_fat32 &fs, uint32_t bytes)
+            {
+                return bytes & (fs.m_cluster_size - 1);
+            }
+        };
+        struct divide_math
+        {
+            inline static uint32_t sectors(const basic_vfs_fast_fat32 &fs, uint32_t bytes)
+            {
+                return bytes / fs.m_sector_size;
+            }
+            inline static uint32_t sector_offset(const basic_vfs_fast_fat32 &fs, uint32_t bytes)
+            {
+                return bytes % fs.m_sector_size;
+            }
+            inline static uint32_t clusters(const basic_vfs_fast_fat32 &fs, uint32_t bytes)
+            {
+                return bytes / fs.m_cluster_size;
+            }
+            inline static uint32_t cluster_offset(const basic_vfs_fast_fat32 &fs, uint32_t bytes)
+            {
+                return bytes % fs.m_cluster_size;
+            }
+        };
+        // returns the cached sector at the current position of the file. sectors past the
+        // end of the file are zeroed instead of read. if load is false the caller must
+        // overwrite the whole sector
+        template <typename Math>
+        uint8_t *file_sector(file_entry &f, uint32_t sector, bool load, int &res)
+        {
+            m_window_sector = unknown;
+            bool past_end = f.position - Math::sector_offset(*this, f.position) >= f.id.size;
+            uint8_t *p = m_cache.get(sector, load && !past_end, res);
+            if (nullptr != p && load && past_end)
+            {
+                memset(p, 0, m_sector_size);
+            }
+            return p;
+        }
+        template <typename Math>
+        ssize_t read_file(file_entry &f, uint8_t *dst, size_t size)
+        {
+            if (!(f.flags & file_read))
+            {
+                return fail(EBADF);
+            }
+            if (f.position >= f.id.size)
+            {
+                return 0;
+            }
+            if (size > f.id.size - f.position)
+            {
+                size = f.id.size - f.position;
+            }
+            // sustained sequential reads widen the read-ahead window, seeks narrow it
+            if (f.position == f.read_next)
+            {
+                f.read_window = 0 == f.read_window ? 1 : f.read_window * 2;
+                if (f.read_window > read_ahead_max)
+                {
+                    f.read_window = read_ahead_max;
+                }
+            }
+            else
+            {
+                f.read_window /= 2;
+                f.prefetched = f.position;
+            }
+            size_t remaining = size;
+            while (remaining > 0)
+            {
+                uint32_t cluster_offset = Math::cluster_offset(*this, f.position);
+                int res = locate_cluster(f, Math::clusters(*this, f.position), false);
+                if (0 != res)
+                {
+                    return fail(res);
+                }
+                uint32_t sector = cluster_to_sector(f.cluster) + Math::sectors(*this, cluster_offset);
+                uint32_t sector_offset = Math::sector_offset(*this, f.position);
+                size_t transferred;
+                if (0 == sector_offset && remaining >= m_sector_size)
+                {
+                    // whole sectors go straight from the card to the caller
+                    uint32_t run = m_cluster_sectors - Math::sectors(*this, cluster_offset);
+                    run = extend_run(f, run, Math::sectors(*this, (uint32_t)remaining), false, res);
+                    if (0 != res)
+                    {
+                        return fail(res);
+                    }
+                    res = read_sectors(dst, sector, run);
+                    if (0 != res)
+                    {
+                        return fail(res);
+                    }
+                    transferred = run * m_sector_size;
+                }
+                else
+                {
+                    uint8_t *p = file_sector<Math>(f, sector, true, res);
+                    if (nullptr == p)
+                    {
+                        return fail(res);
+                    }
+                    transferred = m_sector_size - sector_offset;
+                    if (transferred > remaining)
+                    {
+                        transferred = remaining;
+                    }
+                    memcpy(dst, p + sector_offset, transferred);
+                }
+                dst += transferred;
+                remaining -= transferred;
+                f.position += transferred;
+            }
+            f.read_next = f.position;
+            if (0 != f.read_window)
+            {
+                read_ahead<Math>(f);
+            }
+            return size;
+        }
+        // asks the HAL to fetch the read-ahead window past what it was already asked for, a
+        // physically contiguous run at a time, until it takes no more
+        template <typename Math>
+        void read_ahead(file_entry &f)
+        {
+            uint64_t window_end = (uint64_t)f.position + (uint64_t)f.read_window * m_cluster_size;
+            uint32_t end = window_end < f.id.size ? (uint32_t)window_end : f.id.size;
+            uint32_t from = f.prefetched > f.position ? f.prefetched : f.position;
+            from -= Math::sector_offset(*this, from);
+            // the file's cluster cursor is left where the reader had it
+            uint32_t cluster = f.cluster;
+            uint32_t cluster_index = f.cluster_index;
+            while (from < end)
+            {
+                if (0 != locate_cluster(f, Math::clusters(*this, from), false))
+                {
+                    break;
+                }
+                uint32_t offset = Math::sectors(*this, Math::cluster_offset(*this, from));
+                uint32_t sector = cluster_to_sector(f.cluster) + offset;
+                int res;
+                uint32_t run = extend_run(f, m_cluster_sectors - offset, Math::sectors(*this, end - from + m_sector_size - 1), false, res);
+                if (0 != res)
+                {
+                    break;
+                }
+                unsigned int accepted = m_hal->prefetch(m_pdrv, sector, run);
+                from += accepted * m_sector_size;
+                if (accepted < run)
+                {
+                    break;
+                }
+            }
+            f.prefetched = from;
+            f.cluster = cluster;
+            f.cluster_index = cluster_index;
+        }
+        // writes size bytes at the current position. a null src writes zeros
+        template <typename Math>
+        ssize_t write_file(file_entry &f, const uint8_t *src, size_t size)
+        {
+            if (!(f.flags & file_write))
+            {
+                return fail(EBADF);
+            }
+            if ((uint64_t)f.position + size > 0xFFFFFFFF)
+            {
+                return fail(EFBIG);
+            }
+            size_t remaining = size;
+            while (remaining > 0)
+            {
+                uint32_t cluster_offset = Math::cluster_offset(*this, f.position);
+                int res = locate_cluster(f, Math::clusters(*this, f.position), true);
+                if (0 != res)
+                {
+                    if (size != remaining)
+                    {
+                        break;
+                    }
+                    return fail(res);
+                }
+                uint32_t sector = cluster_to_sector(f.cluster) + Math::sectors(*this, cluster_offset);
+                uint32_t sector_offset = Math::sector_offset(*this, f.position);
+                size_t transferred;
+                if (nullptr != src && 0 == sector_offset && remaining >= m_sector_size)
+                {
+                    // whole sectors go straight from the caller to the card
+                    uint32_t run = m_cluster_sectors - Math::sectors(*this, cluster_offset);
+                    run = extend_run(f, run, Math::sectors(*this, (uint32_t)remaining), true, res);
+                    if (0 == res)
+                    {
+                        res = write_sectors(src, sector, run);
+                    }
+                    if (0 != res)
+                    {
+                        if (size != remaining)
+                        {
+                            break;
+                        }
+                        return fail(res);
+                    }
+                    transferred = run * m_sector_size;
+                }
+                else
+                {
+                    transferred = m_sector_size - sector_offset;
+                    if (transferred > remaining)
+                    {
+                        transferred = remaining;
+                    }
+                    uint8_t *p = file_sector<Math>(f, sector, transferred != m_sector_size, res);
+                    if (nullptr == p)
+                    {
+                        if (size != remaining)
+                        {
+                            break;
+                        }
+                        return fail(res);
+                    }
+                    if (nullptr != src)
+                    {
+                        memcpy(p + sector_offset, src, transferred);
+                    }
+                    else
+                    {
+                        memset(p + sector_offset, 0, transferred);
+                    }
+                    m_cache.dirty(sector);
+                }
+                if (nullptr != src)
+                {
+                    src += transferred;
+                }
+                remaining -= transferred;
+                f.position += transferred;
+                if (f.position > f.id.size)
+                {
+                    f.id.size = f.position;
+                }
+                f.flags |= file_modified;
+            }
+            return size - remaining;
+        }
+        ssize_t read_file(file_entry &f, uint8_t *dst, size_t size)
+        {
+            return m_shift_math ? read_file<shift_math>(f, dst, size) : read_file<divide_math>(f, dst, size);
+        }
+        ssize_t write_file(file_entry &f, const uint8_t *src, size_t size)
+        {
+            return m_shift_math ? write_file<shift_math>(f, src, size) : write_file<divide_math>(f, src, size);
+        }
+        // the buffers in order from the current position, stopping at the first short
+        // transfer. pieces of a sector from several buffers meet in its cache line, so
+        // they reach the card together when the line is written back
+        ssize_t read_vector(file_entry &f, const struct iovec *iov, int count)
+        {
+            if (0 > count)
+            {
+                return fail(EINVAL);
+            }
+            size_t total = 0;
+            for (int i = 0; i < count; ++i)
+            {
+                ssize_t res = read_file(f, (uint8_t *)iov[i].iov_base, iov[i].iov_len);
+                if (0 > res)
+                {
+                    return 0 == total ? res : (ssize_t)total;
+                }
+                total += res;
+                if ((size_t)res < iov[i].iov_len)
+                {
+                    break;
+                }
+            }
+            return total;
+        }
+        ssize_t write_vector(file_entry &f, const struct iovec *iov, int count)
+        {
+            if (0 > count)
+            {
+                return fail(EINVAL);
+            }
+            size_t total = 0;
+            for (int i = 0; i < count; ++i)
+            {
+                ssize_t res = write_file(f, (const uint8_t *)iov[i].iov_base, iov[i].iov_len);
+                if (0 > res)
+                {
+                    return 0 == total ? res : (ssize_t)total;
+                }
+                total += res;
+                if ((size_t)res < iov[i].iov_len)
+                {
+                    break;
+                }
+            }
+            return total;
+        }
+        // fills the gap between the end of the file and the current position with zeros
+        int fill_gap(file_entry &f)
+        {
+            if (f.position <= f.id.size)
+            {
+                return 0;
+            }
+            uint32_t target = f.position;
+            f.position = f.id.size;
+            ssize_t res = write_file(f, nullptr, target - f.position);
+            if (0 > res)
+            {
+                return errno;
+            }
+            return f.position == target ? 0 : ENOSPC;
+        }
+        // changes the size of the file, freeing or zero filling clusters as needed
+        int truncate_file(file_entry &f, uint32_t length)
+        {
+            if (length > f.id.size)
+            {
+                uint32_t position = f.position;
+                f.position = length;
+                int res = fill_gap(f);
+                f.position = position;
+                return res;
+            }
+            if (length == f.id.size)
+            {
+                return 0;
+            }
+            int res = cut_chain(f, 0 == length ? 0 : (length - 1) / m_cluster_size + 1);
+            if (0 != res)
+            {
+                return res;
+            }
+            f.id.size = length;
+            f.flags |= file_modified;
+            return 0;
+        }
+        // frees every cluster of the file past the first count
+        int cut_chain(file_entry &f, uint32_t count)
+        {
+            int res = 0;
+            f.cluster = 0;
+            if (0 == count)
+            {
+                if (0 != f.id.start_cluster)
+                {
+                    res = remove_chain(f.id.start_cluster, 0);
+                    f.id.start_cluster = 0;
+                    f.flags |= file_modified;
+                }
+                unmap_clusters(f, 0);
+            }
+            else if (0 != f.id.start_cluster)
+            {
+                res = locate_cluster(f, count - 1, false);
+                if (0 == res)
+                {
+                    uint32_t next = get_fat(f.cluster);
+                    if (unknown == next)
+                    {
+                        res = EIO;
+                    }
+                    else if (valid_cluster(next))
+                    {
+                        res = remove_chain(next, f.cluster);
+                    }
+                }
+                unmap_clusters(f, count);
+            }
+            return res;
+        }
+        // counts the clusters in the file's chain, which may run past its end if it holds a
+        // reservation, leaving the cluster cursor on the last one
+        int chain_clusters(file_entry &f, uint32_t &count)
+        {
+            count = 0;
+            if (0 == f.id.start_cluster)
+            {
+                return 0;
+            }
+            uint32_t known = 0 == f.id.size ? 0 : (f.id.size - 1) / m_cluster_size + 1;
+            int res = locate_cluster(f, 0 == known ? 0 : known - 1, false);
+            if (0 != res)
+            {
+                return res;
+            }
+            while (true)
+            {
+                uint32_t next = next_cluster(f, false);
+                if (unknown == next)
+                {
+                    return EIO;
+                }
+                if (0 == next)
+                {
+                    break;
+                }
+                f.cluster = next;
+                ++f.cluster_index;
+            }
+            count = f.cluster_index + 1;
+            return 0;
+        }
+        // reserves the clusters needed to hold length bytes, linking them to the end of the
+        // chain. the file size is left alone
+        int reserve_clusters(file_entry &f, uint32_t length)
+        {
+            uint32_t needed = 0 == length ? 0 : (length - 1) / m_cluster_size + 1;
+            while (true)
+            {
+                uint32_t count;
+                int res = chain_clusters(f, count);
+                if (0 != res)
+                {
+                    return res;
+                }
+                if (count >= needed)
+                {
+                    return 0;
+                }
+                if (unknown != m_free_clusters && m_free_clusters < needed - count)
+                {
+                    return ENOSPC;
+                }
+                uint32_t cluster = allocate_clusters(0 == count ? 0 : f.cluster, needed - count);
+                if (0 == cluster)
+                {
+                    return ENOSPC;
+                }
+                if (unknown == cluster)
+                {
+                    return EIO;
+                }
+                if (0 == f.id.start_cluster)
+                {
+                    f.id.start_cluster = cluster;
+                    f.flags |= file_modified;
+                }
+                f.flags |= file_reserved;
+            }
+        }
+        // frees whatever was reserved past the end of the file, then writes it back
+        int close_file(file_entry &f)
+        {
+            int res = 0;
+            if (f.flags & file_reserved)
+            {
+                res = cut_chain(f, 0 == f.id.size ? 0 : (f.id.size - 1) / m_cluster_size + 1);
+            }
+            int sync_res = sync_file(f);
+            f.flags = 0;
+            return 0 != res ? res : sync_res;
+        }
+        int sync_file(file_entry &f)
+        {
+            if (f.flags & file_modified)
+            {
+                int res = move_window(f.directory_sector);
+                if (0 != res)
+                {
+                    return res;
+                }
+                uint8_t *entry = m_window + f.directory_offset;
+                entry[entry_attributes] |= archive;
+                store_cluster(entry, f.id.start_cluster);
+                st_32(entry + entry_size_field, f.id.size);
+                uint32_t tm = get_time();
+                st_32(entry + entry_modified_time, tm);
+                st_16(entry + entry_access_date, (uint16_t)(tm >> 16));
+                window_dirty();
+                f.flags &= ~file_modified;
+            }
+            return sync_fs();
+        }
+        bool is_open(const directory_entry &dir) const
+        {
+            for (size_t i = 0; i < m_max_files; ++i)
+            {
+                if ((m_files[i].flags & file_open) && m_files[i].directory_sector == dir.sector && m_files[i].directory_offset == (dir.position & (m_sector_size - 1)))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+        void fill_stat(const uint8_t *entry, struct stat *st)
+        {
+            memset(st, 0, sizeof(struct stat));
+            uint8_t attributes = entry[entry_attributes];
+            st->st_size = (attributes & directory) ? 0 : ld_32(entry + entry_size_field);
+            st->st_mode = S_IRWXU | S_IRWXG | S_IRWXO | ((attributes & directory) ? S_IFDIR : S_IFREG);
+            if (attributes & read_only)
+            {
+                st->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+            }
+            st->st_mtime = from_fat_time(ld_16(entry + entry_modified_time + 2), ld_16(entry + entry_modified_time));
+            st->st_atime = from_fat_time(ld_16(entry + entry_access_date), 0);
+            st->st_ctime = from_fat_time(ld_16(entry + entry_create_time + 2), ld_16(entry + entry_create_time));
+        }
+        static void get_name(const uint8_t *entry, char *name)
+        {
+            uint8_t nt = entry[entry_nt_res];
+            size_t j = 0;
+            for (size_t i = 0; i < 11; ++i)
+            {
+                char c = (char)entry[i];
+                if (' ' == c)
+                {
+                    continue;
+                }
+                if (8 == i || (i > 8 && 0 == j))
+                {
+                    name[j++] = '.';
+                }
+                if (0 == i && 0x05 == c)
+                {
+                    c = (char)entry_deleted;
+                }
+                if (c >= 'A' && c <= 'Z' && (nt & (i < 8 ? name_body_lower : name_ext_lower)))
+                {
+                    c += 'a' - 'A';
+                }
+                name[j++] = c;
+            }
+            name[j] = 0;
+        }
+        static int check_boot_sector(const uint8_t *sector, uint16_t sector_size)
+        {
+            if (0xAA55 != ld_16(sector + 510))
+            {
+                return 2;
+            }
+            if ((0xEB == sector[0] || 0xE9 == sector[0] || 0xE8 == sector[0]) &&
+                sector_size == ld_16(sector + 11) &&
+                0 != sector[13] && 0 == (sector[13] & (sector[13] - 1)) &&
+                0 == ld_16(sector + 17) && 0 == ld_16(sector + 22) &&
+                0 != ld_32(sector + 36) && 0 != sector[16])
+            {
+                return 0;
+            }
+            return 1;
+        }
+        // reads the boot sector and works out the volume geometry
+        int read_geometry(uint8_t *sector)
+        {
+            m_volume_sector = 0;
+            int res = vfs_fast_fat32_cache<Allocator>::to_errno(m_hal->read(m_pdrv, sector, 0, 1));
+            if (0 != res)
+            {
+                return res;
+            }
+            int fmt = check_boot_sector(sector, m_sector_size);
+            if (1 == fmt)
+            {
+                // look for a FAT32 partition in the MBR
+                uint32_t partitions[4];
+                for (int i = 0; i < 4; ++i)
+                {
+                    const uint8_t *pte = sector + 446 + i * 16;
+                    partitions[i] = (0 != pte[4]) ? ld_32(pte + 8) : 0;
+                }
+                for (int i = 0; i < 4 && 0 != fmt; ++i)
+                {
+                    if (0 == partitions[i])
+                    {
+                        continue;
+                    }
+                    res = vfs_fast_fat32_cache<Allocator>::to_errno(m_hal->read(m_pdrv, sector, partitions[i], 1));
+                    if (0 != res)
+                    {
+                        return res;
+                    }
+                    fmt = check_boot_sector(sector, m_sector_size);
+                    if (0 == fmt)
+                    {
+                        m_volume_sector = partitions[i];
+                    }
+                }
+            }
+            if (0 != fmt)
+            {
+                return ENODEV;
+            }
+            const uint8_t *bpb = sector;
+            m_cluster_sectors = bpb[13];
+            m_cluster_size = (uint32_t)m_cluster_sectors * m_sector_size;
+            m_shift_math = 0 != m_cluster_sectors && 0 == (m_cluster_sectors & (m_cluster_sectors - 1));
+            m_cluster_shift = 0;
+            while (m_shift_math && ((uint32_t)1 << m_cluster_shift) < m_cluster_size)
+            {
+                ++m_cluster_shift;
+            }
+            m_fat_count = bpb[16];
+            m_fat_sector = m_volume_sector + ld_16(bpb + 14);
+            m_fat_sectors = ld_32(bpb + 36);
+            uint32_t total_sectors = 0 != ld_16(bpb + 19) ? ld_16(bpb + 19) : ld_32(bpb + 32);
+            m_data_sector = m_fat_sector + m_fat_count * m_fat_sectors;
+            if (total_sectors <= m_data_sector - m_volume_sector + m_cluster_sectors)
+            {
+                return ENODEV;
+            }
+            m_cluster_count = (total_sectors - (m_data_sector - m_volume_sector)) / m_cluster_sectors;
+            uint32_t fat_capacity = m_fat_sectors * (m_sector_size / 4) - 2;
+            if (m_cluster_count > fat_capacity)
+            {
+                m_cluster_count = fat_capacity;
+            }
+            m_root_cluster = ld_32(bpb + 44);
+            m_fsinfo_sector = m_volume_sector + ld_16(bpb + 48);
+            if (!valid_cluster(m_root_cluster))
+            {
+                return ENODEV;
+            }
+            return 0;
+        }
+        bool mount()
+        {
+            if (nullptr == m_hal || 0 == m_max_files)
+            {
+                m_last_error = EINVAL;
+                return false;
+            }
+            vfs_fast_fat32_disk_status status = m_hal->initialize(m_pdrv);
+            if (status & (not_initialized | no_disk))
+            {
+                m_last_error = ENODEV;
+                return false;
+            }
+            uint16_t sector_size = 512;
+            if (vfs_fast_fat32_hal_result::success != m_hal->ioctl(m_pdrv, get_sector_size, &sector_size))
+            {
+                sector_size = 512;
+            }
+            if (sector_size < 512 || sector_size > 4096 || 0 != (sector_size & (sector_size - 1)))
+            {
+                m_last_error = EINVAL;
+                return false;
+            }
+            m_sector_size = sector_size;
+            m_sector_shift = 0;
+            while (((uint32_t)1 << m_sector_shift) < m_sector_size)
+            {
+                ++m_sector_shift;
+            }
+            uint8_t *sector = (uint8_t *)Allocator::allocate(m_sector_size, buffer_kind::transfer);
+            if (nullptr == sector)
+            {
+                m_last_error = ENOMEM;
+                return false;
+            }
+            int res = read_geometry(sector);
+            Allocator::deallocate(sector);
+            if (0 != res)
+            {
+                m_last_error = res;
+                return false;
+            }
+            m_files = allocate_array<Allocator, file_entry>(m_max_files, buffer_kind::object);
+            m_extents = allocate_array<Allocator, file_extent>(m_max_files * m_max_extents, buffer_kind::object);
+            if (nullptr == m_files || nullptr == m_extents ||
+                !m_cache.initialize(*m_hal, m_pdrv, m_sector_size, m_cache_size, m_cache_line_size, m_data_sector))
+            {
+                m_last_error = ENOMEM;
+                deallocate_array<Allocator>(m_files, m_max_files);
+                m_files = nullptr;
+                deallocate_array<Allocator>(m_extents, m_max_files * m_max_extents);
+                m_extents = nullptr;
+                return false;
+            }
+            m_cache.mirror(m_fat_sector, m_fat_sectors, m_fat_count);
+            m_window_sector = unknown;
+            m_free_clusters = unknown;
+            m_next_free = 2;
+            m_fsinfo_dirty = false;
+            if (0 == move_window(m_fsinfo_sector) &&
+                0x41615252 == ld_32(m_window) &&
+                0x61417272 == ld_32(m_window + 484) &&
+                0xAA550000 == ld_32(m_window + 508))
+            {
+                uint32_t free_clusters = ld_32(m_window + 488);
+                uint32_t next_free = ld_32(m_window + 492);
+                if (free_clusters <= m_cluster_count)
+                {
+                    m_free_clusters = free_clusters;
+                }
+                if (valid_cluster(next_free))
+                {
+                    m_next_free = next_free;
+                }
+            }
+            // the map is built a step at a time as allocations reach its edge, so mounting a large
+            // card doesn't scan its whole FAT. without the RAM for it the FAT is searched
+            m_free_map_clusters = 0;
+            m_free_map_count = 0;
+            m_trim_count = 0;
+            if (m_use_free_map)
+            {
+                m_free_map = allocate_array<Allocator, uint32_t>((m_cluster_count + 31) / 32, buffer_kind::cache);
+                m_free_map_buffer = (uint8_t *)Allocator::allocate(free_map_step() * m_sector_size, buffer_kind::transfer);
+                if (nullptr == m_free_map || nullptr == m_free_map_buffer)
+                {
+                    Allocator::deallocate(m_free_map);
+                    m_free_map = nullptr;
+                    Allocator::deallocate(m_free_map_buffer);
+                    m_free_map_buffer = nullptr;
+                }
+            }
+            for (size_t i = 0; i < m_max_files; ++i)
+            {
+                m_files[i].flags = 0;
+                m_files[i].extents = m_extents + i * m_max_extents;
+                m_files[i].extent_capacity = (uint16_t)m_max_extents;
+            }
+            m_mount_id = ++m_mount_count;
+            return true;
+        }
+        void unmount()
+        {
+            if (!mounted())
+            {
+                return;
+            }
+            for (size_t i = 0; i < m_max_files; ++i)
+            {
+                if (m_files[i].flags & file_open)
+                {
+                    close_file(m_files[i]);
+                }
+            }
+            sync_fs();
+            m_index.clear();
+            m_cache.release();
+            deallocate_array<Allocator>(m_files, m_max_files);
+            m_files = nullptr;
+            deallocate_array<Allocator>(m_extents, m_max_files * m_max_extents);
+            m_extents = nullptr;
+            Allocator::deallocate(m_free_map);
+            m_free_map = nullptr;
+            Allocator::deallocate(m_free_map_buffer);
+            m_free_map_buffer = nullptr;
+        }
+
+    public:
+        // mounts the first FAT32 volume on the HAL's drive. check initialized() afterward.
+        // max_extents bounds the per file map of contiguous cluster runs used for seeking.
+        // each one costs 12 bytes per file. cache_size is the total sector cache shared by
+        // the FAT, directories and unaligned file data, in lines of cache_line_size bytes.
+        // free_map keeps a bitmap of free clusters, one bit per cluster, for allocation and
+        // free space queries that don't read the FAT. directory_index_size is the memory for
+        // indexing the names in recently used directories, at 16 to 32 bytes per entry. 0
+        // turns it off, and every lookup scans the directory
+        basic_vfs_fast_fat32(vfs_fast_fat32_hal &hal, uint8_t pdrv = 0, size_t max_files = 5, size_t max_extents = 16, size_t cache_size = 16384, size_t cache_line_size = 2048, bool free_map = true, size_t directory_index_size = 16384) : m_hal(&hal), m_pdrv(pdrv), m_last_error(0), m_use_free_map(free_map), m_free_map(nullptr), m_free_map_buffer(nullptr), m_trim(true), m_trim_count(0), m_cache_size(cache_size), m_cache_line_size(cache_line_size), m_window(nullptr), m_files(nullptr), m_max_files(max_files), m_extents(nullptr), m_max_extents(0 == max_extents ? 1 : (max_extents > 0xFFFF ? 0xFFFF : max_extents))
+        {
+            m_index.size(directory_index_size);
+            mount();
+        }
+        basic_vfs_fast_fat32(const basic_vfs_fast_fat32 &rhs) = delete;
+        basic_vfs_fast_fat32 &operator=(const basic_vfs_fast_fat32 &rhs) = delete;
+        virtual ~basic_vfs_fast_fat32()
+        {
+            unmount();
+        }
+        inline bool initialized() const
+        {
+            return mounted();
+        }
+        // the errno value of the last mount failure
+        inline int last_error() const
+        {
+            return m_last_error;
+        }
+        // the bytes per sector of the mounted volume
+        inline uint16_t sector_size() const
+        {
+            return m_sector_size;
+        }
+        // true when reads and writes find their place in the file with shifts and masks
+        // rather than divisions, which is the default on every volume that mounts
+        inline bool shift_addressing() const
+        {
+            return m_shift_math;
+        }
+        // turns the shifts off and back on, to measure what they save. they can't be
+        // turned on for a volume that doesn't allow them
+        void shift_addressing(bool value)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_shift_math = value && mounted() && ((uint32_t)1 << m_cluster_shift) == m_cluster_size;
+        }
+        // bytes held by the directory index, out of directory_index_size
+        inline size_t directory_index_used() const
+        {
+            return m_index.used();
+        }
+        unsigned long long size() const
+        {
+            if (!mounted())
+                return 0;
+            return ((unsigned long long)m_cluster_size) * m_cluster_count;
+        }
+        unsigned long long free()
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted())
+                return 0;
+            if (unknown == m_free_clusters && nullptr != m_free_map)
+            {
+                // no valid FSInfo, so finish the map, which counts them
+                if (0 != build_free_map(m_fat_sectors))
+                {
+                    return 0;
+                }
+            }
+            if (unknown == m_free_clusters)
+            {
+                // no valid FSInfo or map, so count them
+                uint32_t count = 0;
+                for (uint32_t cluster = 2; cluster < m_cluster_count + 2; ++cluster)
+                {
+                    uint32_t value = get_fat(cluster);
+                    if (unknown == value)
+                    {
+                        return 0;
+                    }
+                    if (0 == value)
+                    {
+                        ++count;
+                    }
+                }
+                m_free_clusters = count;
+                m_fsinfo_dirty = true;
+            }
+            return ((unsigned long long)m_cluster_size) * m_free_clusters;
+        }
+        // true when clusters freed by unlink, truncation and overwriting are trimmed, so
+        // the card knows it doesn't have to keep what was in them. they're sent to the HAL
+        // as control_trim in coalesced runs on each sync, when too many runs are waiting,
+        // or on trim_freed(). this is the default
+        inline bool trim() const
+        {
+            return m_trim;
+        }
+        void trim(bool value)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_trim = value;
+            m_trim_count = 0;
+        }
+        // sends the clusters freed since the last trim now, rather than at the next sync.
+        // call it when idle. the FAT is written first
+        bool trim_freed()
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted())
+            {
+                return false;
+            }
+            if (0 == m_trim_count)
+            {
+                return true;
+            }
+            return 0 == sync_fs();
+        }
+        // trims every free cluster on the volume, in runs, for maintenance on a card that
+        // has been written with trimming off or by another system. it can take a while on
+        // a large card, and finishes the free map if it isn't done. returns false if the
+        // HAL can't trim or fails
+        bool trim_free_space()
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted() || 0 != sync_fs())
+            {
+                return false;
+            }
+            if (nullptr != m_free_map && 0 != build_free_map(m_fat_sectors))
+            {
+                return false;
+            }
+            uint32_t start = 0, length = 0;
+            for (uint32_t cluster = 2; cluster <= m_cluster_count + 2; ++cluster)
+            {
+                bool is_free = false;
+                if (cluster < m_cluster_count + 2)
+                {
+                    if (nullptr != m_free_map)
+                    {
+                        is_free = 0 != (m_free_map[(cluster - 2) / 32] & (1u << ((cluster - 2) % 32)));
+                    }
+                    else
+                    {
+                        uint32_t value = get_fat(cluster);
+                        if (unknown == value)
+                        {
+                            return false;
+                        }
+                        is_free = 0 == value;
+                    }
+                }
+                if (is_free)
+                {
+                    if (0 == length)
+                    {
+                        start = cluster;
+                    }
+                    ++length;
+                    continue;
+                }
+                if (0 != length && vfs_fast_fat32_hal_result::success != trim_range(start, length))
+                {
+                    return false;
+                }
+                length = 0;
+            }
+            return vfs_fast_fat32_hal_result::success == m_hal->ioctl(m_pdrv, control_sync, nullptr);
+        }
+        // scans up to fat_sectors more of the FAT into the free map, which otherwise fills in
+        // a step at a time as allocations reach its edge. call it when idle to have it done
+        // sooner. returns true once the map is complete, or if there is none
+        bool scan_free_clusters(size_t fat_sectors)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted())
+            {
+                return false;
+            }
+            uint32_t sectors = fat_sectors > m_fat_sectors ? m_fat_sectors : (uint32_t)fat_sectors;
+            return 0 == build_free_map(sectors) && nullptr == m_free_map_buffer;
+        }
+        // writes an empty FAT32 volume across the whole drive with no partition table.
+        // cluster_sectors of 0 picks a size based on the volume size
+        static bool format(vfs_fast_fat32_hal &hal, uint8_t pdrv = 0, uint8_t cluster_sectors = 0)
+        {
+            if (hal.initialize(pdrv) & (not_initialized | no_disk | write_protected))
+            {
+                return false;
+            }
+            uint16_t sector_size = 512;
+            if (vfs_fast_fat32_hal_result::success != hal.ioctl(pdrv, get_sector_size, &sector_size))
+            {
+                sector_size = 512;
+            }
+            uint32_t sector_count = 0;
+            if (vfs_fast_fat32_hal_result::success != hal.ioctl(pdrv, get_sector_count, &sector_count) || sector_size < 512 || sector_size > 4096)
+            {
+                return false;
+            }
+            if (0 == cluster_sectors)
+            {
+                uint64_t bytes = (uint64_t)sector_count * sector_size;
+                uint32_t cluster_size = bytes < (256ull << 20) ? 1024 : bytes < (8ull << 30) ? 4096 : bytes < (16ull << 30) ? 8192 : bytes < (32ull << 30) ? 16384 : 32768;
+                cluster_sectors = cluster_size > sector_size ? (uint8_t)(cluster_size / sector_size) : 1;
+            }
+            const uint32_t reserved = 32;
+            const uint32_t fats = 2;
+            // FAT size: solve for clusters = (total - reserved - fats*fat) / spc
+            uint32_t entries_per_sector = sector_size / 4;
+            uint32_t fat_sectors = 1;
+            while (true)
+            {
+                if (sector_count <= reserved + fats * fat_sectors + cluster_sectors)
+                {
+                    return false;
+                }
+                uint32_t clusters = (sector_count - reserved - fats * fat_sectors) / cluster_sectors;
+                uint32_t needed = (clusters + 2 + entries_per_sector - 1) / entries_per_sector;
+                if (needed <= fat_sectors)
+                {
+                    break;
+                }
+                fat_sectors = needed;
+            }
+            uint8_t *buf = (uint8_t *)Allocator::allocate(sector_size, buffer_kind::transfer);
+            if (nullptr == buf)
+            {
+                return false;
+            }
+            bool result = false;
+            uint32_t data_sector = reserved + fats * fat_sectors;
+            uint32_t clusters = (sector_count - data_sector) / cluster_sectors;
+            do
+            {
+                // boot sector
+                memset(buf, 0, sector_size);
+                memcpy(buf, "\xEB\x58\x90MSDOS5.0", 11);
+                st_16(buf + 11, sector_size);
+                buf[13] = cluster_sectors;
+                st_16(buf + 14, (uint16_t)reserved);
+                buf[16] = (uint8_t)fats;
+                buf[21] = 0xF8;
+                st_16(buf + 24, 63);
+                st_16(buf + 26, 255);
+                st_32(buf + 32, sector_count);
+                st_32(buf + 36, fat_sectors);
+                st_32(buf + 44, 2);
+                st_16(buf + 48, 1);
+                st_16(buf + 50, 6);
+                buf[64] = 0x80;
+                buf[66] = 0x29;
+                st_32(buf + 67, get_time());
+                memcpy(buf + 71, "NO NAME    FAT32   ", 19);
+                st_16(buf + 510, 0xAA55);
+                if (vfs_fast_fat32_hal_result::success != hal.write(pdrv, buf, 0, 1) ||
+                    vfs_fast_fat32_hal_result::success != hal.write(pdrv, buf, 6, 1))
+                {
+                    break;
+                }
+                // FSInfo
+                memset(buf, 0, sector_size);
+                st_32(buf, 0x41615252);
+                st_32(buf + 484, 0x61417272);
+                st_32(buf + 488, clusters - 1);
+                st_32(buf + 492, 2);
+                st_32(buf + 508, 0xAA550000);
+                if (vfs_fast_fat32_hal_result::success != hal.write(pdrv, buf, 1, 1) ||
+                    vfs_fast_fat32_hal_result::success != hal.write(pdrv, buf, 7, 1))
+                {
+                    break;
+                }
+                // FATs
+                bool ok = true;
+                for (uint32_t f = 0; ok && f < fats; ++f)
+                {
+                    for (uint32_t i = 0; ok && i < fat_sectors; ++i)
+                    {
+                        memset(buf, 0, sector_size);
+                        if (0 == i)
+                        {
+                            st_32(buf, 0x0FFFFFF8);
+                            st_32(buf + 4, 0x0FFFFFFF);
+                            st_32(buf + 8, cluster_eoc);
+                        }
+                        ok = vfs_fast_fat32_hal_result::success == hal.write(pdrv, buf, reserved + f * fat_sectors + i, 1);
+                    }
+                }
+                // root directory
+                memset(buf, 0, sector_size);
+                for (uint32_t i = 0; ok && i < cluster_sectors; ++i)
+                {
+                    ok = vfs_fast_fat32_hal_result::success == hal.write(pdrv, buf, data_sector + i, 1);
+                }
+                result = ok && vfs_fast_fat32_hal_result::success == hal.ioctl(pdrv, control_sync, nullptr);
+            } while (false);
+            Allocator::deallocate(buf);
+            return result;
+        }
+        virtual ssize_t write(int fd, const void *data, size_t size)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f)
+            {
+                return fail(EBADF);
+            }
+            if (f->flags & file_append)
+            {
+                f->position = f->id.size;
+            }
+            int res = fill_gap(*f);
+            if (0 != res)
+            {
+                return fail(res);
+            }
+            return write_file(*f, (const uint8_t *)data, size);
+        }
+        virtual off_t lseek(int fd, off_t size, int mode)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f)
+            {
+                return fail(EBADF);
+            }
+            int64_t position;
+            switch (mode)
+            {
+            case SEEK_SET:
+                position = size;
+                break;
+            case SEEK_CUR:
+                position = (int64_t)f->position + size;
+                break;
+            case SEEK_END:
+                position = (int64_t)f->id.size + size;
+                break;
+            default:
+                return fail(EINVAL);
+            }
+            if (0 > position || position > 0xFFFFFFFF)
+            {
+                return fail(EINVAL);
+            }
+            f->position = (uint32_t)position;
+            return (off_t)position;
+        }
+        virtual ssize_t read(int fd, void *dst, size_t size)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f)
+            {
+                return fail(EBADF);
+            }
+            return read_file(*f, (uint8_t *)dst, size);
+        }
+        virtual ssize_t pread(int fd, void *dst, size_t size, off_t offset)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f)
+            {
+                return fail(EBADF);
+            }
+            if (0 > offset || offset > 0xFFFFFFFF)
+            {
+                return fail(EINVAL);
+            }
+            uint32_t position = f->position;
+            f->position = (uint32_t)offset;
+            ssize_t result = read_file(*f, (uint8_t *)dst, size);
+            f->position = position;
+            return result;
+        }
+        virtual ssize_t pwrite(int fd, const void *src, size_t size, off_t offset)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f)
+            {
+                return fail(EBADF);
+            }
+            if (0 > offset || offset > 0xFFFFFFFF)
+            {
+                return fail(EINVAL);
+            }
+            uint32_t position = f->position;
+            f->position = (uint32_t)offset;
+            int res = fill_gap(*f);
+            ssize_t result = 0 == res ? write_file(*f, (const uint8_t *)src, size) : fail(res);
+            f->position = position;
+            return result;
+        }
+        // one lock and one append or gap fill for the lot, rather than one per buffer
+        virtual ssize_t readv(int fd, const struct iovec *iov, int count)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f)
+            {
+                return fail(EBADF);
+            }
+            return read_vector(*f, iov, count);
+        }
+        virtual ssize_t writev(int fd, const struct iovec *iov, int count)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f)
+            {
+                return fail(EBADF);
+            }
+            if (f->flags & file_append)
+            {
+                f->position = f->id.size;
+            }
+            int res = fill_gap(*f);
+            if (0 != res)
+            {
+                return fail(res);
+            }
+            return write_vector(*f, iov, count);
+        }
+        virtual ssize_t pwritev(int fd, const struct iovec *iov, int count, off_t offset)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f)
+            {
+                return fail(EBADF);
+            }
+            if (0 > offset || offset > 0xFFFFFFFF)
+            {
+                return fail(EINVAL);
+            }
+            uint32_t position = f->position;
+            f->position = (uint32_t)offset;
+            int res = fill_gap(*f);
+            ssize_t result = 0 == res ? write_vector(*f, iov, count) : fail(res);
+            f->position = position;
+            return result;
+        }
+        virtual int open(const char *path, int flags, int /*mode*/)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted())
+            {
+                return fail(ENODEV);
+            }
+            int fd = -1;
+            for (size_t i = 0; i < m_max_files; ++i)
+            {
+                if (!(m_files[i].flags & file_open))
+                {
+                    fd = (int)i;
+                    break;
+                }
+            }
+            if (-1 == fd)
+            {
+                return fail(ENFILE);
+            }
+            int access = flags & O_ACCMODE;
+            bool writing = O_WRONLY == access || O_RDWR == access;
+            directory_entry dir;
+            int res = follow_path(path, dir);
+            if (0 == res)
+            {
+                if (dir.fn[11] & name_none)
+                {
+                    return fail(EISDIR);
+                }
+                if ((flags & O_CREAT) && (flags & O_EXCL))
+                {
+                    return fail(EEXIST);
+                }
+                uint8_t attributes = dir.directory_pointer[entry_attributes];
+                if (attributes & directory)
+                {
+                    return fail(EISDIR);
+                }
+                if (writing && (attributes & read_only))
+                {
+                    return fail(EACCES);
+                }
+            }
+            else
+            {
+                if (ENOENT != res || !(flags & O_CREAT) || !(dir.fn[11] & name_last) || (dir.fn[11] & name_dot))
+                {
+                    return fail(res);
+                }
+                res = dir_register(dir);
+                if (0 != res)
+                {
+                    return fail(res);
+                }
+                dir.id.attributes = archive;
+                dir.id.size = 0;
+            }
+            file_entry &f = m_files[fd];
+            f.id.mount_id = m_mount_id;
+            f.id.attributes = (vfs_fast_fat32_attributes)dir.directory_pointer[entry_attributes];
+            f.id.stat = 0;
+            f.id.start_cluster = load_cluster(dir.directory_pointer);
+            f.id.size = ld_32(dir.directory_pointer + entry_size_field);
+            f.flags = file_open;
+            if (O_RDONLY == access || O_RDWR == access)
+            {
+                f.flags |= file_read;
+            }
+            if (writing)
+            {
+                f.flags |= file_write;
+            }
+            if (flags & O_APPEND)
+            {
+                f.flags |= file_append;
+            }
+            f.error = 0;
+            f.position = 0;
+            f.cluster = 0;
+            f.cluster_index = 0;
+            f.extent_count = 0;
+            f.mapped = 0;
+            f.grow_clusters = 0;
+            f.read_next = 0;
+            f.prefetched = 0;
+            f.read_window = 0;
+            f.directory_sector = dir.sector;
+            f.directory_offset = (uint16_t)(dir.position & (m_sector_size - 1));
+            if (writing && (flags & O_TRUNC) && 0 != f.id.size)
+            {
+                res = truncate_file(f, 0);
+                if (0 == res)
+                {
+                    res = sync_file(f);
+                }
+                if (0 != res)
+                {
+                    f.flags = 0;
+                    return fail(res);
+                }
+            }
+            return fd;
+        }
+        virtual int close(int fd)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f)
+            {
+                return fail(EBADF);
+            }
+            int res = close_file(*f);
+            return 0 == res ? 0 : fail(res);
+        }
+        virtual int fstat(int fd, struct stat *st)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f)
+            {
+                return fail(EBADF);
+            }
+            int res = move_window(f->directory_sector);
+            if (0 != res)
+            {
+                return fail(res);
+            }
+            fill_stat(m_window + f->directory_offset, st);
+            st->st_size = f->id.size;
+            return 0;
+        }
+        virtual int fsync(int fd)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f)
+            {
+                return fail(EBADF);
+            }
+            int res = sync_file(*f);
+            return 0 == res ? 0 : fail(res);
+        }
+        // reserves clusters so the file can grow to length bytes as pure data writes. the
+        // FAT is only updated in the cache until the next sync. see file_preallocate
+        int preallocate(int fd, off_t length)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f || !(f->flags & file_write))
+            {
+                return fail(EBADF);
+            }
+            if (0 > length || length > 0xFFFFFFFF)
+            {
+                return fail(EINVAL);
+            }
+            int res = reserve_clusters(*f, (uint32_t)length);
+            return 0 == res ? 0 : fail(res);
+        }
+        // the bytes the file's clusters can hold, including any reserved past its end
+        off_t allocated_size(int fd)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f)
+            {
+                return fail(EBADF);
+            }
+            uint32_t count;
+            int res = chain_clusters(*f, count);
+            if (0 != res)
+            {
+                return fail(res);
+            }
+            return (off_t)count * m_cluster_size;
+        }
+        // grows the file to length over clusters already in its chain, without zeroing them,
+        // so data written past the recorded size before a crash can be read back. length
+        // can't be more than allocated_size()
+        int extend_reserved(int fd, off_t length)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f || !(f->flags & file_write))
+            {
+                return fail(EBADF);
+            }
+            uint32_t count;
+            int res = chain_clusters(*f, count);
+            if (0 != res)
+            {
+                return fail(res);
+            }
+            if (0 > length || (uint64_t)length > (uint64_t)count * m_cluster_size || (uint32_t)length < f->id.size)
+            {
+                return fail(EINVAL);
+            }
+            if ((uint32_t)length != f->id.size)
+            {
+                f->id.size = (uint32_t)length;
+                f->flags |= file_modified;
+            }
+            return 0;
+        }
+        // like fsync() but leaves the directory entry alone, so it costs nothing beyond the
+        // data when the file only writes into clusters it already has
+        int fdatasync(int fd)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (nullptr == get_file(fd))
+            {
+                return fail(EBADF);
+            }
+            int res = sync_fs();
+            return 0 == res ? 0 : fail(res);
+        }
+        // sets how many clusters are reserved at a time as the file grows. see
+        // file_grow_clusters
+        int grow_by(int fd, size_t clusters)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file_entry *f = get_file(fd);
+            if (nullptr == f)
+            {
+                return fail(EBADF);
+            }
+            f->grow_clusters = (uint16_t)(clusters > 0xFFFF ? 0xFFFF : clusters);
+            return 0;
+        }
+        virtual int ioctl(int fd, int cmd, va_list args)
+        {
+            switch (cmd)
+            {
+            case file_preallocate:
+            {
+                unsigned long length = va_arg(args, unsigned long);
+                return preallocate(fd, (off_t)length);
+            }
+            case file_grow_clusters:
+                return grow_by(fd, va_arg(args, unsigned long));
+            default:
+                return fail(ENOTTY);
+            }
+        }
+#ifdef CONFIG_VFS_SUPPORT_DIR
+        virtual int stat(const char *path, struct stat *st)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted())
+            {
+                return fail(ENODEV);
+            }
+            directory_entry dir;
+            int res = follow_path(path, dir);
+            if (0 != res)
+            {
+                return fail(res);
+            }
+            if (dir.fn[11] & name_none)
+            {
+                memset(st, 0, sizeof(struct stat));
+                st->st_mode = S_IRWXU | S_IRWXG | S_IRWXO | S_IFDIR;
+                return 0;
+            }
+            fill_stat(dir.directory_pointer, st);
+            return 0;
+        }
+        virtual int link(const char * /*n1*/, const char * /*n2*/)
+        {
+            return fail(ENOTSUP);
+        }
+        virtual int unlink(const char *path)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted())
+            {
+                return fail(ENODEV);
+            }
+            directory_entry dir;
+            int res = follow_path(path, dir);
+            if (0 != res)
+            {
+                return fail(res);
+            }
+            if ((dir.fn[11] & (name_none | name_dot)) || (dir.directory_pointer[entry_attributes] & directory))
+            {
+                return fail(EISDIR);
+            }
+            if (dir.directory_pointer[entry_attributes] & read_only)
+            {
+                return fail(EACCES);
+            }
+            if (is_open(dir))
+            {
+                return fail(EBUSY);
+            }
+            uint32_t cluster = load_cluster(dir.directory_pointer);
+            dir.directory_pointer[0] = entry_deleted;
+            window_dirty();
+            index_erase(dir.id.start_cluster, dir.fn, dir.position, dir.cluster);
+            res = remove_chain(cluster, 0);
+            if (0 == res)
+            {
+                res = sync_fs();
+            }
+            return 0 == res ? 0 : fail(res);
+        }
+        virtual int rename(const char *src, const char *dst)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted())
+            {
+                return fail(ENODEV);
+            }
+            directory_entry old_dir;
+            int res = follow_path(src, old_dir);
+            if (0 != res)
+            {
+                return fail(res);
+            }
+            if (old_dir.fn[11] & (name_none | name_dot))
+            {
+                return fail(EINVAL);
+            }
+            if (is_open(old_dir))
+            {
+                return fail(EBUSY);
+            }
+            uint8_t saved[entry_size];
+            memcpy(saved, old_dir.directory_pointer, entry_size);
+            uint32_t old_sector = old_dir.sector;
+            uint32_t old_position = old_dir.position;
+            uint32_t old_cluster = old_dir.cluster;
+            uint32_t old_parent = old_dir.id.start_cluster;
+            directory_entry new_dir;
+            res = follow_path(dst, new_dir);
+            if (0 == res)
+            {
+                return fail(EEXIST);
+            }
+            if (ENOENT != res || !(new_dir.fn[11] & name_last) || (new_dir.fn[11] & name_dot))
+            {
+                return fail(res);
+            }
+            uint32_t cluster = load_cluster(saved);
+            if (saved[entry_attributes] & directory)
+            {
+                // don't move a directory into itself
+                directory_entry walk = new_dir;
+                uint32_t parent = walk.id.start_cluster;
+                while (parent != m_root_cluster)
+                {
+                    if (parent == cluster)
+                    {
+                        return fail(EINVAL);
+                    }
+                    memcpy(walk.fn, "..         ", 11);
+                    walk.id.start_cluster = parent;
+                    res = dir_find(walk);
+                    if (0 != res)
+                    {
+                        return fail(res);
+                    }
+                    parent = load_cluster(walk.directory_pointer);
+                    if (0 == parent)
+                    {
+                        parent = m_root_cluster;
+                    }
+                }
+            }
+            res = dir_register(new_dir);
+            if (0 != res)
+            {
+                return fail(res);
+            }
+            memcpy(new_dir.directory_pointer + 13, saved + 13, entry_size - 13);
+            new_dir.directory_pointer[entry_attributes] = saved[entry_attributes] | ((saved[entry_attributes] & directory) ? 0 : archive);
+            window_dirty();
+            if ((saved[entry_attributes] & directory) && new_dir.id.start_cluster != old_parent && valid_cluster(cluster))
+            {
+                // repoint ..
+                res = move_window(cluster_to_sector(cluster));
+                if (0 == res && 0 == memcmp(m_window + entry_size, "..         ", 11))
+                {
+                    store_cluster(m_window + entry_size, new_dir.id.start_cluster == m_root_cluster ? 0 : new_dir.id.start_cluster);
+                    window_dirty();
+                }
+            }
+            if (0 == res)
+            {
+                res = move_window(old_sector);
+            }
+            if (0 == res)
+            {
+                m_window[old_position & (m_sector_size - 1)] = entry_deleted;
+                window_dirty();
+                index_erase(old_parent, old_dir.fn, old_position, old_cluster);
+                res = sync_fs();
+            }
+            return 0 == res ? 0 : fail(res);
+        }
+        virtual DIR *opendir(const char *name)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted())
+            {
+                errno = ENODEV;
+                return nullptr;
+            }
+            directory_entry dir;
+            int res = follow_path(name, dir);
+            if (0 != res)
+            {
+                errno = res;
+                return nullptr;
+            }
+            uint32_t cluster = m_root_cluster;
+            if (!(dir.fn[11] & name_none))
+            {
+                if (!(dir.directory_pointer[entry_attributes] & directory))
+                {
+                    errno = ENOTDIR;
+                    return nullptr;
+                }
+                cluster = load_cluster(dir.directory_pointer);
+            }
+            directory_handle *handle = allocate_array<Allocator, directory_handle>(1, buffer_kind::object);
+            if (nullptr == handle)
+            {
+                errno = ENOMEM;
+                return nullptr;
+            }
+            handle->entry.id.mount_id = m_mount_id;
+            handle->entry.id.attributes = directory;
+            res = dir_rewind(handle->entry, cluster);
+            if (0 != res)
+            {
+                deallocate_array<Allocator>(handle, 1);
+                errno = res;
+                return nullptr;
+            }
+            return reinterpret_cast<DIR *>(handle);
+        }
+        virtual dirent *readdir(DIR *pdir)
+        {
+            directory_handle *handle = reinterpret_cast<directory_handle *>(pdir);
+            dirent *result = nullptr;
+            int res = readdir_r(pdir, &handle->result, &result);
+            if (0 != res)
+            {
+                errno = res;
+                return nullptr;
+            }
+            return result;
+        }
+        virtual int readdir_r(DIR *pdir, struct dirent *entry, struct dirent **out_dirent)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            directory_handle *handle = reinterpret_cast<directory_handle *>(pdir);
+            if (nullptr == handle || nullptr == entry || nullptr == out_dirent || handle->entry.id.mount_id != m_mount_id)
+            {
+                return EBADF;
+            }
+            *out_dirent = nullptr;
+            directory_entry &dir = handle->entry;
+            while (true)
+            {
+                if (0 == dir.sector)
+                {
+                    return 0;
+                }
+                int res = dir_read_next_live(dir);
+                if (ENOENT == res)
+                {
+                    dir.sector = 0;
+                    return 0;
+                }
+                if (0 != res)
+                {
+                    return res;
+                }
+                bool dot = '.' == dir.directory_pointer[0];
+                if (!dot)
+                {
+                    entry->d_ino = 0;
+                    entry->d_type = (dir.directory_pointer[entry_attributes] & directory) ? DT_DIR : DT_REG;
+                    get_name(dir.directory_pointer, entry->d_name);
+                }
+                res = dir_next(dir, false);
+                if (ENOENT == res)
+                {
+                    dir.sector = 0;
+                }
+                else if (0 != res)
+                {
+                    return res;
+                }
+                if (!dot)
+                {
+                    *out_dirent = entry;
+                    return 0;
+                }
+            }
+        }
+        // fills the records straight from the entries in the window, so a listing reads
+        // each directory sector once
+        virtual ssize_t readdir_plus(DIR *pdir, vfs_file_info *entries, size_t count)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            directory_handle *handle = reinterpret_cast<directory_handle *>(pdir);
+            if (nullptr == handle || handle->entry.id.mount_id != m_mount_id)
+            {
+                return fail(EBADF);
+            }
+            if (nullptr == entries && 0 != count)
+            {
+                return fail(EINVAL);
+            }
+            directory_entry &dir = handle->entry;
+            size_t result = 0;
+            while (result < count && 0 != dir.sector)
+            {
+                int res = dir_read_next_live(dir);
+                if (ENOENT == res)
+                {
+                    dir.sector = 0;
+                    break;
+                }
+                if (0 != res)
+                {
+                    return fail(res);
+                }
+                const uint8_t *p = dir.directory_pointer;
+                if ('.' != p[0])
+                {
+                    vfs_file_info &info = entries[result++];
+                    info.attributes = p[entry_attributes];
+                    info.size = (info.attributes & directory) ? 0 : ld_32(p + entry_size_field);
+                    info.modified_time = ld_16(p + entry_modified_time);
+                    info.modified_date = ld_16(p + entry_modified_time + 2);
+                    get_name(p, info.name);
+                }
+                res = dir_next(dir, false);
+                if (ENOENT == res)
+                {
+                    dir.sector = 0;
+                }
+                else if (0 != res)
+                {
+                    return fail(res);
+                }
+            }
+            return (ssize_t)result;
+        }
+        virtual long telldir(DIR *pdir)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            directory_handle *handle = reinterpret_cast<directory_handle *>(pdir);
+            if (nullptr == handle)
+            {
+                errno = EBADF;
+                return -1;
+            }
+            return 0 == handle->entry.sector ? 0x200000 : (long)handle->entry.position;
+        }
+        virtual void seekdir(DIR *pdir, long offset)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            directory_handle *handle = reinterpret_cast<directory_handle *>(pdir);
+            if (nullptr == handle || 0 > offset)
+            {
+                return;
+            }
+            directory_entry &dir = handle->entry;
+            if (0 != dir_rewind(dir, dir.id.start_cluster))
+            {
+                return;
+            }
+            while (dir.position < (uint32_t)offset)
+            {
+                if (0 != dir_next(dir, false))
+                {
+                    dir.sector = 0;
+                    return;
+                }
+            }
+        }
+        virtual int closedir(DIR *pdir)
+        {
+            directory_handle *handle = reinterpret_cast<directory_handle *>(pdir);
+            if (nullptr == handle)
+            {
+                return fail(EBADF);
+            }
+            deallocate_array<Allocator>(handle, 1);
+            return 0;
+        }
+        virtual int mkdir(const char *name, mode_t /*mode*/)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted())
+            {
+                return fail(ENODEV);
+            }
+            directory_entry dir;
+            int res = follow_path(name, dir);
+            if (0 == res)
+            {
+                return fail(EEXIST);
+            }
+            if (ENOENT != res || !(dir.fn[11] & name_last) || (dir.fn[11] & name_dot))
+            {
+                return fail(res);
+            }
+            uint32_t cluster = create_chain(0);
+            if (0 == cluster)
+            {
+                return fail(ENOSPC);
+            }
+            if (unknown == cluster)
+            {
+                return fail(EIO);
+            }
+            m_index.drop(cluster);
+            res = clear_cluster(cluster);
+            if (0 == res)
+            {
+                res = move_window(cluster_to_sector(cluster));
+            }
+            if (0 == res)
+            {
+                uint32_t tm = get_time();
+                uint32_t parent = dir.id.start_cluster == m_root_cluster ? 0 : dir.id.start_cluster;
+                memset(m_window, ' ', 11);
+                m_window[0] = '.';
+                memset(m_window + 11, 0, entry_size - 11);
+                m_window[entry_attributes] = directory;
+                st_32(m_window + entry_create_time, tm);
+                st_16(m_window + entry_access_date, (uint16_t)(tm >> 16));
+                st_32(m_window + entry_modified_time, tm);
+                store_cluster(m_window, cluster);
+                memcpy(m_window + entry_size, m_window, entry_size);
+                m_window[entry_size + 1] = '.';
+                store_cluster(m_window + entry_size, parent);
+                window_dirty();
+                res = dir_register(dir);
+            }
+            if (0 == res)
+            {
+                dir.directory_pointer[entry_attributes] = directory;
+                store_cluster(dir.directory_pointer, cluster);
+                window_dirty();
+                res = sync_fs();
+            }
+            else
+            {
+                remove_chain(cluster, 0);
+            }
+            return 0 == res ? 0 : fail(res);
+        }
+        virtual int rmdir(const char *name)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted())
+            {
+                return fail(ENODEV);
+            }
+            directory_entry dir;
+            int res = follow_path(name, dir);
+            if (0 != res)
+            {
+                return fail(res);
+            }
+            if (dir.fn[11] & (name_none | name_dot))
+            {
+                return fail(EBUSY);
+            }
+            if (!(dir.directory_pointer[entry_attributes] & directory))
+            {
+                return fail(ENOTDIR);
+            }
+            if (dir.directory_pointer[entry_attributes] & read_only)
+            {
+                return fail(EACCES);
+            }
+            uint32_t cluster = load_cluster(dir.directory_pointer);
+            uint32_t sector = dir.sector;
+            uint32_t position = dir.position;
+            uint32_t parent_cluster = dir.cluster;
+            directory_entry child;
+            child.id.start_cluster = cluster;
+            res = dir_rewind(child, cluster);
+            while (0 == res)
+            {
+                res = dir_read_next_live(child);
+                if (0 == res)
+                {
+                    if ('.' != child.directory_pointer[0])
+                    {
+                        return fail(ENOTEMPTY);
+                    }
+                    res = dir_next(child, false);
+                }
+            }
+            if (ENOENT != res)
+            {
+                return fail(res);
+            }
+            res = move_window(sector);
+            if (0 == res)
+            {
+                m_window[position & (m_sector_size - 1)] = entry_deleted;
+                window_dirty();
+                index_erase(dir.id.start_cluster, dir.fn, position, parent_cluster);
+                m_index.drop(cluster);
+                res = remove_chain(cluster, 0);
+            }
+            if (0 == res)
+            {
+                res = sync_fs();
+            }
+            return 0 == res ? 0 : fail(res);
+        }
+        virtual int access(const char *path, int amode)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted())
+            {
+                return fail(ENODEV);
+            }
+            directory_entry dir;
+            int res = follow_path(path, dir);
+            if (0 != res)
+            {
+                return fail(res);
+            }
+            if ((amode & W_OK) && !(dir.fn[11] & name_none) && (dir.directory_pointer[entry_attributes] & read_only))
+            {
+                return fail(EACCES);
+            }
+            return 0;
+        }
+        virtual int truncate(const char *path, off_t length)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted())
+            {
+                return fail(ENODEV);
+            }
+            if (0 > length || length > 0xFFFFFFFF)
+            {
+                return fail(EINVAL);
+            }
+            directory_entry dir;
+            int res = follow_path(path, dir);
+            if (0 != res)
+            {
+                return fail(res);
+            }
+            if ((dir.fn[11] & name_none) || (dir.directory_pointer[entry_attributes] & directory))
+            {
+                return fail(EISDIR);
+            }
+            if (dir.directory_pointer[entry_attributes] & read_only)
+            {
+                return fail(EACCES);
+            }
+            if (is_open(dir))
+            {
+                return fail(EBUSY);
+            }
+            // use a scratch entry so the existing open/flush logic applies
+            file_entry f;
+            memset(&f, 0, sizeof(f));
+            f.id.start_cluster = load_cluster(dir.directory_pointer);
+            f.id.size = ld_32(dir.directory_pointer + entry_size_field);
+            f.flags = file_open | file_write;
+            f.directory_sector = dir.sector;
+            f.directory_offset = (uint16_t)(dir.position & (m_sector_size - 1));
+            res = truncate_file(f, (uint32_t)length);
+            if (0 == res)
+            {
+                res = sync_file(f);
+            }
+            return 0 == res ? 0 : fail(res);
+        }
+        virtual int utime(const char *path, const struct utimbuf *times)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!mounted())
+            {
+                return fail(ENODEV);
+            }
+            directory_entry dir;
+            int res = follow_path(path, dir);
+            if (0 != res)
+            {
+                return fail(res);
+            }
+            if (dir.fn[11] & name_none)
+            {
+                return fail(EINVAL);
+            }
+            uint32_t modified = nullptr != times ? to_fat_time(times->modtime) : get_time();
+            uint32_t accessed = nullptr != times ? to_fat_time(times->actime) : modified;
+            st_32(dir.directory_pointer + entry_modified_time, modified);
+            st_16(dir.directory_pointer + entry_access_date, (uint16_t)(accessed >> 16));
+            window_dirty();
+            res = sync_fs();
+            return 0 == res ? 0 : fail(res);
+        }
+#endif // CONFIG_VFS_SUPPORT_DIR
     };
+    template <typename Allocator>
+    std::atomic<uint16_t> basic_vfs_fast_fat32<Allocator>::m_mount_count {0};
+    typedef basic_vfs_fast_fat32<> vfs_fast_fat32;
 }
 #endif
@@ -0,0 +1,62 @@
+#ifndef HTCW_ESP32_VFS_FAST_FAT32_CARD_HAL_HPP
+#define HTCW_ESP32_VFS_FAST_FAT32_CARD_HAL_HPP
+#include "vfs_fast_fat32.hpp"
+namespace esp32 {
+    // exposes any card with the plain read/write surface of sdmmc_card to vfs_fast_fat32,
+    // such as simulated_sd_card. Card needs:
+    //   bool initialized() const
+    //   bool read(void* destination,size_t start_sector,size_t sector_count)
+    //   bool write(const void* source,size_t start_sector,size_t sector_count)
+    //   size_t sector_count() const
+    //   size_t sector_size() const
+    // writes are taken to be done when write() returns. sdmmc_card has its own HAL in
+    // vfs_fast_fat32_sdmmc_hal.hpp that knows about its write pipeline
+    template<typename Card>
+    class vfs_fast_fat32_card_hal : public vfs_fast_fat32_hal {
+        Card& m_card;
+    public:
+        vfs_fast_fat32_card_hal(Card& card) : m_card(card) {
+        }
+        vfs_fast_fat32_card_hal(const vfs_fast_fat32_card_hal& rhs)=delete;
+        vfs_fast_fat32_card_hal& operator=(const vfs_fast_fat32_card_hal& rhs)=delete;
+        virtual vfs_fast_fat32_disk_status initialize(uint8_t pdrv) {
+            return status(pdrv);
+        }
+        virtual vfs_fast_fat32_disk_status status(uint8_t pdrv) {
+            if(0!=pdrv || !m_card.initialized()) {
+                return (vfs_fast_fat32_disk_status)(not_initialized|no_disk);
+            }
+            return (vfs_fast_fat32_disk_status)0;
+        }
+        virtual vfs_fast_fat32_hal_result read(uint8_t pdrv, void *buffer, uint32_t sector, unsigned int count) {
+            if(0!=pdrv || !m_card.initialized()) {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            return m_card.read(buffer,sector,count)?vfs_fast_fat32_hal_result::success:vfs_fast_fat32_hal_result::io_error;
+        }
+        virtual vfs_fast_fat32_hal_result write(uint8_t pdrv, const void *buffer, uint32_t sector, unsigned int count) {
+            if(0!=pdrv || !m_card.initialized()) {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            return m_card.write(buffer,sector,count)?vfs_fast_fat32_hal_result::success:vfs_fast_fat32_hal_result::io_error;
+        }
+        virtual vfs_fast_fat32_hal_result ioctl(uint8_t pdrv, vfs_fast_fat32_ioctl_command command, void *buffer) {
+            if(0!=pdrv || !m_card.initialized()) {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            switch(command) {
+                case control_sync:
+                    return vfs_fast_fat32_hal_result::success;
+                case get_sector_count:
+                    *(uint32_t*)buffer = (uint32_t)m_card.sector_count();
+                    return vfs_fast_fat32_hal_result::success;
+                case get_sector_size:
+                    *(uint16_t*)buffer = (uint16_t)m_card.sector_size();
+                    return vfs_fast_fat32_hal_result::success;
+                default:
+                    return vfs_fast_fat32_hal_result::invalid_paramter;
+            }
+        }
+    };
+}
+#endif
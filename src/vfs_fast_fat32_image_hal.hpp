@@ -0,0 +1,231 @@
+#ifndef HTCW_ESP32_VFS_FAST_FAT32_IMAGE_HAL_HPP
+#define HTCW_ESP32_VFS_FAST_FAT32_IMAGE_HAL_HPP
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "vfs_fast_fat32.hpp"
+namespace esp32
+{
+    // a drive held entirely in RAM. mostly useful for host builds and tests
+    class vfs_fast_fat32_ram_hal : public vfs_fast_fat32_hal
+    {
+        uint8_t *m_data;
+        uint32_t m_sector_count;
+        uint16_t m_sector_size;
+
+    public:
+        vfs_fast_fat32_ram_hal(uint32_t sector_count, uint16_t sector_size = 512) : m_sector_count(sector_count), m_sector_size(sector_size)
+        {
+            // calloc so the host can hand out zero pages lazily
+            m_data = (uint8_t *)calloc(sector_count, sector_size);
+        }
+        vfs_fast_fat32_ram_hal(const vfs_fast_fat32_ram_hal &rhs) = delete;
+        vfs_fast_fat32_ram_hal &operator=(const vfs_fast_fat32_ram_hal &rhs) = delete;
+        virtual ~vfs_fast_fat32_ram_hal()
+        {
+            ::free(m_data);
+        }
+        inline bool initialized() const
+        {
+            return nullptr != m_data;
+        }
+        inline uint8_t *data()
+        {
+            return m_data;
+        }
+        virtual vfs_fast_fat32_disk_status initialize(uint8_t pdrv)
+        {
+            return status(pdrv);
+        }
+        virtual vfs_fast_fat32_disk_status status(uint8_t pdrv)
+        {
+            return (vfs_fast_fat32_disk_status)(nullptr == m_data || 0 != pdrv ? not_initialized | no_disk : 0);
+        }
+        virtual vfs_fast_fat32_hal_result read(uint8_t pdrv, void *buffer, uint32_t sector, unsigned int count)
+        {
+            if (nullptr == m_data || 0 != pdrv)
+            {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            if ((uint64_t)sector + count > m_sector_count)
+            {
+                return vfs_fast_fat32_hal_result::invalid_paramter;
+            }
+            memcpy(buffer, m_data + (size_t)sector * m_sector_size, (size_t)count * m_sector_size);
+            return vfs_fast_fat32_hal_result::success;
+        }
+        virtual vfs_fast_fat32_hal_result write(uint8_t pdrv, const void *buffer, uint32_t sector, unsigned int count)
+        {
+            if (nullptr == m_data || 0 != pdrv)
+            {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            if ((uint64_t)sector + count > m_sector_count)
+            {
+                return vfs_fast_fat32_hal_result::invalid_paramter;
+            }
+            memcpy(m_data + (size_t)sector * m_sector_size, buffer, (size_t)count * m_sector_size);
+            return vfs_fast_fat32_hal_result::success;
+        }
+        virtual vfs_fast_fat32_hal_result ioctl(uint8_t pdrv, vfs_fast_fat32_ioctl_command command, void *buffer)
+        {
+            if (nullptr == m_data || 0 != pdrv)
+            {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            switch (command)
+            {
+            case control_sync:
+                return vfs_fast_fat32_hal_result::success;
+            case get_sector_count:
+                *(uint32_t *)buffer = m_sector_count;
+                return vfs_fast_fat32_hal_result::success;
+            case get_sector_size:
+                *(uint16_t *)buffer = m_sector_size;
+                return vfs_fast_fat32_hal_result::success;
+            case get_block_size:
+                *(uint32_t *)buffer = 1;
+                return vfs_fast_fat32_hal_result::success;
+            case control_trim:
+            {
+                // nothing to reclaim in RAM, so this only checks the range
+                const uint32_t *range = (const uint32_t *)buffer;
+                return range[1] < range[0] || range[1] >= m_sector_count ? vfs_fast_fat32_hal_result::invalid_paramter : vfs_fast_fat32_hal_result::success;
+            }
+            default:
+                return vfs_fast_fat32_hal_result::invalid_paramter;
+            }
+        }
+    };
+    // a drive backed by a disk image file on the host, such as one dumped from a card
+    class vfs_fast_fat32_file_hal : public vfs_fast_fat32_hal
+    {
+        int m_fd;
+        uint32_t m_sector_count;
+        uint16_t m_sector_size;
+
+    public:
+        // opens an existing image. if sector_count isn't 0 the image is created or resized
+        // (sparsely) to that many sectors
+        vfs_fast_fat32_file_hal(const char *path, uint32_t sector_count = 0, uint16_t sector_size = 512) : m_sector_count(0), m_sector_size(sector_size)
+        {
+            m_fd = ::open(path, O_RDWR | (0 != sector_count ? O_CREAT : 0), 0644);
+            if (0 > m_fd)
+            {
+                return;
+            }
+            if (0 != sector_count)
+            {
+                if (0 != ftruncate(m_fd, (off_t)sector_count * sector_size))
+                {
+                    ::close(m_fd);
+                    m_fd = -1;
+                    return;
+                }
+                m_sector_count = sector_count;
+            }
+            else
+            {
+                off_t size = ::lseek(m_fd, 0, SEEK_END);
+                m_sector_count = 0 < size ? (uint32_t)(size / sector_size) : 0;
+            }
+        }
+        vfs_fast_fat32_file_hal(const vfs_fast_fat32_file_hal &rhs) = delete;
+        vfs_fast_fat32_file_hal &operator=(const vfs_fast_fat32_file_hal &rhs) = delete;
+        virtual ~vfs_fast_fat32_file_hal()
+        {
+            if (initialized())
+            {
+                ::close(m_fd);
+            }
+        }
+        inline bool initialized() const
+        {
+            return -1 < m_fd;
+        }
+        virtual vfs_fast_fat32_disk_status initialize(uint8_t pdrv)
+        {
+            return status(pdrv);
+        }
+        virtual vfs_fast_fat32_disk_status status(uint8_t pdrv)
+        {
+            return (vfs_fast_fat32_disk_status)(!initialized() || 0 != pdrv ? not_initialized | no_disk : 0);
+        }
+        virtual vfs_fast_fat32_hal_result read(uint8_t pdrv, void *buffer, uint32_t sector, unsigned int count)
+        {
+            if (!initialized() || 0 != pdrv)
+            {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            if ((uint64_t)sector + count > m_sector_count)
+            {
+                return vfs_fast_fat32_hal_result::invalid_paramter;
+            }
+            size_t size = (size_t)count * m_sector_size;
+            if ((ssize_t)size != ::pread(m_fd, buffer, size, (off_t)sector * m_sector_size))
+            {
+                return vfs_fast_fat32_hal_result::io_error;
+            }
+            return vfs_fast_fat32_hal_result::success;
+        }
+        virtual vfs_fast_fat32_hal_result write(uint8_t pdrv, const void *buffer, uint32_t sector, unsigned int count)
+        {
+            if (!initialized() || 0 != pdrv)
+            {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            if ((uint64_t)sector + count > m_sector_count)
+            {
+                return vfs_fast_fat32_hal_result::invalid_paramter;
+            }
+            size_t size = (size_t)count * m_sector_size;
+            if ((ssize_t)size != ::pwrite(m_fd, buffer, size, (off_t)sector * m_sector_size))
+            {
+                return vfs_fast_fat32_hal_result::io_error;
+            }
+            return vfs_fast_fat32_hal_result::success;
+        }
+        virtual vfs_fast_fat32_hal_result ioctl(uint8_t pdrv, vfs_fast_fat32_ioctl_command command, void *buffer)
+        {
+            if (!initialized() || 0 != pdrv)
+            {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            switch (command)
+            {
+            case control_sync:
+                return 0 == ::fsync(m_fd) ? vfs_fast_fat32_hal_result::success : vfs_fast_fat32_hal_result::io_error;
+            case get_sector_count:
+                *(uint32_t *)buffer = m_sector_count;
+                return vfs_fast_fat32_hal_result::success;
+            case get_sector_size:
+                *(uint16_t *)buffer = m_sector_size;
+                return vfs_fast_fat32_hal_result::success;
+            case get_block_size:
+                *(uint32_t *)buffer = 1;
+                return vfs_fast_fat32_hal_result::success;
+            case control_trim:
+            {
+                const uint32_t *range = (const uint32_t *)buffer;
+                if (range[1] < range[0] || range[1] >= m_sector_count)
+                {
+                    return vfs_fast_fat32_hal_result::invalid_paramter;
+                }
+#ifdef FALLOC_FL_PUNCH_HOLE
+                // gives the space back to the host, so a sparse image stays small
+                if (0 != ::fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)range[0] * m_sector_size, (off_t)(range[1] - range[0] + 1) * m_sector_size))
+                {
+                    return vfs_fast_fat32_hal_result::io_error;
+                }
+                return vfs_fast_fat32_hal_result::success;
+#else
+                return vfs_fast_fat32_hal_result::invalid_paramter;
+#endif
+            }
+            default:
+                return vfs_fast_fat32_hal_result::invalid_paramter;
+            }
+        }
+    };
+}
+#endif
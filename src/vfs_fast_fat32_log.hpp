@@ -0,0 +1,609 @@
+#ifndef HTCW_ESP32_VFS_FAST_FAT32_LOG_HPP
+#define HTCW_ESP32_VFS_FAST_FAT32_LOG_HPP
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#ifdef ESP_PLATFORM
+#include "esp_system.h"
+#else
+#include <random>
+#endif
+#include "pinned_thread.hpp"
+#include "vfs_fast_fat32.hpp"
+namespace esp32
+{
+    // receives each record when a log is replayed, in the order they were appended
+    typedef void (*vfs_fast_fat32_log_callback)(uint32_t sequence, const void *data, size_t size, void *state);
+    // an append only journal file on a fast FAT32 volume. any number of threads append
+    // records to a buffer, and a dedicated task writes everything gathered so far as one
+    // sector aligned write followed by a single sync, so concurrent writers share the
+    // cost of the commit. a batch is committed when it reaches commit_size bytes or
+    // commit_interval_ms after its first record, whichever is sooner.
+    //
+    // the file's clusters are reserved checkpoint_size bytes ahead, so commits are pure
+    // data writes. the directory entry's size is only brought up to date at checkpoints,
+    // every checkpoint_size bytes, and opening the log scans forward from the last one
+    // for the records that made it to the card before a crash. records are checked with
+    // a CRC seeded with a salt unique to the file and with their offset, so stale data
+    // from earlier files or earlier attempts is never mistaken for a record.
+    //
+    // the file starts with two header sectors, written alternately at checkpoints so a
+    // torn header write leaves the other intact. each record is a 16 byte header of
+    // length, sequence, session and CRC, followed by the data, packed end to end. its
+    // buffers come from Allocator, which should be the volume's
+    template <typename Allocator = heap_allocator>
+    class basic_vfs_fast_fat32_log final
+    {
+        static constexpr const uint32_t header_magic = 0x474F4C48; // "HLOG"
+        static constexpr const size_t header_size = 32;
+        static constexpr const size_t record_header_size = 16;
+        basic_vfs_fast_fat32<Allocator> &m_fs;
+        char *m_path;
+        int m_fd;
+        uint16_t m_sector_size;
+        uint8_t *m_buffers[2];
+        uint8_t *m_header; // one sector for checkpoint writes
+        size_t m_capacity;
+        size_t m_commit_size;
+        std::chrono::milliseconds m_commit_interval;
+        uint32_t m_checkpoint_size;
+        uint8_t m_active;   // buffer the appends go into
+        size_t m_used;      // bytes in the active buffer, starting with the unfinished sector
+        uint32_t m_base;    // file offset of the active buffer, always sector aligned
+        uint32_t m_end;     // file offset just past the last committed record
+        uint32_t m_salt;
+        uint32_t m_session; // bumped each time the log is opened
+        uint32_t m_generation;
+        uint32_t m_checkpoint;
+        uint32_t m_checkpoint_sequence;
+        uint32_t m_checkpoint_session;
+        uint32_t m_appended; // sequence of the last record appended
+        uint32_t m_taken;    // sequence of the last record handed to the committer
+        uint32_t m_durable;  // sequence of the last record on the card
+        std::chrono::steady_clock::time_point m_first_pending;
+        bool m_flush;
+        bool m_full;
+        bool m_stop;
+        int m_error; // the errno of the first failed commit. appends fail after one
+        int m_last_error;
+        int m_core;
+        std::mutex m_lock;
+        std::condition_variable m_ready; // wakes the committer
+        std::condition_variable m_done;  // wakes appenders and waiters
+        std::thread m_thread;
+
+        static uint8_t *allocate(size_t size)
+        {
+            return (uint8_t *)Allocator::allocate(size, buffer_kind::transfer);
+        }
+        static void deallocate(uint8_t *data)
+        {
+            Allocator::deallocate(data);
+        }
+        static uint32_t ld_32(const uint8_t *p)
+        {
+            return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        }
+        static void st_32(uint8_t *p, uint32_t value)
+        {
+            p[0] = (uint8_t)value;
+            p[1] = (uint8_t)(value >> 8);
+            p[2] = (uint8_t)(value >> 16);
+            p[3] = (uint8_t)(value >> 24);
+        }
+        // CRC-32 (IEEE) a nibble at a time, to keep the table small
+        static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size)
+        {
+            static const uint32_t table[16] = {
+                0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+                0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+            crc = ~crc;
+            while (size--)
+            {
+                crc ^= *data++;
+                crc = (crc >> 4) ^ table[crc & 15];
+                crc = (crc >> 4) ^ table[crc & 15];
+            }
+            return ~crc;
+        }
+        static uint32_t make_salt()
+        {
+#ifdef ESP_PLATFORM
+            return esp_random();
+#else
+            std::random_device device;
+            return device();
+#endif
+        }
+        // the crc of a record's length, sequence and session, seeded with the crc of its data
+        uint32_t record_crc(const uint8_t *header, uint32_t data_crc, uint32_t offset) const
+        {
+            return crc32(data_crc ^ offset, header, 12);
+        }
+        inline uint32_t data_start() const
+        {
+            return 2 * (uint32_t)m_sector_size;
+        }
+        // the errno of the last call into the file system
+        static int error()
+        {
+            return 0 == errno ? EIO : errno;
+        }
+        // reads records starting at position until one fails to check out, or limit. position,
+        // sequence and session are left describing the last good record
+        int scan(uint32_t &position, uint32_t limit, uint32_t &sequence, uint32_t &session, uint8_t *buffer, vfs_fast_fat32_log_callback callback, void *state)
+        {
+            uint32_t window = position;
+            size_t have = 0;
+            while (true)
+            {
+                size_t at = position - window;
+                if (at + record_header_size > have || at + record_header_size + ld_32(buffer + at) > have)
+                {
+                    // refill so the buffer starts with this record
+                    if (position >= limit)
+                    {
+                        return 0;
+                    }
+                    size_t want = limit - position < m_capacity ? limit - position : m_capacity;
+                    ssize_t result = m_fs.pread(m_fd, buffer, want, position);
+                    if (0 > result)
+                    {
+                        return error();
+                    }
+                    window = position;
+                    have = (size_t)result;
+                    at = 0;
+                    if (record_header_size > have || record_header_size + ld_32(buffer) > have)
+                    {
+                        return 0;
+                    }
+                }
+                const uint8_t *p = buffer + at;
+                uint32_t length = ld_32(p);
+                uint32_t record_sequence = ld_32(p + 4);
+                uint32_t record_session = ld_32(p + 8);
+                if (length > max_record() || record_sequence != sequence + 1 || record_session < session || record_session > m_session)
+                {
+                    return 0;
+                }
+                uint32_t data_crc = crc32(m_salt, p + record_header_size, length);
+                if (ld_32(p + 12) != record_crc(p, data_crc, position))
+                {
+                    return 0;
+                }
+                if (nullptr != callback)
+                {
+                    callback(record_sequence, p + record_header_size, length, state);
+                }
+                position += record_header_size + length;
+                sequence = record_sequence;
+                session = record_session;
+            }
+        }
+        // reads the newer of the two header sectors
+        int read_header()
+        {
+            ssize_t result = m_fs.pread(m_fd, m_buffers[0], data_start(), 0);
+            if (0 > result)
+            {
+                return error();
+            }
+            bool found = false;
+            for (uint32_t i = 0; i < 2; ++i)
+            {
+                const uint8_t *p = m_buffers[0] + i * m_sector_size;
+                if ((size_t)result < i * m_sector_size + header_size || header_magic != ld_32(p) || ld_32(p + 28) != crc32(0, p, 28))
+                {
+                    continue;
+                }
+                uint32_t generation = ld_32(p + 4);
+                if (found && (int32_t)(generation - m_generation) < 0)
+                {
+                    continue;
+                }
+                found = true;
+                m_generation = generation;
+                m_salt = ld_32(p + 8);
+                m_session = ld_32(p + 12);
+                m_checkpoint = ld_32(p + 16);
+                m_checkpoint_sequence = ld_32(p + 20);
+                m_checkpoint_session = ld_32(p + 24);
+            }
+            return found ? 0 : EILSEQ;
+        }
+        // records that everything up to m_end is on the card, updates the directory entry
+        // and reserves the clusters the log will grow into next
+        int checkpoint(uint32_t sequence)
+        {
+            ++m_generation;
+            memset(m_header, 0, m_sector_size);
+            st_32(m_header, header_magic);
+            st_32(m_header + 4, m_generation);
+            st_32(m_header + 8, m_salt);
+            st_32(m_header + 12, m_session);
+            st_32(m_header + 16, m_end);
+            st_32(m_header + 20, sequence);
+            st_32(m_header + 24, m_session);
+            st_32(m_header + 28, crc32(0, m_header, 28));
+            if (m_sector_size != m_fs.pwrite(m_fd, m_header, m_sector_size, (off_t)(m_generation & 1) * m_sector_size))
+            {
+                return error();
+            }
+            // running out of room to reserve isn't fatal here, the commits will find out
+            m_fs.preallocate(m_fd, (off_t)m_end + m_checkpoint_size);
+            if (0 != m_fs.fsync(m_fd))
+            {
+                return error();
+            }
+            m_checkpoint = m_end;
+            m_checkpoint_sequence = sequence;
+            m_checkpoint_session = m_session;
+            return 0;
+        }
+        int create()
+        {
+            m_salt = make_salt();
+            m_session = 1;
+            m_generation = 0;
+            m_end = data_start();
+            return checkpoint(0);
+        }
+        // finds the end of the log, and starts a new session there
+        int recover()
+        {
+            int res = read_header();
+            if (0 != res)
+            {
+                return res;
+            }
+            // anything committed since the checkpoint is in clusters past the recorded size
+            off_t allocated = m_fs.allocated_size(m_fd);
+            if (0 > allocated || 0 != m_fs.extend_reserved(m_fd, allocated))
+            {
+                return error();
+            }
+            uint32_t position = m_checkpoint;
+            uint32_t sequence = m_checkpoint_sequence;
+            uint32_t session = m_checkpoint_session;
+            res = scan(position, (uint32_t)allocated, sequence, session, m_buffers[0], nullptr, nullptr);
+            if (0 != res)
+            {
+                return res;
+            }
+            m_appended = m_taken = m_durable = sequence;
+            m_end = position;
+            // records from here on can't be confused with any left over past the end
+            ++m_session;
+            return checkpoint(sequence);
+        }
+        int initialize(const char *path, size_t buffer_size)
+        {
+            if (!m_fs.initialized())
+            {
+                return ENODEV;
+            }
+            m_sector_size = m_fs.sector_size();
+            m_capacity = (buffer_size + m_sector_size - 1) / m_sector_size * m_sector_size;
+            if (m_capacity < 4 * (size_t)m_sector_size)
+            {
+                m_capacity = 4 * (size_t)m_sector_size;
+            }
+            if (0 == m_commit_size || m_commit_size > m_capacity)
+            {
+                m_commit_size = m_capacity / 2;
+            }
+            if (m_checkpoint_size < m_capacity)
+            {
+                m_checkpoint_size = (uint32_t)m_capacity;
+            }
+            size_t path_size = strlen(path) + 1;
+            m_path = (char *)Allocator::allocate(path_size, buffer_kind::object);
+            m_header = allocate(m_sector_size);
+            m_buffers[0] = allocate(m_capacity);
+            m_buffers[1] = allocate(m_capacity);
+            if (nullptr == m_path || nullptr == m_header || nullptr == m_buffers[0] || nullptr == m_buffers[1])
+            {
+                return ENOMEM;
+            }
+            memcpy(m_path, path, path_size);
+            m_fd = m_fs.open(path, O_RDWR | O_CREAT, 0);
+            if (0 > m_fd)
+            {
+                return error();
+            }
+            struct stat st;
+            if (0 != m_fs.fstat(m_fd, &st))
+            {
+                return error();
+            }
+            int res = 0 == st.st_size ? create() : recover();
+            if (0 != res)
+            {
+                return res;
+            }
+            // the unfinished sector at the end is rewritten by the next commit, so keep it
+            m_base = m_end - m_end % m_sector_size;
+            m_used = m_end - m_base;
+            if (0 != m_used && (ssize_t)m_used != m_fs.pread(m_fd, m_buffers[m_active], m_used, m_base))
+            {
+                return error();
+            }
+            if (!start_pinned_thread(m_thread, m_core, "fat32 log", [this]()
+                                     { run(); }))
+            {
+                return ENOMEM;
+            }
+            return 0;
+        }
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            while (true)
+            {
+                if (m_appended == m_taken)
+                {
+                    if (m_stop)
+                    {
+                        return;
+                    }
+                    m_ready.wait(lock);
+                    continue;
+                }
+                if (!m_stop && !m_flush && !m_full && m_used < m_commit_size)
+                {
+                    // give other writers the rest of the interval to join the batch
+                    if (std::cv_status::timeout != m_ready.wait_until(lock, m_first_pending + m_commit_interval))
+                    {
+                        continue;
+                    }
+                }
+                uint8_t *data = m_buffers[m_active];
+                size_t used = m_used;
+                uint32_t base = m_base;
+                uint32_t sequence = m_appended;
+                size_t tail = used % m_sector_size;
+                m_taken = sequence;
+                m_flush = false;
+                m_full = false;
+                m_active ^= 1;
+                memcpy(m_buffers[m_active], data + used - tail, tail);
+                m_base = base + (uint32_t)(used - tail);
+                m_used = tail;
+                m_done.notify_all();
+                lock.unlock();
+
+                size_t size = used;
+                if (0 != tail)
+                {
+                    size += m_sector_size - tail;
+                    memset(data + used, 0, size - used);
+                }
+                int res = 0;
+                if ((ssize_t)size != m_fs.pwrite(m_fd, data, size, base) || 0 != m_fs.fdatasync(m_fd))
+                {
+                    res = error();
+                }
+                lock.lock();
+                if (0 != res)
+                {
+                    m_error = res;
+                    m_stop = true;
+                    m_done.notify_all();
+                    return;
+                }
+                m_end = base + (uint32_t)used;
+                m_durable = sequence;
+                m_done.notify_all();
+                if (m_end - m_checkpoint >= m_checkpoint_size)
+                {
+                    lock.unlock();
+                    res = checkpoint(sequence);
+                    lock.lock();
+                    if (0 != res)
+                    {
+                        m_error = res;
+                        m_stop = true;
+                        m_done.notify_all();
+                        return;
+                    }
+                }
+            }
+        }
+        void release()
+        {
+            if (m_thread.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_lock);
+                    m_stop = true;
+                }
+                m_ready.notify_one();
+                m_done.notify_all();
+                m_thread.join();
+            }
+            if (0 <= m_fd)
+            {
+                if (0 == m_error && 0 == m_last_error)
+                {
+                    checkpoint(m_durable);
+                }
+                m_fs.close(m_fd);
+                m_fd = -1;
+                if (0 == m_error && 0 == m_last_error)
+                {
+                    // hand back the clusters reserved past the end
+                    m_fs.truncate(m_path, m_end);
+                }
+            }
+            Allocator::deallocate(m_path);
+            m_path = nullptr;
+            if (nullptr != m_header)
+            {
+                deallocate(m_header);
+                m_header = nullptr;
+            }
+            for (int i = 0; i < 2; ++i)
+            {
+                if (nullptr != m_buffers[i])
+                {
+                    deallocate(m_buffers[i]);
+                    m_buffers[i] = nullptr;
+                }
+            }
+        }
+
+    public:
+        // opens or creates the log at path on fs, recovering any records committed after the
+        // last checkpoint. check initialized() afterward. buffer_size bytes are allocated
+        // twice, and bounds the size of a record. commit_size of 0 commits at half the buffer.
+        // the committer task runs on core, or on the core other than the caller's if it's -1
+        basic_vfs_fast_fat32_log(basic_vfs_fast_fat32<Allocator> &fs, const char *path, size_t buffer_size = 16384, size_t commit_size = 0, uint32_t commit_interval_ms = 10, uint32_t checkpoint_size = 256 * 1024, int core = -1) : m_fs(fs), m_path(nullptr), m_fd(-1), m_sector_size(0), m_header(nullptr), m_capacity(0), m_commit_size(commit_size), m_commit_interval(commit_interval_ms), m_checkpoint_size(checkpoint_size), m_active(0), m_used(0), m_base(0), m_end(0), m_salt(0), m_session(0), m_generation(0), m_checkpoint(0), m_checkpoint_sequence(0), m_checkpoint_session(0), m_appended(0), m_taken(0), m_durable(0), m_flush(false), m_full(false), m_stop(false), m_error(0), m_last_error(0), m_core(core)
+        {
+            m_buffers[0] = m_buffers[1] = nullptr;
+            m_last_error = initialize(path, buffer_size);
+            if (0 != m_last_error)
+            {
+                release();
+            }
+        }
+        basic_vfs_fast_fat32_log(const basic_vfs_fast_fat32_log &rhs) = delete;
+        basic_vfs_fast_fat32_log &operator=(const basic_vfs_fast_fat32_log &rhs) = delete;
+        // commits anything outstanding, writes a final checkpoint and closes the file
+        ~basic_vfs_fast_fat32_log()
+        {
+            release();
+        }
+        inline bool initialized() const
+        {
+            return 0 == m_last_error;
+        }
+        // the errno value of the open failure, or of the first failed commit
+        int last_error()
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return 0 != m_last_error ? m_last_error : m_error;
+        }
+        // the largest record append() takes
+        inline size_t max_record() const
+        {
+            // room for the unfinished sector carried at the start of the buffer
+            return m_capacity - m_sector_size - record_header_size;
+        }
+        // queues a record and returns its sequence number, which starts at 1 and goes up by
+        // one per record. the record is on the card once wait() returns for it. returns 0 if
+        // the record is too big or the log has failed
+        uint32_t append(const void *data, size_t size)
+        {
+            if (!initialized() || size > max_record())
+            {
+                return 0;
+            }
+            uint32_t data_crc = crc32(m_salt, (const uint8_t *)data, size);
+            std::unique_lock<std::mutex> lock(m_lock);
+            while (!m_stop && m_used + record_header_size + size > m_capacity)
+            {
+                m_full = true;
+                m_ready.notify_one();
+                m_done.wait(lock);
+            }
+            if (m_stop)
+            {
+                return 0;
+            }
+            // the first record of a batch starts the committer's clock
+            bool first = m_appended == m_taken;
+            if (first)
+            {
+                m_first_pending = std::chrono::steady_clock::now();
+            }
+            uint32_t sequence = ++m_appended;
+            uint8_t *p = m_buffers[m_active] + m_used;
+            st_32(p, (uint32_t)size);
+            st_32(p + 4, sequence);
+            st_32(p + 8, m_session);
+            st_32(p + 12, record_crc(p, data_crc, m_base + (uint32_t)m_used));
+            memcpy(p + record_header_size, data, size);
+            m_used += record_header_size + size;
+            if (first || m_used >= m_commit_size)
+            {
+                m_ready.notify_one();
+            }
+            return sequence;
+        }
+        // waits until the record with the given sequence number is on the card. returns false
+        // if the log failed first
+        bool wait(uint32_t sequence)
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            while (0 == m_error && (int32_t)(m_durable - sequence) < 0)
+            {
+                if (m_stop && m_appended == m_taken && m_durable == m_taken)
+                {
+                    return false;
+                }
+                m_done.wait(lock);
+            }
+            return 0 == m_error;
+        }
+        // commits every record appended so far without waiting out the interval, and waits
+        // for them
+        bool commit()
+        {
+            uint32_t sequence;
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                if (!initialized())
+                {
+                    return false;
+                }
+                sequence = m_appended;
+                if (m_taken != m_appended)
+                {
+                    m_flush = true;
+                }
+            }
+            m_ready.notify_one();
+            return wait(sequence);
+        }
+        // the sequence number of the last record on the card
+        uint32_t durable()
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_durable;
+        }
+        // calls callback for every record on the card, oldest first. returns false if the
+        // file couldn't be read
+        bool replay(vfs_fast_fat32_log_callback callback, void *state)
+        {
+            if (!initialized())
+            {
+                return false;
+            }
+            uint32_t limit;
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                limit = m_end;
+            }
+            uint8_t *buffer = allocate(m_capacity);
+            if (nullptr == buffer)
+            {
+                return false;
+            }
+            uint32_t position = data_start();
+            uint32_t sequence = 0;
+            uint32_t session = 0;
+            int res = scan(position, limit, sequence, session, buffer, callback, state);
+            deallocate(buffer);
+            return 0 == res && position == limit;
+        }
+    };
+    typedef basic_vfs_fast_fat32_log<> vfs_fast_fat32_log;
+}
+#endif
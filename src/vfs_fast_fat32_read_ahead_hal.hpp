@@ -0,0 +1,411 @@
+#ifndef HTCW_ESP32_VFS_FAST_FAT32_READ_AHEAD_HAL_HPP
+#define HTCW_ESP32_VFS_FAST_FAT32_READ_AHEAD_HAL_HPP
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "pinned_thread.hpp"
+#include "vfs_fast_fat32.hpp"
+namespace esp32
+{
+    struct vfs_fast_fat32_read_ahead_stats
+    {
+        size_t hits;       // reads served entirely from fetched sectors
+        size_t misses;     // reads that had to go to the drive for some of their sectors
+        size_t waits;      // hits that had to wait for their fetch to finish
+        size_t fetched;    // sectors fetched ahead of time
+        size_t unused;     // fetched sectors dropped before anything read them
+    };
+    // wraps another HAL with asynchronous read-ahead. vfs_fast_fat32 hints at the sectors
+    // a sequential reader will want next, and a dedicated task reads them into a ring of
+    // buffers while the caller is busy with the last read. every access to the wrapped HAL
+    // is serialized, so it never sees two at once. its buffers come from Allocator
+    template <typename Allocator = heap_allocator>
+    class basic_vfs_fast_fat32_read_ahead_hal : public vfs_fast_fat32_hal
+    {
+        enum slot_state : uint8_t
+        {
+            slot_empty = 0,
+            slot_queued,
+            slot_reading,
+            slot_ready
+        };
+        struct slot
+        {
+            uint8_t *data;
+            uint32_t sector;
+            uint32_t count;
+            uint32_t consumed; // sectors from the start that have been read
+            uint32_t sequence; // fetch order
+            uint16_t idle;     // misses since this was last read from
+            uint8_t pdrv;
+            slot_state state;
+            bool stale; // written over while being read, so it's dropped when done
+        };
+        vfs_fast_fat32_hal &m_inner;
+        slot *m_slots;
+        size_t m_slot_count;
+        size_t m_buffer_size;
+        uint32_t m_slot_sectors; // 0 until initialize() learns the sector size
+        uint16_t m_sector_size;
+        uint32_t m_sequence;
+        vfs_fast_fat32_read_ahead_stats m_stats;
+        bool m_stop;
+        std::mutex m_bus;  // held across every call into m_inner
+        std::mutex m_lock; // guards the slots
+        std::condition_variable m_queued;
+        std::condition_variable m_finished;
+        std::thread m_thread;
+
+        static uint8_t *allocate(size_t size)
+        {
+            return (uint8_t *)Allocator::allocate(size, buffer_kind::transfer);
+        }
+        static void deallocate(uint8_t *data)
+        {
+            Allocator::deallocate(data);
+        }
+        void release()
+        {
+            if (nullptr != m_slots)
+            {
+                for (size_t i = 0; i < m_slot_count; ++i)
+                {
+                    deallocate(m_slots[i].data);
+                }
+                deallocate_array<Allocator>(m_slots, m_slot_count);
+                m_slots = nullptr;
+            }
+        }
+        // the live slot holding sector, if any
+        slot *find(uint8_t pdrv, uint32_t sector)
+        {
+            for (size_t i = 0; i < m_slot_count; ++i)
+            {
+                slot &s = m_slots[i];
+                if (slot_empty != s.state && !s.stale && s.pdrv == pdrv && sector >= s.sector && sector - s.sector < s.count)
+                {
+                    return &s;
+                }
+            }
+            return nullptr;
+        }
+        // the first sector after sector, and before end, that a live slot holds
+        uint32_t next_held(uint8_t pdrv, uint32_t sector, uint32_t end)
+        {
+            for (size_t i = 0; i < m_slot_count; ++i)
+            {
+                slot &s = m_slots[i];
+                if (slot_empty != s.state && !s.stale && s.pdrv == pdrv && s.sector > sector && s.sector < end)
+                {
+                    end = s.sector;
+                }
+            }
+            return end;
+        }
+        void drop(slot &s)
+        {
+            if (slot_ready == s.state || slot_queued == s.state)
+            {
+                m_stats.unused += s.count - s.consumed;
+            }
+            s.state = slot_empty;
+        }
+        // a slot that can take a new fetch: an empty or fully read one, or else one whose
+        // reader seems to have gone elsewhere. a sequential reader only misses once it
+        // has used up what was fetched for it, so slots left alone across several misses
+        // are taken to be abandoned
+        slot *take()
+        {
+            slot *result = nullptr;
+            for (size_t i = 0; i < m_slot_count; ++i)
+            {
+                slot &s = m_slots[i];
+                if (slot_empty == s.state || (slot_ready == s.state && s.consumed == s.count))
+                {
+                    return &s;
+                }
+                if (slot_ready == s.state && s.idle >= m_slot_count && (nullptr == result || s.sequence < result->sequence))
+                {
+                    result = &s;
+                }
+            }
+            return result;
+        }
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            while (true)
+            {
+                slot *next = nullptr;
+                m_queued.wait(lock, [this, &next] {
+                    next = nullptr;
+                    for (size_t i = 0; i < m_slot_count; ++i)
+                    {
+                        slot &s = m_slots[i];
+                        if (slot_queued == s.state && (nullptr == next || s.sequence < next->sequence))
+                        {
+                            next = &s;
+                        }
+                    }
+                    return m_stop || nullptr != next;
+                });
+                if (m_stop)
+                {
+                    return;
+                }
+                next->state = slot_reading;
+                lock.unlock();
+                vfs_fast_fat32_hal_result res;
+                {
+                    std::lock_guard<std::mutex> bus(m_bus);
+                    res = m_inner.read(next->pdrv, next->data, next->sector, next->count);
+                }
+                lock.lock();
+                if (vfs_fast_fat32_hal_result::success != res || next->stale)
+                {
+                    next->state = slot_empty;
+                    next->stale = false;
+                }
+                else
+                {
+                    next->state = slot_ready;
+                }
+                m_finished.notify_all();
+            }
+        }
+
+    public:
+        // buffer_count buffers of buffer_size bytes each, so at most that much is read
+        // ahead. core is the one the read-ahead task is pinned to on the ESP32. -1 picks
+        // the core other than the caller's. check initialized() afterward
+        basic_vfs_fast_fat32_read_ahead_hal(vfs_fast_fat32_hal &inner, size_t buffer_count = 4, size_t buffer_size = 16384, int core = -1) : m_inner(inner), m_slots(nullptr), m_slot_count(buffer_count), m_buffer_size(buffer_size), m_slot_sectors(0), m_sector_size(0), m_sequence(0), m_stop(false)
+        {
+            memset(&m_stats, 0, sizeof(m_stats));
+            if (0 == buffer_count || 0 == buffer_size)
+            {
+                return;
+            }
+            m_slots = allocate_array<Allocator, slot>(buffer_count, buffer_kind::object);
+            if (nullptr == m_slots)
+            {
+                return;
+            }
+            bool ok = true;
+            for (size_t i = 0; i < buffer_count; ++i)
+            {
+                memset(&m_slots[i], 0, sizeof(slot));
+                m_slots[i].data = allocate(buffer_size);
+                ok = ok && nullptr != m_slots[i].data;
+            }
+            if (!ok || !start_pinned_thread(m_thread, core, "read_ahead", [this] { run(); }))
+            {
+                release();
+            }
+        }
+        basic_vfs_fast_fat32_read_ahead_hal(const basic_vfs_fast_fat32_read_ahead_hal &rhs) = delete;
+        basic_vfs_fast_fat32_read_ahead_hal &operator=(const basic_vfs_fast_fat32_read_ahead_hal &rhs) = delete;
+        virtual ~basic_vfs_fast_fat32_read_ahead_hal()
+        {
+            if (!initialized())
+            {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                m_stop = true;
+            }
+            m_queued.notify_one();
+            m_thread.join();
+            release();
+        }
+        inline bool initialized() const
+        {
+            return nullptr != m_slots;
+        }
+        vfs_fast_fat32_read_ahead_stats stats()
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_stats;
+        }
+        void reset_stats()
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            memset(&m_stats, 0, sizeof(m_stats));
+        }
+        virtual vfs_fast_fat32_disk_status initialize(uint8_t pdrv)
+        {
+            std::lock_guard<std::mutex> bus(m_bus);
+            vfs_fast_fat32_disk_status result = m_inner.initialize(pdrv);
+            uint16_t sector_size = 512;
+            if (vfs_fast_fat32_hal_result::success != m_inner.ioctl(pdrv, get_sector_size, &sector_size))
+            {
+                sector_size = 512;
+            }
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_sector_size = sector_size;
+            m_slot_sectors = (uint32_t)(m_buffer_size / sector_size);
+            return result;
+        }
+        virtual vfs_fast_fat32_disk_status status(uint8_t pdrv)
+        {
+            std::lock_guard<std::mutex> bus(m_bus);
+            return m_inner.status(pdrv);
+        }
+        virtual vfs_fast_fat32_hal_result read(uint8_t pdrv, void *buffer, uint32_t sector, unsigned int count)
+        {
+            uint8_t *p = (uint8_t *)buffer;
+            bool missed = false, waited = false;
+            std::unique_lock<std::mutex> lock(m_lock);
+            while (0 != count)
+            {
+                slot *s = initialized() ? find(pdrv, sector) : nullptr;
+                if (nullptr != s)
+                {
+                    if (slot_ready != s->state)
+                    {
+                        waited = true;
+                        m_finished.wait(lock);
+                        continue;
+                    }
+                    uint32_t offset = sector - s->sector;
+                    uint32_t n = s->count - offset;
+                    if (n > count)
+                    {
+                        n = count;
+                    }
+                    memcpy(p, s->data + (size_t)offset * m_sector_size, (size_t)n * m_sector_size);
+                    if (offset <= s->consumed && offset + n > s->consumed)
+                    {
+                        s->consumed = offset + n;
+                    }
+                    s->idle = 0;
+                    p += (size_t)n * m_sector_size;
+                    sector += n;
+                    count -= n;
+                    continue;
+                }
+                // read up to whatever is held next straight from the drive
+                uint32_t n = initialized() ? next_held(pdrv, sector, sector + count) - sector : count;
+                lock.unlock();
+                vfs_fast_fat32_hal_result res;
+                {
+                    std::lock_guard<std::mutex> bus(m_bus);
+                    res = m_inner.read(pdrv, p, sector, n);
+                }
+                lock.lock();
+                if (vfs_fast_fat32_hal_result::success != res)
+                {
+                    ++m_stats.misses;
+                    return res;
+                }
+                missed = true;
+                p += (size_t)n * m_sector_size;
+                sector += n;
+                count -= n;
+            }
+            if (missed)
+            {
+                ++m_stats.misses;
+                for (size_t i = 0; i < m_slot_count; ++i)
+                {
+                    if (slot_ready == m_slots[i].state && m_slots[i].idle < 0xFFFF)
+                    {
+                        ++m_slots[i].idle;
+                    }
+                }
+            }
+            else
+            {
+                ++m_stats.hits;
+                if (waited)
+                {
+                    ++m_stats.waits;
+                }
+            }
+            return vfs_fast_fat32_hal_result::success;
+        }
+        virtual vfs_fast_fat32_hal_result write(uint8_t pdrv, const void *buffer, uint32_t sector, unsigned int count)
+        {
+            if (initialized())
+            {
+                // fetched copies of these sectors are out of date now
+                std::lock_guard<std::mutex> lock(m_lock);
+                for (size_t i = 0; i < m_slot_count; ++i)
+                {
+                    slot &s = m_slots[i];
+                    if (slot_empty != s.state && s.pdrv == pdrv && s.sector < sector + count && sector < s.sector + s.count)
+                    {
+                        if (slot_reading == s.state)
+                        {
+                            s.stale = true;
+                        }
+                        else
+                        {
+                            drop(s);
+                        }
+                    }
+                }
+            }
+            std::lock_guard<std::mutex> bus(m_bus);
+            return m_inner.write(pdrv, buffer, sector, count);
+        }
+        virtual vfs_fast_fat32_hal_result ioctl(uint8_t pdrv, vfs_fast_fat32_ioctl_command command, void *buffer)
+        {
+            std::lock_guard<std::mutex> bus(m_bus);
+            return m_inner.ioctl(pdrv, command, buffer);
+        }
+        virtual unsigned int prefetch(uint8_t pdrv, uint32_t sector, unsigned int count)
+        {
+            if (!initialized())
+            {
+                return 0;
+            }
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (0 == m_slot_sectors)
+            {
+                return 0;
+            }
+            unsigned int accepted = 0;
+            while (accepted < count)
+            {
+                uint32_t first = sector + accepted;
+                slot *s = find(pdrv, first);
+                if (nullptr != s)
+                {
+                    // already fetched or on its way
+                    uint32_t n = s->sector + s->count - first;
+                    accepted += n < count - accepted ? n : count - accepted;
+                    continue;
+                }
+                s = take();
+                if (nullptr == s)
+                {
+                    break;
+                }
+                drop(*s);
+                uint32_t n = count - accepted;
+                if (n > m_slot_sectors)
+                {
+                    n = m_slot_sectors;
+                }
+                n = next_held(pdrv, first, first + n) - first;
+                s->pdrv = pdrv;
+                s->sector = first;
+                s->count = n;
+                s->consumed = 0;
+                s->sequence = ++m_sequence;
+                s->idle = 0;
+                s->stale = false;
+                s->state = slot_queued;
+                m_stats.fetched += n;
+                accepted += n;
+            }
+            m_queued.notify_one();
+            return accepted;
+        }
+    };
+    typedef basic_vfs_fast_fat32_read_ahead_hal<> vfs_fast_fat32_read_ahead_hal;
+}
+#endif
@@ -0,0 +1,78 @@
+#ifndef HTCW_ESP32_VFS_FAST_FAT32_SDMMC_HAL_HPP
+#define HTCW_ESP32_VFS_FAST_FAT32_SDMMC_HAL_HPP
+#include "sdmmc_host.hpp"
+#include "vfs_fast_fat32.hpp"
+namespace esp32 {
+    // exposes an initialized sdmmc_card to vfs_fast_fat32. each read or write
+    // is a single multi-block transaction on the bus. if the card's write pipeline
+    // is running, writes are queued on it and control_sync waits for them, except
+    // for writes of at least a pipeline buffer from DMA capable memory, which go
+    // straight to the card rather than being copied into the ring
+    class vfs_fast_fat32_sdmmc_hal : public vfs_fast_fat32_hal {
+        sdmmc_card& m_card;
+    public:
+        vfs_fast_fat32_sdmmc_hal(sdmmc_card& card) : m_card(card) {
+        }
+        vfs_fast_fat32_sdmmc_hal(const vfs_fast_fat32_sdmmc_hal& rhs)=delete;
+        vfs_fast_fat32_sdmmc_hal& operator=(const vfs_fast_fat32_sdmmc_hal& rhs)=delete;
+        virtual vfs_fast_fat32_disk_status initialize(uint8_t pdrv) {
+            return status(pdrv);
+        }
+        virtual vfs_fast_fat32_disk_status status(uint8_t pdrv) {
+            if(0!=pdrv || !m_card.initialized()) {
+                return (vfs_fast_fat32_disk_status)(not_initialized|no_disk);
+            }
+            return (vfs_fast_fat32_disk_status)0;
+        }
+        virtual vfs_fast_fat32_hal_result read(uint8_t pdrv, void *buffer, uint32_t sector, unsigned int count) {
+            if(0!=pdrv || !m_card.initialized()) {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            return m_card.read(buffer,sector,count)?vfs_fast_fat32_hal_result::success:vfs_fast_fat32_hal_result::io_error;
+        }
+        virtual vfs_fast_fat32_hal_result write(uint8_t pdrv, const void *buffer, uint32_t sector, unsigned int count) {
+            if(0!=pdrv || !m_card.initialized()) {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            if(m_card.pipelined() &&
+                    (count*m_card.sector_size()<m_card.pipeline_buffer_size() || !sdmmc_card::dma_capable(buffer))) {
+                return 0!=m_card.submit_write(buffer,sector,count)?vfs_fast_fat32_hal_result::success:vfs_fast_fat32_hal_result::io_error;
+            }
+            return m_card.write(buffer,sector,count)?vfs_fast_fat32_hal_result::success:vfs_fast_fat32_hal_result::io_error;
+        }
+        virtual vfs_fast_fat32_hal_result ioctl(uint8_t pdrv, vfs_fast_fat32_ioctl_command command, void *buffer) {
+            if(0!=pdrv || !m_card.initialized()) {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            switch(command) {
+                case control_sync:
+                    // sdmmc_write_sectors doesn't return until the card is done, so
+                    // only queued writes need waiting on
+                    return m_card.flush()?vfs_fast_fat32_hal_result::success:vfs_fast_fat32_hal_result::io_error;
+                case get_sector_count:
+                    *(uint32_t*)buffer = (uint32_t)m_card.sector_count();
+                    return vfs_fast_fat32_hal_result::success;
+                case get_sector_size:
+                    *(uint16_t*)buffer = (uint16_t)m_card.sector_size();
+                    return vfs_fast_fat32_hal_result::success;
+                case get_block_size:
+                    if(0==m_card.erase_block_sectors()) {
+                        return vfs_fast_fat32_hal_result::invalid_paramter;
+                    }
+                    *(uint32_t*)buffer = (uint32_t)m_card.erase_block_sectors();
+                    return vfs_fast_fat32_hal_result::success;
+                case control_trim: {
+                    // [first, last] inclusive
+                    const uint32_t* range = (const uint32_t*)buffer;
+                    if(!sdmmc_card::can_erase() || range[1]<range[0] || range[1]>=m_card.sector_count()) {
+                        return vfs_fast_fat32_hal_result::invalid_paramter;
+                    }
+                    return m_card.erase(range[0],range[1]-range[0]+1)?vfs_fast_fat32_hal_result::success:vfs_fast_fat32_hal_result::io_error;
+                }
+                default:
+                    return vfs_fast_fat32_hal_result::invalid_paramter;
+            }
+        }
+    };
+}
+#endif
@@ -0,0 +1,328 @@
+#ifndef HTCW_ESP32_VFS_FAST_FAT32_STRIPE_HAL_HPP
+#define HTCW_ESP32_VFS_FAST_FAT32_STRIPE_HAL_HPP
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "pinned_thread.hpp"
+#include "vfs_fast_fat32.hpp"
+namespace esp32
+{
+    // presents two drives as one, RAID-0 style: the sectors are dealt out in stripes of
+    // stripe_sectors, alternating between the drives, so a large transfer keeps both busy
+    // at once. each drive has its own task, and a request that spans both is split between
+    // them and runs on both concurrently. a request within one stripe goes straight to its
+    // drive from the caller. the volume is twice the smaller drive, rounded down to whole
+    // stripes, and losing either drive loses everything on it. the drives are typically
+    // vfs_fast_fat32_sdmmc_hal or vfs_fast_fat32_card_hal instances on cards that don't
+    // share a bus, such as one on the SDMMC host and one on SPI
+    class vfs_fast_fat32_stripe_hal : public vfs_fast_fat32_hal
+    {
+        struct member
+        {
+            vfs_fast_fat32_hal *hal;
+            std::thread thread;
+            vfs_fast_fat32_hal_result result;
+            bool busy; // has its part of the current request to do
+        };
+        member m_members[2];
+        uint32_t m_stripe_sectors;
+        uint32_t m_sector_count; // 0 until initialize() has sized the drives
+        uint16_t m_sector_size;
+        bool m_stop;
+        std::mutex m_request; // one request at a time
+        std::mutex m_lock;    // guards the request being split and the members' state
+        std::condition_variable m_started;
+        std::condition_variable m_finished;
+        // the request the member tasks are working on
+        uint8_t *m_buffer;
+        uint32_t m_sector;
+        uint32_t m_count;
+        bool m_out;
+
+        // moves index's share of count sectors at sector. its stripes are contiguous on
+        // the drive but interleaved with the other drive's in the buffer, so each one is a
+        // transaction of its own
+        vfs_fast_fat32_hal_result transfer(size_t index, uint8_t *buffer, uint32_t sector, uint32_t count, bool out)
+        {
+            vfs_fast_fat32_hal &hal = *m_members[index].hal;
+            uint32_t end = sector + count;
+            while (sector < end)
+            {
+                uint32_t stripe = sector / m_stripe_sectors;
+                uint32_t offset = sector % m_stripe_sectors;
+                uint32_t run = m_stripe_sectors - offset;
+                if (run > end - sector)
+                {
+                    run = end - sector;
+                }
+                if ((stripe & 1) == index)
+                {
+                    uint32_t target = (stripe >> 1) * m_stripe_sectors + offset;
+                    vfs_fast_fat32_hal_result result = out ? hal.write(0, buffer, target, run) : hal.read(0, buffer, target, run);
+                    if (vfs_fast_fat32_hal_result::success != result)
+                    {
+                        return result;
+                    }
+                }
+                buffer += (size_t)run * m_sector_size;
+                sector += run;
+            }
+            return vfs_fast_fat32_hal_result::success;
+        }
+        // the sectors on index's drive that count sectors at sector cover, which are always
+        // one run. false if there are none
+        bool member_range(size_t index, uint32_t sector, uint32_t count, uint32_t &start, uint32_t &end) const
+        {
+            uint32_t last_sector = sector + count - 1;
+            uint32_t first = sector / m_stripe_sectors;
+            uint32_t last = last_sector / m_stripe_sectors;
+            uint32_t from = (first & 1) == index ? first : first + 1;
+            uint32_t to = (last & 1) == index ? last : last - 1;
+            if (from > last || from > to)
+            {
+                return false;
+            }
+            start = (from >> 1) * m_stripe_sectors + (from == first ? sector % m_stripe_sectors : 0);
+            end = (to >> 1) * m_stripe_sectors + (to == last ? last_sector % m_stripe_sectors + 1 : m_stripe_sectors);
+            return true;
+        }
+        vfs_fast_fat32_hal_result dispatch(uint8_t *buffer, uint32_t sector, unsigned int count, bool out)
+        {
+            if (0 == m_sector_count)
+            {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            if ((uint64_t)sector + count > m_sector_count)
+            {
+                return vfs_fast_fat32_hal_result::invalid_paramter;
+            }
+            if (0 == count)
+            {
+                return vfs_fast_fat32_hal_result::success;
+            }
+            std::lock_guard<std::mutex> request(m_request);
+            uint32_t first = sector / m_stripe_sectors;
+            if (first == (sector + count - 1) / m_stripe_sectors)
+            {
+                // one drive, so there's nothing to overlap
+                return transfer(first & 1, buffer, sector, count, out);
+            }
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_buffer = buffer;
+            m_sector = sector;
+            m_count = count;
+            m_out = out;
+            m_members[0].busy = m_members[1].busy = true;
+            m_started.notify_all();
+            while (m_members[0].busy || m_members[1].busy)
+            {
+                m_finished.wait(lock);
+            }
+            if (vfs_fast_fat32_hal_result::success != m_members[0].result)
+            {
+                return m_members[0].result;
+            }
+            return m_members[1].result;
+        }
+        void work(size_t index)
+        {
+            member &m = m_members[index];
+            std::unique_lock<std::mutex> lock(m_lock);
+            while (true)
+            {
+                while (!m_stop && !m.busy)
+                {
+                    m_started.wait(lock);
+                }
+                if (m_stop)
+                {
+                    return;
+                }
+                uint8_t *buffer = m_buffer;
+                uint32_t sector = m_sector;
+                uint32_t count = m_count;
+                bool out = m_out;
+                lock.unlock();
+                vfs_fast_fat32_hal_result result = transfer(index, buffer, sector, count, out);
+                lock.lock();
+                m.result = result;
+                m.busy = false;
+                m_finished.notify_one();
+            }
+        }
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                m_stop = true;
+            }
+            m_started.notify_all();
+            for (size_t i = 0; i < 2; ++i)
+            {
+                if (m_members[i].thread.joinable())
+                {
+                    m_members[i].thread.join();
+                }
+            }
+        }
+
+    public:
+        // stripes first and second, stripe_sectors at a time. both drives are used as
+        // pdrv 0. core is the one the drives' tasks are pinned to on the ESP32. -1 picks
+        // the core other than the caller's. check initialized() afterward
+        vfs_fast_fat32_stripe_hal(vfs_fast_fat32_hal &first, vfs_fast_fat32_hal &second, uint32_t stripe_sectors = 64, int core = -1) : m_stripe_sectors(0 == stripe_sectors ? 1 : stripe_sectors), m_sector_count(0), m_sector_size(0), m_stop(false), m_buffer(nullptr), m_sector(0), m_count(0), m_out(false)
+        {
+            m_members[0].hal = &first;
+            m_members[1].hal = &second;
+            for (size_t i = 0; i < 2; ++i)
+            {
+                m_members[i].result = vfs_fast_fat32_hal_result::success;
+                m_members[i].busy = false;
+                if (!start_pinned_thread(m_members[i].thread, core, 0 == i ? "stripe_0" : "stripe_1", [this, i] { work(i); }))
+                {
+                    stop();
+                    return;
+                }
+            }
+        }
+        vfs_fast_fat32_stripe_hal(const vfs_fast_fat32_stripe_hal &rhs) = delete;
+        vfs_fast_fat32_stripe_hal &operator=(const vfs_fast_fat32_stripe_hal &rhs) = delete;
+        virtual ~vfs_fast_fat32_stripe_hal()
+        {
+            stop();
+        }
+        inline bool initialized() const
+        {
+            return !m_stop;
+        }
+        inline uint32_t stripe_sectors() const
+        {
+            return m_stripe_sectors;
+        }
+        virtual vfs_fast_fat32_disk_status initialize(uint8_t pdrv)
+        {
+            if (0 != pdrv || !initialized())
+            {
+                return (vfs_fast_fat32_disk_status)(not_initialized | no_disk);
+            }
+            std::lock_guard<std::mutex> request(m_request);
+            int status = 0;
+            uint32_t sector_count = 0xFFFFFFFF;
+            uint16_t sector_size = 0;
+            for (size_t i = 0; i < 2; ++i)
+            {
+                vfs_fast_fat32_hal &hal = *m_members[i].hal;
+                status |= hal.initialize(0);
+                uint32_t count = 0;
+                uint16_t size = 512;
+                if (vfs_fast_fat32_hal_result::success != hal.ioctl(0, get_sector_count, &count) ||
+                    vfs_fast_fat32_hal_result::success != hal.ioctl(0, get_sector_size, &size) ||
+                    (0 != sector_size && size != sector_size))
+                {
+                    // the drives have to agree on the sector size
+                    status |= not_initialized;
+                }
+                sector_size = size;
+                if (count < sector_count)
+                {
+                    sector_count = count;
+                }
+            }
+            if (0 != (status & not_initialized))
+            {
+                m_sector_count = 0;
+                return (vfs_fast_fat32_disk_status)status;
+            }
+            m_sector_size = sector_size;
+            uint64_t total = (uint64_t)(sector_count / m_stripe_sectors) * m_stripe_sectors * 2;
+            m_sector_count = total > 0xFFFFFFFF ? 0xFFFFFFFF / (m_stripe_sectors * 2) * (m_stripe_sectors * 2) : (uint32_t)total;
+            return (vfs_fast_fat32_disk_status)status;
+        }
+        virtual vfs_fast_fat32_disk_status status(uint8_t pdrv)
+        {
+            if (0 != pdrv || !initialized())
+            {
+                return (vfs_fast_fat32_disk_status)(not_initialized | no_disk);
+            }
+            int status = m_members[0].hal->status(0) | m_members[1].hal->status(0);
+            if (0 == m_sector_count)
+            {
+                status |= not_initialized;
+            }
+            return (vfs_fast_fat32_disk_status)status;
+        }
+        virtual vfs_fast_fat32_hal_result read(uint8_t pdrv, void *buffer, uint32_t sector, unsigned int count)
+        {
+            if (0 != pdrv)
+            {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            return dispatch((uint8_t *)buffer, sector, count, false);
+        }
+        virtual vfs_fast_fat32_hal_result write(uint8_t pdrv, const void *buffer, uint32_t sector, unsigned int count)
+        {
+            if (0 != pdrv)
+            {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            return dispatch((uint8_t *)buffer, sector, count, true);
+        }
+        virtual vfs_fast_fat32_hal_result ioctl(uint8_t pdrv, vfs_fast_fat32_ioctl_command command, void *buffer)
+        {
+            if (0 != pdrv || 0 == m_sector_count)
+            {
+                return vfs_fast_fat32_hal_result::not_ready;
+            }
+            switch (command)
+            {
+            case control_sync:
+            {
+                std::lock_guard<std::mutex> request(m_request);
+                vfs_fast_fat32_hal_result result = m_members[0].hal->ioctl(0, control_sync, nullptr);
+                vfs_fast_fat32_hal_result other = m_members[1].hal->ioctl(0, control_sync, nullptr);
+                return vfs_fast_fat32_hal_result::success != result ? result : other;
+            }
+            case get_sector_count:
+                *(uint32_t *)buffer = m_sector_count;
+                return vfs_fast_fat32_hal_result::success;
+            case get_sector_size:
+                *(uint16_t *)buffer = m_sector_size;
+                return vfs_fast_fat32_hal_result::success;
+            case get_block_size:
+                // a full row of stripes, so aligned clusters span both drives evenly
+                *(uint32_t *)buffer = m_stripe_sectors * 2;
+                return vfs_fast_fat32_hal_result::success;
+            case control_trim:
+            {
+                // [first, last] inclusive, as FatFs passes it
+                const uint32_t *range = (const uint32_t *)buffer;
+                if (range[1] < range[0] || range[1] >= m_sector_count)
+                {
+                    return vfs_fast_fat32_hal_result::invalid_paramter;
+                }
+                std::lock_guard<std::mutex> request(m_request);
+                vfs_fast_fat32_hal_result result = vfs_fast_fat32_hal_result::success;
+                for (size_t i = 0; i < 2; ++i)
+                {
+                    uint32_t member[2];
+                    uint32_t end;
+                    if (member_range(i, range[0], range[1] - range[0] + 1, member[0], end))
+                    {
+                        member[1] = end - 1;
+                        vfs_fast_fat32_hal_result res = m_members[i].hal->ioctl(0, control_trim, member);
+                        if (vfs_fast_fat32_hal_result::success == result)
+                        {
+                            result = res;
+                        }
+                    }
+                }
+                return result;
+            }
+            default:
+                return vfs_fast_fat32_hal_result::invalid_paramter;
+            }
+        }
+    };
+}
+#endif
@@ -0,0 +1,590 @@
+#ifndef HTCW_ESP32_VFS_FAST_FAT32_WRITE_SCHEDULER_HAL_HPP
+#define HTCW_ESP32_VFS_FAST_FAT32_WRITE_SCHEDULER_HAL_HPP
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include "vfs_fast_fat32.hpp"
+namespace esp32
+{
+    struct vfs_fast_fat32_write_scheduler_stats
+    {
+        size_t buffered; // writes that went into a buffer because they didn't cover whole blocks
+        size_t direct;   // whole blocks written straight through
+        size_t flushed;  // blocks written whole from the buffers
+        size_t partial;  // blocks written as they were, because completing them would read too much
+        size_t split;    // blocks written around sectors trimmed while they were held
+        size_t filled;   // sectors read to complete a block before writing it
+    };
+    // wraps another HAL so the card sees whole, aligned erase blocks instead of scattered
+    // sectors. writes that cover whole blocks go straight through. the rest are held in
+    // buffer_count buffers of one block each. when the buffers run out, one block is
+    // written, a complete one if there is any, otherwise the one written least recently.
+    // a sync writes them all in ascending order. a block goes out as a single write, with
+    // the sectors nobody wrote read in around the ones they did, so the card can erase and
+    // program it without copying the old contents first, which is what makes scattered
+    // writes slow and wears the card. a block that would need more than fill_limit sectors
+    // read is written as it is instead, since reading most of a block over the bus costs
+    // more than the card's own copy. the block is the erase block size from the inner
+    // HAL's get_block_size, capped at block_size bytes. a drive that doesn't know its
+    // erase block size gets block_size. sectors trimmed in a held block, or in one of the
+    // last few ranges trimmed, are never read in and written back, which would undo the
+    // trim, so such a block goes out around them. held writes are lost if power fails
+    // before a sync, like the driver's own cache. every access to the wrapped HAL is
+    // serialized. its buffers come from Allocator
+    template <typename Allocator = heap_allocator>
+    class basic_vfs_fast_fat32_write_scheduler_hal : public vfs_fast_fat32_hal
+    {
+        constexpr static const size_t max_block_sectors = 256;
+        constexpr static const size_t max_trims = 8;
+        constexpr static const uint32_t unused = 0xFFFFFFFF;
+        struct slot
+        {
+            uint8_t *data;
+            uint32_t sector; // first sector of the block, or unused
+            uint8_t pdrv;
+            uint32_t written; // when it was last written to, for picking one to evict
+            uint32_t dirty[max_block_sectors / 32];
+            uint32_t trimmed[max_block_sectors / 32]; // never dirty at the same time
+        };
+        // a trimmed range, [first, last] like FatFs passes it. empty when first > last
+        struct trim_range
+        {
+            uint8_t pdrv;
+            uint32_t first;
+            uint32_t last;
+        };
+        // the sectors of a block that runs() works on
+        enum struct sectors_of
+        {
+            fill,  // neither dirty nor trimmed, which are read in
+            dirty, // written out as they are
+            kept   // everything but the trimmed ones, written out
+        };
+        vfs_fast_fat32_hal &m_inner;
+        slot *m_slots;
+        size_t m_slot_count;
+        size_t m_buffer_size;
+        size_t m_fill_limit;
+        uint32_t m_clock;
+        uint32_t m_block_sectors; // power of two. 0 until initialize() learns the sector size
+        uint16_t m_sector_size;
+        // the last ranges trimmed, oldest replaced first
+        trim_range m_trims[max_trims];
+        size_t m_trim_next;
+        vfs_fast_fat32_write_scheduler_stats m_stats;
+        std::mutex m_lock;
+
+        inline static bool dirty(const slot &s, uint32_t index)
+        {
+            return 0 != (s.dirty[index / 32] & (1u << (index % 32)));
+        }
+        inline static bool trimmed(const slot &s, uint32_t index)
+        {
+            return 0 != (s.trimmed[index / 32] & (1u << (index % 32)));
+        }
+        inline static bool in(const slot &s, uint32_t index, sectors_of which)
+        {
+            switch (which)
+            {
+            case sectors_of::fill:
+                return !dirty(s, index) && !trimmed(s, index);
+            case sectors_of::dirty:
+                return dirty(s, index);
+            default:
+                return !trimmed(s, index);
+            }
+        }
+        // marks the sectors of the block in [first, last] trimmed, dropping any written
+        // to them. returns false if that leaves nothing to write
+        bool trim(slot &s, uint32_t first, uint32_t last)
+        {
+            bool any = false;
+            for (uint32_t j = 0; j < m_block_sectors; ++j)
+            {
+                if (s.sector + j >= first && s.sector + j <= last)
+                {
+                    s.dirty[j / 32] &= ~(1u << (j % 32));
+                    s.trimmed[j / 32] |= 1u << (j % 32);
+                }
+                any = any || dirty(s, j);
+            }
+            return any;
+        }
+        // a write makes its sectors live again. only the ends of a range are cut back, so a
+        // range can go on covering sectors written in its middle. that only costs those
+        // blocks their single write
+        void untrim(uint8_t pdrv, uint32_t sector, uint32_t count)
+        {
+            uint32_t end = sector + count;
+            for (size_t i = 0; i < max_trims; ++i)
+            {
+                trim_range &r = m_trims[i];
+                if (r.pdrv != pdrv || r.first > r.last || sector > r.last || end <= r.first)
+                {
+                    continue;
+                }
+                if (sector <= r.first)
+                {
+                    r.first = end;
+                }
+                else if (end > r.last)
+                {
+                    r.last = sector - 1;
+                }
+            }
+        }
+        void release()
+        {
+            if (nullptr != m_slots)
+            {
+                for (size_t i = 0; i < m_slot_count; ++i)
+                {
+                    Allocator::deallocate(m_slots[i].data);
+                }
+                deallocate_array<Allocator>(m_slots, m_slot_count);
+                m_slots = nullptr;
+            }
+        }
+        slot *find(uint8_t pdrv, uint32_t start)
+        {
+            for (size_t i = 0; i < m_slot_count; ++i)
+            {
+                if (m_slots[i].sector == start && m_slots[i].pdrv == pdrv)
+                {
+                    return &m_slots[i];
+                }
+            }
+            return nullptr;
+        }
+        slot *take()
+        {
+            for (size_t i = 0; i < m_slot_count; ++i)
+            {
+                if (unused == m_slots[i].sector)
+                {
+                    return &m_slots[i];
+                }
+            }
+            return nullptr;
+        }
+        static void clear(slot &s)
+        {
+            s.sector = unused;
+            memset(s.dirty, 0, sizeof(s.dirty));
+            memset(s.trimmed, 0, sizeof(s.trimmed));
+        }
+        // the sectors of the block that have to be read in to complete it
+        size_t clean(const slot &s) const
+        {
+            size_t result = 0;
+            for (uint32_t i = 0; i < m_block_sectors; ++i)
+            {
+                if (in(s, i, sectors_of::fill))
+                {
+                    ++result;
+                }
+            }
+            return result;
+        }
+        // reads in or writes out the runs of sectors of the block in order. the ones to fill
+        // are read, the rest written
+        vfs_fast_fat32_hal_result runs(slot &s, sectors_of which)
+        {
+            uint32_t i = 0;
+            while (i < m_block_sectors)
+            {
+                if (!in(s, i, which))
+                {
+                    ++i;
+                    continue;
+                }
+                uint32_t start = i;
+                while (i < m_block_sectors && in(s, i, which))
+                {
+                    ++i;
+                }
+                uint8_t *p = s.data + (size_t)start * m_sector_size;
+                vfs_fast_fat32_hal_result res = sectors_of::fill != which ? m_inner.write(s.pdrv, p, s.sector + start, i - start) : m_inner.read(s.pdrv, p, s.sector + start, i - start);
+                if (vfs_fast_fat32_hal_result::success != res)
+                {
+                    return res;
+                }
+                if (sectors_of::fill == which)
+                {
+                    m_stats.filled += i - start;
+                }
+            }
+            return vfs_fast_fat32_hal_result::success;
+        }
+        // fills in the sectors of the block nobody wrote and writes all of it, unless that
+        // means reading too much. trimmed sectors are left out of both
+        vfs_fast_fat32_hal_result write_block(slot &s)
+        {
+            vfs_fast_fat32_hal_result res;
+            size_t limit = (size_t)-1 == m_fill_limit ? m_block_sectors / 2 : m_fill_limit;
+            if (clean(s) > limit)
+            {
+                res = runs(s, sectors_of::dirty);
+                if (vfs_fast_fat32_hal_result::success == res)
+                {
+                    ++m_stats.partial;
+                    clear(s);
+                }
+                return res;
+            }
+            res = runs(s, sectors_of::fill);
+            if (vfs_fast_fat32_hal_result::success != res)
+            {
+                return res;
+            }
+            bool whole = true;
+            for (size_t i = 0; whole && i < max_block_sectors / 32; ++i)
+            {
+                whole = 0 == s.trimmed[i];
+            }
+            if (!whole)
+            {
+                res = runs(s, sectors_of::kept);
+                if (vfs_fast_fat32_hal_result::success == res)
+                {
+                    ++m_stats.split;
+                    clear(s);
+                }
+                return res;
+            }
+            res = m_inner.write(s.pdrv, s.data, s.sector, m_block_sectors);
+            if (vfs_fast_fat32_hal_result::success == res)
+            {
+                ++m_stats.flushed;
+                clear(s);
+            }
+            return res;
+        }
+        // makes room by writing a complete block, or failing that the one written least
+        // recently
+        vfs_fast_fat32_hal_result evict()
+        {
+            slot *victim = nullptr;
+            for (size_t i = 0; i < m_slot_count; ++i)
+            {
+                slot &s = m_slots[i];
+                if (0 == clean(s))
+                {
+                    victim = &s;
+                    break;
+                }
+                if (nullptr == victim || (int32_t)(s.written - victim->written) < 0)
+                {
+                    victim = &s;
+                }
+            }
+            return write_block(*victim);
+        }
+        // writes every held block, lowest first
+        vfs_fast_fat32_hal_result flush()
+        {
+            while (true)
+            {
+                slot *lowest = nullptr;
+                for (size_t i = 0; i < m_slot_count; ++i)
+                {
+                    slot &s = m_slots[i];
+                    if (unused != s.sector && (nullptr == lowest || s.pdrv < lowest->pdrv || (s.pdrv == lowest->pdrv && s.sector < lowest->sector)))
+                    {
+                        lowest = &s;
+                    }
+                }
+                if (nullptr == lowest)
+                {
+                    return vfs_fast_fat32_hal_result::success;
+                }
+                vfs_fast_fat32_hal_result res = write_block(*lowest);
+                if (vfs_fast_fat32_hal_result::success != res)
+                {
+                    return res;
+                }
+            }
+        }
+
+    public:
+        // buffer_count blocks of at most block_size bytes each are held before they're
+        // written. block_size should be at least the card's erase block size, which for the
+        // SD cards set up by sd_configure() is allocation_unit_size. fill_limit is the most
+        // sectors read to complete a block, or -1 for half a block. check initialized()
+        // afterward
+        basic_vfs_fast_fat32_write_scheduler_hal(vfs_fast_fat32_hal &inner, size_t buffer_count = 4, size_t block_size = 16384, size_t fill_limit = (size_t)-1) : m_inner(inner), m_slots(nullptr), m_slot_count(buffer_count), m_buffer_size(block_size), m_fill_limit(fill_limit), m_clock(0), m_block_sectors(0), m_sector_size(0), m_trim_next(0)
+        {
+            memset(&m_stats, 0, sizeof(m_stats));
+            for (size_t i = 0; i < max_trims; ++i)
+            {
+                m_trims[i].pdrv = 0;
+                m_trims[i].first = 1;
+                m_trims[i].last = 0;
+            }
+            if (0 == buffer_count || 0 == block_size)
+            {
+                return;
+            }
+            m_slots = allocate_array<Allocator, slot>(buffer_count, buffer_kind::object);
+            if (nullptr == m_slots)
+            {
+                return;
+            }
+            bool ok = true;
+            for (size_t i = 0; i < buffer_count; ++i)
+            {
+                m_slots[i].data = (uint8_t *)Allocator::allocate(block_size, buffer_kind::transfer);
+                m_slots[i].pdrv = 0;
+                m_slots[i].written = 0;
+                clear(m_slots[i]);
+                ok = ok && nullptr != m_slots[i].data;
+            }
+            if (!ok)
+            {
+                release();
+            }
+        }
+        basic_vfs_fast_fat32_write_scheduler_hal(const basic_vfs_fast_fat32_write_scheduler_hal &rhs) = delete;
+        basic_vfs_fast_fat32_write_scheduler_hal &operator=(const basic_vfs_fast_fat32_write_scheduler_hal &rhs) = delete;
+        virtual ~basic_vfs_fast_fat32_write_scheduler_hal()
+        {
+            if (initialized())
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                flush();
+            }
+            release();
+        }
+        inline bool initialized() const
+        {
+            return nullptr != m_slots;
+        }
+        // the size of the blocks writes are gathered into, in sectors. 0 before the drive
+        // is initialized
+        inline uint32_t block_sectors() const
+        {
+            return m_block_sectors;
+        }
+        vfs_fast_fat32_write_scheduler_stats stats()
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_stats;
+        }
+        void reset_stats()
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            memset(&m_stats, 0, sizeof(m_stats));
+        }
+        virtual vfs_fast_fat32_disk_status initialize(uint8_t pdrv)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            vfs_fast_fat32_disk_status result = m_inner.initialize(pdrv);
+            uint16_t sector_size = 512;
+            if (vfs_fast_fat32_hal_result::success != m_inner.ioctl(pdrv, get_sector_size, &sector_size) || 0 == sector_size)
+            {
+                sector_size = 512;
+            }
+            // FatFs uses 1 for an unknown erase block size
+            uint32_t erase_sectors = 0;
+            if (vfs_fast_fat32_hal_result::success != m_inner.ioctl(pdrv, get_block_size, &erase_sectors) || erase_sectors < 2)
+            {
+                erase_sectors = 0;
+            }
+            uint32_t limit = (uint32_t)(m_buffer_size / sector_size);
+            if (0 != erase_sectors && erase_sectors < limit)
+            {
+                limit = erase_sectors;
+            }
+            if (limit > max_block_sectors)
+            {
+                limit = max_block_sectors;
+            }
+            uint32_t block_sectors = 1;
+            while (block_sectors * 2 <= limit)
+            {
+                block_sectors *= 2;
+            }
+            if (block_sectors != m_block_sectors || sector_size != m_sector_size)
+            {
+                // held blocks were laid out for the old geometry
+                if (0 != m_block_sectors && initialized())
+                {
+                    flush();
+                }
+                m_sector_size = sector_size;
+                m_block_sectors = block_sectors;
+            }
+            return result;
+        }
+        virtual vfs_fast_fat32_disk_status status(uint8_t pdrv)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_inner.status(pdrv);
+        }
+        // reads from the drive, with any held sectors laid over the top
+        virtual vfs_fast_fat32_hal_result read(uint8_t pdrv, void *buffer, uint32_t sector, unsigned int count)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            vfs_fast_fat32_hal_result res = m_inner.read(pdrv, buffer, sector, count);
+            if (vfs_fast_fat32_hal_result::success != res || !initialized() || 0 == m_block_sectors)
+            {
+                return res;
+            }
+            uint8_t *p = (uint8_t *)buffer;
+            for (size_t i = 0; i < m_slot_count; ++i)
+            {
+                const slot &s = m_slots[i];
+                if (unused == s.sector || s.pdrv != pdrv || s.sector >= sector + count || s.sector + m_block_sectors <= sector)
+                {
+                    continue;
+                }
+                uint32_t first = s.sector > sector ? s.sector : sector;
+                uint32_t last = s.sector + m_block_sectors < sector + count ? s.sector + m_block_sectors : sector + count;
+                for (uint32_t j = first; j < last; ++j)
+                {
+                    if (dirty(s, j - s.sector))
+                    {
+                        memcpy(p + (size_t)(j - sector) * m_sector_size, s.data + (size_t)(j - s.sector) * m_sector_size, m_sector_size);
+                    }
+                }
+            }
+            return res;
+        }
+        virtual vfs_fast_fat32_hal_result write(uint8_t pdrv, const void *buffer, uint32_t sector, unsigned int count)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!initialized() || 0 == m_block_sectors)
+            {
+                return m_inner.write(pdrv, buffer, sector, count);
+            }
+            untrim(pdrv, sector, count);
+            const uint8_t *p = (const uint8_t *)buffer;
+            bool held = false;
+            while (0 != count)
+            {
+                uint32_t start = sector & ~(m_block_sectors - 1);
+                uint32_t offset = sector - start;
+                if (0 == offset && count >= m_block_sectors)
+                {
+                    // whole blocks replace anything held for them
+                    uint32_t n = count & ~(m_block_sectors - 1);
+                    for (uint32_t block = start; block < start + n; block += m_block_sectors)
+                    {
+                        slot *s = find(pdrv, block);
+                        if (nullptr != s)
+                        {
+                            clear(*s);
+                        }
+                    }
+                    vfs_fast_fat32_hal_result res = m_inner.write(pdrv, p, sector, n);
+                    if (vfs_fast_fat32_hal_result::success != res)
+                    {
+                        return res;
+                    }
+                    m_stats.direct += n / m_block_sectors;
+                    p += (size_t)n * m_sector_size;
+                    sector += n;
+                    count -= n;
+                    continue;
+                }
+                uint32_t n = m_block_sectors - offset;
+                if (n > count)
+                {
+                    n = count;
+                }
+                slot *s = find(pdrv, start);
+                if (nullptr == s)
+                {
+                    s = take();
+                    if (nullptr == s)
+                    {
+                        vfs_fast_fat32_hal_result res = evict();
+                        if (vfs_fast_fat32_hal_result::success != res)
+                        {
+                            return res;
+                        }
+                        s = take();
+                    }
+                    s->sector = start;
+                    s->pdrv = pdrv;
+                    for (size_t i = 0; i < max_trims; ++i)
+                    {
+                        const trim_range &r = m_trims[i];
+                        if (r.pdrv == pdrv && r.first <= r.last)
+                        {
+                            trim(*s, r.first, r.last);
+                        }
+                    }
+                }
+                s->written = ++m_clock;
+                memcpy(s->data + (size_t)offset * m_sector_size, p, (size_t)n * m_sector_size);
+                for (uint32_t i = offset; i < offset + n; ++i)
+                {
+                    s->dirty[i / 32] |= 1u << (i % 32);
+                    s->trimmed[i / 32] &= ~(1u << (i % 32));
+                }
+                held = true;
+                p += (size_t)n * m_sector_size;
+                sector += n;
+                count -= n;
+            }
+            if (held)
+            {
+                ++m_stats.buffered;
+            }
+            return vfs_fast_fat32_hal_result::success;
+        }
+        virtual vfs_fast_fat32_hal_result ioctl(uint8_t pdrv, vfs_fast_fat32_ioctl_command command, void *buffer)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (initialized() && 0 != m_block_sectors)
+            {
+                switch (command)
+                {
+                case control_sync:
+                {
+                    vfs_fast_fat32_hal_result res = flush();
+                    if (vfs_fast_fat32_hal_result::success != res)
+                    {
+                        return res;
+                    }
+                }
+                break;
+                case get_block_size:
+                    *(uint32_t *)buffer = m_block_sectors;
+                    return vfs_fast_fat32_hal_result::success;
+                case control_trim:
+                {
+                    // held sectors in the range don't need writing any more, and none of
+                    // them may be filled in later, held now or not
+                    const uint32_t *range = (const uint32_t *)buffer;
+                    for (size_t i = 0; i < m_slot_count; ++i)
+                    {
+                        slot &s = m_slots[i];
+                        if (unused != s.sector && s.pdrv == pdrv && !trim(s, range[0], range[1]))
+                        {
+                            clear(s);
+                        }
+                    }
+                    trim_range &r = m_trims[m_trim_next];
+                    m_trim_next = (m_trim_next + 1) % max_trims;
+                    r.pdrv = pdrv;
+                    r.first = range[0];
+                    r.last = range[1];
+                }
+                break;
+                default:
+                    break;
+                }
+            }
+            return m_inner.ioctl(pdrv, command, buffer);
+        }
+        virtual unsigned int prefetch(uint8_t pdrv, uint32_t sector, unsigned int count)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_inner.prefetch(pdrv, sector, count);
+        }
+    };
+    typedef basic_vfs_fast_fat32_write_scheduler_hal<> vfs_fast_fat32_write_scheduler_hal;
+}
+#endif
@@ -0,0 +1,830 @@
+#ifndef HTCW_ESP32_VFS_RAMFS_HPP
+#define HTCW_ESP32_VFS_RAMFS_HPP
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <new>
+#include <mutex>
+#include "vfs.hpp"
+namespace esp32 {
+    // a file system held in RAM, for scratch files and as the upper bound in benchmarks.
+    // file data lives in fixed size chunks handed out by a pool, so files grow without
+    // being moved, and chunks never written to read back as zeros. max_size limits the
+    // chunk memory in bytes, 0 for as much as the heap will give
+    class vfs_ramfs : public vfs_driver {
+        struct node {
+            node* parent;
+            node* first_child;
+            node* next_sibling;
+            char* name;
+            bool directory;
+            bool unlinked; // still open, but no longer in a directory
+            uint16_t open_count;
+            uint32_t size;
+            uint8_t** chunks;
+            uint32_t chunk_capacity;
+            time_t modified;
+            time_t accessed;
+        };
+        struct file {
+            node* n;
+            uint32_t position;
+            int flags;
+        };
+        struct directory_handle {
+#ifdef ESP_PLATFORM
+            DIR dir; // must come first. esp_vfs fills in dd_vfs_idx
+#endif
+            node* directory;
+            node* cursor; // the next child to list
+            long position;
+            directory_handle* next; // in m_directories
+            struct dirent result;
+        };
+        // chunks are carved from blocks of several at a time, and freed ones are kept on a
+        // list threaded through their first bytes
+        struct pool_block {
+            pool_block* next;
+        };
+        constexpr static const size_t chunks_per_block = 8;
+        std::mutex m_lock;
+        node* m_root;
+        file* m_files;
+        size_t m_max_files;
+        size_t m_chunk_size;
+        size_t m_max_chunks;
+        size_t m_used_chunks;
+        size_t m_allocated_chunks;
+        pool_block* m_blocks;
+        void* m_free_chunks;
+        directory_handle* m_directories; // open ones, so removals can move their cursors
+
+        static int fail(int error) {
+            errno = error;
+            return -1;
+        }
+        uint8_t* allocate_chunk() {
+            if(0!=m_max_chunks && m_used_chunks>=m_max_chunks) {
+                return nullptr;
+            }
+            if(nullptr==m_free_chunks) {
+                size_t count = chunks_per_block;
+                if(0!=m_max_chunks && m_allocated_chunks+count>m_max_chunks) {
+                    count = m_max_chunks-m_allocated_chunks;
+                }
+                // the header is padded to keep the chunks pointer aligned
+                const size_t header = (sizeof(pool_block)+sizeof(void*)-1)/sizeof(void*)*sizeof(void*);
+                pool_block* block = (pool_block*)malloc(header+count*m_chunk_size);
+                if(nullptr==block) {
+                    return nullptr;
+                }
+                block->next = m_blocks;
+                m_blocks = block;
+                uint8_t* p = (uint8_t*)block+header;
+                for(size_t i = 0;i<count;++i) {
+                    *(void**)(p+i*m_chunk_size) = m_free_chunks;
+                    m_free_chunks = p+i*m_chunk_size;
+                }
+                m_allocated_chunks+=count;
+            }
+            uint8_t* result = (uint8_t*)m_free_chunks;
+            m_free_chunks = *(void**)result;
+            ++m_used_chunks;
+            memset(result,0,m_chunk_size);
+            return result;
+        }
+        void free_chunk(uint8_t* chunk) {
+            *(void**)chunk = m_free_chunks;
+            m_free_chunks = chunk;
+            --m_used_chunks;
+        }
+        node* create_node(node* parent,const char* name,size_t name_length,bool directory) {
+            node* result = new(std::nothrow) node();
+            if(nullptr==result) {
+                return nullptr;
+            }
+            result->name = new(std::nothrow) char[name_length+1];
+            if(nullptr==result->name) {
+                delete result;
+                return nullptr;
+            }
+            memcpy(result->name,name,name_length);
+            result->name[name_length]=0;
+            result->directory = directory;
+            result->modified = result->accessed = time(nullptr);
+            if(nullptr!=parent) {
+                attach(parent,result);
+            }
+            return result;
+        }
+        // appends so readdir sees entries in the order they were made
+        static void attach(node* parent,node* child) {
+            child->parent = parent;
+            child->next_sibling = nullptr;
+            node** p = &parent->first_child;
+            while(nullptr!=*p) {
+                p = &(*p)->next_sibling;
+            }
+            *p = child;
+            parent->modified = time(nullptr);
+        }
+        void detach(node* child) {
+            node* parent = child->parent;
+            node** p = &parent->first_child;
+            while(*p!=child) {
+                p = &(*p)->next_sibling;
+            }
+            *p = child->next_sibling;
+            for(directory_handle* h = m_directories;nullptr!=h;h = h->next) {
+                if(h->cursor==child) {
+                    h->cursor = child->next_sibling;
+                }
+            }
+            child->next_sibling = nullptr;
+            child->parent = nullptr;
+            parent->modified = time(nullptr);
+        }
+        // frees chunks from byte length on and zeros the rest of the last one kept, so
+        // whatever is past the end of a file always reads back as zeros
+        void cut(node* n,uint32_t length) {
+            uint32_t keep = (uint32_t)((length+m_chunk_size-1)/m_chunk_size);
+            for(uint32_t i = keep;i<n->chunk_capacity;++i) {
+                if(nullptr!=n->chunks[i]) {
+                    free_chunk(n->chunks[i]);
+                    n->chunks[i] = nullptr;
+                }
+            }
+            uint32_t offset = length%m_chunk_size;
+            if(0!=offset && 0!=keep && keep<=n->chunk_capacity && nullptr!=n->chunks[keep-1]) {
+                memset(n->chunks[keep-1]+offset,0,m_chunk_size-offset);
+            }
+            if(0==keep) {
+                delete[] n->chunks;
+                n->chunks = nullptr;
+                n->chunk_capacity = 0;
+            }
+            n->size = length;
+        }
+        void destroy(node* n) {
+            while(nullptr!=n->first_child) {
+                node* child = n->first_child;
+                n->first_child = child->next_sibling;
+                destroy(child);
+            }
+            cut(n,0);
+            delete[] n->name;
+            delete n;
+        }
+        // makes sure there's a chunk table entry for index
+        bool reserve(node* n,uint32_t index) {
+            if(index<n->chunk_capacity) {
+                return true;
+            }
+            uint32_t capacity = 0==n->chunk_capacity?4:n->chunk_capacity;
+            while(capacity<=index) {
+                capacity*=2;
+            }
+            uint8_t** chunks = new(std::nothrow) uint8_t*[capacity];
+            if(nullptr==chunks) {
+                return false;
+            }
+            for(uint32_t i = 0;i<capacity;++i) {
+                chunks[i] = i<n->chunk_capacity?n->chunks[i]:nullptr;
+            }
+            delete[] n->chunks;
+            n->chunks = chunks;
+            n->chunk_capacity = capacity;
+            return true;
+        }
+        ssize_t read_node(node* n,uint32_t position,uint8_t* dst,size_t size) {
+            if(position>=n->size) {
+                return 0;
+            }
+            if(size>n->size-position) {
+                size = n->size-position;
+            }
+            size_t remaining = size;
+            while(0!=remaining) {
+                uint32_t index = position/m_chunk_size;
+                size_t offset = position%m_chunk_size;
+                size_t count = m_chunk_size-offset<remaining?m_chunk_size-offset:remaining;
+                uint8_t* chunk = index<n->chunk_capacity?n->chunks[index]:nullptr;
+                if(nullptr==chunk) {
+                    memset(dst,0,count);
+                } else {
+                    memcpy(dst,chunk+offset,count);
+                }
+                dst+=count;
+                position+=count;
+                remaining-=count;
+            }
+            n->accessed = time(nullptr);
+            return size;
+        }
+        ssize_t write_node(node* n,uint32_t position,const uint8_t* src,size_t size) {
+            if((uint64_t)position+size>0xFFFFFFFF) {
+                return fail(EFBIG);
+            }
+            size_t remaining = size;
+            while(0!=remaining) {
+                uint32_t index = position/m_chunk_size;
+                size_t offset = position%m_chunk_size;
+                size_t count = m_chunk_size-offset<remaining?m_chunk_size-offset:remaining;
+                if(!reserve(n,index)) {
+                    break;
+                }
+                if(nullptr==n->chunks[index]) {
+                    n->chunks[index] = allocate_chunk();
+                    if(nullptr==n->chunks[index]) {
+                        break;
+                    }
+                }
+                memcpy(n->chunks[index]+offset,src,count);
+                src+=count;
+                position+=count;
+                remaining-=count;
+                if(position>n->size) {
+                    n->size = position;
+                }
+            }
+            if(size==remaining && 0!=size) {
+                return fail(ENOSPC);
+            }
+            n->modified = time(nullptr);
+            return size-remaining;
+        }
+        file* get_file(int fd) {
+            if(0>fd || (size_t)fd>=m_max_files || nullptr==m_files[fd].n) {
+                return nullptr;
+            }
+            return &m_files[fd];
+        }
+        void release(node* n) {
+            if(0==--n->open_count && n->unlinked) {
+                destroy(n);
+            }
+        }
+        // finds the node at path. if it doesn't exist but its parent does, returns ENOENT
+        // with the parent and the last name filled in
+        int find(const char* path,node*& result,node** parent = nullptr,const char** name = nullptr,size_t* name_length = nullptr) {
+            if(nullptr==path) {
+                return EINVAL;
+            }
+            node* current = m_root;
+            while(true) {
+                while('/'==*path) {
+                    ++path;
+                }
+                if(0==*path) {
+                    result = current;
+                    return 0;
+                }
+                const char* end = path;
+                while(0!=*end && '/'!=*end) {
+                    ++end;
+                }
+                size_t length = end-path;
+                if(length>=sizeof(((struct dirent*)nullptr)->d_name)) {
+                    return ENAMETOOLONG;
+                }
+                if(!current->directory) {
+                    return ENOTDIR;
+                }
+                node* child = nullptr;
+                if(1==length && '.'==path[0]) {
+                    child = current;
+                } else if(2==length && '.'==path[0] && '.'==path[1]) {
+                    child = nullptr!=current->parent?current->parent:current;
+                } else {
+                    for(node* c = current->first_child;nullptr!=c;c = c->next_sibling) {
+                        if(0==strncmp(c->name,path,length) && 0==c->name[length]) {
+                            child = c;
+                            break;
+                        }
+                    }
+                }
+                if(nullptr==child) {
+                    const char* rest = end;
+                    while('/'==*rest) {
+                        ++rest;
+                    }
+                    if(0==*rest && nullptr!=parent) {
+                        *parent = current;
+                        *name = path;
+                        *name_length = length;
+                    }
+                    return ENOENT;
+                }
+                current = child;
+                path = end;
+            }
+        }
+        // a new name in an existing directory. "." and ".." can't be created
+        static bool creatable(const char* name,size_t length) {
+            return !(1==length && '.'==name[0]) && !(2==length && '.'==name[0] && '.'==name[1]);
+        }
+        void fill_stat(const node* n,struct stat* st) const {
+            memset(st,0,sizeof(struct stat));
+            st->st_mode = S_IRWXU | S_IRWXG | S_IRWXO | (n->directory?S_IFDIR:S_IFREG);
+            st->st_size = n->size;
+            st->st_mtime = n->modified;
+            st->st_atime = n->accessed;
+            st->st_ctime = n->modified;
+            st->st_blksize = m_chunk_size;
+        }
+    public:
+        vfs_ramfs(size_t max_files = 16,size_t chunk_size = 4096,size_t max_size = 0) :
+                m_max_files(max_files),
+                m_chunk_size(chunk_size<sizeof(void*)?sizeof(void*):chunk_size),
+                m_max_chunks(0),
+                m_used_chunks(0),
+                m_allocated_chunks(0),
+                m_blocks(nullptr),
+                m_free_chunks(nullptr),
+                m_directories(nullptr) {
+            // chunks hold the free list link, so keep them pointer aligned
+            m_chunk_size = (m_chunk_size+sizeof(void*)-1)/sizeof(void*)*sizeof(void*);
+            if(0!=max_size) {
+                m_max_chunks = max_size/m_chunk_size;
+                if(0==m_max_chunks) {
+                    m_max_chunks = 1;
+                }
+            }
+            m_root = create_node(nullptr,"",0,true);
+            m_files = new(std::nothrow) file[0==max_files?1:max_files]();
+            if(nullptr==m_files && nullptr!=m_root) {
+                destroy(m_root);
+                m_root = nullptr;
+            }
+        }
+        vfs_ramfs(const vfs_ramfs& rhs)=delete;
+        vfs_ramfs& operator=(const vfs_ramfs& rhs)=delete;
+        virtual ~vfs_ramfs() {
+            if(nullptr!=m_files) {
+                for(size_t i = 0;i<m_max_files;++i) {
+                    if(nullptr!=m_files[i].n && m_files[i].n->unlinked) {
+                        release(m_files[i].n);
+                    }
+                }
+                delete[] m_files;
+            }
+            if(nullptr!=m_root) {
+                destroy(m_root);
+            }
+            while(nullptr!=m_blocks) {
+                pool_block* next = m_blocks->next;
+                ::free(m_blocks);
+                m_blocks = next;
+            }
+        }
+        inline bool initialized() const {
+            return nullptr!=m_root;
+        }
+        inline size_t chunk_size() const {
+            return m_chunk_size;
+        }
+        // bytes of chunks holding file data
+        size_t used() {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_used_chunks*m_chunk_size;
+        }
+        // bytes of chunks taken from the heap, used or not. chunks go back to the pool, not
+        // the heap, until the file system is destroyed
+        size_t allocated() {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_allocated_chunks*m_chunk_size;
+        }
+        virtual ssize_t write(int fd,const void* data,size_t size) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file* f = get_file(fd);
+            if(nullptr==f || O_RDONLY==(f->flags&O_ACCMODE)) {
+                return fail(EBADF);
+            }
+            if(f->flags&O_APPEND) {
+                f->position = f->n->size;
+            }
+            ssize_t result = write_node(f->n,f->position,(const uint8_t*)data,size);
+            if(0<result) {
+                f->position+=result;
+            }
+            return result;
+        }
+        virtual off_t lseek(int fd,off_t size,int mode) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file* f = get_file(fd);
+            if(nullptr==f) {
+                return fail(EBADF);
+            }
+            int64_t position;
+            switch(mode) {
+                case SEEK_SET:
+                    position = size;
+                    break;
+                case SEEK_CUR:
+                    position = (int64_t)f->position+size;
+                    break;
+                case SEEK_END:
+                    position = (int64_t)f->n->size+size;
+                    break;
+                default:
+                    return fail(EINVAL);
+            }
+            if(0>position || position>0xFFFFFFFF) {
+                return fail(EINVAL);
+            }
+            f->position = (uint32_t)position;
+            return (off_t)position;
+        }
+        virtual ssize_t read(int fd,void* dst,size_t size) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file* f = get_file(fd);
+            if(nullptr==f || O_WRONLY==(f->flags&O_ACCMODE)) {
+                return fail(EBADF);
+            }
+            ssize_t result = read_node(f->n,f->position,(uint8_t*)dst,size);
+            f->position+=result;
+            return result;
+        }
+        virtual ssize_t pread(int fd,void* dst,size_t size,off_t offset) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file* f = get_file(fd);
+            if(nullptr==f || O_WRONLY==(f->flags&O_ACCMODE)) {
+                return fail(EBADF);
+            }
+            if(0>offset || offset>0xFFFFFFFF) {
+                return fail(EINVAL);
+            }
+            return read_node(f->n,(uint32_t)offset,(uint8_t*)dst,size);
+        }
+        virtual ssize_t pwrite(int fd,const void* src,size_t size,off_t offset) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file* f = get_file(fd);
+            if(nullptr==f || O_RDONLY==(f->flags&O_ACCMODE)) {
+                return fail(EBADF);
+            }
+            if(0>offset || offset>0xFFFFFFFF) {
+                return fail(EINVAL);
+            }
+            return write_node(f->n,(uint32_t)offset,(const uint8_t*)src,size);
+        }
+        virtual int open(const char* path,int flags,int mode) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if(!initialized()) {
+                return fail(ENODEV);
+            }
+            int fd = -1;
+            for(size_t i = 0;i<m_max_files;++i) {
+                if(nullptr==m_files[i].n) {
+                    fd = (int)i;
+                    break;
+                }
+            }
+            if(-1==fd) {
+                return fail(ENFILE);
+            }
+            node* parent = nullptr;
+            const char* name = nullptr;
+            size_t name_length = 0;
+            node* n;
+            int res = find(path,n,&parent,&name,&name_length);
+            if(0==res) {
+                if((flags&O_CREAT) && (flags&O_EXCL)) {
+                    return fail(EEXIST);
+                }
+                if(n->directory) {
+                    return fail(EISDIR);
+                }
+            } else {
+                if(ENOENT!=res || !(flags&O_CREAT) || nullptr==parent) {
+                    return fail(res);
+                }
+                if(!creatable(name,name_length)) {
+                    return fail(EISDIR);
+                }
+                n = create_node(parent,name,name_length,false);
+                if(nullptr==n) {
+                    return fail(ENOMEM);
+                }
+            }
+            int access = flags&O_ACCMODE;
+            if((O_WRONLY==access || O_RDWR==access) && (flags&O_TRUNC)) {
+                cut(n,0);
+                n->modified = time(nullptr);
+            }
+            file& f = m_files[fd];
+            f.n = n;
+            f.position = 0;
+            f.flags = flags;
+            ++n->open_count;
+            return fd;
+        }
+        virtual int close(int fd) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file* f = get_file(fd);
+            if(nullptr==f) {
+                return fail(EBADF);
+            }
+            node* n = f->n;
+            f->n = nullptr;
+            release(n);
+            return 0;
+        }
+        virtual int fstat(int fd,struct stat* st) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            file* f = get_file(fd);
+            if(nullptr==f) {
+                return fail(EBADF);
+            }
+            fill_stat(f->n,st);
+            return 0;
+        }
+        virtual int fsync(int fd) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return nullptr==get_file(fd)?fail(EBADF):0;
+        }
+#ifdef CONFIG_VFS_SUPPORT_DIR
+        virtual int stat(const char* path,struct stat* st) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            node* n;
+            int res = find(path,n);
+            if(0!=res) {
+                return fail(res);
+            }
+            fill_stat(n,st);
+            return 0;
+        }
+        virtual int link(const char* n1,const char* n2) {
+            return fail(ENOTSUP);
+        }
+        virtual int unlink(const char* path) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            node* n;
+            int res = find(path,n);
+            if(0!=res) {
+                return fail(res);
+            }
+            if(n->directory) {
+                return fail(EISDIR);
+            }
+            detach(n);
+            // open descriptors keep the data until they're closed
+            if(0!=n->open_count) {
+                n->unlinked = true;
+            } else {
+                destroy(n);
+            }
+            return 0;
+        }
+        virtual int rename(const char* src,const char* dst) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            node* n;
+            int res = find(src,n);
+            if(0!=res) {
+                return fail(res);
+            }
+            if(n==m_root) {
+                return fail(EBUSY);
+            }
+            node* parent = nullptr;
+            const char* name = nullptr;
+            size_t name_length = 0;
+            node* existing;
+            res = find(dst,existing,&parent,&name,&name_length);
+            if(0==res) {
+                if(existing==n) {
+                    return 0;
+                }
+                if(existing->directory!=n->directory) {
+                    return fail(existing->directory?EISDIR:ENOTDIR);
+                }
+                if(existing->directory && nullptr!=existing->first_child) {
+                    return fail(ENOTEMPTY);
+                }
+                if(existing==m_root) {
+                    return fail(EBUSY);
+                }
+                parent = existing->parent;
+                name = existing->name;
+                name_length = strlen(existing->name);
+            } else if(ENOENT!=res || nullptr==parent) {
+                return fail(res);
+            } else if(!creatable(name,name_length)) {
+                return fail(EINVAL);
+            } else {
+                existing = nullptr;
+            }
+            // a directory can't move into itself
+            for(node* p = parent;nullptr!=p;p = p->parent) {
+                if(p==n) {
+                    return fail(EINVAL);
+                }
+            }
+            char* new_name = new(std::nothrow) char[name_length+1];
+            if(nullptr==new_name) {
+                return fail(ENOMEM);
+            }
+            memcpy(new_name,name,name_length);
+            new_name[name_length]=0;
+            if(nullptr!=existing) {
+                detach(existing);
+                if(0!=existing->open_count) {
+                    existing->unlinked = true;
+                } else {
+                    destroy(existing);
+                }
+            }
+            detach(n);
+            delete[] n->name;
+            n->name = new_name;
+            attach(parent,n);
+            return 0;
+        }
+        virtual DIR* opendir(const char* name) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            node* n;
+            int res = find(name,n);
+            if(0!=res) {
+                errno = res;
+                return nullptr;
+            }
+            if(!n->directory) {
+                errno = ENOTDIR;
+                return nullptr;
+            }
+            directory_handle* handle = new(std::nothrow) directory_handle();
+            if(nullptr==handle) {
+                errno = ENOMEM;
+                return nullptr;
+            }
+            handle->directory = n;
+            handle->cursor = n->first_child;
+            handle->position = 0;
+            handle->next = m_directories;
+            m_directories = handle;
+            // a removed directory lasts until its handles are closed
+            ++n->open_count;
+            return reinterpret_cast<DIR*>(handle);
+        }
+        virtual dirent* readdir(DIR* pdir) {
+            directory_handle* handle = reinterpret_cast<directory_handle*>(pdir);
+            if(nullptr==handle) {
+                errno = EBADF;
+                return nullptr;
+            }
+            dirent* result = nullptr;
+            int res = readdir_r(pdir,&handle->result,&result);
+            if(0!=res) {
+                errno = res;
+                return nullptr;
+            }
+            return result;
+        }
+        virtual int readdir_r(DIR* pdir,struct dirent* entry,struct dirent** out_dirent) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            directory_handle* handle = reinterpret_cast<directory_handle*>(pdir);
+            if(nullptr==handle || nullptr==entry || nullptr==out_dirent) {
+                return EBADF;
+            }
+            *out_dirent = nullptr;
+            node* n = handle->cursor;
+            if(nullptr==n) {
+                return 0;
+            }
+            entry->d_ino = 0;
+            entry->d_type = n->directory?DT_DIR:DT_REG;
+            strncpy(entry->d_name,n->name,sizeof(entry->d_name)-1);
+            entry->d_name[sizeof(entry->d_name)-1]=0;
+            handle->cursor = n->next_sibling;
+            ++handle->position;
+            *out_dirent = entry;
+            return 0;
+        }
+        virtual long telldir(DIR* pdir) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            directory_handle* handle = reinterpret_cast<directory_handle*>(pdir);
+            if(nullptr==handle) {
+                errno = EBADF;
+                return -1;
+            }
+            return handle->position;
+        }
+        virtual void seekdir(DIR* pdir,long offset) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            directory_handle* handle = reinterpret_cast<directory_handle*>(pdir);
+            if(nullptr==handle || 0>offset) {
+                return;
+            }
+            handle->cursor = handle->directory->first_child;
+            for(handle->position = 0;handle->position<offset && nullptr!=handle->cursor;++handle->position) {
+                handle->cursor = handle->cursor->next_sibling;
+            }
+        }
+        virtual int closedir(DIR* pdir) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            directory_handle* handle = reinterpret_cast<directory_handle*>(pdir);
+            if(nullptr==handle) {
+                return fail(EBADF);
+            }
+            directory_handle** p = &m_directories;
+            while(nullptr!=*p && *p!=handle) {
+                p = &(*p)->next;
+            }
+            if(nullptr==*p) {
+                return fail(EBADF);
+            }
+            *p = handle->next;
+            release(handle->directory);
+            delete handle;
+            return 0;
+        }
+        virtual int mkdir(const char* name,mode_t mode) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            node* parent = nullptr;
+            const char* leaf = nullptr;
+            size_t length = 0;
+            node* n;
+            int res = find(name,n,&parent,&leaf,&length);
+            if(0==res) {
+                return fail(EEXIST);
+            }
+            if(ENOENT!=res || nullptr==parent) {
+                return fail(res);
+            }
+            if(!creatable(leaf,length)) {
+                return fail(EEXIST);
+            }
+            if(nullptr==create_node(parent,leaf,length,true)) {
+                return fail(ENOMEM);
+            }
+            return 0;
+        }
+        virtual int rmdir(const char* name) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            node* n;
+            int res = find(name,n);
+            if(0!=res) {
+                return fail(res);
+            }
+            if(!n->directory) {
+                return fail(ENOTDIR);
+            }
+            if(n==m_root) {
+                return fail(EBUSY);
+            }
+            if(nullptr!=n->first_child) {
+                return fail(ENOTEMPTY);
+            }
+            detach(n);
+            if(0!=n->open_count) {
+                n->unlinked = true;
+            } else {
+                destroy(n);
+            }
+            return 0;
+        }
+        virtual int access(const char* path,int amode) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            node* n;
+            int res = find(path,n);
+            return 0==res?0:fail(res);
+        }
+        virtual int truncate(const char* path,off_t length) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if(0>length || length>0xFFFFFFFF) {
+                return fail(EINVAL);
+            }
+            node* n;
+            int res = find(path,n);
+            if(0!=res) {
+                return fail(res);
+            }
+            if(n->directory) {
+                return fail(EISDIR);
+            }
+            if((uint32_t)length<n->size) {
+                cut(n,(uint32_t)length);
+            } else {
+                // the chunks past the end are already zeros
+                n->size = (uint32_t)length;
+            }
+            n->modified = time(nullptr);
+            return 0;
+        }
+        virtual int utime(const char* path,const struct utimbuf* times) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            node* n;
+            int res = find(path,n);
+            if(0!=res) {
+                return fail(res);
+            }
+            n->modified = nullptr!=times?times->modtime:time(nullptr);
+            n->accessed = nullptr!=times?times->actime:n->modified;
+            return 0;
+        }
+#endif // CONFIG_VFS_SUPPORT_DIR
+    };
+}
+#endif
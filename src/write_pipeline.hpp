@@ -0,0 +1,234 @@
+#ifndef HTCW_ESP32_WRITE_PIPELINE_HPP
+#define HTCW_ESP32_WRITE_PIPELINE_HPP
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#endif
+#include "pinned_thread.hpp"
+namespace esp32 {
+    // queues sector writes to a device through a small ring of DMA capable buffers, and
+    // moves them to the device from a dedicated task, so the caller fills the next buffer
+    // while the bus is busy with the last one. Device needs:
+    //   bool write(const void* source,size_t start_sector,size_t sector_count)
+    //   size_t sector_size() const
+    // writes complete in the order they were submitted. tokens increase by one per
+    // buffer, and 0 is never a valid token
+    template<typename Device>
+    class write_pipeline final {
+        struct slot {
+            uint8_t* data;
+            size_t start_sector;
+            size_t sector_count;
+            uint32_t token;
+        };
+        Device* m_device;
+        size_t m_sector_size;
+        slot* m_slots;
+        size_t m_slot_count;
+        size_t m_slot_sectors;
+        size_t m_head; // next slot to fill
+        size_t m_tail; // next slot to write
+        size_t m_queued;
+        uint32_t m_submitted; // token of the last buffer queued
+        uint32_t m_completed; // token of the last buffer written
+        uint32_t m_failed; // first token that failed since the last flush(), or 0
+        bool m_stop;
+        std::mutex m_submit_lock; // one submitter at a time owns m_head
+        std::mutex m_lock;
+        std::condition_variable m_ready; // a buffer was queued, or we're stopping
+        std::condition_variable m_done; // a buffer was written
+        std::thread m_thread;
+
+        // token order that survives wrapping
+        static bool reached(uint32_t token,uint32_t target) {
+            return 0<=(int32_t)(token-target);
+        }
+        static uint8_t* allocate(size_t size) {
+#ifdef ESP_PLATFORM
+            return (uint8_t*)heap_caps_malloc(size,MALLOC_CAP_DMA);
+#else
+            return (uint8_t*)malloc(size);
+#endif
+        }
+        static void deallocate(uint8_t* data) {
+#ifdef ESP_PLATFORM
+            heap_caps_free(data);
+#else
+            ::free(data);
+#endif
+        }
+        void release() {
+            if(nullptr!=m_slots) {
+                for(size_t i = 0;i<m_slot_count;++i) {
+                    deallocate(m_slots[i].data);
+                }
+                delete[] m_slots;
+                m_slots = nullptr;
+            }
+        }
+        void run() {
+            std::unique_lock<std::mutex> lock(m_lock);
+            while(true) {
+                m_ready.wait(lock,[this]{return m_stop || 0!=m_queued;});
+                if(0==m_queued) {
+                    // only exit once everything queued is on the device
+                    return;
+                }
+                slot& s = m_slots[m_tail];
+                lock.unlock();
+                bool ok = m_device->write(s.data,s.start_sector,s.sector_count);
+                lock.lock();
+                if(!ok && 0==m_failed) {
+                    m_failed = s.token;
+                }
+                m_completed = s.token;
+                m_tail = (m_tail+1)%m_slot_count;
+                --m_queued;
+                m_done.notify_all();
+            }
+        }
+    public:
+        // buffer_count buffers of buffer_size bytes each (rounded down to whole sectors).
+        // core is the one the I/O task is pinned to on the ESP32. -1 picks the core other
+        // than the caller's. first_token is the token of the first buffer, which tests set
+        // near the top to get the wrap over quickly. check initialized() afterward
+        write_pipeline(Device& device,size_t buffer_count = 2,size_t buffer_size = 16384,int core = -1,uint32_t first_token = 1) :
+                m_device(&device),
+                m_sector_size(device.sector_size()),
+                m_slots(nullptr),
+                m_slot_count(buffer_count),
+                m_slot_sectors(0),
+                m_head(0),
+                m_tail(0),
+                m_queued(0),
+                m_submitted(first_token-1),
+                m_completed(0),
+                m_failed(0),
+                m_stop(false) {
+            if(0==m_sector_size || 0==buffer_count) {
+                return;
+            }
+            m_slot_sectors = buffer_size/m_sector_size;
+            if(0==m_slot_sectors) {
+                m_slot_sectors = 1;
+            }
+            m_slots = new(std::nothrow) slot[buffer_count];
+            if(nullptr==m_slots) {
+                return;
+            }
+            bool ok = true;
+            for(size_t i = 0;i<buffer_count;++i) {
+                m_slots[i].data = allocate(m_slot_sectors*m_sector_size);
+                ok = ok && nullptr!=m_slots[i].data;
+            }
+            if(!ok || !start_pinned_thread(m_thread,core,"write_pipeline",[this]{run();})) {
+                release();
+            }
+        }
+        write_pipeline(const write_pipeline& rhs)=delete;
+        write_pipeline& operator=(const write_pipeline& rhs)=delete;
+        // the I/O task holds this, so it can't move
+        write_pipeline(write_pipeline&& rhs)=delete;
+        write_pipeline& operator=(write_pipeline&& rhs)=delete;
+        ~write_pipeline() {
+            if(!initialized()) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                m_stop = true;
+            }
+            m_ready.notify_one();
+            m_thread.join();
+            release();
+        }
+        inline bool initialized() const {
+            return nullptr!=m_slots;
+        }
+        inline size_t buffer_count() const {
+            return m_slot_count;
+        }
+        inline size_t buffer_size() const {
+            return m_slot_sectors*m_sector_size;
+        }
+        // copies the data into the ring and queues it, waiting for a free buffer if they're
+        // all in flight. source can be reused as soon as this returns. writes bigger than a
+        // buffer are split, and the token of the last piece is returned. returns 0 on error
+        uint32_t submit(const void* source,size_t start_sector,size_t sector_count) {
+            if(!initialized() || nullptr==source || 0==sector_count) {
+                return 0;
+            }
+            std::lock_guard<std::mutex> submit_lock(m_submit_lock);
+            const uint8_t* p = (const uint8_t*)source;
+            uint32_t token = 0;
+            while(0!=sector_count) {
+                size_t count = sector_count<m_slot_sectors?sector_count:m_slot_sectors;
+                std::unique_lock<std::mutex> lock(m_lock);
+                m_done.wait(lock,[this]{return m_queued<m_slot_count;});
+                slot& s = m_slots[m_head];
+                // the I/O task never touches the slot at m_head, so fill it unlocked
+                lock.unlock();
+                memcpy(s.data,p,count*m_sector_size);
+                lock.lock();
+                s.start_sector = start_sector;
+                s.sector_count = count;
+                if(0==++m_submitted) {
+                    ++m_submitted;
+                }
+                s.token = token = m_submitted;
+                m_head = (m_head+1)%m_slot_count;
+                ++m_queued;
+                m_ready.notify_one();
+                p+=count*m_sector_size;
+                start_sector+=count;
+                sector_count-=count;
+            }
+            return token;
+        }
+        // returns true if the write with this token has reached the device
+        bool completed(uint32_t token) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return 0==token || (0!=m_completed && reached(m_completed,token));
+        }
+        // waits for the write with this token, and everything before it, to reach the device.
+        // returns false if any of them failed since the last flush()
+        bool wait(uint32_t token) {
+            if(!initialized()) {
+                return false;
+            }
+            std::unique_lock<std::mutex> lock(m_lock);
+            if(0!=token) {
+                m_done.wait(lock,[this,token]{return 0!=m_completed && reached(m_completed,token);});
+            }
+            return 0==m_failed || !reached(token,m_failed);
+        }
+        // waits for everything queued to reach the device, leaving any failure to be reported
+        // by wait() or flush()
+        void drain() {
+            if(!initialized()) {
+                return;
+            }
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_done.wait(lock,[this]{return 0==m_queued;});
+        }
+        // waits for everything queued to reach the device. returns false if any write failed
+        // since the last flush(), and clears the failure
+        bool flush() {
+            if(!initialized()) {
+                return false;
+            }
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_done.wait(lock,[this]{return 0==m_queued;});
+            bool result = 0==m_failed;
+            m_failed = 0;
+            return result;
+        }
+    };
+}
+#endif